@@ -154,6 +154,17 @@ int bin_get_buffer(str *buffer)
 	return 1;
 }
 
+int bin_truncate(int len)
+{
+	if (!cpos || len < HEADER_SIZE || len > bin_send_size)
+		return -1;
+
+	cpos = send_buffer + len;
+	set_len(send_buffer, cpos);
+
+	return 0;
+}
+
 /*
  * skips @count integers from the current position in the received binary packet
  *
@@ -279,6 +290,29 @@ int bin_pop_int(void *info)
 	return 0;
 }
 
+int bin_enter_region(str *region, char **pos, char **end)
+{
+	if (region->len < 0 || (region->len && (region->s < rcv_buf ||
+	region->s + region->len > rcv_end))) {
+		LM_ERR("region outside of the received binary packet\n");
+		return -1;
+	}
+
+	*pos = cpos;
+	*end = rcv_end;
+
+	cpos = region->s;
+	rcv_end = region->s + region->len;
+
+	return 0;
+}
+
+void bin_leave_region(char *pos, char *end)
+{
+	cpos = pos;
+	rcv_end = end;
+}
+
 /**
  * bin_register_cb - registers a module handler for specific packets
  * @mod_name: used to classify the incoming packets
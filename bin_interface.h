@@ -119,6 +119,16 @@ int bin_push_int(int info);
 /* TODO - comment, lol */
 int bin_get_buffer(str *buffer);
 
+/*
+ * drops the data pushed after the first @len bytes of the packet being
+ * currently built (@len being a length returned by bin_get_buffer())
+ *
+ * @return:
+ *		0: success
+ *		< 0: error, @len outside of the packet
+ */
+int bin_truncate(int len);
+
 /*
  * pops a str structure from a received binary packet
  * @info:   pointer to store the result
@@ -166,5 +176,22 @@ int bin_skip_int(int count);
  */
 int bin_skip_str(int count);
 
+/*
+ * restricts the parsing of the received packet to @region, which must be
+ * a string previously popped from the same packet (e.g. a nested record);
+ * the current parsing state is saved in @pos and @end
+ *
+ * @return:
+ *		0: success
+ *		< 0: error, region outside of the received packet
+ */
+int bin_enter_region(str *region, char **pos, char **end);
+
+/*
+ * resumes the parsing of the received packet from the state saved by
+ * a previous bin_enter_region() call
+ */
+void bin_leave_region(char *pos, char *end);
+
 #endif /* __BINARY_INTERFACE__ */
 
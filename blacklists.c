@@ -39,6 +39,32 @@
 #include "timer.h"
 #include "ut.h"
 
+/*
+ * The rules of a list are compiled into two binary tries (IPv4 and IPv6),
+ * walked along the bits of the checked address: each node holds the
+ * protocols (as bitmasks) of the rules whose network ends there, for any
+ * port or per port. The rules which cannot be indexed this way (applied
+ * contrary, with a body pattern or with a non contiguous mask) are still
+ * checked one by one.
+ */
+struct bl_port_match {
+	unsigned short port;
+	unsigned int protos;
+	struct bl_port_match *next;
+};
+
+struct bl_trie_node {
+	struct bl_trie_node *kid[2];
+	unsigned int any_port;
+	struct bl_port_match *ports;
+};
+
+struct bl_index {
+	struct bl_trie_node *root[2];
+	struct bl_rule **linear;
+	unsigned int linear_no;
+};
+
 static struct bl_head *blst_heads = 0;
 static unsigned int bl_marker = 0;
 static unsigned int bl_default_marker = 0;
@@ -151,6 +177,166 @@ int init_black_lists(void)
 
 
 
+/*! \brief length of the rule's network prefix, or -1 if it cannot be
+ * indexed */
+static int bl_rule_bitlen(struct bl_rule *r)
+{
+	struct net *net = &r->ip_net;
+	unsigned char m;
+	int i, k, bits = 0, end = 0;
+
+	if ( r->flags&BLR_APPLY_CONTRARY || r->body.s ||
+	(net->ip.af!=AF_INET && net->ip.af!=AF_INET6) ||
+	r->proto>=8*sizeof(unsigned int) )
+		return -1;
+
+	for( i=0 ; i<net->ip.len ; i++ ) {
+		m = net->mask.u.addr[i];
+		/* matchnet() never matches address bits out of the mask */
+		if (net->ip.u.addr[i] & ~m)
+			return -1;
+		if (end) {
+			if (m)
+				return -1;
+			continue;
+		}
+		for( k=0 ; k<8 && (m & (0x80>>k)) ; k++ );
+		if ( (unsigned char)(m<<k) )
+			return -1;
+		bits += k;
+		end = (k<8);
+	}
+
+	return bits;
+}
+
+
+static struct bl_index *bl_compile(struct bl_rule *first)
+{
+	struct bl_index *idx;
+	struct bl_trie_node *nodes, *node;
+	struct bl_port_match *pm, *ports;
+	struct bl_rule *p;
+	unsigned int n_lin = 0, n_idx = 0, n_nodes = 2;
+	unsigned int protos;
+	int bits, b, bit, f;
+
+	for( p=first ; p ; p=p->next ) {
+		if ( (bits=bl_rule_bitlen(p))<0 ) {
+			n_lin++;
+		} else {
+			n_idx++;
+			n_nodes += bits;
+		}
+	}
+
+	idx = (struct bl_index*)shm_malloc( sizeof(struct bl_index) +
+		n_lin * sizeof(struct bl_rule*) +
+		n_nodes * sizeof(struct bl_trie_node) +
+		n_idx * sizeof(struct bl_port_match) );
+	if (idx==NULL) {
+		LM_ERR("no more shm memory, the list will be checked rule by "
+			"rule\n");
+		return NULL;
+	}
+	memset( idx, 0, sizeof(struct bl_index) +
+		n_lin * sizeof(struct bl_rule*) +
+		n_nodes * sizeof(struct bl_trie_node) +
+		n_idx * sizeof(struct bl_port_match) );
+
+	idx->linear = (struct bl_rule**)(idx + 1);
+	nodes = (struct bl_trie_node*)(idx->linear + n_lin);
+	ports = (struct bl_port_match*)(nodes + n_nodes);
+
+	for( p=first ; p ; p=p->next ) {
+		if ( (bits=bl_rule_bitlen(p))<0 ) {
+			idx->linear[idx->linear_no++] = p;
+			continue;
+		}
+
+		f = (p->ip_net.ip.af==AF_INET6);
+		if (idx->root[f]==NULL)
+			idx->root[f] = nodes++;
+		node = idx->root[f];
+		for( b=0 ; b<bits ; b++ ) {
+			bit = (p->ip_net.ip.u.addr[b>>3] >> (7-(b&7))) & 1;
+			if (node->kid[bit]==NULL)
+				node->kid[bit] = nodes++;
+			node = node->kid[bit];
+		}
+
+		protos = (p->proto==PROTO_NONE) ? ~0u : (1u<<p->proto);
+		if (p->port==0) {
+			node->any_port |= protos;
+			continue;
+		}
+		for( pm=node->ports ; pm && pm->port!=p->port ; pm=pm->next );
+		if (pm==NULL) {
+			pm = ports++;
+			pm->port = p->port;
+			pm->next = node->ports;
+			node->ports = pm;
+		}
+		pm->protos |= protos;
+	}
+
+	return idx;
+}
+
+
+/*! \brief recompiles the rules of a list (held for writing) */
+static inline void bl_reindex(struct bl_head *head)
+{
+	struct bl_index *old = head->index;
+
+	head->index = bl_compile(head->first);
+	if (old)
+		shm_free(old);
+}
+
+
+static inline int bl_index_match(struct bl_index *idx, struct ip_addr *ip,
+								unsigned short port, unsigned short proto)
+{
+	struct bl_trie_node *node;
+	struct bl_port_match *pm;
+	unsigned int protos, b;
+
+	if ( (ip->af!=AF_INET && ip->af!=AF_INET6) ||
+	proto>=8*sizeof(unsigned int) )
+		return 0;
+	protos = 1u<<proto;
+
+	/* every node on the path is a network containing the address */
+	for( b=0,node=idx->root[ip->af==AF_INET6] ; node ; b++ ) {
+		if (node->any_port & protos)
+			return 1;
+		for( pm=node->ports ; pm ; pm=pm->next )
+			if (pm->port==port && (pm->protos & protos))
+				return 1;
+		if (b==ip->len*8)
+			break;
+		node = node->kid[(ip->u.addr[b>>3] >> (7-(b&7))) & 1];
+	}
+
+	return 0;
+}
+
+
+static inline int bl_rule_match(struct bl_rule *p, struct ip_addr *ip,
+						str *text, unsigned short port, unsigned short proto)
+{
+	int t_val;
+
+	t_val = (p->port==0 || p->port==port) &&
+		(p->proto==PROTO_NONE || p->proto==proto) &&
+		(matchnet(ip, &(p->ip_net)) == 1) &&
+		(p->body.s==NULL || !fnmatch(p->body.s, text->s, 0));
+	return !!(p->flags & BLR_APPLY_CONTRARY) ^ !!(t_val);
+}
+
+
+
 struct bl_head *create_bl_head(int owner, int flags, struct bl_rule *head,
 											struct bl_rule *tail, str *name)
 {
@@ -206,6 +392,8 @@ struct bl_head *create_bl_head(int owner, int flags, struct bl_rule *head,
 	blst_heads[i].flags = flags;
 	blst_heads[i].first = head;
 	blst_heads[i].last = tail;
+	if (!no_shm)
+		blst_heads[i].index = bl_compile(head);
 
 	if (flags&BL_BY_DEFAULT)
 		bl_default_marker |= (1<<i);
@@ -236,6 +424,9 @@ void destroy_black_lists(void)
 			shm_free(q);
 		}
 
+		if (blst_heads[i].index)
+			shm_free(blst_heads[i].index);
+
 		if (blst_heads[i].name.s)
 			shm_free(blst_heads[i].name.s);
 
@@ -291,6 +482,9 @@ static inline void delete_expired(struct bl_head *elem, unsigned int ticks)
 		elem->first = p;
 	}
 
+	/* the old rules are still referred by the old index */
+	bl_reindex(elem);
+
 done:
 	elem->count_write = 0;
 
@@ -476,6 +670,7 @@ static inline int reload_permanent_list(struct bl_rule *first,
 
 	head->first = first;
 	head->last = last;
+	bl_reindex(head);
 
 	head->count_write = 0;
 
@@ -562,6 +757,8 @@ int add_list_to_head( struct bl_head *head,
 		p->next = first;
 	}
 
+	bl_reindex(head);
+
 done:
 	head->count_write = 0;
 
@@ -621,13 +818,14 @@ static inline int check_against_rule_list(struct ip_addr *ip, str *text,
 					  int i)
 {
 	struct bl_rule *p;
-	int t_val;
+	struct bl_index *idx;
+	unsigned int j;
 	int ret = 0;
 
 	LM_DBG("using list %.*s \n",
 		blst_heads[i].name.len, blst_heads[i].name.s);
 
-	if( !blst_heads[i].flags&BL_READONLY_LIST ) {
+	if( !(blst_heads[i].flags&BL_READONLY_LIST) ) {
 		/* get list for read */
 		lock_get( blst_heads[i].lock );
 		while(blst_heads[i].count_write) {
@@ -639,20 +837,20 @@ static inline int check_against_rule_list(struct ip_addr *ip, str *text,
 		lock_release(blst_heads[i].lock);
 	}
 
-	for(p = blst_heads[i].first ; p ; p = p->next) {
-		t_val = (p->port==0 || p->port==port) &&
-			(p->proto==PROTO_NONE || p->proto==proto) &&
-			(matchnet(ip, &(p->ip_net)) == 1) &&
-			(p->body.s==NULL || !fnmatch(p->body.s, text->s, 0));
-		if(!!(p->flags & BLR_APPLY_CONTRARY) ^ !!(t_val)){
-			ret = 1;
-			LM_DBG("matched list %.*s \n",
-				blst_heads[i].name.len,blst_heads[i].name.s);
-			break;
-		}
+	if ( (idx=blst_heads[i].index)!=NULL ) {
+		ret = bl_index_match(idx, ip, port, proto);
+		for(j = 0 ; !ret && j < idx->linear_no ; j++)
+			ret = bl_rule_match(idx->linear[j], ip, text, port, proto);
+	} else {
+		/* not compiled (no memory) */
+		for(p = blst_heads[i].first ; !ret && p ; p = p->next)
+			ret = bl_rule_match(p, ip, text, port, proto);
 	}
+	if (ret)
+		LM_DBG("matched list %.*s \n",
+			blst_heads[i].name.len,blst_heads[i].name.s);
 
-	if( !blst_heads[i].flags&BL_READONLY_LIST ) {
+	if( !(blst_heads[i].flags&BL_READONLY_LIST) ) {
 		lock_get( blst_heads[i].lock );
 		blst_heads[i].count_read--;
 		lock_release(blst_heads[i].lock);
@@ -696,9 +894,9 @@ static struct mi_root* mi_print_blacklists(struct mi_root *cmd, void *param)
 
 	for ( i=0 ; i<used_heads ; i++ ) {
 
-		if( !blst_heads[i].flags&BL_READONLY_LIST ) {
+		if( !(blst_heads[i].flags&BL_READONLY_LIST) ) {
 			/* get list for read */
-				lock_get( blst_heads[i].lock );
+			lock_get( blst_heads[i].lock );
 			while(blst_heads[i].count_write) {
 				lock_release( blst_heads[i].lock );
 				sleep_us(5);
@@ -775,7 +973,7 @@ static struct mi_root* mi_print_blacklists(struct mi_root *cmd, void *param)
 
 		}
 
-		if( !blst_heads[i].flags&BL_READONLY_LIST ) {
+		if( !(blst_heads[i].flags&BL_READONLY_LIST) ) {
 			lock_get( blst_heads[i].lock );
 			blst_heads[i].count_read--;
 			lock_release(blst_heads[i].lock);
@@ -785,7 +983,7 @@ static struct mi_root* mi_print_blacklists(struct mi_root *cmd, void *param)
 
 	return rpl_tree;
 error:
-	if( !blst_heads[i].flags&BL_READONLY_LIST ) {
+	if( !(blst_heads[i].flags&BL_READONLY_LIST) ) {
 		lock_get( blst_heads[i].lock );
 		blst_heads[i].count_read--;
 		lock_release(blst_heads[i].lock);
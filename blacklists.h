@@ -47,6 +47,9 @@ struct bl_rule{
 	unsigned int expire_end;
 };
 
+/*! \brief the rules of a list, compiled for lookups */
+struct bl_index;
+
 struct bl_head{
 	str name;
 	int owner; 	/*!< the id of the module that owns the set of rules */
@@ -57,6 +60,8 @@ struct bl_head{
 	/* ... more fields, maybe ... */
 	struct bl_rule *first;
 	struct bl_rule *last;
+	/* rebuilt on each change of the rules */
+	struct bl_index *index;
 };
 
 
@@ -26,11 +26,13 @@
 
 #include "cachedb.h"
 #include "cachedb_cap.h"
+#include "cachedb_near.h"
 #include "../dprint.h"
 #include "../sr_module.h"
 #include "../mem/mem.h"
 #include "../mem/meminfo.h"
 #include "../str.h"
+#include "../core_stats.h"
 
 #include <string.h>
 #include <stdlib.h>
@@ -299,6 +301,7 @@ int cachedb_remove(str* cachedb_name, str* attr)
 	str cde_engine,grp_name;
 	char *p;
 	cachedb_con *con;
+	struct timeval start;
 	int ret;
 
 	if(cachedb_name == NULL || attr == NULL)
@@ -339,7 +342,11 @@ int cachedb_remove(str* cachedb_name, str* attr)
 		return -1;
 	}
 
+	start_hist_timer(start);
 	ret = cde->cdb_func.remove(con,attr);
+	update_hist_since(cdb_remove_time, start);
+	if (cdb_nc_size)
+		cachedb_near_invalidate(attr);
 	if (ret == 0)
 		ret++;
 
@@ -352,6 +359,7 @@ int cachedb_store(str* cachedb_name, str* attr, str* val,int expires)
 	str cde_engine,grp_name;
 	char *p;
 	cachedb_con *con;
+	struct timeval start;
 	int ret;
 
 	if(cachedb_name == NULL || attr == NULL || val == NULL)
@@ -392,7 +400,11 @@ int cachedb_store(str* cachedb_name, str* attr, str* val,int expires)
 		return -1;
 	}
 
+	start_hist_timer(start);
 	ret = cde->cdb_func.set(con,attr,val,expires);
+	update_hist_since(cdb_store_time, start);
+	if (cdb_nc_size)
+		cachedb_near_invalidate(attr);
 	if (ret ==0)
 		ret++;
 
@@ -405,7 +417,9 @@ int cachedb_fetch(str* cachedb_name, str* attr, str* val)
 	str cde_engine,grp_name;
 	char *p;
 	cachedb_con *con;
-	int ret;
+	struct timeval start;
+	unsigned int gen;
+	int ret, near;
 
 	if(cachedb_name == NULL || attr == NULL || val == NULL)
 	{
@@ -438,6 +452,10 @@ int cachedb_fetch(str* cachedb_name, str* attr, str* val)
 		return -1;
 	}
 
+	near = cdb_nc_size && !CACHEDB_CAPABILITY(&cde->cdb_func,CACHEDB_CAP_LOCAL);
+	if (near && (ret=cachedb_near_fetch(cachedb_name,attr,val,&gen)) != 0)
+		return ret;
+
 	con = cachedb_get_connection(cde,&grp_name);
 	if (con == NULL) {
 		LM_ERR("failed to get connection for grp name [%.*s]\n",
@@ -445,10 +463,19 @@ int cachedb_fetch(str* cachedb_name, str* attr, str* val)
 		return -1;
 	}
 
+	start_hist_timer(start);
 	ret = cde->cdb_func.get(con,attr,val);
+	update_hist_since(cdb_fetch_time, start);
 	if (ret == 0)
 		ret++;
 
+	if (near) {
+		if (ret > 0)
+			cachedb_near_store(cachedb_name,attr,val,gen);
+		else if (ret == -2)
+			cachedb_near_store(cachedb_name,attr,NULL,gen);
+	}
+
 	return ret;
 }
 
@@ -458,6 +485,7 @@ int cachedb_counter_fetch(str* cachedb_name, str* attr, int* val)
 	str cde_engine,grp_name;
 	char *p;
 	cachedb_con *con;
+	struct timeval start;
 	int ret;
 
 	if(cachedb_name == NULL || attr == NULL || val == NULL)
@@ -498,7 +526,9 @@ int cachedb_counter_fetch(str* cachedb_name, str* attr, int* val)
 		return -1;
 	}
 
+	start_hist_timer(start);
 	ret = cde->cdb_func.get_counter(con,attr,val);
+	update_hist_since(cdb_counter_time, start);
 	if (ret == 0)
 		ret++;
 
@@ -511,6 +541,7 @@ int cachedb_add(str* cachedb_name, str* attr, int val,int expires,int *new_val)
 	str cde_engine,grp_name;
 	char *p;
 	cachedb_con *con;
+	struct timeval start;
 	int ret;
 
 	if(cachedb_name == NULL || attr == NULL)
@@ -557,7 +588,11 @@ int cachedb_add(str* cachedb_name, str* attr, int val,int expires,int *new_val)
 		return -1;
 	}
 
+	start_hist_timer(start);
 	ret = cde->cdb_func.add(con,attr,val,expires,new_val);
+	update_hist_since(cdb_counter_time, start);
+	if (cdb_nc_size)
+		cachedb_near_invalidate(attr);
 	if (ret == 0)
 		ret++;
 
@@ -570,6 +605,7 @@ int cachedb_sub(str* cachedb_name, str* attr, int val,int expires,int *new_val)
 	str cde_engine,grp_name;
 	char *p;
 	cachedb_con *con;
+	struct timeval start;
 	int ret;
 
 	if(cachedb_name == NULL || attr == NULL)
@@ -616,7 +652,11 @@ int cachedb_sub(str* cachedb_name, str* attr, int val,int expires,int *new_val)
 		return -1;
 	}
 
+	start_hist_timer(start);
 	ret = cde->cdb_func.sub(con,attr,val,expires,new_val);
+	update_hist_since(cdb_counter_time, start);
+	if (cdb_nc_size)
+		cachedb_near_invalidate(attr);
 	if (ret == 0)
 		ret++;
 
@@ -702,6 +742,7 @@ int cachedb_raw_query(str* cachedb_name, str* attr, cdb_raw_entry*** reply,int e
 	str cde_engine,grp_name;
 	char *p;
 	cachedb_con *con;
+	struct timeval start;
 	int ret;
 
 	if(cachedb_name == NULL || attr == NULL)
@@ -747,7 +788,9 @@ int cachedb_raw_query(str* cachedb_name, str* attr, cdb_raw_entry*** reply,int e
 		return -1;
 	}
 
+	start_hist_timer(start);
 	ret = cde->cdb_func.raw_query(con,attr,reply,expected_kv_no,rpl_no);
+	update_hist_since(cdb_raw_query_time, start);
 	if (ret == 0)
 		ret++;
 
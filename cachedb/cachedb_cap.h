@@ -38,7 +38,9 @@ typedef enum {
 	CACHEDB_CAP_ADD = 1<<3,
 	CACHEDB_CAP_SUB = 1<<4,
 	CACHEDB_CAP_BINARY_VALUE = 1<<5,
-	CACHEDB_CAP_RAW = 1<<6
+	CACHEDB_CAP_RAW = 1<<6,
+	/* the data is in local memory - no point in a near cache */
+	CACHEDB_CAP_LOCAL = 1<<7
 } cachedb_cap;
 
 #define CACHEDB_CAPABILITY(cdbf,cpv) (((cdbf)->capability & (cpv)) == (cpv))
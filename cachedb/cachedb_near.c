@@ -0,0 +1,272 @@
+/*
+ * Copyright (C) 2016 OpenSIPS Solutions
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#include <string.h>
+
+#include "../mem/mem.h"
+#include "../mem/shm_mem.h"
+#include "../dprint.h"
+#include "../timer.h"
+#include "../hash_func.h"
+#include "cachedb_near.h"
+
+struct cdb_nc_entry {
+	unsigned int hash;
+	/* generation of the key when the result was fetched */
+	unsigned int gen;
+	unsigned int expires;
+	str name;
+	str attr;
+	/* val.s NULL - no such key */
+	str val;
+	struct cdb_nc_entry *hnext;
+	/* LRU list */
+	struct cdb_nc_entry *prev;
+	struct cdb_nc_entry *next;
+};
+
+struct cdb_nc {
+	unsigned int mask;
+	unsigned int count;
+	struct cdb_nc_entry **buckets;
+	/* list head - next is the most recently used, prev the oldest */
+	struct cdb_nc_entry lru;
+};
+
+int cdb_nc_size = 0;
+int cdb_nc_ttl = 1;
+int cdb_nc_neg_ttl = 0;
+
+/* invalidation generations, shared by all processes */
+static unsigned int *cdb_nc_gens = NULL;
+
+/* the near cache of this process, built on first use */
+static struct cdb_nc *nc = NULL;
+
+
+int init_cachedb_near_cache(void)
+{
+	if (cdb_nc_size <= 0) {
+		cdb_nc_size = 0;
+		return 0;
+	}
+
+	if (cdb_nc_ttl <= 0) {
+		LM_ERR("bad cachedb_near_cache_ttl %d - need a positive value\n",
+			cdb_nc_ttl);
+		return -1;
+	}
+
+	cdb_nc_gens = shm_malloc(CDB_NC_GENS * sizeof(unsigned int));
+	if (cdb_nc_gens == NULL) {
+		LM_ERR("no more shm mem\n");
+		return -1;
+	}
+	memset(cdb_nc_gens, 0, CDB_NC_GENS * sizeof(unsigned int));
+
+	return 0;
+}
+
+
+static inline void lru_unlink(struct cdb_nc_entry *e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+}
+
+
+static inline void lru_push_front(struct cdb_nc_entry *e)
+{
+	e->next = nc->lru.next;
+	e->prev = &nc->lru;
+	nc->lru.next->prev = e;
+	nc->lru.next = e;
+}
+
+
+static int build_near_cache(void)
+{
+	unsigned int size;
+
+	for (size = 1; size < (unsigned int)cdb_nc_size; size <<= 1);
+
+	nc = pkg_malloc(sizeof(struct cdb_nc) + size*sizeof(struct cdb_nc_entry*));
+	if (nc == NULL) {
+		LM_ERR("no more pkg mem for the cachedb near cache, disabling it\n");
+		cdb_nc_size = 0;
+		return -1;
+	}
+	memset(nc, 0, sizeof(struct cdb_nc) + size*sizeof(struct cdb_nc_entry*));
+
+	nc->mask = size - 1;
+	nc->buckets = (struct cdb_nc_entry**)(nc + 1);
+	nc->lru.next = nc->lru.prev = &nc->lru;
+
+	return 0;
+}
+
+
+static void drop_entry(struct cdb_nc_entry *e)
+{
+	struct cdb_nc_entry **p;
+
+	for (p = &nc->buckets[e->hash & nc->mask]; *p; p = &(*p)->hnext)
+		if (*p == e) {
+			*p = e->hnext;
+			break;
+		}
+
+	lru_unlink(e);
+	nc->count--;
+	pkg_free(e);
+}
+
+
+static inline unsigned int key_gen(str *attr)
+{
+	return cdb_nc_gens[core_hash(attr, NULL, CDB_NC_GENS)];
+}
+
+
+static struct cdb_nc_entry* lookup_entry(str *name, str *attr,
+		unsigned int hash)
+{
+	struct cdb_nc_entry *e;
+
+	for (e = nc->buckets[hash & nc->mask]; e; e = e->hnext)
+		if (e->hash == hash && e->attr.len == attr->len &&
+		e->name.len == name->len &&
+		memcmp(e->attr.s, attr->s, attr->len) == 0 &&
+		memcmp(e->name.s, name->s, name->len) == 0)
+			return e;
+
+	return NULL;
+}
+
+
+int cachedb_near_fetch(str *name, str *attr, str *val, unsigned int *gen)
+{
+	struct cdb_nc_entry *e;
+	unsigned int hash;
+
+	if (cdb_nc_size == 0 || cdb_nc_gens == NULL ||
+	(nc == NULL && build_near_cache() < 0))
+		return 0;
+
+	/* taken before the engine is queried, so an invalidation racing with
+	 * the fetch makes its result stale right away */
+	*gen = key_gen(attr);
+
+	hash = core_hash(name, attr, 0);
+	e = lookup_entry(name, attr, hash);
+	if (e == NULL)
+		return 0;
+
+	if (e->gen != *gen || e->expires < get_ticks()) {
+		drop_entry(e);
+		return 0;
+	}
+
+	lru_unlink(e);
+	lru_push_front(e);
+
+	if (e->val.s == NULL) {
+		LM_DBG("cached no such key [%.*s]\n", attr->len, attr->s);
+		return -2;
+	}
+
+	val->s = pkg_malloc(e->val.len ? e->val.len : 1);
+	if (val->s == NULL) {
+		LM_ERR("no more pkg mem\n");
+		return 0;
+	}
+	memcpy(val->s, e->val.s, e->val.len);
+	val->len = e->val.len;
+
+	LM_DBG("near cache hit for [%.*s]\n", attr->len, attr->s);
+	return 1;
+}
+
+
+void cachedb_near_store(str *name, str *attr, str *val, unsigned int gen)
+{
+	struct cdb_nc_entry *e;
+	unsigned int hash, size;
+
+	if (cdb_nc_size == 0 || nc == NULL)
+		return;
+
+	if ((val == NULL && cdb_nc_neg_ttl <= 0) ||
+	(val && val->len > CDB_NC_MAX_VALUE))
+		return;
+
+	hash = core_hash(name, attr, 0);
+	e = lookup_entry(name, attr, hash);
+	if (e)
+		drop_entry(e);
+
+	/* already invalidated while being fetched */
+	if (gen != key_gen(attr))
+		return;
+
+	if (nc->count == (unsigned int)cdb_nc_size)
+		drop_entry(nc->lru.prev);
+
+	size = sizeof(struct cdb_nc_entry) + name->len + attr->len +
+		(val ? val->len : 0);
+	e = pkg_malloc(size);
+	if (e == NULL) {
+		LM_DBG("no more pkg mem, not caching [%.*s]\n", attr->len, attr->s);
+		return;
+	}
+	memset(e, 0, sizeof(struct cdb_nc_entry));
+
+	e->hash = hash;
+	e->gen = gen;
+	e->expires = get_ticks() + (val ? cdb_nc_ttl : cdb_nc_neg_ttl);
+
+	e->name.s = (char*)(e + 1);
+	e->name.len = name->len;
+	memcpy(e->name.s, name->s, name->len);
+
+	e->attr.s = e->name.s + name->len;
+	e->attr.len = attr->len;
+	memcpy(e->attr.s, attr->s, attr->len);
+
+	if (val) {
+		e->val.s = e->attr.s + attr->len;
+		e->val.len = val->len;
+		memcpy(e->val.s, val->s, val->len);
+	}
+
+	e->hnext = nc->buckets[hash & nc->mask];
+	nc->buckets[hash & nc->mask] = e;
+	lru_push_front(e);
+	nc->count++;
+}
+
+
+void cachedb_near_invalidate(str *attr)
+{
+	if (cdb_nc_gens == NULL)
+		return;
+
+	__sync_add_and_fetch(&cdb_nc_gens[core_hash(attr, NULL, CDB_NC_GENS)], 1);
+}
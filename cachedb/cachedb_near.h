@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2016 OpenSIPS Solutions
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * Per process near cache for the fetches from the remote cachedb engines.
+ *
+ * The results of cache_fetch() - including the "no such key" ones, if
+ * negative caching is on - are kept for a short time in a bounded LRU,
+ * in the memory of each process. Any store/remove/add/sub done through
+ * the cachedb core (by any process) invalidates the key in all the near
+ * caches, via a shm table of generations indexed by the hash of the key;
+ * the engines able to learn about the remote changes (e.g. over a pub/sub
+ * channel) do the same by calling cachedb_near_invalidate().
+ */
+
+#ifndef _CACHEDB_NEAR_H
+#define _CACHEDB_NEAR_H
+
+#include "../str.h"
+
+/* values longer than this are not cached */
+#define CDB_NC_MAX_VALUE  4096
+
+/* number of invalidation generations (power of 2) */
+#define CDB_NC_GENS       4096
+
+/* max number of cached results per process (0 - near cache disabled) */
+extern int cdb_nc_size;
+/* lifetime of a cached result, in seconds */
+extern int cdb_nc_ttl;
+/* lifetime of a cached "no such key" result (0 - not cached) */
+extern int cdb_nc_neg_ttl;
+
+int init_cachedb_near_cache(void);
+
+/* returns 1 (and a pkg copy of the value) on hit, -2 on a cached "no such
+ * key" result, 0 if not cached - then @gen is to be given to the
+ * cachedb_near_store() of the result fetched from the engine */
+int cachedb_near_fetch(str *name, str *attr, str *val, unsigned int *gen);
+
+/* caches the result of a fetch (@val NULL - no such key) */
+void cachedb_near_store(str *name, str *attr, str *val, unsigned int gen);
+
+/* drops the key from the near caches of all the processes */
+void cachedb_near_invalidate(str *attr);
+
+#endif
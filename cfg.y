@@ -379,6 +379,13 @@ extern char *finame;
 %token DB_VERSION_TABLE
 %token DB_DEFAULT_URL
 %token DB_MAX_ASYNC_CONNECTIONS
+%token CACHEDB_NEAR_CACHE_SIZE
+%token CACHEDB_NEAR_CACHE_TTL
+%token CACHEDB_NEAR_CACHE_NEG_TTL
+%token DNS_CACHE_SIZE
+%token DNS_CACHE_MAX_TTL
+%token DNS_CACHE_NEG_TTL
+%token DNS_CACHE_PREFETCH
 %token DISABLE_503_TRANSLATION
 %token SYNC_TOKEN
 %token ASYNC_TOKEN
@@ -1011,6 +1018,34 @@ assign_stm: DEBUG EQUAL snumber {
 		| DB_MAX_ASYNC_CONNECTIONS EQUAL error {
 				yyerror("integer value expected");
 				}
+		| CACHEDB_NEAR_CACHE_SIZE EQUAL NUMBER { cdb_nc_size=$3; }
+		| CACHEDB_NEAR_CACHE_SIZE EQUAL error {
+				yyerror("integer value expected");
+				}
+		| CACHEDB_NEAR_CACHE_TTL EQUAL NUMBER { cdb_nc_ttl=$3; }
+		| CACHEDB_NEAR_CACHE_TTL EQUAL error {
+				yyerror("integer value expected");
+				}
+		| CACHEDB_NEAR_CACHE_NEG_TTL EQUAL NUMBER { cdb_nc_neg_ttl=$3; }
+		| CACHEDB_NEAR_CACHE_NEG_TTL EQUAL error {
+				yyerror("integer value expected");
+				}
+		| DNS_CACHE_SIZE EQUAL NUMBER { dns_cache_size=$3; }
+		| DNS_CACHE_SIZE EQUAL error {
+				yyerror("integer value expected");
+				}
+		| DNS_CACHE_MAX_TTL EQUAL NUMBER { dns_cache_max_ttl=$3; }
+		| DNS_CACHE_MAX_TTL EQUAL error {
+				yyerror("integer value expected");
+				}
+		| DNS_CACHE_NEG_TTL EQUAL NUMBER { dns_cache_neg_ttl=$3; }
+		| DNS_CACHE_NEG_TTL EQUAL error {
+				yyerror("integer value expected");
+				}
+		| DNS_CACHE_PREFETCH EQUAL NUMBER { dns_cache_prefetch=$3; }
+		| DNS_CACHE_PREFETCH EQUAL error {
+				yyerror("integer value expected");
+				}
 		| DISABLE_503_TRANSLATION EQUAL NUMBER { disable_503_translation=$3; }
 		| DISABLE_503_TRANSLATION EQUAL error {
 				yyerror("integer value expected");
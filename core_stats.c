@@ -56,6 +56,8 @@ stat_var* err_rpls;
 stat_var* bad_URIs;
 stat_var* unsupported_methods;
 stat_var* bad_msg_hdr;
+stat_var* req_route_time;
+stat_var* rpl_route_time;
 
 
 stat_export_t core_stats[] = {
@@ -70,6 +72,8 @@ stat_export_t core_stats[] = {
 	{"bad_URIs_rcvd",         0,  &bad_URIs              },
 	{"unsupported_methods",   0,  &unsupported_methods   },
 	{"bad_msg_hdr",           0,  &bad_msg_hdr           },
+	{"request_route_time",    STAT_IS_HIST,  &req_route_time  },
+	{"reply_route_time",      STAT_IS_HIST,  &rpl_route_time  },
 	{"timestamp",  STAT_IS_FUNC, (stat_var**)get_ticks   }, {0,0,0}
 };
 
@@ -101,6 +105,44 @@ stat_export_t net_stats[] = {
 
 
 
+/*************************** DB statistics **********************************/
+stat_var* db_query_time;
+stat_var* db_raw_query_time;
+stat_var* db_insert_time;
+stat_var* db_update_time;
+stat_var* db_delete_time;
+stat_var* db_replace_time;
+
+stat_export_t db_stats[] = {
+	{"query_time",        STAT_IS_HIST,  &db_query_time       },
+	{"raw_query_time",    STAT_IS_HIST,  &db_raw_query_time   },
+	{"insert_time",       STAT_IS_HIST,  &db_insert_time      },
+	{"update_time",       STAT_IS_HIST,  &db_update_time      },
+	{"delete_time",       STAT_IS_HIST,  &db_delete_time      },
+	{"replace_time",      STAT_IS_HIST,  &db_replace_time     },
+	{0,0,0}
+};
+
+
+
+/*************************** CacheDB statistics *****************************/
+stat_var* cdb_fetch_time;
+stat_var* cdb_store_time;
+stat_var* cdb_remove_time;
+stat_var* cdb_counter_time;
+stat_var* cdb_raw_query_time;
+
+stat_export_t cdb_stats[] = {
+	{"fetch_time",        STAT_IS_HIST,  &cdb_fetch_time      },
+	{"store_time",        STAT_IS_HIST,  &cdb_store_time      },
+	{"remove_time",       STAT_IS_HIST,  &cdb_remove_time     },
+	{"counter_time",      STAT_IS_HIST,  &cdb_counter_time    },
+	{"raw_query_time",    STAT_IS_HIST,  &cdb_raw_query_time  },
+	{0,0,0}
+};
+
+
+
 /*************************** PKG statistics *********************************/
 
 #ifdef PKG_MALLOC
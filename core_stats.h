@@ -40,6 +40,8 @@
 #ifdef STATISTICS
 extern stat_export_t core_stats[];
 extern stat_export_t net_stats[];
+extern stat_export_t db_stats[];
+extern stat_export_t cdb_stats[];
 
 /*! \brief received requests */
 extern stat_var* rcv_reqs;
@@ -74,6 +76,25 @@ extern stat_var* unsupported_methods;
 /*! \brief Set in get_hdr_field(). */
 extern stat_var* bad_msg_hdr;
 
+/*! \brief runtime of the request / onreply routes (histograms) */
+extern stat_var* req_route_time;
+extern stat_var* rpl_route_time;
+
+/*! \brief duration of the SQL operations, in db_query.c (histograms) */
+extern stat_var* db_query_time;
+extern stat_var* db_raw_query_time;
+extern stat_var* db_insert_time;
+extern stat_var* db_update_time;
+extern stat_var* db_delete_time;
+extern stat_var* db_replace_time;
+
+/*! \brief duration of the cachedb backend calls (histograms) */
+extern stat_var* cdb_fetch_time;
+extern stat_var* cdb_store_time;
+extern stat_var* cdb_remove_time;
+extern stat_var* cdb_counter_time;
+extern stat_var* cdb_raw_query_time;
+
 #ifdef PKG_MALLOC
 int init_pkg_stats(int no_procs);
 
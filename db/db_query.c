@@ -32,6 +32,7 @@
 #include <stdio.h>
 #include "../dprint.h"
 #include "../locking.h"
+#include "../core_stats.h"
 #include "db_ut.h"
 #include "db_query.h"
 #include "db_insertq.h"
@@ -45,6 +46,7 @@ int db_do_query(const db_con_t* _h, const db_key_t* _k, const db_op_t* _op,
 	const db_val_t*, char*, int* _len), int (*submit_query)(const db_con_t*,
 	const str*), int (*store_result)(const db_con_t* _h, db_res_t** _r))
 {
+	struct timeval start;
 	int off, ret;
 
 	if (!_h || !val2str || !submit_query || (_r && !store_result)) {
@@ -96,7 +98,9 @@ int db_do_query(const db_con_t* _h, const db_key_t* _k, const db_op_t* _op,
 	sql_str.s = sql_buf;
 	sql_str.len = off;
 
+	start_hist_timer(start);
 	if (submit_query(_h, &sql_str) < 0) {
+		update_hist_since(db_query_time, start);
 		LM_ERR("error while submitting query - [%.*s]\n",sql_str.len,sql_str.s);
 		goto err_exit;
 	}
@@ -104,11 +108,13 @@ int db_do_query(const db_con_t* _h, const db_key_t* _k, const db_op_t* _op,
 	if(_r) {
 		int tmp = store_result(_h, _r);
 		if (tmp < 0) {
+			update_hist_since(db_query_time, start);
 			LM_ERR("error while storing result for query [%.*s]\n",sql_str.len,sql_str.s);
 			CON_OR_RESET(_h);
 			return tmp;
 		}
 	}
+	update_hist_since(db_query_time, start);
 
 	CON_OR_RESET(_h);
 	return 0;
@@ -127,12 +133,16 @@ int db_do_raw_query(const db_con_t* _h, const str* _s, db_res_t** _r,
 	int (*submit_query)(const db_con_t* _h, const str* _c),
 	int (*store_result)(const db_con_t* _h, db_res_t** _r))
 {
+	struct timeval start;
+
 	if (!_h || !_s || !submit_query || !store_result) {
 		LM_ERR("invalid parameter value\n");
 		return -1;
 	}
 
+	start_hist_timer(start);
 	if (submit_query(_h, _s) < 0) {
+		update_hist_since(db_raw_query_time, start);
 		LM_ERR("error while submitting query\n");
 		return -2;
 	}
@@ -140,10 +150,12 @@ int db_do_raw_query(const db_con_t* _h, const str* _s, db_res_t** _r,
 	if(_r) {
 		int tmp = store_result(_h, _r);
 		if (tmp < 0) {
+			update_hist_since(db_raw_query_time, start);
 			LM_ERR("error while storing result");
 			return tmp;
 		}
 	}
+	update_hist_since(db_raw_query_time, start);
 	return 0;
 }
 
@@ -154,6 +166,7 @@ int db_do_insert(const db_con_t* _h, const db_key_t* _k, const db_val_t* _v,
 {
 	int off, ret,i,no_rows=0;
 	db_val_t **buffered_rows = NULL;
+	struct timeval start;
 
 	if (!_h || !_k || !_v || !_n || !val2str || !submit_query) {
 		LM_ERR("invalid parameter value\n");
@@ -284,7 +297,10 @@ build_query:
 	sql_str.len = off;
 
 submit:
-	if (submit_query(_h, &sql_str) < 0) {
+	start_hist_timer(start);
+	ret = submit_query(_h, &sql_str);
+	update_hist_since(db_insert_time, start);
+	if (ret < 0) {
 	        LM_ERR("error while submitting query\n");
 		return -2;
 	}
@@ -303,6 +319,7 @@ int db_do_delete(const db_con_t* _h, const db_key_t* _k, const db_op_t* _o,
 	const db_val_t*, char*, int*), int (*submit_query)(const db_con_t* _h,
 	const str* _c))
 {
+	struct timeval start;
 	int off, ret;
 
 	if (!_h || !val2str || !submit_query) {
@@ -329,7 +346,10 @@ int db_do_delete(const db_con_t* _h, const db_key_t* _k, const db_op_t* _o,
 	sql_str.s = sql_buf;
 	sql_str.len = off;
 
-	if (submit_query(_h, &sql_str) < 0) {
+	start_hist_timer(start);
+	ret = submit_query(_h, &sql_str);
+	update_hist_since(db_delete_time, start);
+	if (ret < 0) {
 		LM_ERR("error while submitting query\n");
 		CON_OR_RESET(_h);
 		return -2;
@@ -351,6 +371,7 @@ int db_do_update(const db_con_t* _h, const db_key_t* _k, const db_op_t* _o,
 	const int _un, int (*val2str) (const db_con_t*, const db_val_t*, char*, int*),
 	int (*submit_query)(const db_con_t* _h, const str* _c))
 {
+	struct timeval start;
 	int off, ret;
 
 	if (!_h || !_uk || !_uv || !_un || !val2str || !submit_query) {
@@ -380,7 +401,10 @@ int db_do_update(const db_con_t* _h, const db_key_t* _k, const db_op_t* _o,
 	sql_str.s = sql_buf;
 	sql_str.len = off;
 
-	if (submit_query(_h, &sql_str) < 0) {
+	start_hist_timer(start);
+	ret = submit_query(_h, &sql_str);
+	update_hist_since(db_update_time, start);
+	if (ret < 0) {
 		LM_ERR("error while submitting query\n");
 		CON_OR_RESET(_h);
 		return -2;
@@ -401,6 +425,7 @@ int db_do_replace(const db_con_t* _h, const db_key_t* _k, const db_val_t* _v,
 	const int _n, int (*val2str) (const db_con_t*, const db_val_t*, char*,
 	int*), int (*submit_query)(const db_con_t* _h, const str* _c))
 {
+	struct timeval start;
 	int off, ret;
 
 	if (!_h || !_k || !_v || !val2str|| !submit_query) {
@@ -431,7 +456,10 @@ int db_do_replace(const db_con_t* _h, const db_key_t* _k, const db_val_t* _v,
 	sql_str.s = sql_buf;
 	sql_str.len = off;
 
-	if (submit_query(_h, &sql_str) < 0) {
+	start_hist_timer(start);
+	ret = submit_query(_h, &sql_str);
+	update_hist_since(db_replace_time, start);
+	if (ret < 0) {
 	        LM_ERR("error while submitting query\n");
 		return -2;
 	}
@@ -138,6 +138,15 @@ extern char *db_version_table;
 extern char *db_default_url;
 extern int db_max_async_connections;
 
+extern int cdb_nc_size;
+extern int cdb_nc_ttl;
+extern int cdb_nc_neg_ttl;
+
+extern int dns_cache_size;
+extern int dns_cache_max_ttl;
+extern int dns_cache_neg_ttl;
+extern int dns_cache_prefetch;
+
 extern int disable_503_translation;
 
 extern int enable_asserts;
@@ -112,6 +112,7 @@
 #include "parser/msg_parser.h"
 #include "ip_addr.h"
 #include "resolve.h"
+#include "resolve_cache.h"
 #include "parser/parse_hname2.h"
 #include "parser/digest/digest_parser.h"
 #include "name_alias.h"
@@ -134,6 +135,8 @@
 #include "mi/mi_core.h"
 #include "db/db_insertq.h"
 #include "net/trans.h"
+#include "rcu.h"
+#include "cachedb/cachedb_near.h"
 
 static char* version=OPENSIPS_FULL_VERSION;
 static char* flags=OPENSIPS_COMPILE_FLAGS;
@@ -305,6 +308,7 @@ void cleanup(int show_status)
 #endif
 
 	handle_ql_shutdown();
+	destroy_rcu();
 	destroy_modules();
 	udp_destroy();
 	tcp_destroy();
@@ -314,6 +318,7 @@ void cleanup(int show_status)
 	pv_free_extra_list();
 	destroy_argv_list();
 	destroy_black_lists();
+	destroy_dns_cache();
 #ifdef PKG_MALLOC
 	if (show_status){
 		LM_GEN1(memdump, "Memory status (pkg):\n");
@@ -1189,6 +1194,12 @@ try_again:
 		LM_CRIT("failed to create DNS blacklist\n");
 		goto error;
 	}
+
+	/* init the shm cache of the DNS records */
+	if (init_dns_cache()!=0) {
+		LM_CRIT("failed to init the DNS cache\n");
+		goto error;
+	}
 	
 	/* init modules */
 	if (init_modules() != 0) {
@@ -1225,6 +1236,12 @@ try_again:
 		goto error;
 	}
 
+	/* the number of processes is known - per process stats from now on */
+	if (init_stats_proc_slots()!=0) {
+		LM_ERR("failed to init the per process statistics\n");
+		goto error;
+	}
+
 	#ifdef PKG_MALLOC
 	/* init stats support for pkg mem */
 	if (init_pkg_stats(counted_processes)!=0) {
@@ -1233,6 +1250,18 @@ try_again:
 	}
 	#endif
 
+	/* init the reclamation support for the reloadable data */
+	if (init_rcu()!=0) {
+		LM_ERR("failed to init rcu support\n");
+		goto error;
+	}
+
+	/* init the near cache of the cachedb engines */
+	if (init_cachedb_near_cache()!=0) {
+		LM_ERR("failed to init the cachedb near cache\n");
+		goto error;
+	}
+
 	/* init avps */
 	if (init_extra_avps() != 0) {
 		LM_ERR("error while initializing avps\n");
@@ -41,7 +41,6 @@
 #include "cachedb_local.h"
 #include "hash.h"
 
-#include <fnmatch.h>
 
 str cache_mod_name = str_init("local");
 static int mod_init(void);
@@ -52,6 +51,11 @@ lcache_t* cache_htable = NULL;
 int cache_htable_size = 9;
 int cache_clean_period = 600;
 int local_exec_threshold = 0;
+int cache_max_size = 0;
+
+stat_var *lcache_hits = NULL;
+stat_var *lcache_misses = NULL;
+stat_var *lcache_evictions = NULL;
 
 
 static int remove_chunk_f(struct sip_msg* msg, char* glob);
@@ -62,6 +66,7 @@ static param_export_t params[]={
 	{ "cache_table_size",   INT_PARAM, &cache_htable_size },
 	{ "cache_clean_period", INT_PARAM, &cache_clean_period },
 	{ "exec_threshold",     INT_PARAM, &local_exec_threshold },
+	{ "cache_max_size",     INT_PARAM, &cache_max_size },
 	{0,0,0}
 };
 
@@ -72,6 +77,15 @@ static cmd_export_t cmds[]= {
 	{0,0,0,0,0,0}
 };
 
+static stat_export_t mod_stats[] = {
+	{"cache_hits",        0,             &lcache_hits                    },
+	{"cache_misses",      0,             &lcache_misses                  },
+	{"cache_evictions",   0,             &lcache_evictions               },
+	{"cache_used_size",   STAT_IS_FUNC,  (stat_var**)lcache_used_size    },
+	{"cache_entries",     STAT_IS_FUNC,  (stat_var**)lcache_entries      },
+	{0, 0, 0}
+};
+
 static mi_export_t mi_cmds[] = {
 	{ "cache_remove_chunk",           0, mi_cache_remove_chunk,         0,  0,  0},
 	{ 0, 0, 0, 0, 0, 0}
@@ -87,7 +101,7 @@ struct module_exports exports= {
 	cmds,                       /* exported functions */
 	0,                          /* exported async functions */
 	params,                     /* exported parameters */
-	0,                          /* exported statistics */
+	mod_stats,                  /* exported statistics */
 	mi_cmds,                    /* exported MI functions */
 	0,                          /* exported pseudo-variables */
 	0,                          /* extra processes */
@@ -97,16 +111,13 @@ struct module_exports exports= {
 	child_init                  /* per-child init function */
 };
 
-static char *key_buff = NULL;
-static int key_buff_size = 0;
 static char *pat_buff = NULL;
 static int pat_buff_size = 0;
 static int remove_chunk_f(struct sip_msg* msg, char* glob)
 {
-	int i;
 	str *pat = (str *)glob;
-	lcache_entry_t* me1, *me2;
 	struct timeval start;
+	int ret;
 
 	if (pat->len+1 > pat_buff_size) {
 		pat_buff = pkg_realloc(pat_buff,pat->len+1);
@@ -125,53 +136,11 @@ static int remove_chunk_f(struct sip_msg* msg, char* glob)
 	LM_DBG("trying to remove chunk with pattern [%s]\n",pat_buff);
 	start_expire_timer(start,local_exec_threshold);
 
-	for(i = 0; i< cache_htable_size; i++) {
-		lock_get(&cache_htable[i].lock);
-		me1 = cache_htable[i].entries;
-		me2 = NULL;
-
-		while(me1) {
-			if (me1->attr.len + 1 > key_buff_size) {
-				key_buff = pkg_realloc(key_buff,me1->attr.len+1);
-				if (key_buff == NULL) {
-					LM_ERR("No more pkg mem\n");
-					key_buff_size = 0;
-					lock_release(&cache_htable[i].lock);
-					stop_expire_timer(start,local_exec_threshold,
-					"cachedb_local remove_chunk",pat->s,pat->len,0);
-					return -1;
-				}
-
-				key_buff_size = me1->attr.len + 1;
-			}
-
-			memcpy(key_buff,me1->attr.s,me1->attr.len);
-			key_buff[me1->attr.len] = 0;
-
-			if(fnmatch(pat_buff,key_buff,0) == 0) {
-				LM_DBG("[%.*s] matches glob [%.*s] - removing from bucket %d\n",
-						me1->attr.len, me1->attr.s,pat_buff_size,pat_buff,i);
-
-				if(me2) {
-					me2->next = me1->next;
-					shm_free(me1);
-					me1 = me2->next;
-				} else{
-					cache_htable[i].entries = me1->next;
-					shm_free(me1);
-					me1 = cache_htable[i].entries;
-				}
-			} else {
-				me2 = me1;
-				me1 = me1->next;
-			}
-		}
-		lock_release(&cache_htable[i].lock);
-	}
+	ret = lcache_htable_remove_chunk(pat_buff);
 
 	stop_expire_timer(start,local_exec_threshold,
 	"cachedb_local remove_chunk",pat->s,pat->len,0);
-	return 1;
+	return ret;
 }
 
 struct mi_root * mi_cache_remove_chunk(struct mi_root *cmd_tree,void *param)
@@ -276,7 +245,10 @@ static int mod_init(void)
 	cde.cdb_func.add = lcache_htable_add;
 	cde.cdb_func.sub = lcache_htable_sub;
 
-	cde.cdb_func.capability = CACHEDB_CAP_BINARY_VALUE;
+	cde.cdb_func.capability = CACHEDB_CAP_BINARY_VALUE|CACHEDB_CAP_LOCAL;
+
+	if(cache_max_size < 0)
+		cache_max_size = 0;
 
 	if(cache_clean_period <= 0 )
 	{
@@ -327,43 +299,6 @@ static void destroy(void)
 
 void localcache_clean(unsigned int ticks,void *param)
 {
-	int i;
-	lcache_entry_t* me1, *me2;
-
 	LM_DBG("start\n");
-	for(i = 0; i< cache_htable_size; i++)
-	{
-		lock_get(&cache_htable[i].lock);
-		me1 = cache_htable[i].entries;
-		me2 = NULL;
-
-		while(me1)
-		{
-			if((me1->expires > 0) && (me1->expires < get_ticks()))
-			{
-				LM_DBG("deleted entry attr= [%.*s]\n",
-						me1->attr.len, me1->attr.s);
-
-				if(me2)
-				{
-					me2->next = me1->next;
-					shm_free(me1);
-					me1 = me2->next;
-				}
-				else
-				{
-					cache_htable[i].entries = me1->next;
-					shm_free(me1);
-					me1 = cache_htable[i].entries;
-				}
-			}
-			else
-			{
-				me2 = me1;
-				me1 = me1->next;
-			}
-		}
-
-		lock_release(&cache_htable[i].lock);
-	}
+	lcache_htable_clean();
 }
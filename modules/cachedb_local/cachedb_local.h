@@ -29,11 +29,17 @@
 
 #include "../../cachedb/cachedb.h"
 #include "../../cachedb/cachedb_cap.h"
+#include "../../statistics.h"
 #include "hash.h"
 
 extern lcache_t* cache_htable;
 extern int cache_htable_size;
 extern int local_exec_threshold;
+extern int cache_max_size;
+
+extern stat_var *lcache_hits;
+extern stat_var *lcache_misses;
+extern stat_var *lcache_evictions;
 
 typedef struct {
 	struct cachedb_id *id;
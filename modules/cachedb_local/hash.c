@@ -24,28 +24,140 @@
  *  2009-01-29  initial version (Anca Vamanu)
  */
 
+
 #include <stdlib.h>
 #include <string.h>
+#include <fnmatch.h>
 
 #include "../../dprint.h"
 #include "../../ut.h"
 #include "../../timer.h"
+#include "../../rcu.h"
+#include "../../hash_func.h"
 #include "../../mem/mem.h"
 #include "../../mem/shm_mem.h"
 #include "cachedb_local.h"
 #include "hash.h"
 
-void lcache_htable_remove_safe(str attr, lcache_entry_t** it);
+/* initial number of slots of a segment */
+#define LCACHE_MIN_SLOTS     4
+/* optimistic reads tried before waiting for the writer on the lock */
+#define LCACHE_READ_RETRIES  8
+
+struct lcache_usage {
+	volatile long bytes;        /* size of all the records */
+	volatile long entries;
+	unsigned int hand;          /* segment to evict from next */
+};
+
+static struct lcache_usage *lcache_usage = NULL;
+static unsigned int lcache_seg_bits;
+
+/* per process buffer for the optimistic reads of counters */
+static char *read_buf = NULL;
+static unsigned int read_buf_size = 0;
+
+static char *key_buff = NULL;
+static int key_buff_size = 0;
+
+#define lcache_entry_size(_alen, _vlen) \
+	(sizeof(lcache_entry_t) + (_alen) + (_vlen))
+
+#define lcache_segment(_hash) \
+	(&cache_htable[(_hash) & (cache_htable_size - 1)])
+
+/* first slot to probe - the hash bits not used to pick the segment */
+#define lcache_home(_hash, _size) \
+	((((_hash) >> lcache_seg_bits) | ((_hash) << (32 - lcache_seg_bits))) \
+		& ((_size) - 1))
+
+#define lcache_expired(_sl) \
+	((_sl)->expires != 0 && (_sl)->expires < get_ticks())
+
+#define lcache_write_begin(_seg) \
+	do { \
+		(_seg)->seq++; \
+		__sync_synchronize(); \
+	} while (0)
+
+#define lcache_write_end(_seg) \
+	do { \
+		__sync_synchronize(); \
+		(_seg)->seq++; \
+	} while (0)
+
+
+static lcache_slots_t* lcache_new_slots(unsigned int size)
+{
+	lcache_slots_t *slots;
+
+	slots = (lcache_slots_t*)shm_malloc(sizeof(lcache_slots_t) +
+		size * sizeof(lcache_slot_t));
+	if (slots == NULL) {
+		LM_ERR("no more shared memory\n");
+		return NULL;
+	}
+	memset(slots, 0, sizeof(lcache_slots_t) + size * sizeof(lcache_slot_t));
+	slots->size = size;
+
+	return slots;
+}
+
+static void lcache_free_slots(void *slots)
+{
+	shm_free(slots);
+}
+
+static lcache_entry_t* lcache_new_entry(str *attr, str *value,
+		unsigned int expires)
+{
+	lcache_entry_t *me;
+
+	me = (lcache_entry_t*)shm_malloc(lcache_entry_size(attr->len, value->len));
+	if (me == NULL) {
+		LM_ERR("no more shared memory\n");
+		return NULL;
+	}
+
+	me->attr.s = (char*)(me + 1);
+	memcpy(me->attr.s, attr->s, attr->len);
+	me->attr.len = attr->len;
+
+	me->value.s = (char*)(me + 1) + attr->len;
+	memcpy(me->value.s, value->s, value->len);
+	me->value.len = value->len;
+
+	me->expires = expires;
+
+	return me;
+}
+
+static void lcache_free_entry(lcache_entry_t *me)
+{
+	__sync_fetch_and_sub(&lcache_usage->bytes,
+		lcache_entry_size(me->attr.len, me->value.len));
+	__sync_fetch_and_sub(&lcache_usage->entries, 1);
+	shm_free(me);
+}
 
 int lcache_htable_init(int size)
 {
 	int i = 0, j;
 
+	for (lcache_seg_bits = 1; (1 << lcache_seg_bits) < size; lcache_seg_bits++);
+
+	lcache_usage = (struct lcache_usage*)shm_malloc(sizeof *lcache_usage);
+	if (lcache_usage == NULL) {
+		LM_ERR("no more shared memory\n");
+		return -1;
+	}
+	memset(lcache_usage, 0, sizeof *lcache_usage);
+
 	cache_htable = (lcache_t*)shm_malloc(size * sizeof(lcache_t));
 	if(cache_htable == NULL)
 	{
 		LM_ERR("no more shared memory\n");
-		return -1;
+		goto error_usage;
 	}
 	memset(cache_htable, 0, size * sizeof(lcache_t));
 
@@ -56,6 +168,11 @@ int lcache_htable_init(int size)
 			LM_ERR("failed to initialize lock [%d]\n", i);
 			goto error;
 		}
+		cache_htable[i].slots = lcache_new_slots(LCACHE_MIN_SLOTS);
+		if (cache_htable[i].slots == NULL) {
+			lock_destroy(&cache_htable[i].lock);
+			goto error;
+		}
 	}
 
 	return 0;
@@ -64,16 +181,21 @@ error:
 	for(j = 0; j< i; j++)
 	{
 		lock_destroy(&cache_htable[j].lock);
+		shm_free(cache_htable[j].slots);
 	}
 	shm_free(cache_htable);
 	cache_htable = NULL;
+error_usage:
+	shm_free(lcache_usage);
+	lcache_usage = NULL;
 	return -1;
 }
 
 void lcache_htable_destroy(void)
 {
 	int i;
-	lcache_entry_t* me1, *me2;
+	unsigned int k;
+	lcache_slots_t *slots;
 
 	if(cache_htable == NULL)
 		return;
@@ -81,103 +203,363 @@ void lcache_htable_destroy(void)
 	for(i = 0; i< cache_htable_size; i++)
 	{
 		lock_destroy(&cache_htable[i].lock);
-		me1 = cache_htable[i].entries;
-		while(me1)
-		{
-			me2 = me1->next;
-			shm_free(me1);
-			me1 = me2;
-		}
+		slots = cache_htable[i].slots;
+		for (k = 0; k < slots->size; k++)
+			if (slots->s[k].entry)
+				shm_free(slots->s[k].entry);
+		shm_free(slots);
 	}
 	shm_free(cache_htable);
 	cache_htable = NULL;
+
+	shm_free(lcache_usage);
+	lcache_usage = NULL;
 }
 
-int lcache_htable_insert(cachedb_con *con,str* attr, str* value, int expires)
+unsigned long lcache_used_size(unsigned short foo)
 {
-	lcache_entry_t* me, *it;
-	int hash_code;
-	int size;
-	struct timeval start;
+	return lcache_usage ? lcache_usage->bytes : 0;
+}
 
-	size= sizeof(lcache_entry_t) + attr->len + value->len;
+unsigned long lcache_entries(unsigned short foo)
+{
+	return lcache_usage ? lcache_usage->entries : 0;
+}
 
-	me = (lcache_entry_t*)shm_malloc(size);
-	if(me == NULL)
-	{
-		LM_ERR("no more shared memory\n");
+/* must be called with the segment locked */
+static int lcache_find_slot(lcache_t *seg, str *attr, unsigned int hash)
+{
+	lcache_slots_t *slots = seg->slots;
+	lcache_slot_t *sl;
+	unsigned int i;
+
+	for (i = lcache_home(hash, slots->size); ;
+	i = (i + 1) & (slots->size - 1)) {
+		sl = &slots->s[i];
+		if (sl->entry == NULL)
+			return -1;
+		if (sl->hash == hash && sl->attr_len == attr->len &&
+		memcmp(sl->entry->attr.s, attr->s, attr->len) == 0)
+			return i;
+	}
+}
+
+/* removes the record of a slot, by moving back the next records of the
+ * probe sequence (so no tombstones are needed); must be called within a
+ * write section of the segment */
+static void lcache_del_slot(lcache_t *seg, unsigned int i)
+{
+	lcache_slots_t *slots = seg->slots;
+	lcache_entry_t *me = slots->s[i].entry;
+	unsigned int j, k, mask = slots->size - 1;
+
+	for (j = i; ; ) {
+		j = (j + 1) & mask;
+		if (slots->s[j].entry == NULL)
+			break;
+		k = lcache_home(slots->s[j].hash, slots->size);
+		/* stays where it is if its home is cyclically in (i, j] */
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		slots->s[i] = slots->s[j];
+		i = j;
+	}
+	slots->s[i].entry = NULL;
+	slots->s[i].ref = 0;
+	seg->used--;
+
+	lcache_free_entry(me);
+}
+
+static inline void lcache_fill_slot(lcache_slot_t *sl, unsigned int hash,
+		lcache_entry_t *me)
+{
+	sl->hash = hash;
+	sl->expires = me->expires;
+	sl->attr_len = me->attr.len;
+	sl->value_len = me->value.len;
+	sl->ref = 1;
+	sl->entry = me;
+}
+
+/* doubles the slots of a segment; must be called with the segment locked */
+static int lcache_grow(lcache_t *seg)
+{
+	lcache_slots_t *old = seg->slots, *slots;
+	unsigned int i, k;
+
+	slots = lcache_new_slots(old->size * 2);
+	if (slots == NULL)
 		return -1;
+
+	for (i = 0; i < old->size; i++) {
+		if (old->s[i].entry == NULL)
+			continue;
+		for (k = lcache_home(old->s[i].hash, slots->size); slots->s[k].entry;
+		k = (k + 1) & (slots->size - 1));
+		slots->s[k] = old->s[i];
 	}
-	memset(me, 0, size);
 
-	start_expire_timer(start,local_exec_threshold);
+	/* the readers still probing the old slots are fine with them */
+	rcu_assign_pointer(seg->slots, slots);
+	rcu_retire(old, lcache_free_slots);
 
-	me->attr.s = (char*)me + (sizeof(lcache_entry_t));
-	memcpy(me->attr.s, attr->s, attr->len);
-	me->attr.len = attr->len;
+	return 0;
+}
 
-	me->value.s = (char*)me + (sizeof(lcache_entry_t)) + attr->len;
-	memcpy(me->value.s, value->s, value->len);
-	me->value.len = value->len;
-	if( expires != 0)
-		me->expires = get_ticks() + expires;
+/* adds a record or replaces the one with the same key; must be called
+ * with the segment locked */
+static int lcache_store(lcache_t *seg, unsigned int hash, lcache_entry_t *me)
+{
+	lcache_entry_t *old;
+	unsigned int i;
+	int k;
+
+	__sync_fetch_and_add(&lcache_usage->bytes,
+		lcache_entry_size(me->attr.len, me->value.len));
+	__sync_fetch_and_add(&lcache_usage->entries, 1);
+
+	k = lcache_find_slot(seg, &me->attr, hash);
+	if (k >= 0) {
+		old = seg->slots->s[k].entry;
+		lcache_write_begin(seg);
+		lcache_fill_slot(&seg->slots->s[k], hash, me);
+		lcache_write_end(seg);
+		lcache_free_entry(old);
+		return 0;
+	}
+
+	/* keep the load under 3/4, so the probe sequences stay short */
+	if ((seg->used + 1) * 4 > seg->slots->size * 3 && lcache_grow(seg) < 0) {
+		__sync_fetch_and_sub(&lcache_usage->bytes,
+			lcache_entry_size(me->attr.len, me->value.len));
+		__sync_fetch_and_sub(&lcache_usage->entries, 1);
+		return -1;
+	}
 
-	hash_code= core_hash( attr, 0, cache_htable_size);
-	lock_get(&cache_htable[hash_code].lock);
+	for (i = lcache_home(hash, seg->slots->size); seg->slots->s[i].entry;
+	i = (i + 1) & (seg->slots->size - 1));
 
-	it = cache_htable[hash_code].entries;
+	lcache_write_begin(seg);
+	lcache_fill_slot(&seg->slots->s[i], hash, me);
+	seg->used++;
+	lcache_write_end(seg);
 
-	/* if a previous record for the same attr delete it */
-	lcache_htable_remove_safe( *attr, &it);
+	return 0;
+}
 
-	me->next = it;
-	cache_htable[hash_code].entries = me;
+/*
+ * Approximate LRU (CLOCK) eviction, done until the cache is back under its
+ * limit: the segments are taken in turn and each one drops the first
+ * record its hand finds expired or not used since the previous pass. Gives
+ * up only once a full round of the segments found nothing to drop.
+ */
+static void lcache_evict(void)
+{
+	lcache_t *seg;
+	lcache_slot_t *sl;
+	unsigned int n, i;
+	int tries;
+
+	for (tries = 0; cache_max_size && tries < cache_htable_size &&
+	lcache_usage->bytes > cache_max_size; tries++) {
+		seg = &cache_htable[__sync_fetch_and_add(&lcache_usage->hand, 1) &
+			(cache_htable_size - 1)];
+
+		lock_get(&seg->lock);
+
+		for (n = 0; seg->used && n < 2 * seg->slots->size; n++) {
+			i = seg->hand++ & (seg->slots->size - 1);
+			sl = &seg->slots->s[i];
+			if (sl->entry == NULL)
+				continue;
+			if (sl->ref && !lcache_expired(sl)) {
+				sl->ref = 0;
+				continue;
+			}
 
-	lock_release(&cache_htable[hash_code].lock);
+			LM_DBG("evicting attr= [%.*s]\n",
+				sl->entry->attr.len, sl->entry->attr.s);
+			lcache_write_begin(seg);
+			lcache_del_slot(seg, i);
+			lcache_write_end(seg);
+			update_stat(lcache_evictions, 1);
+			tries = -1;
+			break;
+		}
 
-	stop_expire_timer(start,local_exec_threshold,
-	"cachedb_local insert",attr->s,attr->len,0);
-	return 1;
+		lock_release(&seg->lock);
+	}
 }
 
-void lcache_htable_remove_safe(str attr, lcache_entry_t** it_p)
+/*
+ * Lock-less lookup, copying the value into a (reallocated as needed) pkg
+ * buffer; gives up with -3 if the segment keeps being changed.
+ *	return :
+ *		1  - if found
+ *		-2 - if not found
+ *		-1 - if error
+ *		-3 - if the read raced with the writers
+ */
+static int lcache_read(lcache_t *seg, str *attr, unsigned int hash,
+		char **buf, unsigned int *buf_size, unsigned int *len)
 {
-	lcache_entry_t* me = NULL, *it= *it_p;
+	lcache_slots_t *slots;
+	lcache_slot_t *sl, snap;
+	unsigned int seq, i, n, mask;
+	char *p;
+	int retries, ret;
+
+	for (retries = 0; retries < LCACHE_READ_RETRIES; retries++) {
+		seq = seg->seq;
+		if (seq & 1)
+			continue;
+		__sync_synchronize();
+
+		slots = rcu_dereference(seg->slots);
+		mask = slots->size - 1;
+		ret = -2;
+
+		for (i = lcache_home(hash, slots->size), n = 0; n <= mask;
+		i = (i + 1) & mask, n++) {
+			sl = &slots->s[i];
+			snap = *sl;
+			if (snap.entry == NULL)
+				break;
+			if (snap.hash != hash || snap.attr_len != attr->len)
+				continue;
+			/* the copy may be torn by a writer shifting the slots - make
+			 * sure it was taken whole before following its record; from
+			 * here on only its lengths are trusted, the record may be a
+			 * freed one if a writer got in meanwhile */
+			__sync_synchronize();
+			if (seg->seq != seq)
+				break;
+			if (memcmp(snap.entry + 1, attr->s, attr->len) != 0)
+				continue;
+			if (lcache_expired(&snap))
+				break;
+
+			if (snap.value_len + 1 > *buf_size) {
+				p = pkg_realloc(*buf, snap.value_len + 1);
+				if (p == NULL) {
+					LM_ERR("no more memory\n");
+					return -1;
+				}
+				*buf = p;
+				*buf_size = snap.value_len + 1;
+			}
+			memcpy(*buf, (char*)(snap.entry + 1) + snap.attr_len,
+				snap.value_len);
+			*len = snap.value_len;
+
+			if (!snap.ref)
+				sl->ref = 1;
+			ret = 1;
+			break;
+		}
 
-	while(it)
-	{
-		if(it->attr.len == attr.len &&
-				(strncmp(it->attr.s, attr.s, attr.len) == 0))
-		{
+		__sync_synchronize();
+		if (seg->seq == seq)
+			return ret;
+	}
 
-			if(me)
-				me->next = it->next;
-			else
-				*it_p = it->next;
+	return -3;
+}
 
-			shm_free(it);
+/* as lcache_read(), but falls back to locking the segment if needed */
+static int lcache_get(str *attr, char **buf, unsigned int *buf_size,
+		unsigned int *len)
+{
+	unsigned int hash;
+	lcache_t *seg;
+	int ret;
 
-			return;
-		}
-		me = it;
-		it = it->next;
+	hash = core_hash(attr, 0, 0);
+	seg = lcache_segment(hash);
+
+	rcu_read_lock();
+	ret = lcache_read(seg, attr, hash, buf, buf_size, len);
+	if (ret == -3) {
+		/* no writer may change the segment while we hold the lock */
+		lock_get(&seg->lock);
+		ret = lcache_read(seg, attr, hash, buf, buf_size, len);
+		lock_release(&seg->lock);
 	}
-	LM_DBG("entry not found\n");
+	rcu_read_unlock();
+
+	if (ret == 1)
+		update_stat(lcache_hits, 1);
+	else if (ret == -2)
+		update_stat(lcache_misses, 1);
+
+	return ret;
+}
+
+int lcache_htable_insert(cachedb_con *con,str* attr, str* value, int expires)
+{
+	lcache_entry_t* me;
+	unsigned int hash;
+	lcache_t *seg;
+	struct timeval start;
+
+	if (cache_max_size &&
+	lcache_entry_size(attr->len, value->len) > cache_max_size) {
+		LM_ERR("record of %d bytes does not fit in the cache\n",
+			(int)lcache_entry_size(attr->len, value->len));
+		return -1;
+	}
+
+	me = lcache_new_entry(attr, value, expires ? get_ticks() + expires : 0);
+	if(me == NULL)
+		return -1;
+
+	start_expire_timer(start,local_exec_threshold);
+
+	hash = core_hash(attr, 0, 0);
+	seg = lcache_segment(hash);
+
+	lock_get(&seg->lock);
+	if (lcache_store(seg, hash, me) < 0) {
+		lock_release(&seg->lock);
+		shm_free(me);
+		stop_expire_timer(start,local_exec_threshold,
+		"cachedb_local insert",attr->s,attr->len,0);
+		return -1;
+	}
+	lock_release(&seg->lock);
+
+	lcache_evict();
+
+	stop_expire_timer(start,local_exec_threshold,
+	"cachedb_local insert",attr->s,attr->len,0);
+	return 1;
 }
 
 int lcache_htable_remove(cachedb_con *con,str* attr)
 {
-	int hash_code;
+	unsigned int hash;
+	lcache_t *seg;
+	int i;
 	struct timeval start;
 
 	start_expire_timer(start,local_exec_threshold);
 
-	hash_code= core_hash( attr, 0, cache_htable_size);
-	lock_get(&cache_htable[hash_code].lock);
+	hash = core_hash(attr, 0, 0);
+	seg = lcache_segment(hash);
+
+	lock_get(&seg->lock);
 
-	lcache_htable_remove_safe( *attr, &cache_htable[hash_code].entries);
+	i = lcache_find_slot(seg, attr, hash);
+	if (i >= 0) {
+		lcache_write_begin(seg);
+		lcache_del_slot(seg, i);
+		lcache_write_end(seg);
+	} else {
+		LM_DBG("entry not found\n");
+	}
 
-	lock_release(&cache_htable[hash_code].lock);
+	lock_release(&seg->lock);
 
 	stop_expire_timer(start,local_exec_threshold,
 	"cachedb_local remove",attr->s,attr->len,0);
@@ -187,109 +569,72 @@ int lcache_htable_remove(cachedb_con *con,str* attr)
 
 int lcache_htable_add(cachedb_con *con,str *attr,int val,int expires,int *new_val)
 {
-	int hash_code;
-	lcache_entry_t *it=NULL,*it_prev=NULL;
-	int old_value;
-	char *new_value;
-	int new_len;
+	unsigned int hash;
+	lcache_t *seg;
+	lcache_slot_t *sl;
+	lcache_entry_t *me;
+	int i, old_value;
 	str ins_val;
 	struct timeval start;
 
 	start_expire_timer(start,local_exec_threshold);
 
-	hash_code = core_hash(attr,0,cache_htable_size);
-	lock_get(&cache_htable[hash_code].lock);
-
-	it = cache_htable[hash_code].entries;
-	while (it) {
-		if (it->attr.len == attr->len &&
-				memcmp(it->attr.s,attr->s,attr->len) == 0) {
-			if (it->expires !=0 && it->expires < get_ticks()) {
-				/* found an expired entry  -> delete it */
-				if(it_prev)
-					it_prev->next = it->next;
-				else
-					cache_htable[hash_code].entries = it->next;
-
-				shm_free(it);
-				lock_release(&cache_htable[hash_code].lock);
-
-				ins_val.s = sint2str(val,&ins_val.len);
-				if (lcache_htable_insert(con,attr,&ins_val,expires) < 0) {
-					LM_ERR("failed to insert value\n");
-					stop_expire_timer(start,local_exec_threshold,
-					"cachedb_local add",attr->s,attr->len,0);
-					return -1;
-				}
-
-				if (new_val)
-					*new_val = val;
+	hash = core_hash(attr, 0, 0);
+	seg = lcache_segment(hash);
 
-				stop_expire_timer(start,local_exec_threshold,
-				"cachedb_local add",attr->s,attr->len,0);
-				return 0;
-			}
+	lock_get(&seg->lock);
 
-			/* found our valid entry */
-			if (str2sint(&it->value,&old_value) < 0) {
-				LM_ERR("not an integer\n");
-				lock_release(&cache_htable[hash_code].lock);
-				stop_expire_timer(start,local_exec_threshold,
-				"cachedb_local add",attr->s,attr->len,0);
-				return -1;
-			}
-
-			old_value+=val;
-			expires = it->expires;
-			new_value = sint2str(old_value,&new_len);
-			it = shm_realloc(it,sizeof(lcache_entry_t) + attr->len +new_len);
-			if (it == NULL) {
-				LM_ERR("failed to realloc struct\n");
-				lock_release(&cache_htable[hash_code].lock);
-				stop_expire_timer(start,local_exec_threshold,
-				"cachedb_local add",attr->s,attr->len,0);
-				return -1;
-			}
+	i = lcache_find_slot(seg, attr, hash);
+	if (i >= 0 && lcache_expired(&seg->slots->s[i])) {
+		/* found an expired entry  -> delete it */
+		lcache_write_begin(seg);
+		lcache_del_slot(seg, i);
+		lcache_write_end(seg);
+		i = -1;
+	}
 
-			if (it_prev)
-				it_prev->next = it;
-			else
-				cache_htable[hash_code].entries = it;
-
-			it->attr.s = (char*)(it + 1);
-			it->value.s =(char *)(it + 1) + attr->len;
-			it->expires = expires;
-
-			memcpy(it->value.s,new_value,new_len);
-			it->value.len = new_len;
-			lock_release(&cache_htable[hash_code].lock);
-			if (new_val)
-				*new_val = old_value;
-			stop_expire_timer(start,local_exec_threshold,
-			"cachedb_local add",attr->s,attr->len,0);
-			return 0;
+	if (i < 0) {
+		/* not found */
+		old_value = 0;
+		expires = expires ? get_ticks() + expires : 0;
+	} else {
+		/* found our valid entry */
+		sl = &seg->slots->s[i];
+		if (str2sint(&sl->entry->value,&old_value) < 0) {
+			LM_ERR("not an integer\n");
+			goto error;
 		}
-
-		it_prev = it;
-		it = it->next;
+		expires = sl->expires;
 	}
 
-	lock_release(&cache_htable[hash_code].lock);
+	old_value += val;
+	ins_val.s = sint2str(old_value,&ins_val.len);
+
+	me = lcache_new_entry(attr, &ins_val, expires);
+	if (me == NULL)
+		goto error;
 
-	/* not found */
-	ins_val.s = sint2str(val,&ins_val.len);
-	if (lcache_htable_insert(con,attr,&ins_val,expires) < 0) {
+	if (lcache_store(seg, hash, me) < 0) {
 		LM_ERR("failed to insert value\n");
-		stop_expire_timer(start,local_exec_threshold,
-		"cachedb_local add",attr->s,attr->len,0);
-		return -1;
+		shm_free(me);
+		goto error;
 	}
 
+	lock_release(&seg->lock);
+
+	lcache_evict();
+
 	if (new_val)
-		*new_val = val;
+		*new_val = old_value;
 	stop_expire_timer(start,local_exec_threshold,
 	"cachedb_local add",attr->s,attr->len,0);
 	return 0;
+
+error:
+	lock_release(&seg->lock);
+	stop_expire_timer(start,local_exec_threshold,
+	"cachedb_local add",attr->s,attr->len,0);
+	return -1;
 }
 
 int lcache_htable_sub(cachedb_con *con,str *attr,int val,int expires,int *new_val)
@@ -305,121 +650,120 @@ int lcache_htable_sub(cachedb_con *con,str *attr,int val,int expires,int *new_va
  * */
 int lcache_htable_fetch(cachedb_con *con,str* attr, str* res)
 {
-	int hash_code;
-	lcache_entry_t* it = NULL, *it_aux = NULL;
-	char* value;
+	char *value = NULL;
+	unsigned int size = 0, len;
+	int ret;
 	struct timeval start;
 
 	start_expire_timer(start,local_exec_threshold);
 
-	hash_code= core_hash( attr, 0, cache_htable_size);
-	lock_get(&cache_htable[hash_code].lock);
-
-	it = cache_htable[hash_code].entries;
-
-	while(it)
-	{
-		if(it->attr.len == attr->len &&
-				(strncmp(it->attr.s, attr->s, attr->len) == 0))
-		{
-			if( it->expires != 0 && it->expires < get_ticks())
-			{
-				/* found an expired entry  -> delete it */
-				if(it_aux)
-					it_aux->next = it->next;
-				else
-					cache_htable[hash_code].entries = it->next;
-
-				shm_free(it);
-
-				lock_release(&cache_htable[hash_code].lock);
-				stop_expire_timer(start,local_exec_threshold,
-				"cachedb_local fetch",attr->s,attr->len,0);
-				return -2;
-			}
-			value = (char*)pkg_malloc(it->value.len);
-			if(value == NULL)
-			{
-				LM_ERR("no more memory\n");
-				lock_release(&cache_htable[hash_code].lock);
-				stop_expire_timer(start,local_exec_threshold,
-				"cachedb_local fetch",attr->s,attr->len,0);
-				return -1;
-			}
-			memcpy(value, it->value.s, it->value.len);
-			res->len = it->value.len;
-			res->s = value;
-			lock_release(&cache_htable[hash_code].lock);
-			stop_expire_timer(start,local_exec_threshold,
-			"cachedb_local fetch",attr->s,attr->len,0);
-			return 1;
-		}
-
-		it_aux = it;
-		it = it->next;
+	ret = lcache_get(attr, &value, &size, &len);
+	if (ret == 1) {
+		res->s = value;
+		res->len = len;
+	} else if (value) {
+		pkg_free(value);
 	}
 
-	lock_release(&cache_htable[hash_code].lock);
 	stop_expire_timer(start,local_exec_threshold,
 	"cachedb_local fetch",attr->s,attr->len,0);
-	return -2;
+	return ret;
 }
 
 int lcache_htable_fetch_counter(cachedb_con* con,str* attr,int *val)
 {
-	int hash_code;
-	lcache_entry_t* it = NULL, *it_aux = NULL;
-	int ret;
+	str value;
+	unsigned int len;
+	int ret, counter;
 	struct timeval start;
 
 	start_expire_timer(start,local_exec_threshold);
 
-	hash_code= core_hash( attr, 0, cache_htable_size);
-	lock_get(&cache_htable[hash_code].lock);
+	ret = lcache_get(attr, &read_buf, &read_buf_size, &len);
+	if (ret == 1) {
+		value.s = read_buf;
+		value.len = len;
+		if (str2sint(&value,&counter) != 0) {
+			LM_ERR("Not a counter key\n");
+			ret = -3;
+		} else if (val) {
+			*val = counter;
+		}
+	}
 
-	it = cache_htable[hash_code].entries;
+	stop_expire_timer(start,local_exec_threshold,
+	"cachedb_local fetch_counter",attr->s,attr->len,0);
+	return ret;
+}
 
-	while(it)
-	{
-		if(it->attr.len == attr->len &&
-				(strncmp(it->attr.s, attr->s, attr->len) == 0))
-		{
-			if( it->expires != 0 && it->expires < get_ticks())
-			{
-				/* found an expired entry  -> delete it */
-				if(it_aux)
-					it_aux->next = it->next;
-				else
-					cache_htable[hash_code].entries = it->next;
-
-				shm_free(it);
-
-				lock_release(&cache_htable[hash_code].lock);
-				stop_expire_timer(start,local_exec_threshold,
-				"cachedb_local fetch_counter",attr->s,attr->len,0);
-				return -2;
+/* walks all the records, removing the ones matching the glob pattern (or
+ * the expired ones, if no pattern) */
+static int lcache_htable_sweep(char *glob)
+{
+	lcache_t *seg;
+	lcache_slot_t *sl;
+	unsigned int i;
+	int k;
+
+	for (k = 0; k < cache_htable_size; k++) {
+		seg = &cache_htable[k];
+		lock_get(&seg->lock);
+		lcache_write_begin(seg);
+
+		for (i = 0; i < seg->slots->size; ) {
+			sl = &seg->slots->s[i];
+			if (sl->entry == NULL) {
+				i++;
+				continue;
 			}
-			if (str2sint(&it->value,&ret) != 0) {
-				LM_ERR("Not a counter key\n");
-				lock_release(&cache_htable[hash_code].lock);
-				stop_expire_timer(start,local_exec_threshold,
-				"cachedb_local fetch_counter",attr->s,attr->len,0);
-				return -3;
+
+			if (glob) {
+				if (sl->attr_len + 1 > key_buff_size) {
+					key_buff = pkg_realloc(key_buff, sl->attr_len + 1);
+					if (key_buff == NULL) {
+						LM_ERR("No more pkg mem\n");
+						key_buff_size = 0;
+						lcache_write_end(seg);
+						lock_release(&seg->lock);
+						return -1;
+					}
+					key_buff_size = sl->attr_len + 1;
+				}
+				memcpy(key_buff, sl->entry->attr.s, sl->attr_len);
+				key_buff[sl->attr_len] = 0;
+
+				if (fnmatch(glob, key_buff, 0) != 0) {
+					i++;
+					continue;
+				}
+				LM_DBG("[%.*s] matches glob [%s] - removing from bucket %d\n",
+					sl->attr_len, sl->entry->attr.s, glob, k);
+			} else {
+				if (!lcache_expired(sl)) {
+					i++;
+					continue;
+				}
+				LM_DBG("deleted entry attr= [%.*s]\n",
+					sl->attr_len, sl->entry->attr.s);
 			}
-			if (val)
-				*val = ret;
-			lock_release(&cache_htable[hash_code].lock);
-			stop_expire_timer(start,local_exec_threshold,
-			"cachedb_local fetch_counter",attr->s,attr->len,0);
-			return 1;
+
+			/* a following record is moved in its place, check it again */
+			lcache_del_slot(seg, i);
 		}
 
-		it_aux = it;
-		it = it->next;
+		lcache_write_end(seg);
+		lock_release(&seg->lock);
 	}
 
-	lock_release(&cache_htable[hash_code].lock);
-	stop_expire_timer(start,local_exec_threshold,
-	"cachedb_local fetch_counter",attr->s,attr->len,0);
-	return -2;
+	return 1;
+}
+
+int lcache_htable_remove_chunk(char *glob)
+{
+	return lcache_htable_sweep(glob);
+}
+
+void lcache_htable_clean(void)
+{
+	lcache_htable_sweep(NULL);
 }
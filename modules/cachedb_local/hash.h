@@ -32,18 +32,49 @@
 #include "../../lock_ops.h"
 #include "../../cachedb/cachedb.h"
 
+/*
+ * The table is split in segments, each of them an open addressing (linear
+ * probing) table of slots, guarded by its own lock. The slots hold all the
+ * data needed to probe (hash, lengths, expire time), so only the matching
+ * record is touched; a record keeps the key and the value inline, right
+ * after its header, in a single shm chunk.
+ *
+ * Readers do not take the lock: they probe optimistically and retry if the
+ * sequence number of the segment changed meanwhile (seqlock). The slot
+ * arrays are released via RCU, while a record freed under a reader is still
+ * mapped shm memory, read only within the lengths found in its slot, and
+ * discarded by the sequence check.
+ */
+
 typedef struct lcache_entry
 {
 	str attr;
 	str value;
 	unsigned int expires;
-	struct lcache_entry* next;
 }lcache_entry_t;
 
+typedef struct lcache_slot
+{
+	unsigned int hash;
+	unsigned int expires;       /* 0 - never */
+	unsigned int attr_len;
+	unsigned int value_len;
+	unsigned int ref;           /* CLOCK bit - set on each access */
+	lcache_entry_t *entry;      /* NULL - free slot */
+}lcache_slot_t;
+
+typedef struct lcache_slots
+{
+	unsigned int size;          /* always a power of 2 */
+	lcache_slot_t s[0];
+}lcache_slots_t;
 
 typedef struct lcache
 {
-	lcache_entry_t* entries;
+	lcache_slots_t *slots;
+	unsigned int used;
+	unsigned int hand;          /* CLOCK hand of the segment */
+	volatile unsigned int seq;  /* odd while the segment is changed */
 	gen_lock_t lock;
 }lcache_t;
 
@@ -56,5 +87,10 @@ int lcache_htable_fetch(cachedb_con *con,str* attr, str* val);
 int lcache_htable_add(cachedb_con *con,str *attr,int val,int expires,int *new_val);
 int lcache_htable_sub(cachedb_con *con,str *attr,int val,int expires,int *new_val);
 int lcache_htable_fetch_counter(cachedb_con* con,str* attr,int *val);
+int lcache_htable_remove_chunk(char *glob);
+void lcache_htable_clean(void);
+
+unsigned long lcache_used_size(unsigned short foo);
+unsigned long lcache_entries(unsigned short foo);
 
 #endif
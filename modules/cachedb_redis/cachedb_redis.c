@@ -36,7 +36,11 @@
 #include "../../dprint.h"
 #include "../../error.h"
 #include "../../pt.h"
+#include "../../mod_fix.h"
+#include "../../usr_avp.h"
+#include "../../async.h"
 #include "../../cachedb/cachedb.h"
+#include "../../cachedb/cachedb_near.h"
 
 #include "cachedb_redis_dbase.h"
 
@@ -44,8 +48,19 @@ static int mod_init(void);
 static int child_init(int);
 static void destroy(void);
 
+static int redis_query_fixup(void** param, int param_no);
+static int w_redis_query(struct sip_msg *msg, char *grp, char *out,
+		char *q1, char *q2, char *q3, char *q4);
+static int w_async_redis_query(struct sip_msg *msg,
+		async_resume_module **resume_f, void **resume_param,
+		char *grp, char *out, char *q1, char *q2, char *q3, char *q4);
+
 static str cache_mod_name = str_init("redis");
 struct cachedb_url *redis_script_urls = NULL;
+char *redis_nc_channel = NULL;
+
+/* the connections of this process, by group */
+static cachedb_con_list *redis_cons = NULL;
 
 int set_connection(unsigned int type, void *val)
 {
@@ -54,9 +69,39 @@ int set_connection(unsigned int type, void *val)
 
 static param_export_t params[]={
 	{ "cachedb_url",                 STR_PARAM|USE_FUNC_PARAM, (void *)&set_connection},
+	{ "near_cache_channel",          STR_PARAM, &redis_nc_channel },
+	{ "max_async_connections",       INT_PARAM, &redis_max_async_cons },
 	{0,0,0}
 };
 
+#define REDIS_QUERY_ROUTES (REQUEST_ROUTE|FAILURE_ROUTE|ONREPLY_ROUTE| \
+	BRANCH_ROUTE|LOCAL_ROUTE|STARTUP_ROUTE|TIMER_ROUTE|EVENT_ROUTE)
+
+static cmd_export_t cmds[] = {
+	{"redis_query", (cmd_function)w_redis_query, 3, redis_query_fixup, 0,
+		REDIS_QUERY_ROUTES},
+	{"redis_query", (cmd_function)w_redis_query, 4, redis_query_fixup, 0,
+		REDIS_QUERY_ROUTES},
+	{"redis_query", (cmd_function)w_redis_query, 5, redis_query_fixup, 0,
+		REDIS_QUERY_ROUTES},
+	{"redis_query", (cmd_function)w_redis_query, 6, redis_query_fixup, 0,
+		REDIS_QUERY_ROUTES},
+	{0,0,0,0,0,0}
+};
+
+static acmd_export_t acmds[] = {
+	{"redis_query", (acmd_function)w_async_redis_query, 3, redis_query_fixup},
+	{"redis_query", (acmd_function)w_async_redis_query, 4, redis_query_fixup},
+	{"redis_query", (acmd_function)w_async_redis_query, 5, redis_query_fixup},
+	{"redis_query", (acmd_function)w_async_redis_query, 6, redis_query_fixup},
+	{0,0,0,0}
+};
+
+static proc_export_t procs[] = {
+	{"Redis near cache invalidation", 0, 0, redis_nc_subscriber, 1, 0},
+	{0,0,0,0,0,0}
+};
+
 
 /** module exports */
 struct module_exports exports= {
@@ -65,13 +110,13 @@ struct module_exports exports= {
 	MODULE_VERSION,
 	DEFAULT_DLFLAGS,			/* dlopen flags */
 	NULL,            /* OpenSIPS module dependencies */
-	0,						/* exported functions */
-	0,						/* exported async functions */
+	cmds,						/* exported functions */
+	acmds,						/* exported async functions */
 	params,						/* exported parameters */
 	0,							/* exported statistics */
 	0,							/* exported MI functions */
 	0,							/* exported pseudo-variables */
-	0,							/* extra processes */
+	procs,						/* extra processes */
 	mod_init,					/* module initialization function */
 	(response_function) 0,      /* response handling function */
 	(destroy_function)destroy,	/* destroy function */
@@ -108,9 +153,55 @@ static int mod_init(void)
 		return -1;
 	}
 
+	/* the changes published by the other instances are only needed if
+	 * there is a near cache to invalidate */
+	if (redis_nc_channel && cdb_nc_size) {
+		if (redis_script_urls == NULL) {
+			LM_ERR("near_cache_channel needs a cachedb_url to subscribe on\n");
+			return -1;
+		}
+		procs[0].no = 1;
+	} else {
+		procs[0].no = 0;
+	}
+
+	return 0;
+}
+
+static int redis_remember_con(cachedb_con *con)
+{
+	cachedb_con_list *it;
+	char *grp;
+
+	it = pkg_malloc(sizeof(cachedb_con_list));
+	if (it == NULL) {
+		LM_ERR("no more pkg\n");
+		return -1;
+	}
+
+	grp = ((redis_con *)con->data)->id->group_name;
+	it->grp.s = grp;
+	it->grp.len = grp ? strlen(grp) : 0;
+	it->connection = con;
+	it->next = redis_cons;
+	redis_cons = it;
+
 	return 0;
 }
 
+static redis_con *redis_get_group(str *grp)
+{
+	cachedb_con_list *it;
+
+	for (it=redis_cons;it;it=it->next)
+		if (it->grp.len == grp->len &&
+		(grp->len == 0 || memcmp(it->grp.s,grp->s,grp->len) == 0))
+			return (redis_con *)it->connection->data;
+
+	LM_ERR("no redis connection for group [%.*s]\n",grp->len,grp->s);
+	return NULL;
+}
+
 static int child_init(int rank)
 {
 	struct cachedb_url *it;
@@ -131,6 +222,8 @@ static int child_init(int rank)
 			LM_ERR("failed to insert connection\n");
 			return -1;
 		}
+		if (redis_remember_con(con) < 0)
+			return -1;
 	}
 
 	cachedb_free_url(redis_script_urls);
@@ -146,3 +239,210 @@ static void destroy(void)
 	cachedb_end_connections(&cache_mod_name);
 	return;
 }
+
+
+/* "redis" or "redis:group" -> group name */
+static int redis_query_fixup(void** param, int param_no)
+{
+	str *grp;
+	char *p;
+
+	if (param_no == 1) {
+		p = (char *)*param;
+		if (strncmp(p,cache_mod_name.s,cache_mod_name.len) != 0 ||
+		(p[cache_mod_name.len] != 0 && p[cache_mod_name.len] != ':')) {
+			LM_ERR("bad redis group [%s], expected \"redis[:group]\"\n",p);
+			return E_CFG;
+		}
+
+		grp = pkg_malloc(sizeof(str));
+		if (grp == NULL) {
+			LM_ERR("no more pkg\n");
+			return E_OUT_OF_MEM;
+		}
+		p += cache_mod_name.len;
+		grp->s = *p ? p+1 : p;
+		grp->len = strlen(grp->s);
+		*param = grp;
+		return 0;
+	}
+
+	if (param_no == 2) {
+		if (fixup_pvar(param) < 0)
+			return E_CFG;
+		if (((pv_spec_t *)*param)->type != PVT_AVP) {
+			LM_ERR("the results must go into an AVP\n");
+			return E_CFG;
+		}
+		return 0;
+	}
+
+	return fixup_spve(param);
+}
+
+static int redis_build_pipeline(struct sip_msg *msg, redis_pipeline *pl,
+		char **q, int no)
+{
+	str query;
+	int i;
+
+	memset(pl,0,sizeof(redis_pipeline));
+
+	for (i=0;i<no && q[i];i++) {
+		if (fixup_get_svalue(msg,(gparam_p)q[i],&query) != 0) {
+			LM_ERR("failed to get the query %d\n",i+1);
+			goto error;
+		}
+		if (redis_pipeline_add(pl,&query) < 0)
+			goto error;
+	}
+
+	return 0;
+error:
+	redis_free_pipeline(pl);
+	return -1;
+}
+
+/* one AVP value per command: integer, string (also for status replies) or
+ * NULL (nil, array or error replies) */
+static int redis_push_results(struct sip_msg *msg, pv_spec_t *out,
+		redis_pipeline *pl)
+{
+	int_str avp_name, avp_val;
+	unsigned short name_type, avp_type;
+	redisReply *r;
+	int i, ret = 1;
+
+	if (pv_get_avp_name(msg,&out->pvp,&avp_name.n,&name_type) != 0) {
+		LM_ERR("cannot get the result AVP name\n");
+		return -1;
+	}
+
+	destroy_avps(name_type,avp_name.n,1);
+
+	/* added from the last one, so that $avp(x)[0] holds the first result */
+	for (i=pl->no-1;i>=0;i--) {
+		r = pl->reply[i];
+		avp_type = name_type;
+
+		if (r && r->type == REDIS_REPLY_INTEGER) {
+			avp_val.n = r->integer;
+		} else if (r && (r->type == REDIS_REPLY_STRING ||
+		r->type == REDIS_REPLY_STATUS)) {
+			avp_type |= AVP_VAL_STR;
+			avp_val.s.s = r->str;
+			avp_val.s.len = r->len;
+		} else {
+			if (r == NULL || r->type == REDIS_REPLY_ERROR) {
+				LM_ERR("query %d failed - %.*s\n",i+1,
+					r?r->len:7,r?r->str:"FAILURE");
+				ret = -1;
+			}
+			avp_type |= AVP_VAL_NULL;
+			avp_val.s.s = NULL;
+			avp_val.s.len = 0;
+		}
+
+		if (add_avp(avp_type,avp_name.n,avp_val) != 0) {
+			LM_ERR("failed to add the result AVP\n");
+			return -1;
+		}
+	}
+
+	return ret;
+}
+
+static int w_redis_query(struct sip_msg *msg, char *grp, char *out,
+		char *q1, char *q2, char *q3, char *q4)
+{
+	char *q[REDIS_MAX_PIPELINE] = {q1, q2, q3, q4};
+	redis_pipeline pl;
+	redis_con *con;
+	int ret;
+
+	con = redis_get_group((str *)grp);
+	if (con == NULL)
+		return -1;
+
+	if (redis_build_pipeline(msg,&pl,q,REDIS_MAX_PIPELINE) < 0)
+		return -1;
+
+	redis_run_pipeline(con,&pl);
+	ret = redis_push_results(msg,(pv_spec_t *)out,&pl);
+
+	redis_free_pipeline(&pl);
+	return ret;
+}
+
+struct redis_async_param {
+	redis_pipeline pl;
+	pv_spec_t *out;
+};
+
+static int resume_async_redis_query(int fd, struct sip_msg *msg, void *param)
+{
+	struct redis_async_param *p = (struct redis_async_param *)param;
+	int ret;
+
+	ret = redis_resume_async_pipeline(&p->pl);
+	if (ret == 0) {
+		async_status = ASYNC_CONTINUE;
+		return 1;
+	}
+
+	ret = (ret < 0) ? -1 : redis_push_results(msg,p->out,&p->pl);
+
+	redis_free_pipeline(&p->pl);
+	pkg_free(p);
+
+	/* the fd belongs to a pooled connection - do not close it */
+	async_status = ASYNC_DONE;
+	return ret;
+}
+
+static int w_async_redis_query(struct sip_msg *msg,
+		async_resume_module **resume_f, void **resume_param,
+		char *grp, char *out, char *q1, char *q2, char *q3, char *q4)
+{
+	char *q[REDIS_MAX_PIPELINE] = {q1, q2, q3, q4};
+	struct redis_async_param *p;
+	redis_con *con;
+	int fd, ret;
+
+	*resume_f = NULL;
+	*resume_param = NULL;
+	async_status = ASYNC_NO_IO;
+
+	con = redis_get_group((str *)grp);
+	if (con == NULL)
+		return -1;
+
+	/* the replies are read from the reactor of this very process */
+	p = pkg_malloc(sizeof(struct redis_async_param));
+	if (p == NULL) {
+		LM_ERR("no more pkg\n");
+		return -1;
+	}
+	p->out = (pv_spec_t *)out;
+
+	if (redis_build_pipeline(msg,&p->pl,q,REDIS_MAX_PIPELINE) < 0) {
+		pkg_free(p);
+		return -1;
+	}
+
+	fd = redis_start_async_pipeline(con,&p->pl);
+	if (fd < 0) {
+		/* keys on several nodes or no free connection - block */
+		redis_run_pipeline(con,&p->pl);
+		ret = redis_push_results(msg,p->out,&p->pl);
+		redis_free_pipeline(&p->pl);
+		pkg_free(p);
+		async_status = ASYNC_SYNC;
+		return ret;
+	}
+
+	*resume_f = resume_async_redis_query;
+	*resume_param = p;
+	async_status = fd;
+	return 1;
+}
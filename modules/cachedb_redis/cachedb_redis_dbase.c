@@ -29,49 +29,65 @@
 #include "../../mem/mem.h"
 #include "../../ut.h"
 #include "../../cachedb/cachedb.h"
+#include "../../cachedb/cachedb_near.h"
 
 #include <string.h>
+#include <unistd.h>
 #include <hiredis/hiredis.h>
 
-int redis_connect_node(redis_con *con,cluster_node *node)
+int redis_max_async_cons = 10;
+
+static redisContext *redis_open_context(redis_con *con,char *ip,
+		unsigned short port)
 {
+	redisContext *ctx;
 	redisReply *rpl;
 
-	node->context = redisConnect(node->ip,node->port);
-	if (node->context->err != REDIS_OK) {
-		LM_ERR("failed to open redis connection %s:%hu - %s\n",node->ip,
-				node->port,node->context->errstr);
-		return -1;
+	ctx = redisConnect(ip,port);
+	if (ctx == NULL || ctx->err != REDIS_OK) {
+		LM_ERR("failed to open redis connection %s:%hu - %s\n",ip,
+				port,ctx?ctx->errstr:"FAILURE");
+		if (ctx)
+			redisFree(ctx);
+		return NULL;
 	}
 
 	if (con->id->password) {
-		rpl = redisCommand(node->context,"AUTH %s",con->id->password);
+		rpl = redisCommand(ctx,"AUTH %s",con->id->password);
 		if (rpl == NULL || rpl->type == REDIS_REPLY_ERROR) {
 			LM_ERR("failed to auth to redis - %.*s\n",
 				rpl?rpl->len:7,rpl?rpl->str:"FAILURE");
-			freeReplyObject(rpl);
-			redisFree(node->context);
-			return -1;
+			if (rpl)
+				freeReplyObject(rpl);
+			redisFree(ctx);
+			return NULL;
 		}
 		LM_DBG("AUTH [password] -  %.*s\n",rpl->len,rpl->str);
 		freeReplyObject(rpl);
 	}
 
 	if ((con->type & REDIS_SINGLE_INSTANCE) && con->id->database) {
-		rpl = redisCommand(node->context,"SELECT %s",con->id->database);
+		rpl = redisCommand(ctx,"SELECT %s",con->id->database);
 		if (rpl == NULL || rpl->type == REDIS_REPLY_ERROR) {
 			LM_ERR("failed to select database %s - %.*s\n",con->id->database,
 				rpl?rpl->len:7,rpl?rpl->str:"FAILURE");
-			freeReplyObject(rpl);
-			redisFree(node->context);
-			return -1;
+			if (rpl)
+				freeReplyObject(rpl);
+			redisFree(ctx);
+			return NULL;
 		}
 
 		LM_DBG("SELECT [%s] - %.*s\n",con->id->database,rpl->len,rpl->str);
 		freeReplyObject(rpl);
 	}
 
-	return 0;
+	return ctx;
+}
+
+int redis_connect_node(redis_con *con,cluster_node *node)
+{
+	node->context = redis_open_context(con,node->ip,node->port);
+	return node->context ? 0 : -1;
 }
 
 int redis_reconnect_node(redis_con *con,cluster_node *node)
@@ -79,7 +95,8 @@ int redis_reconnect_node(redis_con *con,cluster_node *node)
 	LM_DBG("reconnecting node %s:%d \n",node->ip,node->port);
 
 	/* close the old connection */
-	redisFree(node->context);
+	if (node->context)
+		redisFree(node->context);
 
 	return redis_connect_node(con,node);
 }
@@ -158,6 +175,9 @@ int redis_connect(redis_con *con)
 		}
 	}
 
+	if ((con->type & REDIS_CLUSTER_INSTANCE) && build_slot_map(con) < 0)
+		return -1;
+
 	return 0;
 }
 
@@ -225,7 +245,16 @@ void redis_destroy(cachedb_con *con) {
 			return -10; \
 		} \
 		for (i=2;i;i--) { \
+			if (node->context == NULL && redis_reconnect_node(con,node) < 0) { \
+				i = 0; break; \
+			} \
 			reply = redisCommand(node->context,fmt,##args); \
+			if (reply && reply->type == REDIS_REPLY_ERROR && \
+			(moved=redis_moved_node(con,reply)) != NULL) { \
+				freeReplyObject(reply); \
+				node = moved; \
+				continue; \
+			} \
 			if (reply == NULL || reply->type == REDIS_REPLY_ERROR) { \
 				LM_ERR("Redis operation failure - %p %.*s\n",\
 					reply,reply?reply->len:7,reply?reply->str:"FAILURE"); \
@@ -242,10 +271,28 @@ void redis_destroy(cachedb_con *con) {
 		} \
 	} while (0)
 
+/* lets the other instances drop the key from their near caches */
+static void redis_publish_change(cluster_node *node,str *attr)
+{
+	redisReply *reply;
+
+	if (redis_nc_channel == NULL)
+		return;
+
+	reply = redisCommand(node->context,"PUBLISH %s %b",
+		redis_nc_channel,attr->s,attr->len);
+	if (reply == NULL || reply->type == REDIS_REPLY_ERROR)
+		LM_WARN("failed to publish the change of %.*s - %.*s\n",
+			attr->len,attr->s,reply?reply->len:7,reply?reply->str:"FAILURE");
+
+	if (reply)
+		freeReplyObject(reply);
+}
+
 int redis_get(cachedb_con *connection,str *attr,str *val)
 {
 	redis_con *con;
-	cluster_node *node;
+	cluster_node *node,*moved;
 	redisReply *reply;
 	int i;
 
@@ -282,7 +329,7 @@ int redis_get(cachedb_con *connection,str *attr,str *val)
 int redis_set(cachedb_con *connection,str *attr,str *val,int expires)
 {
 	redis_con *con;
-	cluster_node *node;
+	cluster_node *node,*moved;
 	redisReply *reply;
 	int i;
 
@@ -297,6 +344,7 @@ int redis_set(cachedb_con *connection,str *attr,str *val,int expires)
 			val->s,reply->type,reply->len,reply->str);
 
 	freeReplyObject(reply);
+	redis_publish_change(node,attr);
 
 	if (expires) {
 		redis_run_command(con,attr,"EXPIRE %b %d",attr->s,attr->len,expires);
@@ -316,7 +364,7 @@ int redis_set(cachedb_con *connection,str *attr,str *val,int expires)
 int redis_remove(cachedb_con *connection,str *attr)
 {
 	redis_con *con;
-	cluster_node *node;
+	cluster_node *node,*moved;
 	redisReply *reply;
 	int ret=0,i;
 
@@ -334,6 +382,8 @@ int redis_remove(cachedb_con *connection,str *attr)
 		LM_DBG("Key %.*s successfully removed\n",attr->len,attr->s);
 
 	freeReplyObject(reply);
+	if (ret == 0)
+		redis_publish_change(node,attr);
 	return ret;
 }
 
@@ -341,7 +391,7 @@ int redis_remove(cachedb_con *connection,str *attr)
 int redis_add(cachedb_con *connection,str *attr,int val,int expires,int *new_val)
 {
 	redis_con *con;
-	cluster_node *node;
+	cluster_node *node,*moved;
 	redisReply *reply;
 	int i;
 
@@ -355,6 +405,7 @@ int redis_add(cachedb_con *connection,str *attr,int val,int expires,int *new_val
 	if (new_val)
 		*new_val = reply->integer;
 	freeReplyObject(reply);
+	redis_publish_change(node,attr);
 
 	if (expires) {
 		redis_run_command(con,attr,"EXPIRE %b %d",attr->s,attr->len,expires);
@@ -371,7 +422,7 @@ int redis_add(cachedb_con *connection,str *attr,int val,int expires,int *new_val
 int redis_sub(cachedb_con *connection,str *attr,int val,int expires,int *new_val)
 {
 	redis_con *con;
-	cluster_node *node;
+	cluster_node *node,*moved;
 	redisReply *reply;
 	int i;
 
@@ -385,6 +436,7 @@ int redis_sub(cachedb_con *connection,str *attr,int val,int expires,int *new_val
 	if (new_val)
 		*new_val = reply->integer;
 	freeReplyObject(reply);
+	redis_publish_change(node,attr);
 
 	if (expires) {
 		redis_run_command(con,attr,"EXPIRE %b %d",attr->s,attr->len,expires);
@@ -401,7 +453,7 @@ int redis_sub(cachedb_con *connection,str *attr,int val,int expires,int *new_val
 int redis_get_counter(cachedb_con *connection,str *attr,int *val)
 {
 	redis_con *con;
-	cluster_node *node;
+	cluster_node *node,*moved;
 	redisReply *reply;
 	int i,ret;
 	str response;
@@ -581,7 +633,7 @@ int redis_raw_query_extract_key(str *attr,str *query_key)
 int redis_raw_query_send(cachedb_con *connection,redisReply **reply,cdb_raw_entry ***rpl,int expected_kv_no,int *reply_no,str *attr, ...)
 {
 	redis_con *con;
-	cluster_node *node;
+	cluster_node *node,*moved;
 	int i,end;
 	va_list ap;
 	str query_key;
@@ -603,7 +655,16 @@ int redis_raw_query_send(cachedb_con *connection,redisReply **reply,cdb_raw_entr
 	attr->s[attr->len] = 0;
 
 	for (i=2;i;i--) {
+		if (node->context == NULL && redis_reconnect_node(con,node) < 0) {
+			i = 0; break;
+		}
 		*reply = redisvCommand(node->context,attr->s,ap);
+		if (*reply && (*reply)->type == REDIS_REPLY_ERROR &&
+		(moved=redis_moved_node(con,*reply)) != NULL) {
+			freeReplyObject(*reply);
+			node = moved;
+			continue;
+		}
 		if (*reply == NULL || (*reply)->type == REDIS_REPLY_ERROR) {
 			LM_ERR("Redis operation failure - %.*s\n",
 				*reply?(*reply)->len:7,*reply?(*reply)->str:"FAILURE");
@@ -669,3 +730,381 @@ int redis_raw_query(cachedb_con *connection,str *attr,cdb_raw_entry ***rpl,int e
 
 	return 1;
 }
+
+/* takes an idle connection to the node out of its async pool, or opens
+ * a new one - NULL if all the allowed connections are busy */
+static redis_async_con *redis_get_async_con(redis_con *con,cluster_node *node)
+{
+	redis_async_con *ac;
+
+	if (node->async_busy >= redis_max_async_cons) {
+		LM_DBG("all the %d async connections to %s:%hu are busy\n",
+			redis_max_async_cons,node->ip,node->port);
+		return NULL;
+	}
+
+	if (node->async_pool) {
+		ac = node->async_pool;
+		node->async_pool = ac->next;
+	} else {
+		ac = pkg_malloc(sizeof(redis_async_con));
+		if (ac == NULL) {
+			LM_ERR("no more pkg\n");
+			return NULL;
+		}
+		ac->context = redis_open_context(con,node->ip,node->port);
+		if (ac->context == NULL) {
+			pkg_free(ac);
+			return NULL;
+		}
+	}
+
+	node->async_busy++;
+	return ac;
+}
+
+/* a connection left in an unknown state (@broken) is closed, not reused */
+static void redis_put_async_con(cluster_node *node,redis_async_con *ac,
+		int broken)
+{
+	node->async_busy--;
+
+	if (broken) {
+		redisFree(ac->context);
+		pkg_free(ac);
+		return;
+	}
+
+	ac->next = node->async_pool;
+	node->async_pool = ac;
+}
+
+void redis_destroy_async_pool(cluster_node *node)
+{
+	redis_async_con *ac;
+
+	while ((ac=node->async_pool) != NULL) {
+		node->async_pool = ac->next;
+		redisFree(ac->context);
+		pkg_free(ac);
+	}
+}
+
+/* splits the query in (space separated) arguments - as for the raw
+ * queries, the 2nd one is taken as the key */
+int redis_pipeline_add(redis_pipeline *pl,str *query)
+{
+	redis_cmd *cmd;
+	char *p, *end, *s;
+	int argc;
+
+	if (pl->no == REDIS_MAX_PIPELINE) {
+		LM_ERR("too many commands, max %d\n",REDIS_MAX_PIPELINE);
+		return -1;
+	}
+
+	end = query->s + query->len;
+	for (argc=0,p=query->s;p<end;) {
+		while (p<end && (*p==' ' || *p=='\t'))
+			p++;
+		if (p==end)
+			break;
+		argc++;
+		while (p<end && *p!=' ' && *p!='\t')
+			p++;
+	}
+
+	if (argc == 0) {
+		LM_ERR("empty Redis query\n");
+		return -1;
+	}
+
+	cmd = &pl->cmd[pl->no];
+	cmd->argv = pkg_malloc(argc * (sizeof(char *) + sizeof(size_t)) +
+		query->len);
+	if (cmd->argv == NULL) {
+		LM_ERR("no more pkg\n");
+		return -1;
+	}
+	cmd->argvlen = (size_t *)(cmd->argv + argc);
+	s = (char *)(cmd->argvlen + argc);
+	memcpy(s,query->s,query->len);
+
+	end = s + query->len;
+	for (cmd->argc=0,p=s;p<end;) {
+		while (p<end && (*p==' ' || *p=='\t'))
+			p++;
+		if (p==end)
+			break;
+		cmd->argv[cmd->argc] = p;
+		while (p<end && *p!=' ' && *p!='\t')
+			p++;
+		cmd->argvlen[cmd->argc] = p - cmd->argv[cmd->argc];
+		cmd->argc++;
+	}
+
+	cmd->key.s = cmd->argv[argc > 1 ? 1 : 0];
+	cmd->key.len = cmd->argvlen[argc > 1 ? 1 : 0];
+
+	pl->reply[pl->no] = NULL;
+	pl->no++;
+	return 0;
+}
+
+/* runs a single command of the pipeline, the same way redis_run_command()
+ * does - an error reply is also a result */
+static redisReply *redis_run_cmd(redis_con *con,redis_cmd *cmd)
+{
+	cluster_node *node,*moved;
+	redisReply *reply;
+	int i;
+
+	node = get_redis_connection(con,&cmd->key);
+	if (node == NULL) {
+		LM_ERR("Bad cluster configuration\n");
+		return NULL;
+	}
+
+	for (i=2;i;i--) {
+		if (node->context == NULL && redis_reconnect_node(con,node) < 0)
+			break;
+
+		reply = redisCommandArgv(node->context,cmd->argc,
+			(const char **)cmd->argv,cmd->argvlen);
+		if (reply && reply->type == REDIS_REPLY_ERROR &&
+		(moved=redis_moved_node(con,reply)) != NULL) {
+			freeReplyObject(reply);
+			node = moved;
+			continue;
+		}
+		if (reply)
+			return reply;
+
+		LM_ERR("Redis operation failure - %s\n",node->context->errstr);
+		if (redis_reconnect_node(con,node) < 0)
+			break;
+	}
+
+	LM_ERR("giving up on query\n");
+	return NULL;
+}
+
+/* the commands which got no reply (or were redirected) are run again,
+ * one by one */
+static void redis_rerun_pipeline(redis_con *con,redis_pipeline *pl)
+{
+	int i;
+
+	for (i=0;i<pl->no;i++) {
+		if (pl->reply[i] && (pl->reply[i]->type != REDIS_REPLY_ERROR ||
+		pl->reply[i]->len < 6 || memcmp(pl->reply[i]->str,"MOVED ",6)))
+			continue;
+
+		if (pl->reply[i]) {
+			/* only remember the new owner of the slot */
+			redis_moved_node(con,pl->reply[i]);
+			freeReplyObject(pl->reply[i]);
+		}
+		pl->reply[i] = redis_run_cmd(con,&pl->cmd[i]);
+	}
+}
+
+/*
+ * Writes all the commands (one buffer per node) before reading any reply,
+ * so a pipeline costs a single round trip per involved node
+ */
+int redis_run_pipeline(redis_con *con,redis_pipeline *pl)
+{
+	cluster_node *node[REDIS_MAX_PIPELINE];
+	int queued[REDIS_MAX_PIPELINE];
+	int i,j;
+
+	for (i=0;i<pl->no;i++) {
+		node[i] = get_redis_connection(con,&pl->cmd[i].key);
+		queued[i] = node[i] &&
+			(node[i]->context || redis_reconnect_node(con,node[i]) == 0) &&
+			redisAppendCommandArgv(node[i]->context,pl->cmd[i].argc,
+				(const char **)pl->cmd[i].argv,pl->cmd[i].argvlen) == REDIS_OK;
+	}
+
+	/* the replies of each connection come in the order of its commands */
+	for (i=0;i<pl->no;i++) {
+		if (!queued[i])
+			continue;
+
+		if (redisGetReply(node[i]->context,(void **)&pl->reply[i]) != REDIS_OK) {
+			LM_ERR("Redis operation failure - %s\n",node[i]->context->errstr);
+			pl->reply[i] = NULL;
+			/* nothing more to read from this connection */
+			for (j=i+1;j<pl->no;j++)
+				if (node[j] == node[i])
+					queued[j] = 0;
+			if (redis_reconnect_node(con,node[i]) < 0)
+				LM_ERR("failed to reconnect to %s:%hu\n",
+					node[i]->ip,node[i]->port);
+		}
+	}
+
+	redis_rerun_pipeline(con,pl);
+	return 0;
+}
+
+/*
+ * Sends the pipeline over one of the async connections of the node and
+ * returns its fd, to be watched for the replies. As a single fd can be
+ * watched, all the keys must be served by the same node; -1 is returned if
+ * not possible, leaving the pipeline to be run in blocking mode
+ */
+int redis_start_async_pipeline(redis_con *con,redis_pipeline *pl)
+{
+	cluster_node *node;
+	int i,done;
+
+	node = get_redis_connection(con,&pl->cmd[0].key);
+	for (i=1;i<pl->no;i++)
+		if (get_redis_connection(con,&pl->cmd[i].key) != node)
+			return -1;
+
+	if (node == NULL || (pl->ac=redis_get_async_con(con,node)) == NULL)
+		return -1;
+
+	pl->con = con;
+	pl->node = node;
+	pl->done = 0;
+
+	for (i=0;i<pl->no;i++)
+		if (redisAppendCommandArgv(pl->ac->context,pl->cmd[i].argc,
+		(const char **)pl->cmd[i].argv,pl->cmd[i].argvlen) != REDIS_OK)
+			goto error;
+
+	do {
+		if (redisBufferWrite(pl->ac->context,&done) != REDIS_OK)
+			goto error;
+	} while (!done);
+
+	return pl->ac->context->fd;
+
+error:
+	LM_ERR("failed to send the queries to %s:%hu - %s\n",node->ip,
+		node->port,pl->ac->context->errstr);
+	redis_put_async_con(node,pl->ac,1);
+	pl->ac = NULL;
+	return -1;
+}
+
+/* reads what is available on the fd: returns 1 if all the replies are in,
+ * 0 if more are expected and -1 if the connection failed */
+int redis_resume_async_pipeline(redis_pipeline *pl)
+{
+	void *reply;
+
+	if (redisBufferRead(pl->ac->context) != REDIS_OK)
+		goto error;
+
+	while (pl->done < pl->no) {
+		if (redisReaderGetReply(pl->ac->context->reader,&reply) != REDIS_OK)
+			goto error;
+		if (reply == NULL)
+			return 0;
+		pl->reply[pl->done++] = reply;
+	}
+
+	redis_put_async_con(pl->node,pl->ac,0);
+	pl->ac = NULL;
+
+	/* the redirections are followed in blocking mode */
+	redis_rerun_pipeline(pl->con,pl);
+	return 1;
+
+error:
+	LM_ERR("failed to read the replies from %s:%hu - %s\n",pl->node->ip,
+		pl->node->port,pl->ac->context->errstr);
+	redis_put_async_con(pl->node,pl->ac,1);
+	pl->ac = NULL;
+	return -1;
+}
+
+void redis_free_pipeline(redis_pipeline *pl)
+{
+	int i;
+
+	for (i=0;i<pl->no;i++) {
+		if (pl->reply[i])
+			freeReplyObject(pl->reply[i]);
+		pkg_free(pl->cmd[i].argv);
+	}
+
+	if (pl->ac)
+		redis_put_async_con(pl->node,pl->ac,1);
+}
+
+/*
+ * Process listening on the near cache channel for the keys changed by the
+ * other instances; reconnects (and subscribes again) if the link is lost
+ */
+void redis_nc_subscriber(int rank)
+{
+	struct cachedb_id *id;
+	redisContext *ctx;
+	redisReply *rpl;
+	str key;
+
+	id = new_cachedb_id(&redis_script_urls->url);
+	if (id == NULL) {
+		LM_ERR("cannot parse url [%.*s]\n",
+			redis_script_urls->url.len,redis_script_urls->url.s);
+		return;
+	}
+
+	for (;;) {
+		ctx = redisConnect(id->host,id->port);
+		if (ctx == NULL || ctx->err != REDIS_OK) {
+			LM_ERR("failed to open redis connection - %s\n",
+				ctx?ctx->errstr:"FAILURE");
+			goto retry;
+		}
+
+		if (id->password) {
+			rpl = redisCommand(ctx,"AUTH %s",id->password);
+			if (rpl == NULL || rpl->type == REDIS_REPLY_ERROR) {
+				LM_ERR("failed to auth to redis - %.*s\n",
+					rpl?rpl->len:7,rpl?rpl->str:"FAILURE");
+				if (rpl)
+					freeReplyObject(rpl);
+				goto retry;
+			}
+			freeReplyObject(rpl);
+		}
+
+		rpl = redisCommand(ctx,"SUBSCRIBE %s",redis_nc_channel);
+		if (rpl == NULL || rpl->type == REDIS_REPLY_ERROR) {
+			LM_ERR("failed to subscribe to %s - %.*s\n",redis_nc_channel,
+				rpl?rpl->len:7,rpl?rpl->str:"FAILURE");
+			if (rpl)
+				freeReplyObject(rpl);
+			goto retry;
+		}
+		freeReplyObject(rpl);
+
+		LM_DBG("subscribed to %s\n",redis_nc_channel);
+
+		/* [ "message", channel, key ] */
+		while (redisGetReply(ctx,(void **)&rpl) == REDIS_OK) {
+			if (rpl->type == REDIS_REPLY_ARRAY && rpl->elements == 3 &&
+			rpl->element[2]->type == REDIS_REPLY_STRING) {
+				key.s = rpl->element[2]->str;
+				key.len = rpl->element[2]->len;
+				LM_DBG("key %.*s changed\n",key.len,key.s);
+				cachedb_near_invalidate(&key);
+			}
+			freeReplyObject(rpl);
+		}
+
+		LM_ERR("lost the subscription to %s - %s\n",redis_nc_channel,
+			ctx->errstr);
+retry:
+		if (ctx)
+			redisFree(ctx);
+		sleep(1);
+	}
+}
@@ -29,6 +29,14 @@
 #include <hiredis/hiredis.h>
 #include "../../cachedb/cachedb.h"
 
+#define REDIS_CLUSTER_SLOTS	16384
+
+/* extra connection, used by a single async query at a time */
+typedef struct redis_async_con {
+	redisContext *context;
+	struct redis_async_con *next;
+} redis_async_con;
+
 typedef struct cluster_nodes {
 	char *ip;							/* ip of this cluster node */
 	short port;						/* port of this cluster node */
@@ -36,6 +44,8 @@ typedef struct cluster_nodes {
 	unsigned short end_slot;		/* last slot for this server */
 
 	redisContext *context;			/* actual connection to this node */
+	redis_async_con *async_pool;	/* idle connections for async queries */
+	unsigned int async_busy;		/* connections with an ongoing query */
 	struct cluster_nodes *next;
 } cluster_node;
 
@@ -49,8 +59,34 @@ typedef struct {
 	int type; /* single node or cluster node */
 	unsigned short slots_assigned; /* total slots for cluster */
 	cluster_node *nodes; /* one or more Redis nodes */
+	cluster_node **slot_map; /* owner of each slot (cluster only) */
 } redis_con;
 
+/* max number of commands sent in a single round trip */
+#define REDIS_MAX_PIPELINE	4
+
+typedef struct {
+	int argc;
+	char **argv;
+	size_t *argvlen;
+	str key;			/* selects the cluster node */
+} redis_cmd;
+
+typedef struct {
+	redis_cmd cmd[REDIS_MAX_PIPELINE];
+	redisReply *reply[REDIS_MAX_PIPELINE];
+	int no;
+	/* set while running in async mode */
+	redis_con *con;
+	cluster_node *node;
+	redis_async_con *ac;
+	int done;
+} redis_pipeline;
+
+extern char *redis_nc_channel;
+extern int redis_max_async_cons;
+extern struct cachedb_url *redis_script_urls;
+
 cachedb_con* redis_init(str *url);
 void redis_destroy(cachedb_con *con);
 int redis_get(cachedb_con *con,str *attr,str *val);
@@ -60,6 +96,15 @@ int redis_add(cachedb_con *con,str *attr,int val,int expires,int *new_val);
 int redis_sub(cachedb_con *con,str *attr,int val,int expires,int *new_val);
 int redis_get_counter(cachedb_con *connection,str *attr,int *val);
 int redis_raw_query(cachedb_con *connection,str *attr,cdb_raw_entry ***reply,int expected_kv_no,int *reply_no);
+void redis_nc_subscriber(int rank);
+
+int redis_connect_node(redis_con *con,cluster_node *node);
+void redis_destroy_async_pool(cluster_node *node);
+int redis_pipeline_add(redis_pipeline *pl,str *query);
+int redis_run_pipeline(redis_con *con,redis_pipeline *pl);
+int redis_start_async_pipeline(redis_con *con,redis_pipeline *pl);
+int redis_resume_async_pipeline(redis_pipeline *pl);
+void redis_free_pipeline(redis_pipeline *pl);
 
 #endif /* CACHEDBREDIS_DBASE_H */
 
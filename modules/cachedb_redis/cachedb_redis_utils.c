@@ -78,26 +78,115 @@ uint16_t crc16(const char *buf, int len)
     return crc;
 }
 
+/* the slot of a key - only the {hash tag} is hashed, if present */
 unsigned int redisHash(redis_con *con, str* key)
 {
-	return crc16(key->s,key->len) & con->slots_assigned;
+	char *start, *end;
+
+	start = memchr(key->s,'{',key->len);
+	if (start) {
+		end = memchr(start+1,'}',key->len - (start+1-key->s));
+		if (end && end > start+1)
+			return crc16(start+1,end-start-1) & (REDIS_CLUSTER_SLOTS-1);
+	}
+
+	return crc16(key->s,key->len) & (REDIS_CLUSTER_SLOTS-1);
 }
 
 cluster_node *get_redis_connection(redis_con *con,str *key)
 {
-	unsigned short hash_slot;
-	cluster_node *it;
-
 	if (con->type & REDIS_SINGLE_INSTANCE)
 		return con->nodes;
-	else {
-		hash_slot = redisHash(con, key);
-		for (it=con->nodes;it;it=it->next) {
-			if (it->start_slot <= hash_slot && it->end_slot >= hash_slot)
-				return it;
+	else
+		return con->slot_map[redisHash(con, key)];
+}
+
+/* (re)builds the slot -> node index out of the node slot ranges */
+int build_slot_map(redis_con *con)
+{
+	cluster_node *it;
+	unsigned int i;
+
+	if (con->slot_map == NULL) {
+		con->slot_map = pkg_malloc(REDIS_CLUSTER_SLOTS * sizeof(cluster_node*));
+		if (con->slot_map == NULL) {
+			LM_ERR("no more pkg\n");
+			return -1;
 		}
+	}
+	memset(con->slot_map,0,REDIS_CLUSTER_SLOTS * sizeof(cluster_node*));
+
+	for (it=con->nodes;it;it=it->next)
+		for (i=it->start_slot;i<=it->end_slot && i<REDIS_CLUSTER_SLOTS;i++)
+			con->slot_map[i] = it;
+
+	return 0;
+}
+
+/*
+ * Follows a "MOVED <slot> <ip>:<port>" reply - the slot is pointed to the
+ * given node (connected first, if not known yet), which is returned
+ */
+cluster_node *redis_moved_node(redis_con *con,redisReply *reply)
+{
+	cluster_node *it;
+	char *p, *end, *ip;
+	unsigned int slot, port;
+	int ip_len;
+
+	if (!(con->type & REDIS_CLUSTER_INSTANCE) || con->slot_map == NULL ||
+	reply->len < 6 || memcmp(reply->str,"MOVED ",6) != 0)
 		return NULL;
+
+	end = reply->str + reply->len;
+	slot = strtoul(reply->str + 6,&p,10);
+	if (p >= end || *p != ' ' || slot >= REDIS_CLUSTER_SLOTS)
+		goto error;
+
+	ip = p + 1;
+	p = memchr(ip,':',end - ip);
+	if (p == NULL || p == ip)
+		goto error;
+	ip_len = p - ip;
+	port = strtoul(p + 1,NULL,10);
+	if (port == 0 || port > 65535)
+		goto error;
+
+	for (it=con->nodes;it;it=it->next)
+		if (it->port == port && strlen(it->ip) == ip_len &&
+		memcmp(it->ip,ip,ip_len) == 0)
+			break;
+
+	if (it == NULL) {
+		it = pkg_malloc(sizeof(cluster_node) + ip_len + 1);
+		if (it == NULL) {
+			LM_ERR("no more pkg\n");
+			return NULL;
+		}
+		memset(it,0,sizeof(cluster_node));
+		it->ip = (char *)(it + 1);
+		memcpy(it->ip,ip,ip_len);
+		it->ip[ip_len] = 0;
+		it->port = port;
+		it->start_slot = it->end_slot = slot;
+
+		if (redis_connect_node(con,it) < 0) {
+			LM_ERR("failed to connect to the new node %s:%u\n",it->ip,port);
+			pkg_free(it);
+			return NULL;
+		}
+
+		it->next = con->nodes;
+		con->nodes = it;
 	}
+
+	LM_DBG("slot %u moved to %s:%u\n",slot,it->ip,port);
+	con->slot_map[slot] = it;
+	return it;
+
+error:
+	LM_ERR("bad redirection: %.*s\n",reply->len,reply->str);
+	return NULL;
 }
 
 void destroy_cluster_nodes(redis_con *con)
@@ -110,9 +199,16 @@ void destroy_cluster_nodes(redis_con *con)
 	while (new) {
 		foo = new->next;
 		redisFree(new->context);
+		redis_destroy_async_pool(new);
 		pkg_free(new);
 		new = foo;
 	}
+	con->nodes = NULL;
+
+	if (con->slot_map) {
+		pkg_free(con->slot_map);
+		con->slot_map = NULL;
+	}
 }
 
 struct datavalues {
@@ -82,6 +82,14 @@ struct route_rule_p_list {
 	struct route_rule_p_list * next;
 };
 
+/**
+ * Entry of the cumulative probability table of a rule set.
+ */
+struct route_dice {
+	int dice_to; /*!< copy of the dice_to of the rule */
+	struct route_rule * rule; /*!< the rule */
+};
+
 /**
  * Use route rules only if message flags match stored mask/flags.
  */
@@ -92,6 +100,7 @@ struct route_flags {
 	struct route_rule ** rules; /*!< The array points to the rules in order of hash indices */
 	int rule_num; /*!< The number of rules */
 	int dice_max; /*!< The DICE_MAX value for the rule set, calculated by rule_fixup */
+	struct route_dice * dice; /*!< The rules in rule_list order with growing dice_to, for a binary search */
 	int max_targets; /*!< upper edge of hashing via prime number algorithm, must be eqal to rule_num */
 	struct route_flags * next; /*!< A pointer to the next route flags struct */
 };
@@ -119,6 +128,28 @@ struct failure_route_tree_item {
 	struct failure_route_rule * rule_list; /*!< Each node MAY contain a failure rule list */
 };
 
+/**
+ * Node of the flat form of a route tree. The nodes refer to each other
+ * by their index in the node array, the root is always at index 0.
+ */
+struct route_flat_node {
+	unsigned int nodes[10]; /*!< Index of the child nodes, 0 if not present */
+	unsigned int parent; /*!< Index of the parent node */
+	unsigned int flag_list; /*!< Index of the flag list plus 1, 0 if the node has none */
+};
+
+/**
+ * Read-only form of a route tree used for the lookups, built by rule_fixup
+ * in a single shm block. The flag lists (and the rules) are shared with
+ * the route tree.
+ */
+struct route_flat_tree {
+	unsigned int node_num; /*!< number of nodes */
+	unsigned int flag_list_num; /*!< number of flag lists */
+	struct route_flat_node * nodes; /*!< the nodes, in depth first order */
+	struct route_flags ** flag_lists; /*!< the flag lists of the nodes */
+};
+
 /**
  * The head of each route tree.
  */
@@ -127,6 +158,7 @@ struct route_tree {
 	str name; /*!< the name of the routing tree */
 	struct route_tree_item * tree; /*!< the root node of the routing tree */
 	struct failure_route_tree_item * failure_tree; /*!< the root node of the failure routing tree */
+	struct route_flat_tree * flat; /*!< the flat form of the routing tree, used for lookups */
 };
 
 /**
@@ -434,9 +434,34 @@ static int actually_rewrite(const struct route_rule *rs, str *dest,
 
 
 /**
- * writes the uri dest using the rule list of route_tree
+ * searches the rule set for the rule the prob value falls into: the first
+ * one with a dice_to greater than prob, or the last one
  *
- * @param route_tree the current routing tree node
+ * @param rf the route_flags node to search for rule
+ * @param prob the hash value, between 0 and dice_max
+ *
+ * @return pointer to route rule
+ */
+static inline struct route_rule * get_rule_by_dice(const struct route_flags * rf,
+		const int prob) {
+	int lo = 0, hi = rf->rule_num - 1, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (rf->dice[mid].dice_to <= prob) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return rf->dice[lo].rule;
+}
+
+
+/**
+ * writes the uri dest using the rule list of flag_list
+ *
+ * @param flag_list the flag list of the current routing tree node
  * @param flags user defined flags
  * @param dest the returned new destination URI
  * @param msg the sip message
@@ -447,18 +472,17 @@ static int actually_rewrite(const struct route_rule *rs, str *dest,
  *
  * @return 0 on success, -1 on failure, 1 on empty rule list
  */
-static int rewrite_on_rule(const struct route_tree_item * route_tree, flag_t flags, str * dest,
+static int rewrite_on_rule(struct route_flags * flag_list, flag_t flags, str * dest,
 		struct sip_msg * msg, const str * user, const enum hash_source hash_source,
 		const enum hash_algorithm alg, struct multiparam_t *dstavp) {
 	struct route_flags * rf;
 	struct route_rule * rr;
 	int prob;
 
-	assert(route_tree != NULL);
-	assert(route_tree->flag_list != NULL);
+	assert(flag_list != NULL);
 
 	LM_DBG("searching for matching routing rules");
-	for (rf = route_tree->flag_list; rf != NULL; rf = rf->next) {
+	for (rf = flag_list; rf != NULL; rf = rf->next) {
 		/* LM_DBG("actual flags %i, searched flags %i, mask %i and match %i", rf->flags, flags, rf->mask, flags&rf->mask); */
 		if ((flags&rf->mask) == rf->flags) break;
 	}
@@ -499,9 +523,7 @@ static int rewrite_on_rule(const struct route_tree_item * route_tree, flag_t fla
 			 * zero and the message could not be routed at all if we use
 			 * '<' here. Thus the '<=' is necessary.
 			 */
-			for (rr = rf->rule_list;
-			        rr->next != NULL && rr->dice_to <= prob;
-		        rr = rr->next) {}
+			rr = get_rule_by_dice(rf, prob);
 			if (!rr->status) {
 				if (!rr->backup) {
 					LM_ERR("all routes are off\n");
@@ -524,11 +546,12 @@ static int rewrite_on_rule(const struct route_tree_item * route_tree, flag_t fla
 
 
 /**
- * traverses the routing tree until a matching rule is found
+ * walks the flat routing tree until a matching rule is found
  * The longest match is taken, so it is possible to define
- * route rules for a single number
+ * route rules for a single number. If the rule list of a
+ * matched prefix is empty, the shorter prefixes are tried.
  *
- * @param route_tree the current routing tree node
+ * @param ft the flat routing tree
  * @param pm the user to be used for prefix matching
  * @param flags user defined flags
  * @param dest the returned new destination URI
@@ -538,48 +561,48 @@ static int rewrite_on_rule(const struct route_tree_item * route_tree, flag_t fla
  * @param alg the algorithm used for hashing
  * @param dstavp the name of the destination AVP where the used host name is stored
  *
- * @return 0 on success, -1 on failure, 1 on no more matching child node and no rule list
+ * @return 0 on success, -1 on failure, 1 on no matching prefix with a rule list
  */
-static int rewrite_uri_recursor(const struct route_tree_item * route_tree,
+static int rewrite_uri_flat(const struct route_flat_tree * ft,
 		const str * pm, flag_t flags, str * dest, struct sip_msg * msg, const str * user,
 		const enum hash_source hash_source, const enum hash_algorithm alg,
 		struct multiparam_t *dstavp) {
-	struct route_tree_item *re_tree;
-	str re_pm;
-
-	re_pm=*pm;
-	/* Skip over non-digits.  */
-	while (re_pm.len > 0 && !isdigit(*re_pm.s)) {
-		++re_pm.s;
-		--re_pm.len;
+	const struct route_flat_node * fn;
+	unsigned int idx, next;
+	int i, ret;
+
+	/* go down as long as the digits match, skipping over non-digits */
+	idx = 0;
+	for (i = 0; i < pm->len; i++) {
+		if (!isdigit(pm->s[i])) {
+			continue;
+		}
+		next = ft->nodes[idx].nodes[pm->s[i] - '0'];
+		if (next == 0) {
+			break;
+		}
+		idx = next;
 	}
-	if (re_pm.len == 0 || route_tree->nodes[*re_pm.s - '0'] == NULL) {
-		if (route_tree->flag_list == NULL) {
-			LM_INFO("URI or route tree nodes empty, empty flag list\n");
-			return 1;
-		} else {
-			return rewrite_on_rule(route_tree, flags, dest, msg, user, hash_source, alg, dstavp);
+
+	/* and back up, until a flag list gives an answer */
+	for (;;) {
+		fn = &ft->nodes[idx];
+		if (fn->flag_list) {
+			ret = rewrite_on_rule(ft->flag_lists[fn->flag_list - 1], flags, dest,
+				msg, user, hash_source, alg, dstavp);
+			if (ret != 1) {
+				return ret;
+			}
 		}
-	} else {
-		/* match, goto the next digit of the uri and try again */
-		re_tree = route_tree->nodes[*re_pm.s - '0'];
-		re_pm.s = re_pm.s + 1;
-		re_pm.len = re_pm.len - 1;
-		switch (rewrite_uri_recursor(re_tree, &re_pm, flags, dest, msg, user, hash_source, alg, dstavp)) {
-			case 0:
-				return 0;
-			case 1:
-				if (route_tree->flag_list != NULL) {
-					return rewrite_on_rule(route_tree, flags, dest, msg, user, hash_source, alg, dstavp);
-				} else {
-					LM_INFO("empty flag list for prefix [%.*s]%.*s\n", user->len - re_pm.len,
-						user->s, re_pm.len, re_pm.s);
-					return 1;
-				}
-			default:
-				return -1;
+		if (idx == 0) {
+			break;
 		}
+		idx = fn->parent;
 	}
+
+	LM_INFO("URI or route tree nodes empty, empty flag list for %.*s\n",
+		pm->len, pm->s);
+	return 1;
 }
 
 
@@ -668,9 +691,14 @@ int cr_do_route(struct sip_msg * _msg, struct multiparam_t *_carrier,
 		goto unlock_and_out;
 	}
 
-	if (rewrite_uri_recursor(rt->tree, &prefix_matching, flags, &dest, _msg, &rewrite_user, _hsrc, _halg, _dstavp) != 0) {
-		/* this is not necessarily an error, rewrite_recursor does already some error logging */
-		LM_INFO("rewrite_uri_recursor doesn't complete, uri %.*s, carrier %d, domain %d\n", prefix_matching.len,
+	if (rt->flat == NULL) {
+		LM_ERR("routing domain %d of carrier %d has no routes\n", domain_id, carrier_id);
+		goto unlock_and_out;
+	}
+
+	if (rewrite_uri_flat(rt->flat, &prefix_matching, flags, &dest, _msg, &rewrite_user, _hsrc, _halg, _dstavp) != 0) {
+		/* this is not necessarily an error, rewrite_uri_flat does already some error logging */
+		LM_INFO("rewrite_uri_flat doesn't complete, uri %.*s, carrier %d, domain %d\n", prefix_matching.len,
 			prefix_matching.s, carrier_id, domain_id);
 		goto unlock_and_out;
 	}
@@ -31,6 +31,7 @@
 
 #include "carrierroute.h"
 #include "route_rule.h"
+#include "route_tree.h"
 
 static int rule_fixup_recursor(struct route_tree_item * rt);
 
@@ -306,6 +307,9 @@ int rule_fixup(struct rewrite_data * rd) {
 				if (rule_fixup_recursor(rd->carriers[i]->trees[j]->tree) < 0) {
 					return -1;
 				}
+				if (flatten_route_tree(rd->carriers[i]->trees[j]) < 0) {
+					return -1;
+				}
 			} else {
 				LM_NOTICE("empty tree at [%i][%i]\n", i, j);
 			}
@@ -337,15 +341,28 @@ static int rule_fixup_recursor(struct route_tree_item * rt) {
 		if (rf->rule_list) {
 			rr = rf->rule_list;
 			rf->rule_num = 0;
+			rf->dice_max = 0;
 			while (rr) {
 				rf->rule_num++;
 				rf->dice_max += rr->prob * DICE_MAX;
 				rr = rr->next;
 			}
+			if(rf->dice) {
+				shm_free(rf->dice);
+				rf->dice = NULL;
+			}
+			if ((rf->dice = shm_malloc(sizeof(struct route_dice) * rf->rule_num)) == NULL) {
+				LM_ERR("out of shared memory\n");
+				return -1;
+			}
 			rr = rf->rule_list;
+			i = 0;
 			while (rr) {
 				rr->dice_to = (rr->prob * DICE_MAX) + p_dice;
 				p_dice = rr->dice_to;
+				rf->dice[i].dice_to = rr->dice_to;
+				rf->dice[i].rule = rr;
+				i++;
 				rr = rr->next;
 			}
 
@@ -375,12 +375,98 @@ void destroy_route_map(void) {
 	}
 }
 
+/**
+ * Counts the nodes and the flag lists of the routing tree below rt.
+ */
+static void count_route_tree_items(const struct route_tree_item * rt,
+		unsigned int * node_num, unsigned int * flag_list_num) {
+	int i;
+
+	(*node_num)++;
+	if (rt->flag_list) {
+		(*flag_list_num)++;
+	}
+	for (i = 0; i < 10; ++i) {
+		if (rt->nodes[i]) {
+			count_route_tree_items(rt->nodes[i], node_num, flag_list_num);
+		}
+	}
+}
+
+
+/**
+ * Copies the routing tree below rt into the flat tree, depth first.
+ *
+ * @return the index of the node of rt
+ */
+static unsigned int flatten_route_tree_item(const struct route_tree_item * rt,
+		struct route_flat_tree * ft, unsigned int parent) {
+	struct route_flat_node * fn;
+	unsigned int idx;
+	int i;
+
+	idx = ft->node_num++;
+	fn = &ft->nodes[idx];
+	fn->parent = parent;
+	if (rt->flag_list) {
+		ft->flag_lists[ft->flag_list_num++] = rt->flag_list;
+		fn->flag_list = ft->flag_list_num;
+	}
+	for (i = 0; i < 10; ++i) {
+		if (rt->nodes[i]) {
+			fn->nodes[i] = flatten_route_tree_item(rt->nodes[i], ft, idx);
+		}
+	}
+	return idx;
+}
+
+
+int flatten_route_tree(struct route_tree * rt) {
+	struct route_flat_tree * ft;
+	unsigned int node_num = 0;
+	unsigned int flag_list_num = 0;
+	unsigned long size;
+
+	if (rt->flat) {
+		shm_free(rt->flat);
+		rt->flat = NULL;
+	}
+	if (rt->tree == NULL) {
+		return 0;
+	}
+
+	count_route_tree_items(rt->tree, &node_num, &flag_list_num);
+
+	size = sizeof(struct route_flat_tree) +
+		node_num * sizeof(struct route_flat_node) +
+		flag_list_num * sizeof(struct route_flags *);
+	if ((ft = shm_malloc(size)) == NULL) {
+		LM_ERR("out of shared memory\n");
+		return -1;
+	}
+	memset(ft, 0, size);
+	ft->nodes = (struct route_flat_node *)(ft + 1);
+	ft->flag_lists = (struct route_flags **)(ft->nodes + node_num);
+
+	flatten_route_tree_item(rt->tree, ft, 0);
+
+	LM_INFO("flattened tree %.*s: %u nodes, %u flag lists, %lu bytes\n",
+		rt->name.len, rt->name.s, ft->node_num, ft->flag_list_num, size);
+
+	rt->flat = ft;
+	return 0;
+}
+
+
 /**
  * Destroys route_tree by freeing all its memory.
  *
  * @param route_tree route tree to be destroyed
  */
 void destroy_route_tree(struct route_tree *route_tree) {
+	if (route_tree->flat) {
+		shm_free(route_tree->flat);
+	}
 	destroy_route_tree_item(route_tree->tree);
 	destroy_failure_route_tree_item(route_tree->failure_tree);
 	shm_free(route_tree->name.s);
@@ -400,6 +486,9 @@ static void destroy_route_flags(struct route_flags *rf) {
 	if (rf->rules) {
 		shm_free(rf->rules);
 	}
+	if (rf->dice) {
+		shm_free(rf->dice);
+	}
 	rs = rf->rule_list;
 	while (rs != NULL) {
 		rs_tmp = rs->next;
@@ -135,6 +135,16 @@ struct route_tree * get_route_tree(const str * domain, struct carrier_tree * rd)
 
 struct route_tree * get_route_tree_by_id(struct carrier_tree * ct, int id);
 
+/**
+ * Builds the flat form of the routing tree of rt, replacing the previous
+ * one (if any). Must be called after the rules of the tree are fixed up.
+ *
+ * @param rt the route tree to be flattened
+ *
+ * @return 0 on success, -1 on failure
+ */
+int flatten_route_tree(struct route_tree * rt);
+
 void destroy_route_tree(struct route_tree *route_tree);
 
 void destroy_route_map(void);
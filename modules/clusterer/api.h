@@ -35,6 +35,24 @@ typedef int (*send_to_f) (int, int);
 typedef int (*register_module_f) (char *, int,  void (*cb)(int, struct receive_info *, int), 
                                     int, int, int);
 
+/* the sync dump of a module is complete */
+#define CL_SYNC_DONE ((unsigned long long)-1)
+
+/*
+ * pushes (bin_push_*) the module data found at position @cursor (e.g. a
+ * hash bucket) into the sync chunk being built, then moves @cursor to the
+ * next position (CL_SYNC_DONE after the last one). @cursor is 0 at start.
+ * If only part of the data fits, the pushed records are kept and @cursor
+ * is moved inside the position, to the first record left out.
+ * Returns the number of pushed records or -1 if no record fit (@cursor
+ * being left unchanged).
+ */
+typedef int (*sync_dump_f) (unsigned long long *cursor);
+/* pops (bin_pop_*) one record pushed by the sync_dump_f of node @node_id */
+typedef int (*sync_load_f) (int node_id);
+typedef int (*register_sync_f) (char *, int, sync_dump_f, int, sync_load_f);
+typedef int (*request_sync_f) (char *);
+
 
 struct clusterer_binds {
     get_nodes_f get_nodes;
@@ -44,6 +62,8 @@ struct clusterer_binds {
     get_my_id_f get_my_id;
     send_to_f send_to;
     register_module_f register_module;
+    register_sync_f register_sync;
+    request_sync_f request_sync;
 };
 
 
@@ -115,6 +115,24 @@ int server_id = -1;
 /* shm data*/
 static table_entry_t **tdata = 0;
 static struct module_list *clusterer_modules = NULL;
+static struct sync_module *sync_modules = NULL;
+
+/* bin packets of the state sync between nodes */
+#define CL_SYNC_REQUEST 1
+#define CL_SYNC_CHUNK   2
+#define CL_SYNC_ACK     3
+#define BIN_VERSION     1
+
+/* max chunks sent and not yet acked */
+#define CL_SYNC_WINDOW  4
+/* usecs without an ack after which the unacked chunks are sent again */
+#define CL_SYNC_RESEND  (1000 * 1000)
+/* resends in a row after which the sender drops the sync */
+#define CL_SYNC_RETRIES 5
+/* seconds without progress after which the receiver asks again */
+#define CL_SYNC_TIMEOUT 10
+
+static str cl_sync_name = str_init("clusterer");
 
 /* initialize functions */
 static int mod_init(void);
@@ -149,6 +167,8 @@ static int get_my_id(void);
 static void update_nodes_handler(unsigned int ticks, void *param);
 static struct module_timestamp* create_module_timestamp(int ctime, struct module_list *module);
 static table_entry_value_t *clusterer_find_nodes(int cluster_id, int proto);
+static void sync_timer(utime_t ticks, void *param);
+static void bin_receive_sync(int packet_type, struct receive_info *ri, void *ptr);
 
 static int su_ip_cmp(union sockaddr_union* s1, union sockaddr_union* s2)
 {
@@ -334,6 +354,18 @@ static int mod_init(void)
 		goto error;
 	}
 
+	/* state sync between nodes - the modules register later on */
+	if (register_utimer("clusterer-sync", sync_timer, NULL,
+		100 * 1000, TIMER_FLAG_DELAY_ON_DELAY) < 0) {
+		LM_CRIT("unable to register sync timer\n");
+		goto error;
+	}
+
+	if (bin_register_cb(cl_sync_name.s, bin_receive_sync, NULL) < 0) {
+		LM_CRIT("cannot register sync packets callback\n");
+		goto error;
+	}
+
 
 	/* everything is OK */
 	return 0;
@@ -1646,6 +1678,519 @@ static int cl_register_module(char *mod_name, int proto, void (*cb)(int, struct
 	return 0;
 }
 
+/* sends the packet built in the bin buffer to node @node_id only */
+static int send_to_node(int cluster_id, int node_id, int proto)
+{
+	table_entry_value_t *value;
+	str send_buffer;
+	int rc = -1;
+
+	bin_get_buffer(&send_buffer);
+
+	lock_start_read(ref_lock);
+
+	for (value = clusterer_find_nodes(cluster_id, proto); value;
+	value = value->next) {
+		if (value->machine_id != node_id)
+			continue;
+
+		if (value->state == 1) {
+			if (msg_send(NULL, proto, &value->addr, 0, send_buffer.s,
+			send_buffer.len, 0) != 0) {
+				LM_ERR("cannot send message\n");
+				temp_disable_machine(value);
+			} else {
+				rc = 0;
+			}
+		}
+		break;
+	}
+
+	lock_stop_read(ref_lock);
+
+	return rc;
+}
+
+static struct sync_module *find_sync_module(str *mod_name)
+{
+	struct sync_module *sm;
+
+	for (sm = sync_modules; sm; sm = sm->next)
+		if (sm->mod_name.len == mod_name->len &&
+		!memcmp(sm->mod_name.s, mod_name->s, mod_name->len))
+			return sm;
+
+	return NULL;
+}
+
+static int cl_register_sync(char *mod_name, int serve_cluster_id,
+			sync_dump_f dump, int accept_cluster_id, sync_load_f load)
+{
+	struct sync_module *sm;
+
+	LM_DBG("register sync for module %s\n", mod_name);
+
+	if ((!serve_cluster_id || !dump) && (!accept_cluster_id || !load)) {
+		LM_ERR("nothing to sync for module %s\n", mod_name);
+		return -1;
+	}
+
+	sm = shm_malloc(sizeof *sm);
+	if (!sm) {
+		LM_ERR("insufficient shm memory\n");
+		return -1;
+	}
+	memset(sm, 0, sizeof *sm);
+
+	sm->mod_name.s = mod_name;
+	sm->mod_name.len = strlen(mod_name);
+	/* a role without its cluster is disabled */
+	if (serve_cluster_id && dump) {
+		sm->serve_cluster_id = serve_cluster_id;
+		sm->dump = dump;
+	}
+	if (accept_cluster_id && load) {
+		sm->accept_cluster_id = accept_cluster_id;
+		sm->load = load;
+	}
+
+	if (!lock_init(&sm->lock)) {
+		LM_ERR("failed to init lock\n");
+		shm_free(sm);
+		return -1;
+	}
+
+	sm->next = sync_modules;
+	sync_modules = sm;
+
+	return 0;
+}
+
+/* asks a node of the accepting cluster for all the data of the module */
+static int cl_request_sync(char *mod_name)
+{
+	struct sync_module *sm;
+	str name;
+
+	name.s = mod_name;
+	name.len = strlen(mod_name);
+
+	sm = find_sync_module(&name);
+	if (!sm || !sm->load) {
+		LM_ERR("module %s is not registered for loading synced data\n",
+			mod_name);
+		return -1;
+	}
+
+	/* the request itself is sent from the sync timer */
+	lock_get(&sm->lock);
+	if (sm->state == CL_SYNC_NONE)
+		sm->state = CL_SYNC_WANTED;
+	lock_release(&sm->lock);
+
+	return 0;
+}
+
+static void sync_send_request(struct sync_module *sm, unsigned int now)
+{
+	clusterer_node_t *nodes, *node, *dst = NULL;
+
+	nodes = get_nodes(sm->accept_cluster_id, PROTO_BIN);
+	if (!nodes) {
+		/* nobody to ask yet, try again later */
+		lock_get(&sm->lock);
+		sm->rcv_ts = now;
+		lock_release(&sm->lock);
+		return;
+	}
+
+	/* round robin over the nodes which are up, in case one fails us */
+	for (node = nodes; node; node = node->next)
+		if (node->machine_id > sm->src_node &&
+		(!dst || node->machine_id < dst->machine_id))
+			dst = node;
+	if (!dst)
+		for (node = nodes; node; node = node->next)
+			if (!dst || node->machine_id < dst->machine_id)
+				dst = node;
+
+	if (bin_init(&cl_sync_name, CL_SYNC_REQUEST, BIN_VERSION) != 0)
+		goto out;
+
+	bin_push_int(server_id);
+	bin_push_str(&sm->mod_name);
+
+	LM_INFO("requesting %.*s data from node %d\n", sm->mod_name.len,
+		sm->mod_name.s, dst->machine_id);
+
+	lock_get(&sm->lock);
+	sm->src_node = dst->machine_id;
+	sm->rcv_seq = 0;
+	sm->rcv_cursor = 0;
+	sm->rcv_ts = now;
+	sm->state = CL_SYNC_REQUESTED;
+	lock_release(&sm->lock);
+
+	if (send_to_node(sm->accept_cluster_id, dst->machine_id, PROTO_BIN) < 0)
+		LM_ERR("failed to send sync request to node %d\n", dst->machine_id);
+
+out:
+	free_nodes(nodes);
+}
+
+/* the cursors travel as two ints, high word first */
+static inline void sync_push_cursor(unsigned long long cursor)
+{
+	bin_push_int((int)(cursor >> 32));
+	bin_push_int((int)cursor);
+}
+
+static inline int sync_pop_cursor(unsigned long long *cursor)
+{
+	unsigned int hi, lo;
+
+	if (bin_pop_int(&hi) != 0 || bin_pop_int(&lo) != 0)
+		return -1;
+
+	*cursor = ((unsigned long long)hi << 32) | lo;
+	return 0;
+}
+
+/* builds and sends the next chunk of the dump
+ * @return: 1 if more chunks follow, 0 if this was the last one, -1 on error */
+static int sync_send_chunk(struct sync_module *sm)
+{
+	str buf;
+	int count = 0, rc, len, count_pos, dst_node;
+	unsigned long long cursor;
+	unsigned int seq;
+
+	lock_get(&sm->lock);
+	cursor = sm->cursor;
+	seq = sm->snd_seq + 1;
+	dst_node = sm->dst_node;
+	lock_release(&sm->lock);
+
+	if (bin_init(&cl_sync_name, CL_SYNC_CHUNK, BIN_VERSION) != 0)
+		return -1;
+
+	bin_push_int(server_id);
+	bin_push_str(&sm->mod_name);
+	bin_push_int(seq);
+	/* the receiver only takes the chunk if it starts where it stands */
+	sync_push_cursor(cursor);
+
+	/* number of records, filled in below */
+	bin_get_buffer(&buf);
+	count_pos = buf.len;
+	bin_push_int(0);
+
+	while (cursor != CL_SYNC_DONE) {
+		bin_get_buffer(&buf);
+		len = buf.len;
+
+		rc = sm->dump(&cursor);
+		if (rc < 0) {
+			/* did not fit - goes into the next chunk */
+			bin_truncate(len);
+			if (!count) {
+				LM_ERR("%.*s sync data at position %llu does not fit in "
+					"a packet\n", sm->mod_name.len, sm->mod_name.s, cursor);
+				return -1;
+			}
+			break;
+		}
+		count += rc;
+	}
+
+	bin_get_buffer(&buf);
+	memcpy(buf.s + count_pos, &count, sizeof count);
+	sync_push_cursor(cursor);
+
+	/* moved before sending, so the ack may not come ahead of it; a restart
+	 * requested meanwhile takes precedence and the chunk is not sent */
+	lock_get(&sm->lock);
+	if (sm->restart || sm->dst_node != dst_node) {
+		lock_release(&sm->lock);
+		return 1;
+	}
+	sm->cursor = cursor;
+	sm->snd_seq = seq;
+	if ((int)(seq - sm->max_seq) > 0)
+		sm->max_seq = seq;
+	lock_release(&sm->lock);
+
+	if (send_to_node(sm->serve_cluster_id, dst_node, PROTO_BIN) < 0)
+		return -1;
+
+	return cursor != CL_SYNC_DONE;
+}
+
+static void sync_timer(utime_t ticks, void *param)
+{
+	struct sync_module *sm;
+	unsigned int now = get_ticks();
+	utime_t unow = get_uticks();
+	int state, rc, more;
+
+	for (sm = sync_modules; sm; sm = sm->next) {
+		/* requesting side */
+		if (sm->load) {
+			lock_get(&sm->lock);
+			state = sm->state;
+			if (state != CL_SYNC_NONE && state != CL_SYNC_WANTED &&
+			now - sm->rcv_ts > CL_SYNC_TIMEOUT) {
+				LM_WARN("%.*s sync from node %d timed out, retrying\n",
+					sm->mod_name.len, sm->mod_name.s, sm->src_node);
+				sm->state = state = CL_SYNC_WANTED;
+				/* give the node a chance to notice as well */
+				sm->rcv_ts = now;
+			}
+			lock_release(&sm->lock);
+
+			if (state == CL_SYNC_WANTED && now != sm->rcv_ts)
+				sync_send_request(sm, now);
+		}
+
+		/* serving side */
+		if (!sm->dump)
+			continue;
+
+		lock_get(&sm->lock);
+		if (!sm->dst_node) {
+			lock_release(&sm->lock);
+			continue;
+		}
+		if (sm->restart) {
+			sm->cursor = sm->ack_cursor = 0;
+			sm->snd_seq = sm->max_seq = sm->ack_seq = 0;
+			sm->resend = sm->retries = 0;
+			sm->resend_ts = unow;
+			sm->restart = 0;
+		}
+		/* the node got further than the chunks (re)sent so far */
+		if ((int)(sm->snd_seq - sm->ack_seq) < 0) {
+			sm->cursor = sm->ack_cursor;
+			sm->snd_seq = sm->ack_seq;
+		}
+		if (sm->ack_seq == sm->snd_seq) {
+			if (sm->cursor == CL_SYNC_DONE) {
+				LM_INFO("%.*s sync to node %d complete (%u chunks)\n",
+					sm->mod_name.len, sm->mod_name.s, sm->dst_node,
+					sm->snd_seq);
+				sm->dst_node = 0;
+				lock_release(&sm->lock);
+				continue;
+			}
+			sm->resend_ts = unow;
+		} else if (sm->resend || unow - sm->resend_ts > CL_SYNC_RESEND) {
+			/* go back N - the chunks after the last acked one are built
+			 * again, from where the node stands */
+			if (++sm->retries > CL_SYNC_RETRIES) {
+				LM_WARN("node %d stopped acking %.*s sync data, aborting\n",
+					sm->dst_node, sm->mod_name.len, sm->mod_name.s);
+				sm->dst_node = 0;
+				lock_release(&sm->lock);
+				continue;
+			}
+			LM_DBG("resending %.*s sync data to node %d from chunk %u\n",
+				sm->mod_name.len, sm->mod_name.s, sm->dst_node,
+				sm->ack_seq + 1);
+			sm->cursor = sm->ack_cursor;
+			sm->snd_seq = sm->ack_seq;
+			sm->resend = 0;
+			sm->resend_ts = unow;
+		}
+		lock_release(&sm->lock);
+
+		/* only the sync timer moves the cursor, but the acks advance the
+		 * window and the requests may restart the dump */
+		for (;;) {
+			lock_get(&sm->lock);
+			more = sm->dst_node && !sm->restart &&
+				sm->cursor != CL_SYNC_DONE &&
+				sm->snd_seq - sm->ack_seq < CL_SYNC_WINDOW;
+			lock_release(&sm->lock);
+			if (!more)
+				break;
+
+			rc = sync_send_chunk(sm);
+			if (rc < 0) {
+				lock_get(&sm->lock);
+				sm->dst_node = 0;
+				lock_release(&sm->lock);
+				break;
+			}
+		}
+	}
+}
+
+static void sync_receive_request(struct sync_module *sm, int node_id,
+														struct receive_info *ri)
+{
+	if (!sm->dump ||
+	!clusterer_check(sm->serve_cluster_id, &ri->src_su, node_id, ri->proto)) {
+		LM_WARN("unexpected %.*s sync request from node %d\n",
+			sm->mod_name.len, sm->mod_name.s, node_id);
+		return;
+	}
+
+	lock_get(&sm->lock);
+	if (sm->dst_node && sm->dst_node != node_id) {
+		/* the other node will time out and try someone else */
+		lock_release(&sm->lock);
+		LM_INFO("busy syncing node %d, ignoring node %d\n", sm->dst_node,
+			node_id);
+		return;
+	}
+	LM_INFO("sending %.*s data to node %d\n", sm->mod_name.len,
+		sm->mod_name.s, node_id);
+	sm->dst_node = node_id;
+	/* the dump may be in progress - only the timer resets it */
+	sm->restart = 1;
+	lock_release(&sm->lock);
+}
+
+static void sync_receive_chunk(struct sync_module *sm, int node_id)
+{
+	unsigned long long start, end;
+	unsigned int seq;
+	int count, i;
+
+	if (bin_pop_int(&seq) != 0 || sync_pop_cursor(&start) != 0 ||
+	bin_pop_int(&count) != 0)
+		return;
+
+	lock_get(&sm->lock);
+
+	if ((sm->state != CL_SYNC_REQUESTED && sm->state != CL_SYNC_RUNNING)
+	|| sm->src_node != node_id) {
+		lock_release(&sm->lock);
+		LM_DBG("unexpected %.*s sync data from node %d\n",
+			sm->mod_name.len, sm->mod_name.s, node_id);
+		return;
+	}
+
+	/* only take the chunks in order, the ack tells the sender where we are;
+	 * a chunk built again after a resend may not start where the first one
+	 * did (the data changed meanwhile), so the cursors must match as well */
+	if (seq == sm->rcv_seq + 1 && start == sm->rcv_cursor) {
+		for (i = 0; i < count; i++)
+			if (sm->load(node_id) < 0) {
+				LM_ERR("failed to load %.*s sync record %d/%d\n",
+					sm->mod_name.len, sm->mod_name.s, i, count);
+				break;
+			}
+
+		if (i < count) {
+			/* the rest of the chunk is lost - do not ack it, but ask for
+			 * the whole data again (the records are loaded as updates) */
+			LM_WARN("restarting the %.*s sync\n", sm->mod_name.len,
+				sm->mod_name.s);
+			sm->state = CL_SYNC_WANTED;
+			sm->rcv_ts = get_ticks();
+			lock_release(&sm->lock);
+			return;
+		}
+
+		if (sync_pop_cursor(&end) != 0) {
+			lock_release(&sm->lock);
+			return;
+		}
+
+		sm->rcv_seq = seq;
+		sm->rcv_cursor = end;
+		sm->rcv_ts = get_ticks();
+		sm->state = CL_SYNC_RUNNING;
+		if (end == CL_SYNC_DONE) {
+			LM_INFO("%.*s sync from node %d complete\n", sm->mod_name.len,
+				sm->mod_name.s, node_id);
+			sm->state = CL_SYNC_NONE;
+		}
+	}
+	seq = sm->rcv_seq;
+	end = sm->rcv_cursor;
+
+	lock_release(&sm->lock);
+
+	if (bin_init(&cl_sync_name, CL_SYNC_ACK, BIN_VERSION) != 0)
+		return;
+
+	bin_push_int(server_id);
+	bin_push_str(&sm->mod_name);
+	bin_push_int(seq);
+	sync_push_cursor(end);
+
+	if (send_to_node(sm->accept_cluster_id, node_id, PROTO_BIN) < 0)
+		LM_ERR("failed to ack sync data of node %d\n", node_id);
+}
+
+static void sync_receive_ack(struct sync_module *sm, int node_id)
+{
+	unsigned long long cursor;
+	unsigned int seq;
+
+	if (bin_pop_int(&seq) != 0 || sync_pop_cursor(&cursor) != 0)
+		return;
+
+	lock_get(&sm->lock);
+	if (sm->dst_node != node_id || sm->restart) {
+		lock_release(&sm->lock);
+		return;
+	}
+	/* the chunks sent before a resend count as well, their acks may have
+	 * been lost alone */
+	if ((int)(seq - sm->ack_seq) > 0 && (int)(seq - sm->max_seq) <= 0) {
+		sm->ack_seq = seq;
+		sm->ack_cursor = cursor;
+		sm->retries = 0;
+		sm->resend_ts = get_uticks();
+	} else if (seq == sm->ack_seq && sm->snd_seq != sm->ack_seq &&
+	get_uticks() - sm->resend_ts > CL_SYNC_RESEND / 10) {
+		/* a chunk got lost (or out of order), the node acked the last one
+		 * in order again; the duplicates coming right after a resend are
+		 * still about the chunks sent before it */
+		sm->resend = 1;
+	}
+	lock_release(&sm->lock);
+}
+
+static void bin_receive_sync(int packet_type, struct receive_info *ri, void *ptr)
+{
+	struct sync_module *sm;
+	int node_id;
+	str mod_name;
+
+	if (get_bin_pkg_version() != BIN_VERSION) {
+		LM_ERR("incompatible bin protocol version\n");
+		return;
+	}
+
+	if (bin_pop_int(&node_id) != 0 || bin_pop_str(&mod_name) != 0)
+		return;
+
+	sm = find_sync_module(&mod_name);
+	if (!sm) {
+		LM_DBG("no sync registered for module %.*s\n", mod_name.len,
+			mod_name.s);
+		return;
+	}
+
+	switch (packet_type) {
+	case CL_SYNC_REQUEST:
+		sync_receive_request(sm, node_id, ri);
+		break;
+	case CL_SYNC_CHUNK:
+		sync_receive_chunk(sm, node_id);
+		break;
+	case CL_SYNC_ACK:
+		sync_receive_ack(sm, node_id);
+		break;
+	default:
+		LM_WARN("invalid clusterer sync packet type %d\n", packet_type);
+	}
+}
+
 int load_clusterer(struct clusterer_binds *binds)
 {
 	binds->get_nodes = get_nodes;
@@ -1655,6 +2200,8 @@ int load_clusterer(struct clusterer_binds *binds)
 	binds->get_my_id = get_my_id;
 	binds->send_to = send_to;
 	binds->register_module = cl_register_module;
+	binds->register_sync = cl_register_sync;
+	binds->request_sync = cl_request_sync;
 	/* everything ok*/
 	return 1;
 }
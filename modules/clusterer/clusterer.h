@@ -2,6 +2,9 @@
 #define	CLUSTERER_H
 
 #include "../../str.h"
+#include "../../locking.h"
+#include "../../timer.h"
+#include "api.h"
 
 #define INT_VALS_CLUSTER_ID_COL     0
 #define INT_VALS_MACHINE_ID_COL     1
@@ -42,6 +45,42 @@ struct module_list{
    struct module_list *next;
 };
 
+/* state of a module sync, on the requesting side */
+#define CL_SYNC_NONE      0
+#define CL_SYNC_WANTED    1
+#define CL_SYNC_REQUESTED 2
+#define CL_SYNC_RUNNING   3
+
+struct sync_module{
+   str mod_name;
+   /* serving side: data is dumped to the nodes of this cluster */
+   int serve_cluster_id;
+   sync_dump_f dump;
+   int dst_node;
+   /* a (new) request came from dst_node, the timer starts the dump over */
+   int restart;
+   unsigned long long cursor;
+   unsigned int snd_seq;
+   unsigned int max_seq;
+   /* last chunk loaded by dst_node and the cursor at its end */
+   unsigned int ack_seq;
+   unsigned long long ack_cursor;
+   /* a duplicate ack came, the timer resends from ack_seq on */
+   int resend;
+   int retries;
+   utime_t resend_ts;
+   /* requesting side: data is loaded from a node of this cluster */
+   int accept_cluster_id;
+   sync_load_f load;
+   int state;
+   int src_node;
+   unsigned int rcv_seq;
+   unsigned long long rcv_cursor;
+   unsigned int rcv_ts;
+   gen_lock_t lock;
+   struct sync_module *next;
+};
+
 struct module_timestamp{
     int state;
     uint64_t timestamp;
@@ -76,6 +76,7 @@ static void mod_destroy(void);
 
 /* module parameter */
 int log_profile_hash_size = 4;
+int profile_size_approx = 0;
 str rr_param = {"did",3};
 static int dlg_hash_size = 4096;
 static str timeout_spec = {NULL, 0};
@@ -119,6 +120,7 @@ str cdb_url = {0,0};
 /* dialog replication using the bpi interface */
 int accept_replicated_dlg=0;
 int dialog_replicate_cluster = 0;
+int dialog_sync = 0;
 int profile_replicate_cluster = 0;
 int accept_repl_profiles=0;
 int accept_replicated_profile_timeout = 10;
@@ -226,6 +228,7 @@ static param_export_t mod_params[]={
 	{ "enable_stats",          INT_PARAM, &dlg_enable_stats         },
 	{ "hash_size",             INT_PARAM, &dlg_hash_size            },
 	{ "log_profile_hash_size", INT_PARAM, &log_profile_hash_size    },
+	{ "profile_size_approx",   INT_PARAM, &profile_size_approx      },
 	{ "rr_param",              STR_PARAM, &rr_param.s               },
 	{ "default_timeout",       INT_PARAM, &default_timeout          },
 	{ "ping_interval",         INT_PARAM, &ping_interval            },
@@ -270,6 +273,8 @@ static param_export_t mod_params[]={
 	/* dialog replication through UDP binary packets */
 	{ "accept_replicated_dialogs",INT_PARAM, &accept_replicated_dlg },
 	{ "replicate_dialogs_to",     INT_PARAM, &dialog_replicate_cluster       },
+	{ "replicate_dialogs_batch",  INT_PARAM, &dialog_repl_batch    },
+	{ "sync_replicated_dialogs",  INT_PARAM, &dialog_sync          },
 	{ "accept_replicated_profiles",INT_PARAM, &accept_repl_profiles },
 	{ "replicate_profiles_timer", INT_PARAM, &repl_prof_utimer      },
 	{ "replicate_profiles_check", INT_PARAM, &repl_prof_timer_check },
@@ -294,6 +299,8 @@ static stat_export_t mod_stats[] = {
 	{"create_recv",         0,              &create_recv       },
 	{"update_recv",         0,              &update_recv       },
 	{"delete_recv",         0,              &delete_recv       },
+	{"timer_backlog",       STAT_IS_FUNC,
+		(stat_var**)get_dlg_timer_backlog                          },
 	{0,0,0}
 };
 
@@ -872,6 +879,25 @@ static int mod_init(void)
 	
 	if( profile_replicate_cluster < 0 )
 		profile_replicate_cluster = 0;
+
+	if (dlg_repl_batch_init() < 0) {
+		LM_ERR("failed to init dialog replication batching\n");
+		return -1;
+	}
+
+	/* serve our dialogs to the joining nodes and/or fetch theirs */
+	if (dialog_sync && !accept_replicated_dlg)
+		dialog_sync = 0;
+	if ((dialog_replicate_cluster || dialog_sync) &&
+	clusterer_api.register_sync("dialog", dialog_replicate_cluster,
+	dlg_sync_dump, accept_replicated_dlg, dialog_sync ? dlg_sync_load : NULL) < 0) {
+		LM_ERR("failed to register dialog sync\n");
+		return -1;
+	}
+	if (dialog_sync && clusterer_api.request_sync("dialog") < 0) {
+		LM_ERR("failed to request dialog sync\n");
+		return -1;
+	}
 	
 	if ( register_timer( "dlg-timer", dlg_timer_routine, NULL, 1,
 	TIMER_FLAG_DELAY_ON_DELAY)<0 ) {
@@ -880,7 +906,7 @@ static int mod_init(void)
 	}
 
 	if ( register_timer( "dlg-pinger", dlg_ping_routine, NULL,
-	ping_interval, TIMER_FLAG_DELAY_ON_DELAY)<0) {
+	1, TIMER_FLAG_DELAY_ON_DELAY)<0) {
 		LM_ERR("failed to register timer 2\n");
 		return -1;
 	}
@@ -894,7 +920,7 @@ static int mod_init(void)
 		return -1;
 	}
 
-	if (init_dlg_ping_timer()!=0) {
+	if (init_dlg_ping_timer(ping_interval)!=0) {
 		LM_ERR("cannot init ping timer\n");
 		return -1;
 	}
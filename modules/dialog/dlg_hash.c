@@ -579,23 +579,21 @@ struct dlg_cell* lookup_dlg( unsigned int h_entry, unsigned int h_id)
 
 	d_entry = &(d_table->entries[h_entry]);
 
-	dlg_lock( d_table, d_entry);
+	dlg_lock_read( d_table, d_entry);
 
 	for( dlg=d_entry->first ; dlg ; dlg=dlg->next ) {
 		if (dlg->h_id == h_id) {
-			if (dlg->state==DLG_STATE_DELETED) {
-				dlg_unlock( d_table, d_entry);
+			if (dlg->state==DLG_STATE_DELETED || !ref_dlg_if_alive(dlg)) {
+				dlg_unlock_read( d_table, d_entry);
 				goto not_found;
 			}
-			dlg->ref++;
-			LM_DBG("ref dlg %p with 1 -> %d\n", dlg, dlg->ref);
-			dlg_unlock( d_table, d_entry);
+			dlg_unlock_read( d_table, d_entry);
 			LM_DBG("dialog id=%u found on entry %u\n", h_id, h_entry);
 			return dlg;
 		}
 	}
 
-	dlg_unlock( d_table, d_entry);
+	dlg_unlock_read( d_table, d_entry);
 not_found:
 	LM_DBG("no dialog id=%u found on entry %u\n", h_id, h_entry);
 	return 0;
@@ -618,7 +616,7 @@ struct dlg_cell* get_dlg( str *callid, str *ftag, str *ttag,
 	h_entry = dlg_hash(callid);
 	d_entry = &(d_table->entries[h_entry]);
 
-	dlg_lock( d_table, d_entry);
+	dlg_lock_read( d_table, d_entry);
 
 	LM_DBG("input ci=<%.*s>(%d), tt=<%.*s>(%d), ft=<%.*s>(%d)\n",
 		callid->len,callid->s, callid->len,
@@ -645,16 +643,17 @@ struct dlg_cell* get_dlg( str *callid, str *ftag, str *ttag,
 				   with the same callid and fromtag - like in auth/challenge
 				   case -bogdan */
 				continue;
-			dlg->ref++;
-			LM_DBG("ref dlg %p with 1 -> %d\n", dlg, dlg->ref);
-			dlg_unlock( d_table, d_entry);
+			if (!ref_dlg_if_alive(dlg))
+				/* last ref already released, dialog is being destroyed */
+				continue;
+			dlg_unlock_read( d_table, d_entry);
 			LM_DBG("dialog callid='%.*s' found\n on entry %u, dir=%d\n",
 				callid->len, callid->s,h_entry,*dir);
 			return dlg;
 		}
 	}
 
-	dlg_unlock( d_table, d_entry);
+	dlg_unlock_read( d_table, d_entry);
 
 	LM_DBG("no dialog callid='%.*s' found\n", callid->len, callid->s);
 	return 0;
@@ -671,21 +670,21 @@ struct dlg_cell* get_dlg_by_val(str *attr, str *val)
 	for ( h=0 ; h<d_table->size ; h++ ) {
 
 		d_entry = &(d_table->entries[h]);
-		dlg_lock( d_table, d_entry);
+		dlg_lock_read( d_table, d_entry);
 
 		/* go through all dialogs on entry */
 		for( dlg = d_entry->first ; dlg ; dlg = dlg->next ) {
 			LM_DBG("dlg in state %d to check\n",dlg->state);
 			if ( dlg->state>DLG_STATE_CONFIRMED )
 				continue;
-			if (check_dlg_value_unsafe( dlg, attr, val)==0) {
-				ref_dlg_unsafe( dlg, 1);
-				dlg_unlock( d_table, d_entry);
+			if (check_dlg_value_unsafe( dlg, attr, val)==0 &&
+			ref_dlg_if_alive(dlg)) {
+				dlg_unlock_read( d_table, d_entry);
 				return dlg;
 			}
 		}
 
-		dlg_unlock( d_table, d_entry);
+		dlg_unlock_read( d_table, d_entry);
 	}
 
 	return NULL;
@@ -709,11 +708,10 @@ void link_dlg(struct dlg_cell *dlg, int n)
 		d_entry->last = dlg;
 	}
 
-	dlg->ref += 1 + n;
 	d_entry->cnt++;
 
-	LM_DBG("ref dlg %p with %d -> %d in h_entry %p - %d \n", dlg, n+1, dlg->ref,
-								d_entry,dlg->h_entry);
+	LM_DBG("ref dlg %p with %d -> %d in h_entry %p - %d \n", dlg, n+1,
+		__sync_add_and_fetch( &dlg->ref, 1 + n), d_entry, dlg->h_entry);
 
 	dlg_unlock( d_table, d_entry);
 	return;
@@ -740,15 +738,10 @@ void unlink_unsafe_dlg(struct dlg_entry *d_entry,
 }
 
 
+/* the caller must already own a reference to the dialog */
 void ref_dlg(struct dlg_cell *dlg, unsigned int cnt)
 {
-	struct dlg_entry *d_entry;
-
-	d_entry = &(d_table->entries[dlg->h_entry]);
-
-	dlg_lock( d_table, d_entry);
 	ref_dlg_unsafe( dlg, cnt);
-	dlg_unlock( d_table, d_entry);
 }
 
 
@@ -758,8 +751,15 @@ void unref_dlg(struct dlg_cell *dlg, unsigned int cnt)
 
 	d_entry = &(d_table->entries[dlg->h_entry]);
 
+	if (unref_dlg_cnt( dlg, cnt, d_entry)>0)
+		return;
+
+	/* last reference gone - no lookup can reference the dialog anymore,
+	 * so it is safe to unlink and destroy it */
 	dlg_lock( d_table, d_entry);
-	unref_dlg_unsafe( dlg, cnt, d_entry);
+	unlink_unsafe_dlg( d_entry, dlg);
+	LM_DBG("ref <=0 for dialog %p\n",dlg);
+	destroy_dlg(dlg);
 	dlg_unlock( d_table, d_entry);
 }
 
@@ -1286,7 +1286,7 @@ static int internal_mi_print_dlgs(struct mi_root *rpl_tree,struct mi_node *rpl,
 	rpl->flags |= MI_NOT_COMPLETED;
 
 	for( i=0,n=0 ; i<d_table->size ; i++ ) {
-		dlg_lock( d_table, &(d_table->entries[i]) );
+		dlg_lock_read( d_table, &(d_table->entries[i]) );
 
 		for( dlg=d_table->entries[i].first ; dlg ; dlg=dlg->next ) {
 			if (cnt && n<idx) {n++;continue;}
@@ -1294,18 +1294,18 @@ static int internal_mi_print_dlgs(struct mi_root *rpl_tree,struct mi_node *rpl,
 				goto error;
 			n++;
 			if (cnt && n>=idx+cnt) {
-				dlg_unlock( d_table, &(d_table->entries[i]) );
+				dlg_unlock_read( d_table, &(d_table->entries[i]) );
 				return 0;
 			}
 			if ( (n % 50) == 0 )
 				flush_mi_tree(rpl_tree);
 		}
-		dlg_unlock( d_table, &(d_table->entries[i]) );
+		dlg_unlock_read( d_table, &(d_table->entries[i]) );
 	}
 	return 0;
 
 error:
-	dlg_unlock( d_table, &(d_table->entries[i]) );
+	dlg_unlock_read( d_table, &(d_table->entries[i]) );
 	LM_ERR("failed to print dialog\n");
 	return -1;
 }
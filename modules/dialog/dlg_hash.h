@@ -39,6 +39,8 @@
 #ifndef _DIALOG_DLG_HASH_H_
 #define _DIALOG_DLG_HASH_H_
 
+#include <sched.h>
+
 #include "../../locking.h"
 #include "../../context.h"
 #include "../../mi/mi.h"
@@ -112,6 +114,17 @@ struct dlg_leg {
 #define TOPOH_KEEP_USER   (1 << 2)
 #define TOPOH_HIDE_CALLID (1 << 3)
 
+/* values of a dialog, as last replicated to the cluster - used for
+ * building the field-level deltas of the update events */
+struct dlg_repl_info {
+	unsigned int state;
+	unsigned int user_flags;
+	unsigned int flags;
+	unsigned int timeout;
+	unsigned int gen_cseq[2];
+	unsigned int vp_hash;
+};
+
 struct dlg_cell
 {
 	volatile int         ref;
@@ -140,6 +153,7 @@ struct dlg_cell
 	struct dlg_head_cbl  cbs;
 	struct dlg_profile_link *profile_links;
 	struct dlg_val       *vals;
+	struct dlg_repl_info repl;
 };
 
 
@@ -150,6 +164,8 @@ struct dlg_entry
 	unsigned int        next_id;
 	unsigned int        cnt;
 	unsigned int        lock_idx;
+	volatile int        readers; /* processes walking the entry (read side) */
+	volatile int        writer;  /* set while the entry is write-locked */
 };
 
 
@@ -180,10 +196,38 @@ struct dlg_cell *get_current_dialog();
 
 #define dlg_hash(_callid) core_hash(_callid, 0, d_table->size)
 
+/* Each hash entry is protected by a readers-writer scheme: writers (any
+ * change of the entry list or of the dialogs linked in it) serialize on the
+ * entry's lock from the lock set and wait for the in-flight readers to leave;
+ * readers (dialog lookups) only do an atomic inc/dec on the entry and never
+ * touch the lock set, unless a writer is active */
 #define dlg_lock(_table, _entry) \
-		lock_set_get( (_table)->locks, (_entry)->lock_idx);
+	do { \
+		lock_set_get( (_table)->locks, (_entry)->lock_idx); \
+		(_entry)->writer = 1; \
+		__sync_synchronize(); \
+		while ((_entry)->readers) \
+			sched_yield(); \
+	} while (0)
 #define dlg_unlock(_table, _entry) \
-		lock_set_release( (_table)->locks, (_entry)->lock_idx);
+	do { \
+		__sync_synchronize(); \
+		(_entry)->writer = 0; \
+		lock_set_release( (_table)->locks, (_entry)->lock_idx); \
+	} while (0)
+
+#define dlg_lock_read(_table, _entry) \
+	do { \
+		__sync_fetch_and_add( &(_entry)->readers, 1); \
+		while ((_entry)->writer) { \
+			__sync_fetch_and_sub( &(_entry)->readers, 1); \
+			while ((_entry)->writer) \
+				sched_yield(); \
+			__sync_fetch_and_add( &(_entry)->readers, 1); \
+		} \
+	} while (0)
+#define dlg_unlock_read(_table, _entry) \
+	__sync_fetch_and_sub( &(_entry)->readers, 1)
 
 #define dlg_leg_print_info(_dlg, _leg, _field) \
 	((_dlg)->legs_no[DLG_LEGS_USED]>_leg)?(_dlg)->legs[_leg]._field.len:4, \
@@ -226,28 +270,55 @@ static inline str* dlg_leg_to_uri(struct dlg_cell *dlg,int leg_no)
 void unlink_unsafe_dlg(struct dlg_entry *d_entry, struct dlg_cell *dlg);
 void destroy_dlg(struct dlg_cell *dlg);
 
+/* the dialog reference counter is atomically updated, so holding a
+ * reference is enough for changing it; only the release of the last
+ * reference (unlinking the dialog) requires the entry to be write-locked */
 #define ref_dlg_unsafe(_dlg,_cnt)     \
 	do { \
-		(_dlg)->ref += (_cnt); \
-		LM_DBG("ref dlg %p with %d -> %d\n", \
-			(_dlg),(_cnt),(_dlg)->ref); \
+		LM_DBG("ref dlg %p with %d -> %d\n", (_dlg),(_cnt), \
+			__sync_add_and_fetch( &(_dlg)->ref, (_cnt))); \
 	}while(0)
 
+/* references the dialog only if it is not already on its way to be
+ * destroyed (ref dropped to 0); to be used when picking dialogs from the
+ * hash entry, without holding any previous reference
+ * Returns 1 if referenced, 0 otherwise */
+static inline int ref_dlg_if_alive(struct dlg_cell *dlg)
+{
+	int ref;
+
+	do {
+		ref = dlg->ref;
+		if (ref<=0)
+			return 0;
+	} while (!__sync_bool_compare_and_swap( &dlg->ref, ref, ref+1));
+
+	LM_DBG("ref dlg %p with 1 -> %d\n", dlg, ref+1);
+	return 1;
+}
+
+/* atomically drops _cnt references; returns the remaining ones */
+static inline int unref_dlg_cnt(struct dlg_cell *dlg, unsigned int cnt,
+													struct dlg_entry *d_entry)
+{
+	int ref;
+
+	ref = __sync_sub_and_fetch( &dlg->ref, cnt);
+	LM_DBG("unref dlg %p with %d -> %d in entry %p\n", dlg, cnt, ref, d_entry);
+	if (ref<0) {
+		LM_CRIT("bogus ref %d with cnt %d for dlg %p [%u:%u] "
+			"with clid '%.*s' and tags '%.*s' '%.*s'\n",
+			ref, cnt, dlg, dlg->h_entry, dlg->h_id,
+			dlg->callid.len, dlg->callid.s,
+			dlg_leg_print_info( dlg, DLG_CALLER_LEG, tag),
+			dlg_leg_print_info( dlg, callee_idx(dlg), tag));
+	}
+	return ref;
+}
+
 #define unref_dlg_unsafe(_dlg,_cnt,_d_entry)   \
 	do { \
-		(_dlg)->ref -= (_cnt); \
-		LM_DBG("unref dlg %p with %d -> %d in entry %p\n",\
-			(_dlg),(_cnt),(_dlg)->ref,(_d_entry));\
-		if ((_dlg)->ref<0) {\
-			LM_CRIT("bogus ref %d with cnt %d for dlg %p [%u:%u] "\
-				"with clid '%.*s' and tags '%.*s' '%.*s'\n",\
-				(_dlg)->ref, _cnt, _dlg,\
-				(_dlg)->h_entry, (_dlg)->h_id,\
-				(_dlg)->callid.len, (_dlg)->callid.s,\
-				dlg_leg_print_info(_dlg, DLG_CALLER_LEG, tag), \
-				dlg_leg_print_info(_dlg, callee_idx(_dlg), tag)); \
-		}\
-		if ((_dlg)->ref<=0) { \
+		if (unref_dlg_cnt( _dlg, _cnt, _d_entry)<=0) { \
 			unlink_unsafe_dlg( _d_entry, _dlg);\
 			LM_DBG("ref <=0 for dialog %p\n",_dlg);\
 			destroy_dlg(_dlg);\
@@ -32,6 +32,7 @@
 #include "../../hash_func.h"
 #include "../../dprint.h"
 #include "../../ut.h"
+#include "../../timer.h"
 #include "dlg_hash.h"
 #include "dlg_profile.h"
 #include "dlg_repl_profile.h"
@@ -447,7 +448,7 @@ static struct dlg_profile_table* new_dlg_profile( str *name, unsigned int size,
 
 	len = sizeof(struct dlg_profile_table) + name->len + 1 +
 		(!use_cached ? (size  * ( (has_value == 0 ) ?
-				sizeof( int ) : sizeof( map_t ) )) : 0);
+				sizeof( struct dlg_prof_shard ) : sizeof( map_t ) )) : 0);
 
 	profile = (struct dlg_profile_table *)shm_malloc(len);
 
@@ -466,8 +467,8 @@ static struct dlg_profile_table* new_dlg_profile( str *name, unsigned int size,
 
 	profile->repl = NULL;
 
-	/* init locks */
-	if (!use_cached) {
+	/* init locks - profiles without value use atomic counters only */
+	if (!use_cached && has_value) {
 		profile->locks = get_a_lock_set(size) ;
 
 		if( !profile->locks )
@@ -503,8 +504,9 @@ static struct dlg_profile_table* new_dlg_profile( str *name, unsigned int size,
 			size*sizeof( map_t );
 	} else {
 
-		profile->counts = ( int *)(profile + 1);
-		profile->name.s = (char*) (profile->counts) + size*sizeof( int ) ;
+		profile->counts = ( struct dlg_prof_shard *)(profile + 1);
+		profile->name.s = (char*) (profile->counts) +
+			size*sizeof( struct dlg_prof_shard ) ;
 
 	}
 
@@ -571,10 +573,9 @@ void destroy_linkers(struct dlg_profile_link *linker, char is_replicated)
 
 
 		if (!l->profile->use_cached) {
-			lock_set_get( l->profile->locks, l->hash_idx);
-
 			if( l->profile->has_value)
 			{
+				lock_set_get( l->profile->locks, l->hash_idx);
 				entry = l->profile->entries[l->hash_idx];
 				dest = map_find( entry, l->value );
 				if( dest )
@@ -589,11 +590,10 @@ void destroy_linkers(struct dlg_profile_link *linker, char is_replicated)
 						map_remove(entry,l->value );
 					}
 				}
+				lock_set_release( l->profile->locks, l->hash_idx  );
 			}
 			else
-				l->profile->counts[l->hash_idx]--;
-
-			lock_set_release( l->profile->locks, l->hash_idx  );
+				__sync_fetch_and_sub(&l->profile->counts[l->hash_idx].count, 1);
 		} else if (!is_replicated) {
 			if (!cdbc) {
 				LM_WARN("CacheDB not initialized - some information might"
@@ -680,21 +680,19 @@ static void link_dlg_profile(struct dlg_profile_link *linker,
 		linker->hash_idx = hash;
 
 
-		lock_set_get( linker->profile->locks, hash );
-
 		LM_DBG("Entered here with hash = %d \n",hash);
 		if( linker->profile->has_value)
 		{
+			lock_set_get( linker->profile->locks, hash );
 			p_entry = linker->profile->entries[hash];
 			dest = map_get( p_entry, linker->value );
 			/* if we accept replicated stuff, we have to allocate the
 			 * structure for it and treat the counter differently */
 			repl_prof_inc(dest);
+			lock_set_release( linker->profile->locks,hash );
 		}
 		else
-			linker->profile->counts[hash]++;
-
-		lock_set_release( linker->profile->locks,hash );
+			__sync_fetch_and_add(&linker->profile->counts[hash].count, 1);
 	} else if (!is_replicated) {
 		if (!cdbc) {
 			LM_WARN("Cachedb not initialized yet - cannot update profile\n");
@@ -858,6 +856,41 @@ int is_dlg_in_profile(struct dlg_cell *dlg, struct dlg_profile_table *profile,
 }
 
 
+/* Sums up the local shards of a non-cached profile - the dialog counters
+ * for profiles without value, the number of values for profiles with value.
+ * No locking is done, each shard being read atomically. In approximate mode,
+ * the aggregated total is computed at most once per profile_size_approx
+ * seconds and served from cache in between */
+int get_profile_local_size(struct dlg_profile_table *profile)
+{
+	unsigned int now = 0;
+	int i, n;
+
+	if (profile_size_approx) {
+		now = get_ticks();
+		if (profile->total_ts &&
+		now - profile->total_ts < (unsigned int)profile_size_approx)
+			return profile->total;
+	}
+
+	n = 0;
+	if (profile->has_value) {
+		for( i=0; i<profile->size; i++ )
+			n += map_size(profile->entries[i]);
+	} else {
+		for( i=0; i<profile->size; i++ )
+			n += profile->counts[i].count;
+	}
+
+	if (profile_size_approx) {
+		profile->total = n;
+		profile->total_ts = now ? now : 1;
+	}
+
+	return n;
+}
+
+
 unsigned int get_profile_size(struct dlg_profile_table *profile, str *value)
 {
 	unsigned int n = 0, i;
@@ -882,18 +915,7 @@ unsigned int get_profile_size(struct dlg_profile_table *profile, str *value)
 			}
 
 		} else {
-
-			for( i=0; i<profile->size; i++ )
-			{
-
-				lock_set_get( profile->locks, i);
-
-				n += profile->counts[i];
-
-				lock_set_release( profile->locks, i);
-
-			}
-
+			n = get_profile_local_size(profile);
 		}
 		n += replicate_profiles_count(profile->repl);
 
@@ -914,17 +936,7 @@ unsigned int get_profile_size(struct dlg_profile_table *profile, str *value)
 				}
 
 			} else {
-
-				for( i=0; i<profile->size; i++ )
-				{
-
-					lock_set_get( profile->locks, i);
-
-					n += map_size(profile->entries[i]);
-
-					lock_set_release( profile->locks, i);
-
-				}
+				n = get_profile_local_size(profile);
 			}
 
 
@@ -1129,11 +1141,7 @@ struct mi_root * mi_get_profile_values(struct mi_root *cmd_tree, void *param )
 		n = 0;
 
 		for( i=0; i<profile->size; i++ )
-		{
-			lock_set_get( profile->locks, i);
-			n += profile->counts[i];
-			lock_set_release( profile->locks, i);
-		}
+			n += profile->counts[i].count;
 
 		tmp.s = "WITHOUT VALUE";
 		tmp.len = sizeof("WITHOUT VALUE")-1;
@@ -1196,7 +1204,7 @@ struct mi_root * mi_profile_list(struct mi_root *cmd_tree, void *param )
 	for( n=0,i=0; i<d_table->size; i++)
 	{
 		d_entry = &(d_table->entries[i]);
-		lock_set_get(d_table->locks,d_entry->lock_idx);
+		dlg_lock_read( d_table, d_entry);
 
 
 		cur_dlg = d_entry->first;
@@ -1223,7 +1231,7 @@ struct mi_root * mi_profile_list(struct mi_root *cmd_tree, void *param )
 			if( found ) {
 
 				if( mi_print_dlg( rpl, cur_dlg, 0) ) {
-					lock_set_release(d_table->locks,d_entry->lock_idx);
+					dlg_unlock_read( d_table, d_entry);
 					goto error;
 				}
 
@@ -1236,7 +1244,7 @@ struct mi_root * mi_profile_list(struct mi_root *cmd_tree, void *param )
 			cur_dlg = cur_dlg->next;
 		}
 
-		lock_set_release(d_table->locks,d_entry->lock_idx);
+		dlg_unlock_read( d_table, d_entry);
 	}
 
 
@@ -54,6 +54,14 @@ struct dlg_profile_link {
 
 struct repl_prof_novalue;
 
+/* one shard of a profile counter; each shard sits on its own cache line,
+ * so processes updating different shards do not contend on it */
+#define DLG_PROF_CACHELINE 64
+struct dlg_prof_shard {
+	volatile int count;
+	char pad[DLG_PROF_CACHELINE - sizeof(int)];
+};
+
 struct dlg_profile_table {
 	str name;
 	unsigned int has_value;
@@ -73,7 +81,13 @@ struct dlg_profile_table {
 	 * information for profiles without values
 	 */
 
-	int * counts;
+	struct dlg_prof_shard * counts;
+
+	/*
+	 * lazily aggregated size of the profile (used by the approximate mode)
+	 */
+	volatile int total;
+	volatile unsigned int total_ts;
 
 	/*
 	 * information used for profile replication without values
@@ -123,6 +137,8 @@ int is_dlg_in_profile(struct dlg_cell *dlg, struct dlg_profile_table *profile,
 
 unsigned int get_profile_size(struct dlg_profile_table *profile, str *value);
 
+int get_profile_local_size(struct dlg_profile_table *profile);
+
 struct mi_root * mi_get_profile(struct mi_root *cmd_tree, void *param );
 
 struct mi_root * mi_get_profile_values(struct mi_root *cmd_tree, void *param );
@@ -139,6 +155,7 @@ extern str cdb_noval_prefix;
 extern str cdb_size_prefix;
 extern str cdb_url;
 extern int profile_timeout;
+extern int profile_size_approx;
 
 extern struct dlg_profile_table *profiles;
 
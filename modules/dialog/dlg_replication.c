@@ -33,6 +33,9 @@
 
 #include "../../resolve.h"
 #include "../../forward.h"
+#include "../../timer.h"
+#include "../../hash_func.h"
+#include "../../locking.h"
 
 extern int active_dlgs_cnt;
 extern int early_dlgs_cnt;
@@ -187,7 +190,7 @@ int dlg_replicated_create(struct dlg_cell *cell, str *ftag, str *ttag, int safe)
 		dlg->prev = d_entry->last;
 		d_entry->last = dlg;
 	}
-	dlg->ref++;
+	ref_dlg_unsafe(dlg, 1);
 	d_entry->cnt++;
 
 	bin_pop_str(&vars);
@@ -437,49 +440,255 @@ int dlg_replicated_delete(void)
 
 /*  Binary Packet sending functions   */
 
+int dialog_repl_batch = 0;
+
+/* replication events buffered in shm, to be sent as one packet */
+struct dlg_repl_batch {
+	gen_lock_t lock;
+	unsigned int epoch;   /* identifies the sequence space of this run */
+	unsigned int seq;     /* sequence number of the last sent packet */
+	int len;
+	int count;
+	char *buf;            /* [type][len][record] ... */
+};
+
+/* sequence tracking for the batches received from a node */
+struct dlg_repl_peer {
+	int id;
+	unsigned int epoch;
+	unsigned int seq;
+	unsigned int resync_ts;
+	struct dlg_repl_peer *next;
+};
+
+static struct dlg_repl_batch *repl_batch;
+static struct dlg_repl_peer **repl_peers;
+static gen_lock_t *repl_peers_lock;
+
+/* do not ask a node for a resync more often than this (seconds) */
+#define DLG_REPL_RESYNC_INTERVAL 10
+
+static str module_name = str_init("dialog");
+
+static void dlg_repl_batch_timer(utime_t ticks, void *param);
+
+int dlg_repl_batch_init(void)
+{
+	int max_len;
+
+	/* batches may be received even if we do not send any */
+	if (accept_replicated_dlg) {
+		repl_peers = shm_malloc(sizeof *repl_peers + sizeof *repl_peers_lock);
+		if (!repl_peers) {
+			LM_ERR("no more shm memory\n");
+			return -1;
+		}
+		*repl_peers = NULL;
+		repl_peers_lock = (gen_lock_t *)(repl_peers + 1);
+		if (!lock_init(repl_peers_lock)) {
+			LM_ERR("failed to init lock\n");
+			return -1;
+		}
+	}
+
+	if (dialog_repl_batch <= 0 || !dialog_replicate_cluster) {
+		dialog_repl_batch = 0;
+		return 0;
+	}
+
+	/* leave room for the packet and batch headers */
+	max_len = BUF_SIZE - 256;
+	if (dialog_repl_batch > max_len) {
+		LM_WARN("replicate_dialogs_batch too big, using %d\n", max_len);
+		dialog_repl_batch = max_len;
+	}
+
+	repl_batch = shm_malloc(sizeof *repl_batch + dialog_repl_batch);
+	if (!repl_batch) {
+		LM_ERR("no more shm memory\n");
+		return -1;
+	}
+	memset(repl_batch, 0, sizeof *repl_batch);
+	repl_batch->buf = (char *)(repl_batch + 1);
+	repl_batch->epoch = (unsigned int)time(NULL);
+	if (!lock_init(&repl_batch->lock)) {
+		LM_ERR("failed to init lock\n");
+		return -1;
+	}
+
+	if (register_utimer("dlg-repl-batch", dlg_repl_batch_timer, NULL,
+	DLG_REPL_BATCH_INTERVAL * 1000, TIMER_FLAG_DELAY_ON_DELAY) < 0) {
+		LM_ERR("failed to register batch utimer\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* sends the @count records from @buf as a single packet */
+static int dlg_repl_send_batch(char *buf, int len, int count)
+{
+	char *p, *end;
+	int type;
+	str rec;
+
+	if (bin_init(&module_name, REPLICATION_DLG_BATCH, BIN_VERSION) != 0)
+		return -1;
+
+	bin_push_int(clusterer_api.get_my_id());
+	bin_push_int(repl_batch->epoch);
+	bin_push_int(++repl_batch->seq);
+	bin_push_int(count);
+
+	for (p = buf, end = buf + len; p < end; p += rec.len) {
+		memcpy(&type, p, sizeof type);
+		memcpy(&rec.len, p + sizeof type, sizeof rec.len);
+		p += sizeof type + sizeof rec.len;
+		rec.s = p;
+
+		if (bin_push_int(type) < 0 || bin_push_str(&rec) < 0) {
+			LM_ERR("batch does not fit into a bin packet\n");
+			return -1;
+		}
+	}
+
+	if (clusterer_api.send_to(dialog_replicate_cluster, PROTO_BIN) < 0)
+		return -1;
+
+	return 0;
+}
+
+static void dlg_repl_flush_unsafe(void)
+{
+	if (!repl_batch->count)
+		return;
+
+	if (dlg_repl_send_batch(repl_batch->buf, repl_batch->len,
+	repl_batch->count) < 0)
+		LM_ERR("failed to send %d buffered dialog events\n",
+			repl_batch->count);
+
+	repl_batch->len = repl_batch->count = 0;
+}
+
+static void dlg_repl_batch_timer(utime_t ticks, void *param)
+{
+	lock_get(&repl_batch->lock);
+	dlg_repl_flush_unsafe();
+	lock_release(&repl_batch->lock);
+}
 
 /**
- * replicates a locally created dialog to all the destinations
- * specified with the 'replicate_dialogs' modparam
+ * sends the event built in the bin buffer (started with dlg_repl_start())
+ * either right away, or buffered into the current batch
  */
-void replicate_dialog_created(struct dlg_cell *dlg)
+static int dlg_repl_send(int type)
 {
-	static str module_name = str_init("dialog");
-	int callee_leg;
-	str *vars, *profiles;
+	static char *rec_buf;
+	str buf;
+	int hdr_len, rec_len;
+
+	if (!dialog_repl_batch)
+		return clusterer_api.send_to(dialog_replicate_cluster, PROTO_BIN);
+
+	/* the record is the body of the built packet */
+	bin_get_buffer(&buf);
+	hdr_len = HEADER_SIZE + LEN_FIELD_SIZE + module_name.len + CMD_FIELD_SIZE;
+	rec_len = buf.len - hdr_len;
+
+	/* save the record aside, the bin buffer is reused for flushing */
+	if (!rec_buf) {
+		rec_buf = pkg_malloc(BUF_SIZE);
+		if (!rec_buf) {
+			LM_ERR("no more pkg memory\n");
+			return -1;
+		}
+	}
+	memcpy(rec_buf, &type, sizeof type);
+	memcpy(rec_buf + sizeof type, &rec_len, sizeof rec_len);
+	memcpy(rec_buf + sizeof type + sizeof rec_len, buf.s + hdr_len, rec_len);
+	rec_len += sizeof type + sizeof rec_len;
 
-	if (bin_init(&module_name, REPLICATION_DLG_CREATED, BIN_VERSION) != 0)
-		goto error;
-	
-	bin_push_int(clusterer_api.get_my_id());	
+	lock_get(&repl_batch->lock);
+
+	if (repl_batch->len + rec_len > dialog_repl_batch)
+		dlg_repl_flush_unsafe();
+
+	if (rec_len > dialog_repl_batch) {
+		/* too big to be buffered - goes alone */
+		if (dlg_repl_send_batch(rec_buf, rec_len, 1) < 0) {
+			lock_release(&repl_batch->lock);
+			return -1;
+		}
+	} else {
+		memcpy(repl_batch->buf + repl_batch->len, rec_buf, rec_len);
+		repl_batch->len += rec_len;
+		repl_batch->count++;
+	}
+
+	lock_release(&repl_batch->lock);
+	return 0;
+}
+
+static inline int dlg_repl_start(int type)
+{
+	if (bin_init(&module_name, type, BIN_VERSION) != 0)
+		return -1;
+
+	/* the sender is identified by the batch header */
+	if (!dialog_repl_batch)
+		bin_push_int(clusterer_api.get_my_id());
+
+	return 0;
+}
+
+static inline unsigned int dlg_vp_hash(str *vars, str *profiles)
+{
+	unsigned int h = 0;
+
+	if (vars && vars->s && vars->len)
+		h = core_hash(vars, NULL, 0) + vars->len;
+	if (profiles && profiles->s && profiles->len)
+		h ^= core_hash(profiles, NULL, 0) + (profiles->len << 16);
+
+	return h;
+}
+
+/* pushes the full dialog info, as expected by dlg_replicated_create()
+ * and dlg_replicated_update(); @all_nodes: the info goes to the whole
+ * cluster, so the following deltas are relative to it */
+static int dlg_repl_push_full(struct dlg_cell *dlg, int all_nodes)
+{
+	int callee_leg, rc = 0;
+	str *vars, *profiles;
 
 	callee_leg = callee_idx(dlg);
 
-	bin_push_str(&dlg->callid);
-	bin_push_str(&dlg->legs[DLG_CALLER_LEG].tag);
-	bin_push_str(&dlg->legs[callee_leg].tag);
+	rc |= bin_push_str(&dlg->callid);
+	rc |= bin_push_str(&dlg->legs[DLG_CALLER_LEG].tag);
+	rc |= bin_push_str(&dlg->legs[callee_leg].tag);
 
-	bin_push_str(&dlg->from_uri);
-	bin_push_str(&dlg->to_uri);
+	rc |= bin_push_str(&dlg->from_uri);
+	rc |= bin_push_str(&dlg->to_uri);
 
-	bin_push_int(dlg->h_id);
-	bin_push_int(dlg->start_ts);
-	bin_push_int(dlg->state);
+	rc |= bin_push_int(dlg->h_id);
+	rc |= bin_push_int(dlg->start_ts);
+	rc |= bin_push_int(dlg->state);
 
-	bin_push_str(&dlg->legs[DLG_CALLER_LEG].bind_addr->sock_str);
+	rc |= bin_push_str(&dlg->legs[DLG_CALLER_LEG].bind_addr->sock_str);
 	if (dlg->legs[callee_leg].bind_addr)
-		bin_push_str(&dlg->legs[callee_leg].bind_addr->sock_str);
+		rc |= bin_push_str(&dlg->legs[callee_leg].bind_addr->sock_str);
 	else
-		bin_push_str(NULL);
+		rc |= bin_push_str(NULL);
 
-	bin_push_str(&dlg->legs[DLG_CALLER_LEG].r_cseq);
-	bin_push_str(&dlg->legs[callee_leg].r_cseq);
-	bin_push_str(&dlg->legs[DLG_CALLER_LEG].route_set);
-	bin_push_str(&dlg->legs[callee_leg].route_set);
-	bin_push_str(&dlg->legs[DLG_CALLER_LEG].contact);
-	bin_push_str(&dlg->legs[callee_leg].contact);
-	bin_push_str(&dlg->legs[callee_leg].from_uri);
-	bin_push_str(&dlg->legs[callee_leg].to_uri);
+	rc |= bin_push_str(&dlg->legs[DLG_CALLER_LEG].r_cseq);
+	rc |= bin_push_str(&dlg->legs[callee_leg].r_cseq);
+	rc |= bin_push_str(&dlg->legs[DLG_CALLER_LEG].route_set);
+	rc |= bin_push_str(&dlg->legs[callee_leg].route_set);
+	rc |= bin_push_str(&dlg->legs[DLG_CALLER_LEG].contact);
+	rc |= bin_push_str(&dlg->legs[callee_leg].contact);
+	rc |= bin_push_str(&dlg->legs[callee_leg].from_uri);
+	rc |= bin_push_str(&dlg->legs[callee_leg].to_uri);
 
 	/* XXX: on shutdown only? */
 	vars = write_dialog_vars(dlg->vals);
@@ -487,16 +696,43 @@ void replicate_dialog_created(struct dlg_cell *dlg)
 	profiles = write_dialog_profiles(dlg->profile_links);
 	dlg_unlock_dlg(dlg);
 
-	bin_push_str(vars);
-	bin_push_str(profiles);
-	bin_push_int(dlg->user_flags);
-	bin_push_int(dlg->flags &
+	rc |= bin_push_str(vars);
+	rc |= bin_push_str(profiles);
+	rc |= bin_push_int(dlg->user_flags);
+	rc |= bin_push_int(dlg->flags &
 			     ~(DLG_FLAG_NEW|DLG_FLAG_CHANGED|DLG_FLAG_VP_CHANGED));
-	bin_push_int((unsigned int)time(0) + dlg->tl.timeout - get_ticks());
-	bin_push_int(dlg->legs[DLG_CALLER_LEG].last_gen_cseq);
-	bin_push_int(dlg->legs[callee_leg].last_gen_cseq);
+	rc |= bin_push_int((unsigned int)time(0) + dlg->tl.timeout - get_ticks());
+	rc |= bin_push_int(dlg->legs[DLG_CALLER_LEG].last_gen_cseq);
+	rc |= bin_push_int(dlg->legs[callee_leg].last_gen_cseq);
+
+	if (!all_nodes)
+		return rc < 0 ? -1 : 0;
+
+	/* remember what the cluster knows about the dialog */
+	dlg->repl.state = dlg->state;
+	dlg->repl.user_flags = dlg->user_flags;
+	dlg->repl.flags = dlg->flags;
+	dlg->repl.timeout = dlg->tl.timeout;
+	dlg->repl.gen_cseq[0] = dlg->legs[DLG_CALLER_LEG].last_gen_cseq;
+	dlg->repl.gen_cseq[1] = dlg->legs[callee_leg].last_gen_cseq;
+	dlg->repl.vp_hash = dlg_vp_hash(vars, profiles);
+
+	/* any failed push (buffer full) leaves a negative rc */
+	return rc < 0 ? -1 : 0;
+}
 
-	if (clusterer_api.send_to(dialog_replicate_cluster, PROTO_BIN) < 0)
+/**
+ * replicates a locally created dialog to all the destinations
+ * specified with the 'replicate_dialogs' modparam
+ */
+void replicate_dialog_created(struct dlg_cell *dlg)
+{
+	if (dlg_repl_start(REPLICATION_DLG_CREATED) != 0)
+		goto error;
+
+	dlg_repl_push_full(dlg, 1);
+
+	if (dlg_repl_send(REPLICATION_DLG_CREATED) < 0)
  		goto error;
 
 	if_update_stat(dlg_enable_stats,create_sent,1);
@@ -507,63 +743,98 @@ error:
 }
 
 /**
- * replicates a local dialog update to all the destinations
- * specified with the 'replicate_dialogs' modparam
+ * pushes only the fields of the dialog which changed since they were
+ * last replicated, as expected by dlg_replicated_update_delta()
  */
-void replicate_dialog_updated(struct dlg_cell *dlg)
+static void dlg_repl_push_delta(struct dlg_cell *dlg)
 {
-	static str module_name = str_init("dialog");
 	int callee_leg;
-	str *vars, *profiles;	
-
-	if (bin_init(&module_name, REPLICATION_DLG_UPDATED, BIN_VERSION) != 0)
-		goto error;
+	unsigned int mask, vp_hash;
+	str *vars, *profiles = NULL;
 
 	callee_leg = callee_idx(dlg);
 
-	bin_push_int(clusterer_api.get_my_id());
 	bin_push_str(&dlg->callid);
 	bin_push_str(&dlg->legs[DLG_CALLER_LEG].tag);
 	bin_push_str(&dlg->legs[callee_leg].tag);
 
-	bin_push_str(&dlg->from_uri);
-	bin_push_str(&dlg->to_uri);
-
-	bin_push_int(dlg->h_id);
-	bin_push_int(dlg->start_ts);
-	bin_push_int(dlg->state);
-
-	bin_push_str(&dlg->legs[DLG_CALLER_LEG].bind_addr->sock_str);
-	if (dlg->legs[callee_leg].bind_addr)
-		bin_push_str(&dlg->legs[callee_leg].bind_addr->sock_str);
-	else
-		bin_push_str(NULL);
+	/* the cseqs change with almost any sequential request */
+	mask = DLG_REPL_F_CSEQ;
 
-	bin_push_str(&dlg->legs[DLG_CALLER_LEG].r_cseq);
-	bin_push_str(&dlg->legs[callee_leg].r_cseq);
-	bin_push_str(&dlg->legs[DLG_CALLER_LEG].route_set);
-	bin_push_str(&dlg->legs[callee_leg].route_set);
-	bin_push_str(&dlg->legs[DLG_CALLER_LEG].contact);
-	bin_push_str(&dlg->legs[callee_leg].contact);
-	bin_push_str(&dlg->legs[callee_leg].from_uri);
-	bin_push_str(&dlg->legs[callee_leg].to_uri);
+	if (dlg->state != dlg->repl.state)
+		mask |= DLG_REPL_F_STATE;
+	if (dlg->user_flags != dlg->repl.user_flags ||
+	dlg->flags != dlg->repl.flags)
+		mask |= DLG_REPL_F_FLAGS;
+	if (dlg->tl.timeout != dlg->repl.timeout)
+		mask |= DLG_REPL_F_TIMEOUT;
+	if (dlg->legs[DLG_CALLER_LEG].last_gen_cseq != dlg->repl.gen_cseq[0] ||
+	dlg->legs[callee_leg].last_gen_cseq != dlg->repl.gen_cseq[1])
+		mask |= DLG_REPL_F_GEN_CSEQ;
 
-	/* XXX: on shutdown only? */
 	vars = write_dialog_vars(dlg->vals);
 	dlg_lock_dlg(dlg);
 	profiles = write_dialog_profiles(dlg->profile_links);
 	dlg_unlock_dlg(dlg);
+	vp_hash = dlg_vp_hash(vars, profiles);
+	if (vp_hash != dlg->repl.vp_hash)
+		mask |= DLG_REPL_F_VP;
+
+	bin_push_int(mask);
 
-	bin_push_str(vars);
-	bin_push_str(profiles);
-	bin_push_int(dlg->user_flags);
-	bin_push_int(dlg->flags &
+	if (mask & DLG_REPL_F_STATE) {
+		bin_push_int(dlg->state);
+		dlg->repl.state = dlg->state;
+	}
+	if (mask & DLG_REPL_F_CSEQ) {
+		bin_push_str(&dlg->legs[DLG_CALLER_LEG].r_cseq);
+		bin_push_str(&dlg->legs[callee_leg].r_cseq);
+	}
+	if (mask & DLG_REPL_F_VP) {
+		bin_push_str(vars);
+		bin_push_str(profiles);
+		dlg->repl.vp_hash = vp_hash;
+	}
+	if (mask & DLG_REPL_F_FLAGS) {
+		bin_push_int(dlg->user_flags);
+		bin_push_int(dlg->flags &
 			     ~(DLG_FLAG_NEW|DLG_FLAG_CHANGED|DLG_FLAG_VP_CHANGED));
-	bin_push_int((unsigned int)time(0) + dlg->tl.timeout - get_ticks());
-	bin_push_int(dlg->legs[DLG_CALLER_LEG].last_gen_cseq);
-	bin_push_int(dlg->legs[callee_leg].last_gen_cseq);
-	
-	if (clusterer_api.send_to(dialog_replicate_cluster, PROTO_BIN) < 0) {
+		dlg->repl.user_flags = dlg->user_flags;
+		dlg->repl.flags = dlg->flags;
+	}
+	if (mask & DLG_REPL_F_TIMEOUT) {
+		bin_push_int((unsigned int)time(0) + dlg->tl.timeout - get_ticks());
+		dlg->repl.timeout = dlg->tl.timeout;
+	}
+	if (mask & DLG_REPL_F_GEN_CSEQ) {
+		bin_push_int(dlg->legs[DLG_CALLER_LEG].last_gen_cseq);
+		bin_push_int(dlg->legs[callee_leg].last_gen_cseq);
+		dlg->repl.gen_cseq[0] = dlg->legs[DLG_CALLER_LEG].last_gen_cseq;
+		dlg->repl.gen_cseq[1] = dlg->legs[callee_leg].last_gen_cseq;
+	}
+}
+
+/**
+ * replicates a local dialog update to all the destinations
+ * specified with the 'replicate_dialogs' modparam
+ */
+void replicate_dialog_updated(struct dlg_cell *dlg)
+{
+	int type;
+
+	/* the batching receivers also understand the deltas */
+	type = dialog_repl_batch ?
+		REPLICATION_DLG_UPDATED_DELTA : REPLICATION_DLG_UPDATED;
+
+	if (dlg_repl_start(type) != 0)
+		goto error;
+
+	if (type == REPLICATION_DLG_UPDATED_DELTA)
+		dlg_repl_push_delta(dlg);
+	else
+		dlg_repl_push_full(dlg, 1);
+
+	if (dlg_repl_send(type) < 0) {
 		LM_ERR("replicate dialog updated failed\n");
 		return;
  	}
@@ -581,17 +852,14 @@ error:
  */
 void replicate_dialog_deleted(struct dlg_cell *dlg)
 {
-	static str module_name = str_init("dialog");
-	
-	if (bin_init(&module_name, REPLICATION_DLG_DELETED, BIN_VERSION) != 0)
+	if (dlg_repl_start(REPLICATION_DLG_DELETED) != 0)
 		goto error;
 
-	bin_push_int(clusterer_api.get_my_id());
 	bin_push_str(&dlg->callid);
 	bin_push_str(&dlg->legs[DLG_CALLER_LEG].tag);
 	bin_push_str(&dlg->legs[callee_idx(dlg)].tag);
 	
-	if (clusterer_api.send_to(dialog_replicate_cluster, PROTO_BIN) < 0) {
+	if (dlg_repl_send(REPLICATION_DLG_DELETED) < 0) {
 		goto error;
  	}
 	
@@ -600,6 +868,362 @@ error:
 	LM_ERR("Failed to replicate deleted dialog\n");
 }
 
+/**
+ * asks node @server_id to send again all its dialogs, after a gap was
+ * detected in the sequence of its batches
+ */
+static void dlg_repl_request_resync(int server_id)
+{
+	struct dlg_repl_peer *peer;
+	unsigned int now = get_ticks();
+
+	lock_get(repl_peers_lock);
+	for (peer = *repl_peers; peer && peer->id != server_id; peer = peer->next);
+	if (peer) {
+		if (peer->resync_ts && now - peer->resync_ts < DLG_REPL_RESYNC_INTERVAL) {
+			lock_release(repl_peers_lock);
+			return;
+		}
+		peer->resync_ts = now ? now : 1;
+	}
+	lock_release(repl_peers_lock);
+
+	LM_INFO("requesting dialogs resync from node %d\n", server_id);
+
+	if (bin_init(&module_name, REPLICATION_DLG_RESYNC, BIN_VERSION) != 0)
+		goto error;
+	bin_push_int(clusterer_api.get_my_id());
+	/* all the nodes receive it, only the target answers */
+	bin_push_int(server_id);
+
+	if (clusterer_api.send_to(accept_replicated_dlg, PROTO_BIN) < 0)
+		goto error;
+
+	return;
+error:
+	LM_ERR("Failed to request dialogs resync from node %d\n", server_id);
+}
+
+/**
+ * checks the sequence number of a batch received from @server_id
+ * @return: 1 if a gap was detected, 0 otherwise
+ */
+static int dlg_repl_check_seq(int server_id, unsigned int epoch,
+															unsigned int seq)
+{
+	struct dlg_repl_peer *peer;
+	int gap = 0;
+
+	lock_get(repl_peers_lock);
+
+	for (peer = *repl_peers; peer && peer->id != server_id; peer = peer->next);
+	if (!peer) {
+		peer = shm_malloc(sizeof *peer);
+		if (!peer) {
+			lock_release(repl_peers_lock);
+			LM_ERR("no more shm memory\n");
+			return 0;
+		}
+		memset(peer, 0, sizeof *peer);
+		peer->id = server_id;
+		peer->next = *repl_peers;
+		*repl_peers = peer;
+	} else if (peer->epoch == epoch) {
+		if ((int)(seq - peer->seq) <= 0) {
+			/* reordered or duplicated - already accounted */
+			lock_release(repl_peers_lock);
+			return 0;
+		}
+		gap = (seq != peer->seq + 1);
+	}
+
+	/* first batch from a (re)started node is in sequence */
+	peer->epoch = epoch;
+	peer->seq = seq;
+
+	lock_release(repl_peers_lock);
+
+	if (gap)
+		LM_WARN("lost dialog events from node %d (got batch %u, expected %u)\n",
+			server_id, seq, peer->seq + 1);
+
+	return gap;
+}
+
+/**
+ * replicates the delta update of a remote dialog locally
+ */
+int dlg_replicated_update_delta(int server_id)
+{
+	struct dlg_cell *dlg;
+	str call_id, from_tag, to_tag, vars, profiles, st;
+	unsigned int dir, dst_leg, mask;
+	int timeout;
+	struct dlg_entry *d_entry;
+
+	bin_pop_str(&call_id);
+	bin_pop_str(&from_tag);
+	bin_pop_str(&to_tag);
+	if (bin_pop_int(&mask) != 0)
+		return -1;
+
+	dst_leg = -1;
+	dlg = get_dlg(&call_id, &from_tag, &to_tag, &dir, &dst_leg);
+	if (!dlg) {
+		/* cannot apply a delta - we missed the dialog creation */
+		LM_DBG("delta for unknown dialog '%.*s'\n", call_id.len, call_id.s);
+		dlg_repl_request_resync(server_id);
+		return 0;
+	}
+
+	d_entry = &d_table->entries[dlg->h_entry];
+	vars.s = profiles.s = NULL;
+
+	dlg_lock(d_table, d_entry);
+
+	if (mask & DLG_REPL_F_STATE)
+		bin_pop_int(&dlg->state);
+
+	if (mask & DLG_REPL_F_CSEQ) {
+		bin_pop_str(&st);
+		if (dlg_update_cseq(dlg, DLG_CALLER_LEG, &st, 0) != 0) {
+			LM_ERR("failed to update caller cseq\n");
+			goto error;
+		}
+		bin_pop_str(&st);
+		if (dlg_update_cseq(dlg, callee_idx(dlg), &st, 0) != 0) {
+			LM_ERR("failed to update callee cseq\n");
+			goto error;
+		}
+	}
+
+	if (mask & DLG_REPL_F_VP) {
+		bin_pop_str(&vars);
+		bin_pop_str(&profiles);
+	}
+
+	if (mask & DLG_REPL_F_FLAGS) {
+		bin_pop_int(&dlg->user_flags);
+		bin_pop_int(&dlg->flags);
+	}
+
+	if (mask & DLG_REPL_F_TIMEOUT) {
+		bin_pop_int(&timeout);
+		timeout -= time(0);
+		if (dlg->lifetime != timeout) {
+			dlg->lifetime = timeout;
+			if (update_dlg_timer(&dlg->tl, dlg->lifetime) == -1)
+				LM_ERR("failed to update dialog lifetime!\n");
+		}
+	}
+
+	if (mask & DLG_REPL_F_GEN_CSEQ) {
+		bin_pop_int(&dlg->legs[DLG_CALLER_LEG].last_gen_cseq);
+		bin_pop_int(&dlg->legs[callee_idx(dlg)].last_gen_cseq);
+	}
+
+	if (vars.s && vars.len != 0)
+		read_dialog_vars(vars.s, vars.len, dlg);
+
+	dlg_unlock(d_table, d_entry);
+
+	if (profiles.s && profiles.len != 0)
+		read_dialog_profiles(profiles.s, profiles.len, dlg, 1, 1);
+
+	unref_dlg(dlg, 1);
+	return 0;
+
+error:
+	dlg_unlock(d_table, d_entry);
+	unref_dlg(dlg, 1);
+	return -1;
+}
+
+/**
+ * processes a batch of dialog events received from another node
+ */
+static int dlg_replicated_batch(int server_id)
+{
+	unsigned int epoch, seq;
+	int count, type, i, rc = 0;
+	char *pos, *end;
+	str rec;
+
+	if (bin_pop_int(&epoch) != 0 || bin_pop_int(&seq) != 0 ||
+	bin_pop_int(&count) != 0)
+		return -1;
+
+	if (dlg_repl_check_seq(server_id, epoch, seq))
+		dlg_repl_request_resync(server_id);
+
+	for (i = 0; i < count; i++) {
+		if (bin_pop_int(&type) != 0 || bin_pop_str(&rec) != 0) {
+			LM_ERR("truncated dialog batch (%d/%d events)\n", i, count);
+			return -1;
+		}
+
+		/* each event is parsed within its own record, so a failure
+		 * cannot affect the following events */
+		if (bin_enter_region(&rec, &pos, &end) < 0)
+			return -1;
+
+		switch (type) {
+		case REPLICATION_DLG_CREATED:
+			if (dlg_replicated_create(NULL, NULL, NULL, 1) != 0)
+				rc = -1;
+			if_update_stat(dlg_enable_stats, create_recv, 1);
+			break;
+		case REPLICATION_DLG_UPDATED:
+			if (dlg_replicated_update() != 0)
+				rc = -1;
+			if_update_stat(dlg_enable_stats, update_recv, 1);
+			break;
+		case REPLICATION_DLG_UPDATED_DELTA:
+			if (dlg_replicated_update_delta(server_id) != 0)
+				rc = -1;
+			if_update_stat(dlg_enable_stats, update_recv, 1);
+			break;
+		case REPLICATION_DLG_DELETED:
+			if (dlg_replicated_delete() != 0)
+				rc = -1;
+			if_update_stat(dlg_enable_stats, delete_recv, 1);
+			break;
+		default:
+			LM_WARN("Invalid dialog event %d in batch\n", type);
+			rc = -1;
+		}
+
+		bin_leave_region(pos, end);
+	}
+
+	return rc;
+}
+
+/**
+ * references all the confirmed dialogs of hash entry @i, so they can be
+ * pushed without holding the entry lock (which pushing needs)
+ * @return: number of dialogs in @dlgs, to be unref'ed by the caller
+ */
+static int dlg_grab_confirmed(unsigned int i, struct dlg_cell ***dlgs)
+{
+	static struct dlg_cell **grabbed;
+	static int size;
+	struct dlg_entry *d_entry = &d_table->entries[i];
+	struct dlg_cell *dlg, **tmp;
+	int n = 0;
+
+	dlg_lock_read(d_table, d_entry);
+	for (dlg = d_entry->first; dlg; dlg = dlg->next) {
+		if (dlg->state != DLG_STATE_CONFIRMED_NA &&
+		dlg->state != DLG_STATE_CONFIRMED)
+			continue;
+		if (n == size) {
+			tmp = pkg_realloc(grabbed, (size ? 2 * size : 16) * sizeof *tmp);
+			if (!tmp) {
+				LM_ERR("no more pkg memory\n");
+				break;
+			}
+			grabbed = tmp;
+			size = size ? 2 * size : 16;
+		}
+		if (ref_dlg_if_alive(dlg))
+			grabbed[n++] = dlg;
+	}
+	dlg_unlock_read(d_table, d_entry);
+
+	*dlgs = grabbed;
+	return n;
+}
+
+/**
+ * answers a resync request by sending the full info of all the
+ * confirmed dialogs
+ */
+static int dlg_replicated_resync(int server_id)
+{
+	struct dlg_cell **dlgs;
+	unsigned int i;
+	int j, n, target;
+
+	if (bin_pop_int(&target) != 0)
+		return -1;
+
+	if (target != clusterer_api.get_my_id() || !dialog_replicate_cluster)
+		return 0;
+
+	LM_INFO("node %d requested a resync of our dialogs\n", server_id);
+
+	for (i = 0; i < d_table->size; i++) {
+		n = dlg_grab_confirmed(i, &dlgs);
+		for (j = 0; j < n; j++) {
+			/* full updates also create the missing dialogs */
+			if (dlg_repl_start(REPLICATION_DLG_UPDATED) == 0) {
+				dlg_repl_push_full(dlgs[j], 1);
+				dlg_repl_send(REPLICATION_DLG_UPDATED);
+			}
+			unref_dlg(dlgs[j], 1);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * clusterer sync: pushes the confirmed dialogs of a hash entry; the @cursor
+ * holds the index of the entry (upper 32 bits) and of the first dialog to
+ * push within the entry (lower 32 bits), so the dialogs of an entry not
+ * fitting into a packet are split across the sync chunks
+ */
+int dlg_sync_dump(unsigned long long *cursor)
+{
+	struct dlg_cell **dlgs;
+	unsigned int entry, skip;
+	int j, n, pushed = 0, full = 0;
+	str buf;
+
+	entry = *cursor >> 32;
+	skip = *cursor & 0xFFFFFFFF;
+
+	n = dlg_grab_confirmed(entry, &dlgs);
+	for (j = 0; j < n; j++) {
+		if (!full && j >= skip) {
+			bin_get_buffer(&buf);
+			if (dlg_repl_push_full(dlgs[j], 0) < 0) {
+				/* the packet is full - continue from this dialog */
+				bin_truncate(buf.len);
+				full = 1;
+				skip = j;
+			} else {
+				pushed++;
+			}
+		}
+		unref_dlg(dlgs[j], 1);
+	}
+
+	if (full) {
+		if (!pushed)
+			return -1;
+		*cursor = ((unsigned long long)entry << 32) | skip;
+		return pushed;
+	}
+
+	if (++entry < d_table->size)
+		*cursor = (unsigned long long)entry << 32;
+	else
+		*cursor = CL_SYNC_DONE;
+
+	return pushed;
+}
+
+/**
+ * clusterer sync: loads a dialog pushed by dlg_sync_dump() of @node_id
+ */
+int dlg_sync_load(int node_id)
+{
+	/* creates the dialog if missing, and consumes the whole record */
+	return dlg_replicated_update();
+}
+
 /**
  * receive_binary_packet (callback) - receives a cmd_type, specifying the
  * purpose of the data encoded in the received UDP packet
@@ -674,6 +1298,14 @@ void receive_dlg_binary_packet(int packet_type, struct receive_info *ri, void *a
 		if_update_stat(dlg_enable_stats, delete_recv, 1);
 		break;
 
+	case REPLICATION_DLG_BATCH:
+		rc = dlg_replicated_batch(server_id);
+		break;
+
+	case REPLICATION_DLG_RESYNC:
+		rc = dlg_replicated_resync(server_id);
+		break;
+
 	default:
 		rc = -1;
 		get_su_info(&ri->src_su.s, ip, port);
@@ -1072,11 +1704,8 @@ static void repl_prof_utimer_f(utime_t ticks, void *param)
 	for (profile = profiles; profile; profile = profile->next) {
 		count = 0;
 		if (!profile->has_value) {
-			for (i = 0; i < profile->size; i++) {
-				lock_set_get(profile->locks, i);
-				count += profile->counts[i];
-				lock_set_release(profile->locks, i);
-			}
+			for (i = 0; i < profile->size; i++)
+				count += profile->counts[i].count;
 
 			if ((ret = repl_prof_add(&profile->name, 0, NULL, count)) < 0)
 				goto error;
@@ -36,12 +36,28 @@
 #define REPLICATION_DLG_CREATED		1
 #define REPLICATION_DLG_UPDATED		2
 #define REPLICATION_DLG_DELETED		3
+/* 4 is used by the profiles replication */
+#define REPLICATION_DLG_BATCH		5
+#define REPLICATION_DLG_UPDATED_DELTA	6
+#define REPLICATION_DLG_RESYNC		7
+
+/* fields carried by a delta update */
+#define DLG_REPL_F_STATE     (1<<0)
+#define DLG_REPL_F_CSEQ      (1<<1)
+#define DLG_REPL_F_VP        (1<<2)
+#define DLG_REPL_F_FLAGS     (1<<3)
+#define DLG_REPL_F_TIMEOUT   (1<<4)
+#define DLG_REPL_F_GEN_CSEQ  (1<<5)
+
+/* how often (ms) the buffered replication events are flushed */
+#define DLG_REPL_BATCH_INTERVAL 100
 
 #define BIN_VERSION 1
 
 extern int accept_replicated_dlg;
 extern int dialog_replicate_cluster;
 extern int profile_replicate_cluster;
+extern int dialog_repl_batch;
 
 struct clusterer_binds clusterer_api;
 
@@ -49,6 +65,13 @@ void replicate_dialog_created(struct dlg_cell *dlg);
 void replicate_dialog_updated(struct dlg_cell *dlg);
 void replicate_dialog_deleted(struct dlg_cell *dlg);
 
+int dlg_repl_batch_init(void);
+
+extern int dialog_sync;
+
+int dlg_sync_dump(unsigned long long *cursor);
+int dlg_sync_load(int node_id);
+
 int dlg_replicated_create(struct dlg_cell *cell, str *ftag, str *ttag, int safe);
 int dlg_replicated_update(void);
 int dlg_replicated_delete(void);
@@ -44,8 +44,18 @@ str options_str=str_init("OPTIONS");
  */
 #define FAKE_DIALOG_TL ((struct dlg_tl*)-1)
 
+#define DLG_TIMER_WHEEL_MASK (DLG_TIMER_WHEEL_SIZE-1)
+
+/* the shard is picked based on the address of the timer link, so a dialog
+ * always lands in the same shard */
+#define dlg_timer_shard(_tl) \
+	(&d_timer->shards[((unsigned long)(_tl)>>4) % DLG_TIMER_SHARDS])
+
 int init_dlg_timer( dlg_timer_handler hdl )
 {
+	struct dlg_timer_shard *shard;
+	int i, j;
+
 	d_timer = (struct dlg_timer*)shm_malloc(sizeof(struct dlg_timer));
 	if (d_timer==0) {
 		LM_ERR("no more shm mem\n");
@@ -53,24 +63,23 @@ int init_dlg_timer( dlg_timer_handler hdl )
 	}
 	memset( d_timer, 0, sizeof(struct dlg_timer) );
 
-	d_timer->first.next = d_timer->first.prev = &(d_timer->first);
+	for( i=0 ; i<DLG_TIMER_SHARDS ; i++ ) {
+		shard = &d_timer->shards[i];
+		for( j=0 ; j<DLG_TIMER_WHEEL_SIZE ; j++ )
+			shard->slots[j].next = shard->slots[j].prev = &shard->slots[j];
 
-	d_timer->lock = lock_alloc();
-	if (d_timer->lock==0) {
-		LM_ERR("failed to alloc lock\n");
-		goto error0;
-	}
-
-	if (lock_init(d_timer->lock)==0) {
-		LM_ERR("failed to init lock\n");
-		goto error1;
+		if (lock_init(&shard->lock)==0) {
+			LM_ERR("failed to init lock\n");
+			goto error;
+		}
+		shard->last = get_ticks();
 	}
 
 	timer_hdl = hdl;
 	return 0;
-error1:
-	lock_dealloc(d_timer->lock);
-error0:
+error:
+	while (--i>=0)
+		lock_destroy(&d_timer->shards[i].lock);
 	shm_free(d_timer);
 	d_timer = 0;
 	return -1;
@@ -99,16 +108,16 @@ void debug_detached_timer_list(struct dlg_tl *detached)
 
 }
 
-/* assumed to be always called under timer lock */
-void debug_main_timer_list(void)
+/* assumed to be always called under shard lock */
+void debug_main_timer_list(struct dlg_tl *head)
 {
 	struct dlg_tl *start,*finish;
 	int visited=1;
 
-	start = finish = &(d_timer->first);
+	start = finish = head;
 	LM_DBG("testing forward loop with visited = %d\n",visited);
 
-	/* check the main list is circular in both directions from start to end,
+	/* check the slot list is circular in both directions from start to end,
 	 * with no loops in the middle */
 	while (start) {
 		start->visited=visited;
@@ -124,7 +133,7 @@ void debug_main_timer_list(void)
 	}
 
 	visited++;
-	start = &(d_timer->first);
+	start = head;
 
 	LM_DBG("testing backward loop with visited = %d\n",visited);
 
@@ -144,31 +153,35 @@ void debug_main_timer_list(void)
 
 #endif
 
-int init_dlg_ping_timer(void)
+int init_dlg_ping_timer(int interval)
 {
-	ping_timer = (struct dlg_ping_timer*)shm_malloc(sizeof(struct dlg_timer));
+	unsigned int i;
+
+	ping_timer = (struct dlg_ping_timer*)shm_malloc(
+		sizeof(struct dlg_ping_timer) + interval*sizeof(struct dlg_ping_slot));
 	if (ping_timer==0) {
 		LM_ERR("no more shm mem\n");
 		return -1;
 	}
 
-	memset(ping_timer,0,sizeof(struct dlg_ping_timer));
-	ping_timer->lock = lock_alloc();
-	if (ping_timer->lock == 0) {
-		LM_ERR("failed to alloc lock\n");
-		goto error0;
-	}
+	memset(ping_timer,0,sizeof(struct dlg_ping_timer) +
+		interval*sizeof(struct dlg_ping_slot));
+	ping_timer->size = interval;
+	ping_timer->slots = (struct dlg_ping_slot*)(ping_timer+1);
+	ping_timer->last = get_ticks();
 
-	if (lock_init(ping_timer->lock) == 0) {
-		LM_ERR("failed to init lock\n");
-		goto error1;
+	for( i=0 ; i<ping_timer->size ; i++ ) {
+		if (lock_init(&ping_timer->slots[i].lock) == 0) {
+			LM_ERR("failed to init lock\n");
+			goto error;
+		}
 	}
 
 	return 0;
 
-error1:
-	lock_dealloc(ping_timer->lock);
-error0:
+error:
+	while (i-->0)
+		lock_destroy(&ping_timer->slots[i].lock);
 	shm_free(ping_timer);
 	ping_timer=0;
 	return -1;
@@ -176,11 +189,13 @@ error0:
 
 void destroy_ping_timer(void)
 {
+	unsigned int i;
+
 	if (ping_timer ==0)
 		return;
 
-	lock_destroy(ping_timer->lock);
-	lock_dealloc(ping_timer->lock);
+	for( i=0 ; i<ping_timer->size ; i++ )
+		lock_destroy(&ping_timer->slots[i].lock);
 
 	shm_free(ping_timer);
 	ping_timer=0;
@@ -189,57 +204,80 @@ void destroy_ping_timer(void)
 
 void destroy_dlg_timer(void)
 {
+	int i;
+
 	if (d_timer==0)
 		return;
 
-	lock_destroy(d_timer->lock);
-	lock_dealloc(d_timer->lock);
+	for( i=0 ; i<DLG_TIMER_SHARDS ; i++ )
+		lock_destroy(&d_timer->shards[i].lock);
 
 	shm_free(d_timer);
 	d_timer = 0;
 }
 
 
+/* number of dialogs currently waiting in the lifetime timer */
+unsigned long get_dlg_timer_backlog(void)
+{
+	unsigned long n = 0;
+	int i;
 
-static inline void insert_dlg_timer_unsafe(struct dlg_tl *tl)
+	if (d_timer==0)
+		return 0;
+
+	for( i=0 ; i<DLG_TIMER_SHARDS ; i++ )
+		n += d_timer->shards[i].count;
+
+	return n;
+}
+
+
+static inline void insert_dlg_timer_unsafe(struct dlg_timer_shard *shard,
+															struct dlg_tl *tl)
 {
-	struct dlg_tl* ptr;
+	struct dlg_tl* head;
+	unsigned int tick;
+
+	/* a timeout already covered by the timer routine goes into the
+	 * first slot to be processed */
+	tick = ((int)(tl->timeout - shard->last) > 0) ?
+		tl->timeout : shard->last+1;
+	head = &shard->slots[tick & DLG_TIMER_WHEEL_MASK];
 
 #ifdef EXTRA_DEBUG
-	debug_main_timer_list();
+	debug_main_timer_list(head);
 #endif
 
-	for(ptr = d_timer->first.prev; ptr != &d_timer->first ; ptr = ptr->prev) {
-		if ( ptr->timeout <= tl->timeout )
-			break;
-	}
-
 	LM_DBG("inserting %p for %d\n", tl,tl->timeout);
-	tl->prev = ptr;
-	tl->next = ptr->next;
+	tl->prev = head->prev;
+	tl->next = head;
 	tl->prev->next = tl;
 	tl->next->prev = tl;
+	shard->count++;
 
 #ifdef EXTRA_DEBUG
-	debug_main_timer_list();
+	debug_main_timer_list(head);
 #endif
 }
 
 int insert_dlg_timer(struct dlg_tl *tl, int interval)
 {
-	lock_get( d_timer->lock);
+	struct dlg_timer_shard *shard = dlg_timer_shard(tl);
+
+	lock_get( &shard->lock);
 
 	if (tl->next!=0 || tl->prev!=0) {
-		lock_release( d_timer->lock);
+		lock_release( &shard->lock);
 		LM_CRIT("Trying to insert a bogus dlg tl=%p tl->next=%p tl->prev=%p\n",
 			tl, tl->next, tl->prev);
 		return -1;
 	}
 	tl->timeout = get_ticks()+interval;
 
-	insert_dlg_timer_unsafe( tl );
+	insert_dlg_timer_unsafe( shard, tl );
 
-	lock_release( d_timer->lock);
+	lock_release( &shard->lock);
 
 	return 0;
 }
@@ -247,6 +285,7 @@ int insert_dlg_timer(struct dlg_tl *tl, int interval)
 int insert_ping_timer(struct dlg_cell* dlg)
 {
 	struct dlg_ping_list *node;
+	struct dlg_ping_slot *slot;
 
 	node = shm_malloc(sizeof(struct dlg_ping_list));
 	if (node == 0) {
@@ -257,41 +296,43 @@ int insert_ping_timer(struct dlg_cell* dlg)
 	node->dlg = dlg;
 	node->next = 0;
 	node->prev = 0;
+	/* first ping after a whole interval; as dialogs are created at
+	 * different moments, the pings end up evenly spread over the slots */
+	node->slot = ping_timer->last % ping_timer->size;
+	slot = &ping_timer->slots[node->slot];
 
-	lock_get( ping_timer->lock );
+	lock_get( &slot->lock );
 
 	dlg->pl = node;
 
-	if (ping_timer->first == 0)
-		ping_timer->first = node;
+	if (slot->first == 0)
+		slot->first = node;
 	else {
-		node->next = ping_timer->first;
-		ping_timer->first->prev = node;
-		ping_timer->first = node;
+		node->next = slot->first;
+		slot->first->prev = node;
+		slot->first = node;
 	}
 
 	dlg->legs[DLG_CALLER_LEG].reply_received = 1;
 	dlg->legs[callee_idx(dlg)].reply_received = 1;
 
 
-	lock_release( ping_timer->lock);
-	LM_DBG("Inserted dlg [%p] in ping timer list\n",dlg);
+	lock_release( &slot->lock);
+	LM_DBG("Inserted dlg [%p] in ping timer slot %u\n",dlg,node->slot);
 
 	return 0;
 }
 
-static inline void remove_dlg_timer_unsafe(struct dlg_tl *tl)
+static inline void remove_dlg_timer_unsafe(struct dlg_timer_shard *shard,
+															struct dlg_tl *tl)
 {
 #ifdef EXTRA_DEBUG
-	debug_main_timer_list();
+	debug_main_timer_list(tl);
 #endif
 
 	tl->prev->next = tl->next;
 	tl->next->prev = tl->prev;
-
-#ifdef EXTRA_DEBUG
-	debug_main_timer_list();
-#endif
+	shard->count--;
 }
 
 
@@ -303,34 +344,37 @@ static inline void remove_dlg_timer_unsafe(struct dlg_tl *tl)
  */
 int remove_dlg_timer(struct dlg_tl *tl)
 {
-	lock_get( d_timer->lock);
+	struct dlg_timer_shard *shard = dlg_timer_shard(tl);
+
+	lock_get( &shard->lock);
 
 	if (tl->prev==NULL && tl->timeout==0) {
 		/* dialog is not in timer list; either it is completly removed
 		   (prev=next=timeout=0), either is in process by timeout routine
 		   (prev=timeout=0;next!=0) */
-		lock_release( d_timer->lock);
+		lock_release( &shard->lock);
 		return 1;
 	}
 
 	if (tl->prev==NULL || tl->next==NULL || tl->next == FAKE_DIALOG_TL) {
 		LM_CRIT("bogus tl=%p tl->prev=%p tl->next=%p\n",
 			tl, tl->prev, tl->next);
-		lock_release( d_timer->lock);
+		lock_release( &shard->lock);
 		return -1;
 	}
 
-	remove_dlg_timer_unsafe(tl);
+	remove_dlg_timer_unsafe(shard, tl);
 	/* mark that this dialog was one a part of the timer list */
 	tl->next = FAKE_DIALOG_TL;
 	tl->prev = NULL;
 	tl->timeout = 0;
 
-	lock_release( d_timer->lock);
+	lock_release( &shard->lock);
 	return 0;
 }
 
-static inline void detach_node_unsafe(struct dlg_ping_list *it)
+static inline void detach_node_unsafe(struct dlg_ping_slot *slot,
+												struct dlg_ping_list *it)
 {
 	if (it->next && it->prev) {
 		it->prev->next = it->next;
@@ -338,13 +382,13 @@ static inline void detach_node_unsafe(struct dlg_ping_list *it)
 	}
 	else if (it->next) {
 		it->next->prev = 0;
-		ping_timer->first = it->next;
+		slot->first = it->next;
 	}
 	else if (it->prev) {
 		it->prev->next = 0;
 	}
 	else
-		ping_timer->first = 0;
+		slot->first = 0;
 
 	it->next = it->prev = 0;
 }
@@ -355,17 +399,27 @@ static inline void detach_node_unsafe(struct dlg_ping_list *it)
  */
 int remove_ping_timer(struct dlg_cell *dlg)
 {
-	lock_get(ping_timer->lock);
+	struct dlg_ping_list *pl;
+	struct dlg_ping_slot *slot;
+
+	/* the slot of a node never changes, so it is safe to find it
+	 * before locking; dlg->pl is re-checked under the lock */
+	pl = dlg->pl;
+	if (pl == 0)
+		return 1;
+	slot = &ping_timer->slots[pl->slot];
+
+	lock_get(&slot->lock);
 	if (dlg->pl)
 	{
-		detach_node_unsafe(dlg->pl);
+		detach_node_unsafe(slot, dlg->pl);
 		shm_free(dlg->pl);
 		dlg->pl = 0;
-		lock_release(ping_timer->lock);
+		lock_release(&slot->lock);
 		return 0;
 	}
 
-	lock_release(ping_timer->lock);
+	lock_release(&slot->lock);
 	return 1;
 }
 
@@ -374,77 +428,72 @@ int remove_ping_timer(struct dlg_cell *dlg)
     -1 - failure (dialog is expired, so it cannot be added again) */
 int update_dlg_timer( struct dlg_tl *tl, int timeout )
 {
-	lock_get( d_timer->lock);
+	struct dlg_timer_shard *shard = dlg_timer_shard(tl);
+
+	lock_get( &shard->lock);
 
 	if ( tl->next == FAKE_DIALOG_TL ) {
 		/* previously removed from timer list - we will not add it again */
-		lock_release( d_timer->lock);
+		lock_release( &shard->lock);
 		return 0;
 	}
 
 	if ( tl->next ) {
 		if (tl->prev==0) {
-			lock_release( d_timer->lock);
+			lock_release( &shard->lock);
 			return -1;
 		}
-		remove_dlg_timer_unsafe(tl);
+		remove_dlg_timer_unsafe(shard, tl);
 	}
 
 	tl->timeout = get_ticks()+timeout;
-	insert_dlg_timer_unsafe( tl );
+	insert_dlg_timer_unsafe( shard, tl );
 
-	lock_release( d_timer->lock);
+	lock_release( &shard->lock);
 	return 0;
 }
 
-static inline struct dlg_tl* get_expired_dlgs(unsigned int time)
+/* detaches all the expired dialogs of a shard and links them into the
+ * 'ret' list (linked via next, prev and timeout being zeroed) */
+static inline struct dlg_tl* get_expired_dlgs(struct dlg_timer_shard *shard,
+									unsigned int time, struct dlg_tl *ret)
 {
-	struct dlg_tl *tl , *end, *ret;
+	struct dlg_tl *tl, *next, *head;
+	unsigned int tick;
 
-	lock_get( d_timer->lock);
+	lock_get( &shard->lock);
 
-	if (d_timer->first.next==&(d_timer->first)
-	|| d_timer->first.next->timeout > time ) {
-		lock_release( d_timer->lock);
-		return FAKE_DIALOG_TL;
-	}
+	/* if the timer routine lagged more than a whole round, one pass over
+	 * all the slots is enough */
+	tick = shard->last;
+	if ((int)(time - tick) > DLG_TIMER_WHEEL_SIZE)
+		tick = time - DLG_TIMER_WHEEL_SIZE;
+
+	while ((int)(time - tick) > 0) {
+		tick++;
+		head = &shard->slots[tick & DLG_TIMER_WHEEL_MASK];
 
 #ifdef EXTRA_DEBUG
-	debug_main_timer_list();
+		debug_main_timer_list(head);
 #endif
 
-	end = &d_timer->first;
-	tl = d_timer->first.next;
-	LM_DBG("start with tl=%p tl->prev=%p tl->next=%p (%d) at %d "
-		"and end with end=%p end->prev=%p end->next=%p\n",
-		tl,tl->prev,tl->next,tl->timeout,time,
-		end,end->prev,end->next);
-	while( tl!=end && tl->timeout <= time) {
-		LM_DBG("getting tl=%p tl->prev=%p tl->next=%p with %d\n",
-			tl,tl->prev,tl->next,tl->timeout);
-		tl->prev = 0;
-		tl->timeout = 0;
-		tl=tl->next;
-	}
-	LM_DBG("end with tl=%p tl->prev=%p tl->next=%p and "
-		"d_timer->first.next->prev=%p\n",
-		tl,tl->prev,tl->next,d_timer->first.next->prev);
-
-	if (tl==end && d_timer->first.next->prev) {
-		LM_DBG("no dialog to return\n");
-		ret = FAKE_DIALOG_TL;
-	} else {
-		ret = d_timer->first.next;
-		tl->prev->next = FAKE_DIALOG_TL;
-		d_timer->first.next = tl;
-		tl->prev = &d_timer->first;
+		for( tl=head->next ; tl!=head ; tl=next ) {
+			next = tl->next;
+			/* later rounds stay in the slot */
+			if ((int)(tl->timeout - time) > 0)
+				continue;
+			LM_DBG("getting tl=%p tl->prev=%p tl->next=%p with %d\n",
+				tl,tl->prev,tl->next,tl->timeout);
+			remove_dlg_timer_unsafe(shard, tl);
+			tl->prev = 0;
+			tl->timeout = 0;
+			tl->next = ret;
+			ret = tl;
+		}
 	}
+	shard->last = time;
 
-#ifdef EXTRA_DEBUG
-	debug_main_timer_list();
-#endif
-
-	lock_release( d_timer->lock);
+	lock_release( &shard->lock);
 
 #ifdef EXTRA_DEBUG
 	debug_detached_timer_list(ret);
@@ -455,31 +504,34 @@ static inline struct dlg_tl* get_expired_dlgs(unsigned int time)
 void dlg_timer_routine(unsigned int ticks , void * attr)
 {
 	struct dlg_tl *tl, *ctl;
-
-	tl = get_expired_dlgs( ticks );
-
-	while (tl != FAKE_DIALOG_TL) {
-		ctl = tl;
-		tl = tl->next;
-		/* keep dialog as expired (next is still set) */
-		ctl->next = FAKE_DIALOG_TL;
-		LM_DBG("tl=%p next=%p\n", ctl, tl);
-		timer_hdl( ctl );
+	int i;
+
+	for( i=0 ; i<DLG_TIMER_SHARDS ; i++ ) {
+		tl = get_expired_dlgs( &d_timer->shards[i], ticks, FAKE_DIALOG_TL);
+
+		while (tl != FAKE_DIALOG_TL) {
+			ctl = tl;
+			tl = tl->next;
+			/* keep dialog as expired (next is still set) */
+			ctl->next = FAKE_DIALOG_TL;
+			LM_DBG("tl=%p next=%p\n", ctl, tl);
+			timer_hdl( ctl );
+		}
 	}
 }
 
-/* removes expired dlgs from main ping_timer list
+/* removes expired dlgs from a ping_timer slot
  * and links them back into a new list */
-void get_timeout_dlgs(struct dlg_ping_list **expired,
-					struct dlg_ping_list **to_be_deleted)
+void get_timeout_dlgs(struct dlg_ping_slot *slot,
+		struct dlg_ping_list **expired, struct dlg_ping_list **to_be_deleted)
 {
 	struct dlg_ping_list *exp = NULL,*del=NULL,*it=NULL,*next=NULL;
 	struct dlg_cell *current;
 	int detached;
 
-	lock_get(ping_timer->lock);
+	lock_get(&slot->lock);
 
-	for (it=ping_timer->first;it;it=next) {
+	for (it=slot->first;it;it=next) {
 		current = it->dlg;
 		next = it->next;
 		detached = 0;
@@ -487,7 +539,7 @@ void get_timeout_dlgs(struct dlg_ping_list **expired,
 		if (current->state == DLG_STATE_DELETED) {
 			/* the dialog has terminated - we remove it as well
 			 * since we also have a ref */
-			detach_node_unsafe(it);
+			detach_node_unsafe(slot, it);
 			it->dlg->pl = 0;
 
 			if (del == NULL)
@@ -502,7 +554,7 @@ void get_timeout_dlgs(struct dlg_ping_list **expired,
 
 		if (current->flags & DLG_FLAG_PING_CALLER) {
 			if (current->legs[DLG_CALLER_LEG].reply_received == 0) {
-				detach_node_unsafe(it);
+				detach_node_unsafe(slot, it);
 				detached=1;
 				it->dlg->pl = 0;
 
@@ -518,7 +570,7 @@ void get_timeout_dlgs(struct dlg_ping_list **expired,
 		if (detached == 0) {
 			if (current->flags & DLG_FLAG_PING_CALLEE) {
 				if (current->legs[callee_idx(current)].reply_received == 0) {
-					detach_node_unsafe(it);
+					detach_node_unsafe(slot, it);
 					it->dlg->pl = 0;
 
 					if (exp == NULL)
@@ -532,7 +584,7 @@ void get_timeout_dlgs(struct dlg_ping_list **expired,
 		}
 	}
 
-	lock_release(ping_timer->lock);
+	lock_release(&slot->lock);
 
 	*to_be_deleted = del;
 	*expired = exp;
@@ -636,12 +688,12 @@ void unref_dlg_cb(void *dlg)
 	unref_dlg((struct dlg_cell*)dlg,1);
 }
 
-void dlg_ping_routine(unsigned int ticks , void * attr)
+static void dlg_ping_slot(struct dlg_ping_slot *slot)
 {
 	struct dlg_ping_list *expired,*to_be_deleted,*it,*curr;
 	struct dlg_cell *dlg;
 
-	get_timeout_dlgs(&expired,&to_be_deleted);
+	get_timeout_dlgs(slot, &expired, &to_be_deleted);
 
 	it = expired;
 	while (it) {
@@ -674,8 +726,8 @@ void dlg_ping_routine(unsigned int ticks , void * attr)
 
 	tcp_no_new_conn = 1;
 
-	/* ping_timer->first now contains all active dialogs */
-	it = ping_timer->first;
+	/* slot->first now contains all active dialogs of this slot */
+	it = slot->first;
 	while (it) {
 		dlg = it->dlg;
 
@@ -706,3 +758,21 @@ void dlg_ping_routine(unsigned int ticks , void * attr)
 
 	tcp_no_new_conn = 0;
 }
+
+/* runs every second and pings the dialogs of the slot(s) due since the
+ * previous run */
+void dlg_ping_routine(unsigned int ticks , void * attr)
+{
+	unsigned int tick;
+
+	tick = ping_timer->last;
+	if ((int)(ticks - tick) > (int)ping_timer->size)
+		tick = ticks - ping_timer->size;
+
+	while ((int)(ticks - tick) > 0) {
+		tick++;
+		dlg_ping_slot(&ping_timer->slots[tick % ping_timer->size]);
+	}
+
+	ping_timer->last = ticks;
+}
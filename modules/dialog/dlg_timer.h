@@ -41,10 +41,24 @@ struct dlg_tl
 };
 
 
+/* the lifetime timer is a hashed timing wheel with one slot per second;
+ * timeouts further than the wheel size simply stay in their slot for
+ * several rounds. To reduce contention, the dialogs are spread over
+ * several independent wheels (shards), each with its own lock */
+#define DLG_TIMER_WHEEL_SIZE  1024
+#define DLG_TIMER_SHARDS      16
+
+struct dlg_timer_shard
+{
+	struct dlg_tl   slots[DLG_TIMER_WHEEL_SIZE];
+	gen_lock_t      lock;
+	unsigned int    last;     /* last tick processed for this shard */
+	unsigned int    count;    /* dialogs currently in this shard */
+};
+
 struct  dlg_timer
 {
-	struct dlg_tl   first;
-	gen_lock_t      *lock;
+	struct dlg_timer_shard shards[DLG_TIMER_SHARDS];
 };
 
 struct dlg_ping_list
@@ -52,19 +66,30 @@ struct dlg_ping_list
 	struct dlg_cell* dlg;
 	struct dlg_ping_list *next;
 	struct dlg_ping_list *prev;
+	unsigned int slot;
 };
 
-struct dlg_ping_timer
+/* the ping timer is a wheel with one slot per second of the ping interval;
+ * each second only the dialogs of one slot are pinged, so the pings are
+ * spread over the whole interval instead of being sent in bursts */
+struct dlg_ping_slot
 {
 	struct dlg_ping_list *first;
-	gen_lock_t *lock;
+	gen_lock_t lock;
+};
+
+struct dlg_ping_timer
+{
+	unsigned int size;
+	unsigned int last;
+	struct dlg_ping_slot *slots;
 };
 
 typedef void (*dlg_timer_handler)(struct dlg_tl *);
 
 int init_dlg_timer( dlg_timer_handler );
 
-int init_dlg_ping_timer();
+int init_dlg_ping_timer(int interval);
 
 void destroy_dlg_timer();
 
@@ -84,4 +109,6 @@ void dlg_timer_routine(unsigned int ticks , void * attr);
 
 void dlg_ping_routine(unsigned int ticks , void * attr);
 
+unsigned long get_dlg_timer_backlog(void);
+
 #endif
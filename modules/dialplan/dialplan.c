@@ -721,9 +721,9 @@ static int dp_translate_f(struct sip_msg *msg, char *str1, char *str2,
 	connection = id_par->hash;
 
 	/* ref the data for reading */
-	lock_start_read( connection->ref_lock );
+	rcu_read_lock();
 
-	if ((idp = select_dpid(connection, dpid, connection->crt_index)) == 0) {
+	if ((idp = select_dpid(rcu_dereference(connection->hash), dpid)) == 0) {
 		LM_DBG("no information available for dpid %i\n", dpid);
 		goto error;
 	}
@@ -747,7 +747,7 @@ static int dp_translate_f(struct sip_msg *msg, char *str1, char *str2,
 	}
 
 	/* we are done reading -> unref the data */
-	lock_stop_read( connection->ref_lock );
+	rcu_read_unlock();
 
 	if (attr_spec) {
 		pval.flags = PV_VAL_STR;
@@ -764,7 +764,7 @@ static int dp_translate_f(struct sip_msg *msg, char *str1, char *str2,
 
 error:
 	/* we are done reading -> unref the data */
-	lock_stop_read( connection->ref_lock );
+	rcu_read_unlock();
 
 	return -1;
 }
@@ -1176,22 +1176,22 @@ static struct mi_root * mi_translate(struct mi_root *cmd, void *param)
 	}
 
 	/* ref the data for reading */
-	lock_start_read( connection->ref_lock );
+	rcu_read_lock();
 
-	if ((idp = select_dpid(connection, dpid, connection->crt_index)) ==0 ){
+	if ((idp = select_dpid(rcu_dereference(connection->hash), dpid)) ==0 ){
 		LM_ERR("no information available for dpid %i\n", dpid);
-		lock_stop_read( connection->ref_lock );
+		rcu_read_unlock();
 		return init_mi_tree(404, "No information available for dpid", 33);
 	}
 
 	if (translate(NULL, input, &output, idp, &attrs)!=0){
 		LM_DBG("could not translate %.*s with dpid %i\n",
 			input.len, input.s, idp->dp_id);
-		lock_stop_read( connection->ref_lock );
+		rcu_read_unlock();
 		return init_mi_tree(404, "No translation", 14);
 	}
 	/* we are done reading -> unref the data */
-	lock_stop_read( connection->ref_lock );
+	rcu_read_unlock();
 
 	LM_DBG("input %.*s with dpid %i => output %.*s\n",
 			input.len, input.s, idp->dp_id, output.len, output.s);
@@ -27,6 +27,7 @@
 
 #include "../../parser/msg_parser.h"
 #include "../../rw_locking.h"
+#include "../../rcu.h"
 #include "../../time_rec.h"
 
 #include "../../db/db.h"
@@ -37,7 +38,9 @@
 #define EQUAL_OP	0
 
 #define DP_CASE_INSENSITIVE		1
-#define DP_INDEX_HASH_SIZE		16
+#define DP_INDEX_HASH_SIZE		16	/* initial number of string buckets */
+#define DP_INDEX_HASH_MAX		(1<<16)
+#define DP_REGEX_SET_MAX		256	/* max rules matched by one pcre */
 
 typedef struct dpl_node{
 	int dpid;
@@ -63,25 +66,37 @@ typedef struct dpl_index{
 
 }dpl_index_t, *dpl_index_p;
 
+/* consecutive (by priority) regexp rules of a DPID, matched in a single
+   pass by the union of their expressions - the first rule to match is
+   given by the mark of the matching alternative */
+typedef struct dpl_regex_set{
+	pcre * comp; /*NULL if the set has a single rule, use its own pattern*/
+	int rule_no;
+	dpl_node_t ** rules;
+	struct dpl_regex_set * next;
+}dpl_regex_set_t, *dpl_regex_set_p;
+
 /*For every DPID*/
 typedef struct dpl_id{
 	int dp_id;
+	int hash_size;/*number of string buckets, the regexps are at hash_size*/
 	dpl_index_t* rule_hash;/*fast access :string rules are hashed*/
+	dpl_regex_set_t * regex_sets;/*the regexp rules, in priority order*/
 	struct dpl_id * next;
 }dpl_id_t,*dpl_id_p;
 
 typedef struct dp_connection_list {
 
-	dpl_id_t *hash[2];
+	dpl_id_t *hash;      /* current rules, read inside rcu sections */
 	str table_name;
 	str partition;
 	str db_url;
-	int crt_index, next_index;
+	int ongoing_reload;
 
 	db_con_t** dp_db_handle;
 	db_func_t dp_dbf;
 
-	rw_lock_t *ref_lock;
+	rw_lock_t *ref_lock;  /* serializes the reloads */
 
 	struct dp_connection_list * next;
 } dp_connection_list_t, *dp_connection_list_p;
@@ -113,13 +128,14 @@ int dp_load_db(dp_connection_list_p dp_table);
 int dp_load_all_db(void);
 void dp_disconnect_all_db(void);
 
-dpl_id_p select_dpid(dp_connection_list_p table, int id, int index);
+dpl_id_p select_dpid(dpl_id_p hash, int id);
 
 struct subst_expr* repl_exp_parse(str subst);
 void repl_expr_free(struct subst_expr *se);
 int translate(struct sip_msg *msg, str user_name, str* repl_user, dpl_id_p idp, str *);
 int rule_translate(struct sip_msg *msg, str , dpl_node_t * rule,  str *);
 int test_match(str string, pcre * exp, int * out, int out_max);
+dpl_node_t * match_regex_set(str string, dpl_regex_set_t * set);
 
 
 typedef void * (*func_malloc)(size_t );
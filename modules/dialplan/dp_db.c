@@ -24,6 +24,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 
 #include "../../dprint.h"
 #include "../../ut.h"
@@ -60,12 +61,15 @@ str timerec_column              =   str_init(TIMEREC_COL);
 
 void destroy_rule(dpl_node_t * rule);
 void destroy_hash(dpl_id_t **rules_hash);
+static void dp_free_hash(void *hash);
 
 dpl_node_t * build_rule(db_val_t * values);
-int add_rule2hash(dpl_node_t * rule, dp_connection_list_t *table, int index);
+int add_rule2hash(dpl_node_t * rule, dpl_id_p *hash);
+static int resize_dpid_hash(dpl_id_p idp);
+static int build_regex_sets(dpl_id_p idp);
 
 void list_rule(dpl_node_t * );
-void list_hash(dpl_id_t * , rw_lock_t *);
+void list_hash(dpl_id_t *);
 
 
 dp_connection_list_p dp_conns = NULL;
@@ -191,8 +195,7 @@ void destroy_data(void)
 
 	LM_DBG("Destroying data\n");
 	for (el = dp_conns; el && (next = el->next, 1); el = next) {
-		destroy_hash(&el->hash[0]);
-		destroy_hash(&el->hash[1]);
+		destroy_hash(&el->hash);
 		lock_destroy_rw(el->ref_lock);
 
 		shm_free(el);
@@ -238,20 +241,21 @@ int dp_load_db(dp_connection_list_p dp_conn)
 	db_val_t cond_val[1];
 
 	dpl_node_t *rule;
+	dpl_id_p new_hash = NULL, old_hash, crt_idp;
 	int no_rows = 10;
 
 
-	lock_start_write( dp_conn->ref_lock );
+	lock_get( dp_conn->ref_lock->lock );
 
-	if( dp_conn->crt_index != dp_conn->next_index){
+	if( dp_conn->ongoing_reload ){
 		LM_WARN("a load command already generated, aborting reload...\n");
-		lock_stop_write( dp_conn->ref_lock );
+		lock_release( dp_conn->ref_lock->lock );
 		return 0;
 	}
 
-	dp_conn->next_index = dp_conn->crt_index == 0 ? 1 : 0;
+	dp_conn->ongoing_reload = 1;
 
-	lock_stop_write( dp_conn->ref_lock );
+	lock_release( dp_conn->ref_lock->lock );
 
 	if (dp_conn->dp_dbf.use_table(*dp_conn->dp_db_handle, &dp_conn->table_name) < 0){
 		LM_ERR("error in use_table\n");
@@ -313,7 +317,7 @@ int dp_load_db(dp_connection_list_p dp_conn)
 
 			rule->table_id = i;
 
-			if(add_rule2hash(rule , dp_conn, dp_conn->next_index) != 0) {
+			if(add_rule2hash(rule , &new_hash) != 0) {
 				LM_ERR("add_rule2hash failed\n");
 				goto err2;
 			}
@@ -335,43 +339,40 @@ int dp_load_db(dp_connection_list_p dp_conn)
 
 
 end:
+	/* final layout of the rules, now that all of them are known */
+	for (crt_idp = new_hash; crt_idp; crt_idp = crt_idp->next) {
+		if (resize_dpid_hash(crt_idp) != 0 || build_regex_sets(crt_idp) != 0) {
+			LM_ERR("failed to index the rules of dpid %d\n", crt_idp->dp_id);
+			dp_conn->dp_dbf.free_result(*dp_conn->dp_db_handle, res);
+			goto err1;
+		}
+	}
 
+	/*update data - the readers are not blocked, the ones still using
+	 * the old rules keep them until they leave their read section */
+	old_hash = dp_conn->hash;
+	rcu_assign_pointer(dp_conn->hash, new_hash);
+	rcu_retire(old_hash, dp_free_hash);
 
-	/*update data*/
-	lock_start_write( dp_conn->ref_lock );
-
-	destroy_hash(&dp_conn->hash[dp_conn->crt_index]);
-
-	dp_conn->crt_index = dp_conn->next_index;
-
-	lock_stop_write( dp_conn->ref_lock );
+	list_hash(new_hash);
 
-	list_hash(dp_conn->hash[dp_conn->crt_index], dp_conn->ref_lock);
+	dp_conn->ongoing_reload = 0;
 
 	dp_conn->dp_dbf.free_result(*dp_conn->dp_db_handle, res);
 	return 0;
 
 err1:
-
-	lock_start_write( dp_conn->ref_lock );
-
-	dp_conn->next_index = dp_conn->crt_index;
-
-	lock_stop_write( dp_conn->ref_lock );
+	destroy_hash(&new_hash);
+	dp_conn->ongoing_reload = 0;
 
 	return -1;
 
 err2:
 	if(rule)	destroy_rule(rule);
-	destroy_hash(&dp_conn->hash[dp_conn->next_index]);
+	destroy_hash(&new_hash);
 	dp_conn->dp_dbf.free_result(*dp_conn->dp_db_handle, res);
 
-	lock_start_write( dp_conn->ref_lock );
-
-	dp_conn->next_index = dp_conn->crt_index;
-	/* if lock defined - release the exclusive writing access */
-
-	lock_stop_write( dp_conn->ref_lock );
+	dp_conn->ongoing_reload = 0;
 	return -1;
 }
 
@@ -579,20 +580,20 @@ err:
 }
 
 
-int add_rule2hash(dpl_node_t * rule, dp_connection_list_t *conn, int index)
+int add_rule2hash(dpl_node_t * rule, dpl_id_p *hash)
 {
 	dpl_id_p crt_idp;
 	dpl_index_p indexp;
 	int new_id, bucket = 0;
 
-	if(!conn){
+	if(!hash){
 		LM_ERR("data not allocated\n");
 		return -1;
 	}
 
 	new_id = 0;
 
-	crt_idp = select_dpid(conn, rule->dpid, index);
+	crt_idp = select_dpid(*hash, rule->dpid);
 	/*didn't find a dpl_id*/
 	if(!crt_idp){
 		crt_idp = shm_malloc(sizeof(dpl_id_t) + (DP_INDEX_HASH_SIZE+1) * sizeof(dpl_index_t));
@@ -602,6 +603,7 @@ int add_rule2hash(dpl_node_t * rule, dp_connection_list_t *conn, int index)
 		}
 		memset(crt_idp, 0, sizeof(dpl_id_t) + (DP_INDEX_HASH_SIZE+1) * sizeof(dpl_index_t));
 		crt_idp->dp_id = rule->dpid;
+		crt_idp->hash_size = DP_INDEX_HASH_SIZE;
 		crt_idp->rule_hash = (dpl_index_t*)(crt_idp + 1);
 		new_id = 1;
 		LM_DBG("new dpl_id %i\n", rule->dpid);
@@ -609,11 +611,11 @@ int add_rule2hash(dpl_node_t * rule, dp_connection_list_t *conn, int index)
 
 	switch (rule->matchop) {
 		case REGEX_OP:
-			indexp = &crt_idp->rule_hash[DP_INDEX_HASH_SIZE];
+			indexp = &crt_idp->rule_hash[crt_idp->hash_size];
 			break;
 
 		case EQUAL_OP:
-			bucket = core_case_hash(&rule->match_exp, NULL, DP_INDEX_HASH_SIZE);
+			bucket = core_case_hash(&rule->match_exp, NULL, crt_idp->hash_size);
 
 			indexp = &crt_idp->rule_hash[bucket];
 			break;
@@ -636,12 +638,12 @@ int add_rule2hash(dpl_node_t * rule, dp_connection_list_t *conn, int index)
 	indexp->last_rule = rule;
 
 	if(new_id){
-		crt_idp->next = conn->hash[conn->next_index];
-		conn->hash[conn->next_index] = crt_idp;
+		crt_idp->next = *hash;
+		*hash = crt_idp;
 	}
 	LM_DBG("added the rule id %i pr %i next %p to the "
 		" %i bucket\n", rule->dpid,
-		rule->pr, rule->next, rule->matchop == REGEX_OP ? DP_INDEX_HASH_SIZE : bucket);
+		rule->pr, rule->next, rule->matchop == REGEX_OP ? crt_idp->hash_size : bucket);
 
 	return 0;
 
@@ -652,11 +654,266 @@ err:
 }
 
 
+/* spreads the string rules of a DPID over a number of buckets that fits
+ * their count (keeping their order), as the initial ones may be too few */
+static int resize_dpid_hash(dpl_id_p idp)
+{
+	dpl_index_p new_hash, indexp;
+	dpl_node_p rulep, next;
+	int i, size, bucket, rule_no;
+
+	for (i = 0, rule_no = 0; i < idp->hash_size; i++)
+		for (rulep = idp->rule_hash[i].first_rule; rulep; rulep = rulep->next)
+			rule_no++;
+
+	for (size = idp->hash_size; size < rule_no && size < DP_INDEX_HASH_MAX;
+	size <<= 1);
+	if (size == idp->hash_size)
+		return 0;
+
+	new_hash = shm_malloc((size+1) * sizeof(dpl_index_t));
+	if (!new_hash) {
+		LM_ERR("out of shm memory (rule hash)\n");
+		return -1;
+	}
+	memset(new_hash, 0, (size+1) * sizeof(dpl_index_t));
+
+	/* the rules were added in priority order, so re-adding them bucket
+	 * by bucket keeps this order inside each new bucket */
+	for (i = 0; i < idp->hash_size; i++) {
+		for (rulep = idp->rule_hash[i].first_rule; rulep; rulep = next) {
+			next = rulep->next;
+			bucket = core_case_hash(&rulep->match_exp, NULL, size);
+			indexp = &new_hash[bucket];
+			rulep->next = NULL;
+			if (indexp->last_rule)
+				indexp->last_rule->next = rulep;
+			else
+				indexp->first_rule = rulep;
+			indexp->last_rule = rulep;
+		}
+	}
+	new_hash[size] = idp->rule_hash[idp->hash_size];
+
+	if (idp->rule_hash != (dpl_index_t*)(idp + 1))
+		shm_free(idp->rule_hash);
+	idp->rule_hash = new_hash;
+	idp->hash_size = size;
+
+	LM_DBG("dpid %d: %d string rules in %d buckets\n",
+		idp->dp_id, rule_no, size);
+	return 0;
+}
+
+
+/* tells if a regexp may be put in a union with others - its meaning must
+ * not depend on its group numbers or names, and it must not use verbs
+ * (they are used for marking the alternatives) or the extended syntax */
+static int regex_combinable(str *exp)
+{
+	char *s = exp->s;
+	int i, j, len = exp->len;
+
+	for (i = 0; i < len; i++) {
+		if (s[i] == '\\') {
+			if (++i == len)
+				return 0;
+			/* back references, quoting */
+			if ((s[i] >= '1' && s[i] <= '9') || s[i] == 'g' || s[i] == 'k' ||
+			s[i] == 'Q' || s[i] == 'E')
+				return 0;
+			continue;
+		}
+		if (s[i] != '(' || i + 1 == len)
+			continue;
+		if (s[i+1] == '*')
+			return 0;
+		if (s[i+1] != '?')
+			continue;
+		if (i + 2 == len)
+			return 0;
+		switch (s[i+2]) {
+			case ':': case '=': case '!': case '>': case '|':
+				continue;
+			case '<':
+				if (i + 3 < len && (s[i+3] == '=' || s[i+3] == '!'))
+					continue;
+				return 0;
+		}
+		/* option settings are fine, but for the extended syntax */
+		for (j = i + 2; j < len && (isalpha((int)s[j]) || s[j] == '-'); j++)
+			if (s[j] == 'x')
+				return 0;
+		if (j == i + 2 || j == len || (s[j] != ')' && s[j] != ':'))
+			return 0;
+	}
+
+	return 1;
+}
+
+
+/* tells if a regexp may only match at the start of the input */
+static int regex_anchored(str *exp)
+{
+	char *s = exp->s;
+	int i, depth, len = exp->len;
+
+	if (len == 0 || s[0] != '^')
+		return 0;
+
+	/* any top level alternative may not be anchored */
+	for (i = 1, depth = 0; i < len; i++) {
+		switch (s[i]) {
+			case '\\':
+				i++;
+				break;
+			case '[':
+				/* a ']' right at the start of a class is a literal one */
+				if (i + 1 < len && s[i+1] == '^')
+					i++;
+				for (i += 2; i < len && s[i] != ']'; i++)
+					if (s[i] == '\\')
+						i++;
+				break;
+			case '(':
+				depth++;
+				break;
+			case ')':
+				depth--;
+				break;
+			case '|':
+				if (depth == 0)
+					return 0;
+				break;
+		}
+	}
+
+	return 1;
+}
+
+
+static dpl_regex_set_p new_regex_set(dpl_node_t **rules, int rule_no,
+															pcre *comp)
+{
+	dpl_regex_set_p set;
+
+	set = shm_malloc(sizeof(dpl_regex_set_t) + rule_no * sizeof(dpl_node_t*));
+	if (!set) {
+		LM_ERR("out of shm memory (regex set)\n");
+		return NULL;
+	}
+	memset(set, 0, sizeof(dpl_regex_set_t));
+	set->comp = comp;
+	set->rule_no = rule_no;
+	set->rules = (dpl_node_t**)(set + 1);
+	memcpy(set->rules, rules, rule_no * sizeof(dpl_node_t*));
+
+	return set;
+}
+
+
+/* builds the sets for @rule_no combinable rules and links them at @tail;
+ * if the union cannot be compiled, the rules are split in halves */
+static int add_regex_sets(dpl_node_t **rules, int rule_no,
+													dpl_regex_set_p **tail)
+{
+	dpl_regex_set_p set;
+	pcre *comp;
+	char *pattern, *p;
+	int i, len;
+
+	comp = NULL;
+	if (rule_no > 1) {
+		for (i = 0, len = 1; i < rule_no; i++)
+			len += rules[i]->match_exp.len + 48;
+		pattern = pkg_malloc(len);
+		if (!pattern) {
+			LM_ERR("out of pkg memory (regex union)\n");
+			return -1;
+		}
+
+		/* each alternative is tried from the start of the input (the match
+		 * is anchored) and is marked with its index in the set */
+		p = pattern;
+		for (i = 0; i < rule_no; i++) {
+			p += sprintf(p, "%s(?:%s%s(?:", i ? "|" : "",
+				(rules[i]->match_flags & DP_CASE_INSENSITIVE) ? "(?i)" : "",
+				regex_anchored(&rules[i]->match_exp) ? "" : "(?s:.*?)");
+			memcpy(p, rules[i]->match_exp.s, rules[i]->match_exp.len);
+			p += rules[i]->match_exp.len;
+			p += sprintf(p, "))(*MARK:%d)", i);
+		}
+		*p = 0;
+
+		comp = wrap_pcre_compile(pattern, 0);
+		pkg_free(pattern);
+
+		if (!comp) {
+			LM_DBG("failed to compile the union of %d rules, splitting\n",
+				rule_no);
+			if (add_regex_sets(rules, rule_no / 2, tail) < 0)
+				return -1;
+			return add_regex_sets(rules + rule_no / 2, rule_no - rule_no / 2,
+				tail);
+		}
+	}
+
+	if ((set = new_regex_set(rules, rule_no, comp)) == NULL) {
+		if (comp)
+			wrap_pcre_free(comp);
+		return -1;
+	}
+	**tail = set;
+	*tail = &set->next;
+
+	return 0;
+}
+
+
+/* groups the regexp rules of a DPID in sets matched in a single pass;
+ * the rules with time recurrences or not combinable get their own set */
+static int build_regex_sets(dpl_id_p idp)
+{
+	dpl_node_p rulep;
+	dpl_regex_set_p *tail;
+	dpl_node_t *rules[DP_REGEX_SET_MAX];
+	int rule_no;
+
+	tail = &idp->regex_sets;
+	rule_no = 0;
+
+	for (rulep = idp->rule_hash[idp->hash_size].first_rule; rulep;
+	rulep = rulep->next) {
+		if (rulep->parsed_timerec || !regex_combinable(&rulep->match_exp)) {
+			if (rule_no && add_regex_sets(rules, rule_no, &tail) < 0)
+				return -1;
+			rule_no = 0;
+			if (add_regex_sets(&rulep, 1, &tail) < 0)
+				return -1;
+			continue;
+		}
+
+		rules[rule_no++] = rulep;
+		if (rule_no == DP_REGEX_SET_MAX) {
+			if (add_regex_sets(rules, rule_no, &tail) < 0)
+				return -1;
+			rule_no = 0;
+		}
+	}
+
+	if (rule_no && add_regex_sets(rules, rule_no, &tail) < 0)
+		return -1;
+
+	return 0;
+}
+
+
 void destroy_hash(dpl_id_t **rules_hash)
 {
 	dpl_id_p crt_idp;
 	dpl_index_p indexp;
 	dpl_node_p rulep;
+	dpl_regex_set_p set;
 	int i;
 
 	if(!rules_hash || !*rules_hash)
@@ -664,8 +921,15 @@ void destroy_hash(dpl_id_t **rules_hash)
 
 	for(crt_idp = *rules_hash; crt_idp; crt_idp = *rules_hash) {
 
+		while ((set = crt_idp->regex_sets) != NULL) {
+			crt_idp->regex_sets = set->next;
+			if (set->comp)
+				wrap_pcre_free(set->comp);
+			shm_free(set);
+		}
+
 		for (i = 0, indexp = &crt_idp->rule_hash[i];
-			 i <= DP_INDEX_HASH_SIZE;
+			 i <= crt_idp->hash_size;
 			 i++, indexp = &crt_idp->rule_hash[i]) {
 
 			for (rulep = indexp->first_rule; rulep; rulep=indexp->first_rule) {
@@ -679,6 +943,8 @@ void destroy_hash(dpl_id_t **rules_hash)
 		}
 		*rules_hash = crt_idp->next;
 
+		if (crt_idp->rule_hash != (dpl_index_t*)(crt_idp + 1))
+			shm_free(crt_idp->rule_hash);
 		shm_free(crt_idp);
 		crt_idp = NULL;
 	}
@@ -687,6 +953,14 @@ void destroy_hash(dpl_id_t **rules_hash)
 }
 
 
+static void dp_free_hash(void *hash)
+{
+	dpl_id_p rules_hash = (dpl_id_p)hash;
+
+	destroy_hash(&rules_hash);
+}
+
+
 void destroy_rule(dpl_node_t * rule){
 
 	if(!rule)
@@ -725,14 +999,11 @@ void destroy_rule(dpl_node_t * rule){
 }
 
 
-dpl_id_p select_dpid(dp_connection_list_p conn, int id, int index)
+dpl_id_p select_dpid(dpl_id_p hash, int id)
 {
 	dpl_id_p idp;
 
-	if(!conn || !conn->hash[index])
-		return NULL;
-
-	for(idp = conn->hash[index]; idp!=NULL; idp = idp->next)
+	for(idp = hash; idp!=NULL; idp = idp->next)
 		if(idp->dp_id == id)
 			return idp;
 
@@ -741,7 +1012,7 @@ dpl_id_p select_dpid(dp_connection_list_p conn, int id, int index)
 
 
 /* FOR DEBUG PURPOSES */
-void list_hash(dpl_id_t * hash, rw_lock_t * ref_lock)
+void list_hash(dpl_id_t * hash)
 {
 	dpl_id_p crt_idp;
 	dpl_node_p rulep;
@@ -751,12 +1022,12 @@ void list_hash(dpl_id_t * hash, rw_lock_t * ref_lock)
 		return;
 
 	/* lock the data for reading */
-	lock_start_read( ref_lock );
+	rcu_read_lock();
 
 	for(crt_idp = hash; crt_idp; crt_idp = crt_idp->next) {
 		LM_DBG("DPID: %i, pointer %p\n", crt_idp->dp_id, crt_idp);
 
-		for (i = 0; i <= DP_INDEX_HASH_SIZE; i++) {
+		for (i = 0; i <= crt_idp->hash_size; i++) {
 			LM_DBG("BUCKET %d rules:\n", i);
 
 			for(rulep = crt_idp->rule_hash[i].first_rule; rulep;
@@ -768,7 +1039,7 @@ void list_hash(dpl_id_t * hash, rw_lock_t * ref_lock)
 	}
 
 	/* we are done reading -> unref the data */
-	lock_stop_read( ref_lock );
+	rcu_read_unlock();
 }
 
 
@@ -832,6 +1103,9 @@ dp_connection_list_p dp_add_connection(dp_head_p head)
 	}
 
 
+	el->hash = NULL;
+	el->ongoing_reload = 0;
+
 	/*Set table name*/
 	el->table_name.s = (char*)el + sizeof(*el);
 	el->table_name.len = head->dp_table_name.len;
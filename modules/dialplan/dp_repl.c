@@ -22,6 +22,8 @@
  *  2007-08-01 initial version (ancuta onofrei)
  */
 
+#include <stdlib.h>
+
 #include "../../re.h"
 #include "../../time_rec.h"
 #include "dialplan.h"
@@ -364,6 +366,7 @@ static char dp_attrs_buf[DP_MAX_ATTRS_LEN+1];
 int translate(struct sip_msg *msg, str input, str * output, dpl_id_p idp, str * attrs) {
 
 	dpl_node_p rulep, rrulep;
+	dpl_regex_set_p set;
 	int string_res = -1, regexp_res = -1, bucket;
 
 	if(!input.s || !input.len) {
@@ -371,7 +374,7 @@ int translate(struct sip_msg *msg, str input, str * output, dpl_id_p idp, str *
 		return -1;
 	}
 
-	bucket = core_case_hash(&input, NULL, DP_INDEX_HASH_SIZE);
+	bucket = core_case_hash(&input, NULL, idp->hash_size);
 
 	/* try to match the input in the corresponding string bucket */
 	for (rulep = idp->rule_hash[bucket].first_rule; rulep; rulep=rulep->next) {
@@ -406,25 +409,12 @@ int translate(struct sip_msg *msg, str input, str * output, dpl_id_p idp, str *
 		}
 	}
 
-	/* try to match the input in the regexp bucket */
-	for (rrulep = idp->rule_hash[DP_INDEX_HASH_SIZE].first_rule; rrulep; rrulep=rrulep->next) {
-
-		// Check for Time Period if Set
-		if(rrulep->parsed_timerec) {
-			LM_DBG("Timerec exists for rule checking: %.*s\n", rrulep->timerec.len, rrulep->timerec.s);
-			// Doesn't matches time period continue with next rule
-			if(!check_time(rrulep->parsed_timerec)) {
-				LM_DBG("Time rule doesn't match: skip next!\n");
-				continue;
-			}
-		}
-
-		regexp_res = (test_match(input, rrulep->match_comp, matches, MAX_MATCHES)
-					>= 0 ? 0 : -1);
-
-		LM_DBG("Regex operator testing. Got result: %d\n", regexp_res);
-
-		if (regexp_res == 0) {
+	/* try to match the input against the regexp rules, set by set */
+	rrulep = NULL;
+	for (set = idp->regex_sets; set; set = set->next) {
+		rrulep = match_regex_set(input, set);
+		if (rrulep) {
+			regexp_res = 0;
 			break;
 		}
 	}
@@ -479,6 +469,62 @@ int translate(struct sip_msg *msg, str input, str * output, dpl_id_p idp, str *
 }
 
 
+/* returns the first rule of the set matching the string, if any */
+dpl_node_t * match_regex_set(str string, dpl_regex_set_t * set)
+{
+	dpl_node_p rulep;
+	pcre_extra extra;
+	unsigned char *mark;
+	int i, ret, ovector[3];
+
+	if (set->comp) {
+		memset(&extra, 0, sizeof extra);
+		extra.flags = PCRE_EXTRA_MARK;
+		extra.mark = &mark;
+		mark = NULL;
+
+		ret = pcre_exec(set->comp, &extra, string.s, string.len, 0,
+			PCRE_ANCHORED, ovector, 3);
+		if (ret >= 0 && mark) {
+			i = atoi((char*)mark);
+			if (i >= 0 && i < set->rule_no) {
+				LM_DBG("Regex set testing. Matched rule %d of %d\n",
+					i, set->rule_no);
+				return set->rules[i];
+			}
+		}
+		if (ret == PCRE_ERROR_NOMATCH)
+			return NULL;
+
+		LM_WARN("failed to match the regex set (%d), testing rule by rule\n",
+			ret);
+	}
+
+	for (i = 0; i < set->rule_no; i++) {
+		rulep = set->rules[i];
+
+		// Check for Time Period if Set
+		if(rulep->parsed_timerec) {
+			LM_DBG("Timerec exists for rule checking: %.*s\n", rulep->timerec.len, rulep->timerec.s);
+			// Doesn't matches time period continue with next rule
+			if(!check_time(rulep->parsed_timerec)) {
+				LM_DBG("Time rule doesn't match: skip next!\n");
+				continue;
+			}
+		}
+
+		ret = test_match(string, rulep->match_comp, matches, MAX_MATCHES);
+
+		LM_DBG("Regex operator testing. Got result: %d\n", ret);
+
+		if (ret >= 0)
+			return rulep;
+	}
+
+	return NULL;
+}
+
+
 int test_match(str string, pcre * exp, int * out, int out_max)
 {
 	int i, result_count;
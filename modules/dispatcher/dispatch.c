@@ -53,7 +53,10 @@
 #include "../../action.h"
 #include "../../route.h"
 #include "../../dset.h"
+#include "../../mem/mem.h"
 #include "../../mem/shm_mem.h"
+#include "../../hash_func.h"
+#include "../../timer.h"
 #include "../../parser/parse_uri.h"
 #include "../../parser/parse_from.h"
 #include "../../usr_avp.h"
@@ -65,6 +68,7 @@
 #include "../../db/db_res.h"
 #include "../../str.h"
 #include "../../rw_locking.h"
+#include "../../rcu.h"
 
 #include "dispatch.h"
 #include "ds_bl.h"
@@ -125,6 +129,8 @@ static void ds_destroy_data_set( ds_data_t *d)
 			}while(dest);
 			shm_free(sp_curr->dlist);
 		}
+		if (sp_curr->ch_table)
+			shm_free(sp_curr->ch_table);
 		shm_free(sp_curr);
 	}
 
@@ -362,6 +368,113 @@ static inline void re_calculate_active_dsts(ds_set_p sp)
 }
 
 
+#define DS_CH_EMPTY_SLOT    0xffff
+/* slots in the lookup table for each destination in the set */
+#define DS_CH_SLOTS_PER_DST 100
+
+/* the table size must be a prime, so any skip walks all the slots */
+static unsigned int ds_ch_sizes[] = {
+	251, 509, 1021, 2039, 4093, 8191, 16381, 32749, 65521 };
+
+static str ds_ch_salt = str_init("ds-ch");
+
+/* builds the maglev lookup table over the active destinations of the set:
+ * each destination fills the slots in the order of its own permutation,
+ * so a destination going up or down moves only the slots it owns */
+static ds_ch_table_t* ds_build_ch_table(ds_set_p sp)
+{
+	ds_ch_table_t *t;
+	unsigned int *offset, *skip, *next, *credit;
+	unsigned int size, filled, max_w, w, c, i;
+	int active;
+
+	for( i=0,active=0,max_w=0 ; i<sp->nr ; i++ ) {
+		if ( !dst_is_active(sp->dlist[i]) )
+			continue;
+		active++;
+		if (sp->dlist[i].weight>max_w)
+			max_w = sp->dlist[i].weight;
+	}
+	if (active==0)
+		return NULL;
+
+	for( i=0 ; i<sizeof(ds_ch_sizes)/sizeof(ds_ch_sizes[0])-1 &&
+	ds_ch_sizes[i]<sp->nr*DS_CH_SLOTS_PER_DST ; i++ );
+	size = ds_ch_sizes[i];
+
+	t = (ds_ch_table_t*)shm_malloc( sizeof(ds_ch_table_t) +
+		size*sizeof(unsigned short) );
+	if (t==NULL) {
+		LM_ERR("no more shm mem\n");
+		return NULL;
+	}
+	t->size = size;
+	memset( t->slots, 0xff, size*sizeof(unsigned short));
+
+	offset = (unsigned int*)pkg_malloc( 4*sp->nr*sizeof(unsigned int) );
+	if (offset==NULL) {
+		LM_ERR("no more pkg mem\n");
+		shm_free(t);
+		return NULL;
+	}
+	skip = offset + sp->nr;
+	next = skip + sp->nr;
+	credit = next + sp->nr;
+
+	/* the permutations depend only on the URIs, so they survive reloads */
+	for( i=0 ; i<sp->nr ; i++ ) {
+		offset[i] = core_hash( &sp->dlist[i].uri, NULL, 0) % size;
+		skip[i] = core_hash( &sp->dlist[i].uri, &ds_ch_salt, 0) % (size-1) + 1;
+		next[i] = credit[i] = 0;
+	}
+
+	/* in each round, a destination takes as many slots as its weight
+	 * allows (no weights - one slot each) */
+	filled = 0;
+	while (filled<size) {
+		for( i=0 ; i<sp->nr && filled<size ; i++ ) {
+			if ( !dst_is_active(sp->dlist[i]) )
+				continue;
+			w = max_w ? sp->dlist[i].weight : 1;
+			if (w==0)
+				continue;
+			credit[i] += w;
+			while (credit[i]>=(max_w?max_w:1) && filled<size) {
+				credit[i] -= max_w?max_w:1;
+				do {
+					c = (unsigned int)((offset[i] +
+						(unsigned long long)next[i]*skip[i]) % size);
+					next[i]++;
+				} while (t->slots[c]!=DS_CH_EMPTY_SLOT);
+				t->slots[c] = i;
+				filled++;
+			}
+		}
+	}
+
+	pkg_free(offset);
+	return t;
+}
+
+
+static void ds_free_ch_table(void *t)
+{
+	shm_free(t);
+}
+
+
+/* to be called after any change of the active destinations of the set;
+ * the callers are serialized via the partition lock */
+static void ds_update_ch_table(ds_set_p sp)
+{
+	ds_ch_table_t *old_t;
+
+	old_t = sp->ch_table;
+	rcu_assign_pointer( sp->ch_table, ds_build_ch_table(sp) );
+	rcu_retire( old_t, ds_free_ch_table);
+}
+
+
 /* compact destinations from sets for fast access */
 int reindex_dests( ds_data_t *d_data)
 {
@@ -403,6 +516,7 @@ int reindex_dests( ds_data_t *d_data)
 		sp->dlist=dp0;
 
 		re_calculate_active_dsts(sp);
+		ds_update_ch_table(sp);
 
 	}
 
@@ -646,6 +760,10 @@ static void ds_inherit_state( ds_data_t *old_data , ds_data_t *new_data)
 					LM_DBG("DST <%.*s> found in old set, copying state\n",
 						new_ds->uri.len,new_ds->uri.s);
 					new_ds->flags = old_ds->flags;
+					new_ds->rtt = old_ds->rtt;
+					new_ds->ping_interval = old_ds->ping_interval;
+					new_ds->next_ping = old_ds->next_ping;
+					new_ds->ping_state = old_ds->ping_state;
 					break;
 				}
 			}
@@ -653,6 +771,10 @@ static void ds_inherit_state( ds_data_t *old_data , ds_data_t *new_data)
 				LM_DBG("DST <%.*s> not found in old set\n",
 					new_ds->uri.len,new_ds->uri.s);
 		}
+
+		/* the inherited states may change the active destinations */
+		re_calculate_active_dsts(new_set);
+		ds_update_ch_table(new_set);
 	}
 }
 
@@ -663,6 +785,7 @@ void ds_flusher_routine(unsigned int ticks, void* param)
 	db_val_t val_cmp;
 	db_key_t key_set;
 	db_val_t val_set;
+	ds_data_t *data;
 	ds_set_p list;
 	int j;
 
@@ -687,9 +810,13 @@ void ds_flusher_routine(unsigned int ticks, void* param)
 		key_cmp = &ds_dest_uri_col;
 		key_set = &ds_dest_state_col;
 
-		if (*partition->data) {
+		/* the DB updates only delay the freeing of a set retired meanwhile,
+		 * the readers and the reloads do not wait for them */
+		rcu_read_lock();
+		data = rcu_dereference(*partition->data);
+		if (data) {
 			/* Iterate over the groups and the entries of each group */
-			for(list = (*partition->data)->sets; list!= NULL; list=list->next){
+			for(list = data->sets; list!= NULL; list=list->next){
 				for(j=0; j<list->nr; j++) {
 					/* If the Flag of the entry is STATE_DIRTY -> flush do db*/
 					if ( (list->dlist[j].flags&DS_STATE_DIRTY_DST)==0 )
@@ -711,11 +838,14 @@ void ds_flusher_routine(unsigned int ticks, void* param)
 					&val_cmp,&key_set,&val_set,1,1)<0 ) {
 						LM_ERR("DB update failed\n");
 					} else {
+						lock_get( partition->lock->lock );
 						list->dlist[j].flags &= ~DS_STATE_DIRTY_DST;
+						lock_release( partition->lock->lock );
 					}
 				}
 			}
 		}
+		rcu_read_unlock();
 	}
 
 	return;
@@ -871,6 +1001,12 @@ error2:
 }
 
 
+static void ds_free_data_set(void *data)
+{
+	ds_destroy_data_set( (ds_data_t*)data );
+}
+
+
 int ds_reload_db(ds_partition_t *partition)
 {
 	ds_data_t *old_data;
@@ -882,24 +1018,31 @@ int ds_reload_db(ds_partition_t *partition)
 		return -1;
 	}
 
-	lock_start_write( partition->lock );
+	/* the readers are never blocked, this only serializes the concurrent
+	 * reloads (so the same old data is not retired twice) and the state
+	 * changes, so none of them is done after being copied */
+	lock_get( partition->lock->lock );
 
-	/* no more activ readers -> do the swapping */
 	old_data = *partition->data;
-	*partition->data = new_data;
+	/* copy the state of the destinations from the old set
+	 * (for the matching ids) */
+	if (old_data)
+		ds_inherit_state( old_data, new_data);
 
-	lock_stop_write( partition->lock );
+	/* publish the new set; whoever still works with the old one keeps
+	 * it until leaving its read section */
+	rcu_assign_pointer( *partition->data, new_data);
+
+	lock_release( partition->lock->lock );
 
 	/* destroy old data */
-	if (old_data) {
-		/* copy the state of the destinations from the old set
-		 * (for the matching ids) */
-		ds_inherit_state( old_data, new_data);
-		ds_destroy_data_set( old_data );
-	}
+	rcu_retire( old_data, ds_free_data_set);
 
 	/* update the Black Lists with the new gateways */
-	populate_ds_bls( new_data->sets, partition->name);
+	rcu_read_lock();
+	populate_ds_bls( rcu_dereference(*partition->data)->sets,
+		partition->name);
+	rcu_read_unlock();
 
 	return 0;
 }
@@ -1245,16 +1388,17 @@ int ds_hash_pvar(struct sip_msg *msg, unsigned int *hash)
 }
 
 
-static inline int ds_get_index(int group, ds_set_p *index,
+/* @data is the set loaded (once) by the caller, inside its read section */
+static inline int ds_get_index(int group, ds_set_p *index, ds_data_t *data,
 													ds_partition_t *partition)
 {
 	ds_set_p si = NULL;
 
-	if(index==NULL || group<0 || (*partition->data)->sets==NULL)
+	if(index==NULL || group<0 || data->sets==NULL)
 		return -1;
 
 	/* get the index of the set */
-	for ( si=(*partition->data)->sets ; si ; si = si->next ) {
+	for ( si=data->sets ; si ; si = si->next ) {
 		if(si->id == group) {
 			*index = si;
 			break;
@@ -1361,6 +1505,59 @@ static inline int push_ds_2_avps( ds_dest_t *ds, ds_partition_t *partition )
 }
 
 
+/* load of a destination (or set) in the current second; the counters are
+ * shared and updated without locking, so they are only an estimation */
+static inline unsigned int ds_ch_get_load(unsigned int *load,
+									unsigned int *tick, unsigned int now)
+{
+	if (*tick!=now) {
+		*tick = now;
+		*load = 0;
+	}
+	return *load;
+}
+
+
+/* picks the destination for the hash via the consistent hashing table;
+ * if the owner of the slot is not usable (or already got more than its
+ * share of load), the next slots are tried */
+static int ds_ch_select(ds_set_p idx, unsigned int hash, int use_default)
+{
+	ds_ch_table_t *t;
+	unsigned int s, n, now, bound;
+	int i, first;
+
+	t = rcu_dereference(idx->ch_table);
+	if (t==NULL)
+		return -1;
+
+	now = get_ticks();
+	bound = 0;
+	if (ds_ch_load_factor>0 && idx->active_nr>0)
+		/* ceil( factor * (set load + 1) / active dsts ) */
+		bound = (ds_ch_load_factor *
+			(ds_ch_get_load(&idx->ch_load, &idx->ch_tick, now) + 1) +
+			100*idx->active_nr - 1) / (100*idx->active_nr);
+
+	first = -1;
+	for( s=hash%t->size,n=0 ; n<t->size ; n++,s=(s+1==t->size)?0:s+1 ) {
+		i = t->slots[s];
+		/* the table may lag behind a state change */
+		if ( i>=idx->nr || !dst_is_active(idx->dlist[i]) ||
+		(use_default && i==idx->nr-1) || i==first )
+			continue;
+		if (bound==0 || ds_ch_get_load( &idx->dlist[i].ch_load,
+		&idx->dlist[i].ch_tick, now)<bound)
+			return i;
+		/* all overloaded - stick to the owner */
+		if (first==-1)
+			first = i;
+	}
+
+	return first;
+}
+
+
 /**
  *
  */
@@ -1371,6 +1568,7 @@ int ds_select_dst(struct sip_msg *msg, ds_select_ctl_p ds_select_ctl,
 	unsigned int ds_hash, ds_rand;
 	int_str avp_val;
 	int ds_id;
+	ds_data_t *data;
 	ds_set_p idx = NULL;
 	int inactive_dst_count = 0;
 	int destination_entries_to_skip = 0;
@@ -1385,11 +1583,6 @@ int ds_select_dst(struct sip_msg *msg, ds_select_ctl_p ds_select_ctl,
 		return -1;
 	}
 
-	if ( (*ds_select_ctl->partition->data)->sets==NULL) {
-		LM_DBG("empty destination set\n");
-		return -1;
-	}
-
 	if((ds_select_ctl->mode==0) && (ds_flags&DS_FORCE_DST)
 			&& (msg->dst_uri.s!=NULL || msg->dst_uri.len>0))
 	{
@@ -1398,11 +1591,18 @@ int ds_select_dst(struct sip_msg *msg, ds_select_ctl_p ds_select_ctl,
 		return -1;
 	}
 
-	/* access ds data under reader's lock */
-	lock_start_read( ds_select_ctl->partition->lock );
+	/* access ds data inside a read section */
+	rcu_read_lock();
+	data = rcu_dereference(*ds_select_ctl->partition->data);
+
+	if (data->sets==NULL) {
+		LM_DBG("empty destination set\n");
+		goto error;
+	}
 
 	/* get the index of the set */
-	if(ds_get_index(ds_select_ctl->set, &idx, ds_select_ctl->partition)!=0)
+	if(ds_get_index(ds_select_ctl->set, &idx, data,
+	ds_select_ctl->partition)!=0)
 	{
 		LM_ERR("destination set [%d] not found\n", ds_select_ctl->set);
 		goto error;
@@ -1515,6 +1715,30 @@ int ds_select_dst(struct sip_msg *msg, ds_select_ctl_p ds_select_ctl,
 			}
 			selected = sorted_set[0];
 		break;
+		case 10:
+			/* consistent hashing over the hash_pvar or, by default,
+			 * over the callid */
+			if ( (hash_param_model ? ds_hash_pvar(msg, &ds_hash) :
+			ds_hash_callid(msg, &ds_hash))!=0 ) {
+				LM_ERR("can't get hash for consistent hashing\n");
+				goto error;
+			}
+			ds_id = ds_ch_select( idx, ds_hash, ds_flags&DS_USE_DEFAULT);
+			if (ds_id<0) {
+				if ( !(ds_flags&DS_USE_DEFAULT) ||
+				!dst_is_active(idx->dlist[idx->nr-1]) )
+					goto error;
+				ds_id = idx->nr-1;
+			}
+			selected = &idx->dlist[ds_id];
+			if (ds_ch_load_factor>0) {
+				ds_ch_get_load( &selected->ch_load, &selected->ch_tick,
+					get_ticks());
+				selected->ch_load++;
+				ds_ch_get_load( &idx->ch_load, &idx->ch_tick, get_ticks());
+				idx->ch_load++;
+			}
+		break;
 		default:
 			LM_WARN("dispatching via [%d] with unknown algo [%d]"
 					": defaulting to 0 - first entry\n",
@@ -1718,11 +1942,11 @@ done:
 				ds_select_ctl->partition->cnt_avp_name, avp_val)!=0)
 		goto error;
 
-	lock_stop_read( ds_select_ctl->partition->lock );
+	rcu_read_unlock();
 	return 1;
 
 error:
-	lock_stop_read( ds_select_ctl->partition->lock );
+	rcu_read_unlock();
 	return -1;
 }
 
@@ -1836,18 +2060,19 @@ int ds_set_state(int group, str *address, int state, int type,
 	evi_params_p list = NULL;
 	int old_flags;
 
-	if ( (*partition->data)->sets==NULL ){
-		LM_DBG("empty destination set\n");
-		return -1;
-	}
+	/* access ds data inside a read section */
+	rcu_read_lock();
 
-	/* access ds data under reader's lock */
-	lock_start_read( partition->lock );
+	/* the state is changed under the reload lock and on the set published
+	 * by now - so a change is either copied by a reload in progress or it
+	 * is done on its new set, never lost with the old one */
+	lock_get( partition->lock->lock );
 
-	/* get the index of the set */
-	if(ds_get_index(group, &idx, partition)!=0) {
+	if (ds_get_index(group, &idx, rcu_dereference(*partition->data),
+	partition)!=0) {
+		lock_release( partition->lock->lock );
 		LM_ERR("destination set [%d] not found\n", group);
-		lock_stop_read( partition->lock );
+		rcu_read_unlock();
 		return -1;
 	}
 
@@ -1862,9 +2087,10 @@ int ds_set_state(int group, str *address, int state, int type,
 			if (state == DS_PROBING_DST) {
 				if (type) {
 					if (idx->dlist[i].flags & DS_INACTIVE_DST) {
+						lock_release( partition->lock->lock );
 						LM_INFO("Ignoring the request to set this destination"
 								" to probing: It is already inactive!\n");
-						lock_stop_read( partition->lock );
+						rcu_read_unlock();
 						return 0;
 					}
 
@@ -1872,7 +2098,8 @@ int ds_set_state(int group, str *address, int state, int type,
 					/* Fire only, if the Threshold is reached. */
 					if (idx->dlist[i].failure_count
 							< probing_threshhold) {
-						lock_stop_read( partition->lock );
+						lock_release( partition->lock->lock );
+						rcu_read_unlock();
 						return 0;
 					}
 					if (idx->dlist[i].failure_count
@@ -1898,43 +2125,47 @@ int ds_set_state(int group, str *address, int state, int type,
 				idx->dlist[i].flags |= DS_STATE_DIRTY_DST;
 				/* update info on active destinations */
 				if ( ((old_flags&(DS_PROBING_DST|DS_INACTIVE_DST))?0:1) !=
-				((idx->dlist[i].flags&(DS_PROBING_DST|DS_INACTIVE_DST))?0:1) )
+				((idx->dlist[i].flags&(DS_PROBING_DST|DS_INACTIVE_DST))?0:1) ) {
 					/* this destination switched state between 
 					 * disabled <> enabled -> update active info */
 					re_calculate_active_dsts( idx );
+					ds_update_ch_table( idx );
+				}
 			}
 
+			lock_release( partition->lock->lock );
+
 			if (dispatch_evi_id == EVI_ERROR) {
 				LM_ERR("event not registered %d\n", dispatch_evi_id);
 			} else if (evi_probe_event(dispatch_evi_id)) {
 				if (!(list = evi_get_params())) {
-					lock_stop_read( partition->lock );
+					rcu_read_unlock();
 					return 0;
 				}
 				if (partition != default_partition
 				&& evi_param_add_str(list,&partition_str,&partition->name)){
 					LM_ERR("unable to add partition parameter\n");
 					evi_free_params(list);
-					lock_stop_read( partition->lock );
+					rcu_read_unlock();
 					return 0;
 				}
 				if (evi_param_add_int(list, &group_str, &group)) {
 					LM_ERR("unable to add group parameter\n");
 					evi_free_params(list);
-					lock_stop_read( partition->lock );
+					rcu_read_unlock();
 					return 0;
 				}
 				if (evi_param_add_str(list, &address_str, address)) {
 					LM_ERR("unable to add address parameter\n");
 					evi_free_params(list);
-					lock_stop_read( partition->lock );
+					rcu_read_unlock();
 					return 0;
 				}
 				if (evi_param_add_str(list, &status_str,
 							type ? &inactive_str : &active_str)) {
 					LM_ERR("unable to add status parameter\n");
 					evi_free_params(list);
-					lock_stop_read( partition->lock );
+					rcu_read_unlock();
 					return 0;
 				}
 
@@ -1944,13 +2175,14 @@ int ds_set_state(int group, str *address, int state, int type,
 			} else {
 				LM_DBG("no event sent\n");
 			}
-			lock_stop_read( partition->lock );
+			rcu_read_unlock();
 			return 0;
 		}
 		i++;
 	}
 
-	lock_stop_read( partition->lock );
+	lock_release( partition->lock->lock );
+	rcu_read_unlock();
 	return -1;
 }
 
@@ -1994,10 +2226,11 @@ int ds_is_in_list(struct sip_msg *_m, gparam_t *gp_ip, gparam_t *gp_port,
 	memset(&val, 0, sizeof(pv_value_t));
 	val.flags = PV_VAL_INT|PV_TYPE_INT;
 
-	/* access ds data under reader's lock */
-	lock_start_read( partition->lock );
+	/* access ds data inside a read section */
+	rcu_read_lock();
 
-	for(list = (*partition->data)->sets ; list!= NULL; list= list->next) {
+	for(list = rcu_dereference(*partition->data)->sets ; list!= NULL;
+	list= list->next) {
 		if ((set == -1) || (set == list->id)) {
 			/* interate through all elements/destinations in the list */
 			for(j=0; j<list->nr; j++) {
@@ -2025,7 +2258,7 @@ int ds_is_in_list(struct sip_msg *_m, gparam_t *gp_ip, gparam_t *gp_port,
 								goto error;
 						}
 
-						lock_stop_read( partition->lock );
+						rcu_read_unlock();
 						return 1;
 					}
 				}
@@ -2034,7 +2267,7 @@ int ds_is_in_list(struct sip_msg *_m, gparam_t *gp_ip, gparam_t *gp_port,
 	}
 
 error:
-	lock_stop_read( partition->lock );
+	rcu_read_unlock();
 	return -1;
 }
 
@@ -2049,15 +2282,17 @@ int ds_print_mi_list(struct mi_node* rpl, ds_partition_t *partition)
 	struct mi_node* set_node = NULL;
 	struct mi_attr* attr = NULL;
 
-	if ( (*partition->data)->sets==NULL ) {
+	/* access ds data inside a read section */
+	rcu_read_lock();
+
+	list = rcu_dereference(*partition->data)->sets;
+	if ( list==NULL ) {
 		LM_DBG("empty destination sets\n");
+		rcu_read_unlock();
 		return  0;
 	}
 
-	/* access ds data under reader's lock */
-	lock_start_read( partition->lock );
-
-	for(list = (*partition->data)->sets ; list!= NULL; list= list->next) {
+	for( ; list!= NULL; list= list->next) {
 		p = int2str(list->id, &len);
 		set_node= add_mi_node_child(rpl, MI_IS_ARRAY|MI_DUP_VALUE,
 			"SET", 3, p, len);
@@ -2087,6 +2322,13 @@ int ds_print_mi_list(struct mi_node* rpl, ds_partition_t *partition)
 			if(attr == NULL)
 				goto error;
 
+			if (list->dlist[j].rtt) {
+				p = int2str(list->dlist[j].rtt, &len);
+				attr = add_mi_attr (node, MI_DUP_VALUE, "rtt", 3, p, len);
+				if(attr == NULL)
+					goto error;
+			}
+
 			if (list->dlist[j].sock)
 			{
 				p = socket2str(list->dlist[j].sock, NULL, &len, 0);
@@ -2109,10 +2351,10 @@ int ds_print_mi_list(struct mi_node* rpl, ds_partition_t *partition)
 		}
 	}
 
-	lock_stop_read( partition->lock );
+	rcu_read_unlock();
 	return 0;
 error:
-	lock_stop_read( partition->lock );
+	rcu_read_unlock();
 	return -1;
 }
 
@@ -2123,6 +2365,66 @@ error:
  * (e. g. a Response came in, the timeout was hit, ...)
  *
  */
+/* keeps the RTT of the probes and adapts the probing interval of the
+ * destination: back to the minimum when the outcome flips (flapping),
+ * doubled up to the maximum while it stays the same */
+static void ds_probe_done( ds_options_callback_param_t *cb_param, str *uri,
+															int ok, int code)
+{
+	ds_set_p set;
+	ds_dest_p dst;
+	utime_t now;
+	int rtt;
+	int j;
+
+	now = get_uticks();
+
+	rcu_read_lock();
+	/* the probing state is inherited by the reloads, as the flags */
+	lock_get( cb_param->partition->lock->lock );
+
+	if (ds_get_index(cb_param->set_id, &set,
+	rcu_dereference(*cb_param->partition->data), cb_param->partition)!=0) {
+		lock_release( cb_param->partition->lock->lock );
+		rcu_read_unlock();
+		return;
+	}
+
+	for( j=0 ; j<set->nr ; j++ ) {
+		dst = &set->dlist[j];
+		if (dst->uri.len!=uri->len ||
+		strncasecmp(dst->uri.s, uri->s, uri->len)!=0)
+			continue;
+
+		/* a local timeout says nothing about the latency */
+		if (code!=408 && now>cb_param->sent) {
+			rtt = (int)(now - cb_param->sent);
+			/* EWMA with a 1/8 gain, as for the TCP srtt */
+			dst->rtt = dst->rtt ? (int)dst->rtt + (rtt - (int)dst->rtt)/8 : rtt;
+		}
+
+		if (dst->ping_state!=DS_PING_NONE &&
+		dst->ping_state!=(ok?DS_PING_OK:DS_PING_FAILED)) {
+			dst->ping_interval = ds_ping_interval_min;
+			/* do not wait for a probe scheduled with the old interval */
+			if (dst->next_ping > now+(utime_t)dst->ping_interval*1000000)
+				dst->next_ping = now + (utime_t)dst->ping_interval*1000000;
+		} else if (dst->ping_interval<ds_ping_interval_max) {
+			dst->ping_interval = (dst->ping_interval*2<ds_ping_interval_max) ?
+				dst->ping_interval*2 : ds_ping_interval_max;
+		}
+		dst->ping_state = ok ? DS_PING_OK : DS_PING_FAILED;
+
+		LM_DBG("probe of %.*s done with %d, rtt %uus, next in %us\n",
+			uri->len, uri->s, code, dst->rtt, dst->ping_interval);
+		break;
+	}
+
+	lock_release( cb_param->partition->lock->lock );
+	rcu_read_unlock();
+}
+
+
 static void ds_options_callback( struct cell *t, int type,
 		struct tmcb_params *ps )
 {
@@ -2178,6 +2480,9 @@ static void ds_options_callback( struct cell *t, int type,
 		}
 	}
 
+	ds_probe_done( cb_param, &uri,
+		(ps->code == 200) || check_options_rplcode(ps->code), ps->code);
+
 	return;
 }
 
@@ -2186,75 +2491,115 @@ void shm_free_cb_param(void *param)
 	shm_free(param);
 }
 
+static void ds_send_probe(ds_partition_t *partition, ds_set_p list,
+												ds_dest_p dst, utime_t now)
+{
+	dlg_t *dlg;
+	ds_options_callback_param_t *cb_param;
+
+	LM_DBG("probing set #%d, URI %.*s\n", list->id,
+			dst->uri.len, dst->uri.s);
+
+	/* Execute the Dialog using the "request"-Method of the
+	 * TM-Module.*/
+	if (tmb.new_auto_dlg_uac(&ds_ping_from, &dst->uri,
+	dst->sock?dst->sock:probing_sock, &dlg) != 0 ) {
+		LM_ERR("failed to create new TM dlg\n");
+		return;
+	}
+	dlg->state = DLG_CONFIRMED;
+
+	cb_param = shm_malloc(sizeof(*cb_param));
+	if (cb_param == NULL) {
+		LM_CRIT("No more shared memory\n");
+		tmb.free_dlg(dlg);
+		return;
+	}
+	cb_param->partition = partition;
+	cb_param->set_id = list->id;
+	cb_param->sent = now;
+
+	/* the request is sent right away, the reply (or the timeout) comes
+	 * via the callback - so all the due probes are fired in one go */
+	if (tmb.t_request_within(&ds_ping_method,
+			NULL,
+			NULL,
+			dlg,
+			ds_options_callback,
+			(void*)cb_param,
+			shm_free_cb_param) < 0) {
+		LM_ERR("unable to execute dialog\n");
+	}
+	tmb.free_dlg(dlg);
+}
+
+
 /*
  * Timer for checking inactive destinations
  *
- * This timer is regularly fired.
+ * This timer is fired every DS_PING_TICK and sends only the probes that
+ * are due; each destination has its own interval and the first probe is
+ * shifted (by a hash over the URI) inside the interval, so the probes are
+ * evenly spread in time instead of going all in one burst.
  */
-void ds_check_timer(unsigned int ticks, void* param)
+void ds_check_timer(utime_t uticks, void* param)
 {
-	dlg_t *dlg;
 	ds_set_p list;
+	ds_dest_p dst;
+	utime_t interval;
 	int j;
 
 	ds_partition_t *partition = partitions;
 
 	for (partition = partitions; partition; partition = partition->next){
-		/* Check for the list. */
-		if ( (*partition->data)->sets==NULL )
-			continue;
-
-		/* access ds data under reader's lock */
-		lock_start_read( partition->lock );
+		/* access ds data inside a read section */
+		rcu_read_lock();
 
 		/* Iterate over the groups and the entries of each group: */
-		for( list=(*partition->data)->sets ; list!= NULL ; list= list->next)
+		for( list=rcu_dereference(*partition->data)->sets ; list!= NULL ;
+		list= list->next)
 		{
 			for(j=0; j<list->nr; j++)
 			{
+				dst = &list->dlist[j];
+
+				/* the schedule is also changed by the probe replies; the
+				 * lock is not held while sending, as a failed probe may
+				 * call back right away */
+				lock_get( partition->lock->lock );
+
 				/* If the Flag of the entry has "Probing set, send a probe:	*/
-				if ( ((list->dlist[j].flags&DS_INACTIVE_DST)==0) &&
-				(ds_probing_mode==1 || (list->dlist[j].flags&DS_PROBING_DST)!=0
-				))
-				{
-					LM_DBG("probing set #%d, URI %.*s\n", list->id,
-							list->dlist[j].uri.len, list->dlist[j].uri.s);
-
-					/* Execute the Dialog using the "request"-Method of the
-					 * TM-Module.*/
-					if (tmb.new_auto_dlg_uac(&ds_ping_from,
-					&list->dlist[j].uri,
-					list->dlist[j].sock?list->dlist[j].sock:probing_sock,
-					&dlg) != 0 ) {
-						LM_ERR("failed to create new TM dlg\n");
-						continue;
-					}
-					dlg->state = DLG_CONFIRMED;
+				if ( (dst->flags&DS_INACTIVE_DST)!=0 ||
+				(ds_probing_mode!=1 && (dst->flags&DS_PROBING_DST)==0) ) {
+					dst->next_ping = 0;
+					lock_release( partition->lock->lock );
+					continue;
+				}
 
-					ds_options_callback_param_t *cb_param =
-								shm_malloc(sizeof(*cb_param));
+				if (dst->ping_interval==0)
+					dst->ping_interval = ds_ping_interval;
+				interval = (utime_t)dst->ping_interval*1000000;
 
-					if (cb_param == NULL) {
-						LM_CRIT("No more shared memory\n");
-						continue;
-					}
-					cb_param->partition = partition;
-					cb_param->set_id = list->id;
-					if (tmb.t_request_within(&ds_ping_method,
-							NULL,
-							NULL,
-							dlg,
-							ds_options_callback,
-							(void*)cb_param,
-							shm_free_cb_param) < 0) {
-						LM_ERR("unable to execute dialog\n");
-					}
-					tmb.free_dlg(dlg);
+				if (dst->next_ping==0) {
+					/* not scheduled yet */
+					dst->next_ping = uticks +
+						core_hash(&dst->uri, NULL, 0) % interval;
+					lock_release( partition->lock->lock );
+					continue;
 				}
+				if (dst->next_ping>uticks) {
+					lock_release( partition->lock->lock );
+					continue;
+				}
+
+				dst->next_ping = uticks + interval;
+				lock_release( partition->lock->lock );
+
+				ds_send_probe( partition, list, dst, uticks);
 			}
 		}
 
-		lock_stop_read( partition->lock );
+		rcu_read_unlock();
 	}
 }
 
@@ -2269,12 +2614,13 @@ int ds_count(struct sip_msg *msg, int set_id, const char *cmp, pv_spec_p ret,
 
 	LM_DBG("Searching for set: %d, filtering: %d\n", set_id, *cmp);
 
-	/* access ds data under reader's lock */
-	lock_start_read( partition->lock );
+	/* access ds data inside a read section */
+	rcu_read_lock();
 
-	if ( ds_get_index( set_id, &set, partition)!=0 ) {
+	if ( ds_get_index( set_id, &set, rcu_dereference(*partition->data),
+	partition)!=0 ) {
 		LM_ERR("INVALID SET %d (not found)!\n",set_id);
-		lock_stop_read( partition->lock );
+		rcu_read_unlock();
 		return -1;
 	}
 
@@ -2294,7 +2640,7 @@ int ds_count(struct sip_msg *msg, int set_id, const char *cmp, pv_spec_p ret,
 		}
 	}
 
-	lock_stop_read( partition->lock );
+	rcu_read_unlock();
 
 	switch (*cmp)
 	{
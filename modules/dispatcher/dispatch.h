@@ -44,6 +44,7 @@
 #include "../tm/tm_load.h"
 #include "../../db/db.h"
 #include "../../rw_locking.h"
+#include "../../timer.h"
 
 #define DS_HASH_USER_ONLY	1  /* use only the uri user part for hashing */
 #define DS_FAILOVER_ON		2  /* store the other dest in avps */
@@ -62,6 +63,14 @@
 
 #define DS_MAX_IPS  32
 
+/* outcome of the last probe of a destination */
+#define DS_PING_NONE    0
+#define DS_PING_OK      1
+#define DS_PING_FAILED  2
+
+/* resolution of the probing scheduler (us) */
+#define DS_PING_TICK    100000
+
 #define DS_COUNT_ACTIVE     1
 #define DS_COUNT_INACTIVE   2
 #define DS_COUNT_PROBING    4
@@ -87,16 +96,34 @@ typedef struct _ds_dest
 	unsigned short ips_cnt;
 	unsigned short failure_count;
 	unsigned short chosen_count;
+	unsigned int ch_load;   /* selections by alg 10 in the current second */
+	unsigned int ch_tick;   /* the second ch_load refers to */
+	unsigned int rtt;       /* smoothed RTT of the probes (us), 0 - unknown */
+	unsigned int ping_interval; /* current probing interval (s) */
+	utime_t next_ping;      /* when to probe next, 0 - not scheduled */
+	int ping_state;         /* outcome of the last probe (DS_PING_*) */
 	void *param;
 	struct _ds_dest *next;
 } ds_dest_t, *ds_dest_p;
 
+/* consistent hashing (maglev) lookup table - each slot holds the index
+ * of an active destination, proportionally with the weights */
+typedef struct _ds_ch_table
+{
+	unsigned int size;
+	unsigned short slots[0];
+} ds_ch_table_t;
+
 typedef struct _ds_set
 {
 	int id;				/* id of dst set */
 	int nr;				/* number of items in dst set */
 	int active_nr;		/* number of active items in dst set */
 	int last;			/* last used item in dst set */
+	ds_ch_table_t *ch_table;	/* lookup table for alg 10, rebuilt on
+								 * every change of the active dsts */
+	unsigned int ch_load;		/* selections by alg 10 in ch_tick */
+	unsigned int ch_tick;
 	ds_dest_p dlist;
 	struct _ds_set *next;
 } ds_set_t, *ds_set_p;
@@ -123,7 +150,7 @@ typedef struct _ds_partition
 	db_con_t **db_handle;
 	db_func_t dbf;
 	ds_data_t **data;      /* dispatching data holder */
-	rw_lock_t *lock;       /* reader-writers lock for reloading the data */
+	rw_lock_t *lock;       /* serializes the reloads (readers go via rcu) */
 
 	int dst_avp_name;
 	unsigned short dst_avp_type;
@@ -160,6 +187,7 @@ typedef struct
 {
 	ds_partition_t *partition;
 	int set_id;
+	utime_t sent;
 } ds_options_callback_param_t;
 
 typedef struct _ds_selected_dst
@@ -188,6 +216,11 @@ extern str ds_ping_from;
 extern int probing_threshhold; /* number of failed requests,
 						before a destination is taken into probing */
 extern int ds_probing_mode;
+extern int ds_ping_interval;
+extern int ds_ping_interval_min;
+extern int ds_ping_interval_max;
+extern int ds_ch_load_factor; /* percentage of the average load a dst may
+						get via consistent hashing (0 - unbounded) */
 
 
 int init_ds_db(ds_partition_t *partition);
@@ -213,7 +246,7 @@ int ds_is_in_list(struct sip_msg *_m, gparam_t *addr, gparam_t *port,
 /*
  * Timer for checking inactive destinations
  */
-void ds_check_timer(unsigned int ticks, void* param);
+void ds_check_timer(utime_t uticks, void* param);
 void ds_flusher_routine(unsigned int ticks, void* param);
 
 
@@ -79,9 +79,12 @@ int probing_threshhold = 3; /* number of failed requests, before a destination
 							   is taken into probing */
 str ds_ping_method = {"OPTIONS",7};
 str ds_ping_from   = {"sip:dispatcher@localhost", 24};
-static int ds_ping_interval = 0;
+int ds_ping_interval = 0;
+int ds_ping_interval_min = 0;
+int ds_ping_interval_max = 0;
 int ds_probing_mode = 0;
 int ds_persistent_state = 1;
+int ds_ch_load_factor = 0;
 
 /* db partiton info */
 
@@ -255,11 +258,14 @@ static param_export_t params[]={
 	{"ds_ping_method",        STR_PARAM, &ds_ping_method.s},
 	{"ds_ping_from",          STR_PARAM, &ds_ping_from.s},
 	{"ds_ping_interval",      INT_PARAM, &ds_ping_interval},
+	{"ds_ping_interval_min",  INT_PARAM, &ds_ping_interval_min},
+	{"ds_ping_interval_max",  INT_PARAM, &ds_ping_interval_max},
 	{"ds_probing_mode",       INT_PARAM, &ds_probing_mode},
 	{"options_reply_codes",   STR_PARAM, &options_reply_codes_str.s},
 	{"ds_probing_sock",       STR_PARAM, &probing_sock_s},
 	{"ds_define_blacklist",   STR_PARAM|USE_FUNC_PARAM, (void*)set_ds_bl},
 	{"persistent_state",      INT_PARAM, &ds_persistent_state},
+	{"ch_load_factor",        INT_PARAM, &ds_ch_load_factor},
 	{0,0,0}
 };
 
@@ -717,6 +723,14 @@ static int mod_init(void)
 		hash_param_model = NULL;
 	}
 
+	if (ds_ch_load_factor<0) {
+		ds_ch_load_factor = 0;
+	} else if (ds_ch_load_factor>0 && ds_ch_load_factor<100) {
+		LM_WARN("ch_load_factor %d is below the average load, using 100\n",
+			ds_ch_load_factor);
+		ds_ch_load_factor = 100;
+	}
+
 	if(ds_setid_pvname.s && (ds_setid_pvname.len=strlen(ds_setid_pvname.s))>0){
 		if(pv_parse_spec(&ds_setid_pvname, &ds_setid_pv)==NULL
 				|| !pv_is_w(&ds_setid_pv))
@@ -825,9 +839,15 @@ static int mod_init(void)
 			LM_ERR("could not load the TM-functions - disable DS ping\n");
 			return -1;
 		}
-		/* Register the PING-Timer */
-		if (register_timer("ds-pinger", ds_check_timer, NULL,
-		ds_ping_interval, TIMER_FLAG_DELAY_ON_DELAY)<0) {
+		/* the probing interval adapts between these limits */
+		if (ds_ping_interval_min<=0 || ds_ping_interval_min>ds_ping_interval)
+			ds_ping_interval_min = ds_ping_interval;
+		if (ds_ping_interval_max<ds_ping_interval)
+			ds_ping_interval_max = ds_ping_interval;
+		/* Register the PING-Timer; it only fires the probes that are due,
+		 * so they are spread over the whole interval */
+		if (register_utimer("ds-pinger", ds_check_timer, NULL,
+		DS_PING_TICK, TIMER_FLAG_DELAY_ON_DELAY)<0) {
 			LM_ERR("failed to register timer for probing!\n");
 			return -1;
 		}
@@ -39,14 +39,21 @@ static int add_rule_api(dr_head_p partition, unsigned int rid,
 		tmrec_t *time_rec, void *attr);
 
 
-/* Warning this function assumes the lock is already taken */
-rt_info_t* find_rule_by_prefix_unsafe(ptree_t *pt, ptree_node_t *noprefix,
-		str prefix, unsigned int grp_id, unsigned int *matched_len)
+/* Warning this function assumes the lock is already taken
+ * @ppt: the packed tree, if already built (@pt holds then only the prefixes
+ * changed by delta reloads, if any) */
+rt_info_t* find_rule_by_prefix_unsafe(ptree_t *pt, ptree_pack_t *ppt,
+		ptree_node_t *noprefix, str prefix, unsigned int grp_id,
+		unsigned int *matched_len)
 {
 	unsigned int rule_idx = 0;
 	rt_info_t *rt_info;
 
-	rt_info = get_prefix(pt, &prefix, grp_id,matched_len, &rule_idx);
+	if (ppt)
+		rt_info = get_packed_prefix(ppt, pt, &prefix, grp_id, matched_len,
+			&rule_idx);
+	else
+		rt_info = get_prefix(pt, &prefix, grp_id,matched_len, &rule_idx);
 
 	if (rt_info==NULL) {
 		LM_DBG("no matching for prefix \"%.*s\"\n",
@@ -75,8 +82,8 @@ static rt_info_t *match_number (dr_head_p partition, unsigned int grp_id,
 		const str *number, unsigned int *matched_len)
 {
 
-	return find_rule_by_prefix_unsafe(partition->pt, &(partition->noprefix),
-			*number, grp_id, matched_len);
+	return find_rule_by_prefix_unsafe(partition->pt, NULL,
+			&(partition->noprefix), *number, grp_id, matched_len);
 }
 
 static dr_head_p create_dr_head(void)
@@ -30,7 +30,8 @@
 #include "dr_api.h"
 
 int load_dr (struct dr_binds *drb);
-rt_info_t* find_rule_by_prefix_unsafe(ptree_t *pt, ptree_node_t *noprefix,
-		str prefix, unsigned int grp_id, unsigned int *matched_len);
+rt_info_t* find_rule_by_prefix_unsafe(ptree_t *pt, ptree_pack_t *ppt,
+		ptree_node_t *noprefix, str prefix, unsigned int grp_id,
+		unsigned int *matched_len);
 
 #endif
@@ -0,0 +1,230 @@
+/*
+ * Copyright (C) 2016 OpenSIPS Solutions
+ *
+ * This file is part of Open SIP Server (OpenSIPS).
+ *
+ * DROUTING OpenSIPS-module is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * DROUTING OpenSIPS-module is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "../../mem/mem.h"
+#include "../../mem/shm_mem.h"
+#include "../../dprint.h"
+#include "../../hash_func.h"
+#include "prefix_tree.h"
+#include "dr_cache.h"
+
+
+struct dr_cache_entry {
+	/* key */
+	unsigned int gen;
+	unsigned int rgid;
+	unsigned int hash;
+	unsigned short len;
+	char number[DR_CACHE_MAX_NUMBER];
+	/* cached result */
+	rt_info_t *rt_info;
+	unsigned int matched_len;
+	unsigned int rgidx;
+	/* second of the lookup, 0 if the result does not depend on time */
+	time_t stamp;
+	/* hash bucket */
+	struct dr_cache_entry *hnext;
+	/* LRU list */
+	struct dr_cache_entry *prev;
+	struct dr_cache_entry *next;
+};
+
+struct dr_cache {
+	unsigned int mask;
+	struct dr_cache_entry **buckets;
+	/* list head - next is the most recently used, prev the oldest */
+	struct dr_cache_entry lru;
+	struct dr_cache_entry *entries;
+};
+
+int dr_cache_size = 0;
+
+stat_var *dr_cache_hits = NULL;
+stat_var *dr_cache_misses = NULL;
+
+/* last generation given to a data set (shared by all processes) */
+static unsigned int *dr_cache_gen = NULL;
+
+/* the cache of this process, built on first use */
+static struct dr_cache *cache = NULL;
+
+
+int init_dr_cache(void)
+{
+	dr_cache_gen = (unsigned int*)shm_malloc(sizeof(unsigned int));
+	if (dr_cache_gen==NULL) {
+		LM_ERR("no more shm mem\n");
+		return -1;
+	}
+	*dr_cache_gen = 0;
+
+	if (dr_cache_size<0)
+		dr_cache_size = 0;
+
+	return 0;
+}
+
+
+void destroy_dr_cache(void)
+{
+	if (dr_cache_gen) {
+		shm_free(dr_cache_gen);
+		dr_cache_gen = NULL;
+	}
+}
+
+
+void dr_cache_tag_data(rt_data_t *rd)
+{
+	/* 0 is never given, so the empty cache entries match nothing */
+	rd->gen = __sync_add_and_fetch(dr_cache_gen, 1);
+	if (rd->gen==0)
+		rd->gen = __sync_add_and_fetch(dr_cache_gen, 1);
+}
+
+
+static inline void lru_unlink(struct dr_cache_entry *e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+}
+
+
+static inline void lru_push_front(struct dr_cache_entry *e)
+{
+	e->next = cache->lru.next;
+	e->prev = &cache->lru;
+	cache->lru.next->prev = e;
+	cache->lru.next = e;
+}
+
+
+static int build_cache(void)
+{
+	unsigned int size;
+	int i;
+
+	for (size = 1; size < (unsigned int)dr_cache_size; size <<= 1);
+
+	cache = (struct dr_cache*)pkg_malloc(sizeof(struct dr_cache) +
+		size * sizeof(struct dr_cache_entry*) +
+		dr_cache_size * sizeof(struct dr_cache_entry));
+	if (cache==NULL) {
+		LM_ERR("no more pkg mem for %d cache entries, disabling the "
+			"cache\n", dr_cache_size);
+		dr_cache_size = 0;
+		return -1;
+	}
+	memset(cache, 0, sizeof(struct dr_cache) +
+		size * sizeof(struct dr_cache_entry*) +
+		dr_cache_size * sizeof(struct dr_cache_entry));
+
+	cache->mask = size - 1;
+	cache->buckets = (struct dr_cache_entry**)(cache + 1);
+	cache->entries = (struct dr_cache_entry*)(cache->buckets + size);
+
+	/* all the (empty) entries start in the LRU list, none in the hash */
+	cache->lru.next = cache->lru.prev = &cache->lru;
+	for (i = 0; i < dr_cache_size; i++)
+		lru_push_front(&cache->entries[i]);
+
+	return 0;
+}
+
+
+/* takes the least recently used entry out of the cache */
+static struct dr_cache_entry* evict_entry(void)
+{
+	struct dr_cache_entry *e, **p;
+
+	e = cache->lru.prev;
+	lru_unlink(e);
+
+	if (e->gen) {
+		for (p = &cache->buckets[e->hash & cache->mask]; *p; p = &(*p)->hnext)
+			if (*p==e) {
+				*p = e->hnext;
+				break;
+			}
+		e->gen = 0;
+	}
+
+	return e;
+}
+
+
+rt_info_t* dr_cache_lookup(rt_data_t *rd, str *number, unsigned int rgid,
+		unsigned int *matched_len, unsigned int *rgidx)
+{
+	struct dr_cache_entry *e;
+	unsigned int hash;
+	time_t now;
+
+	/* only the lookups from the start of the rule list are cached */
+	if (dr_cache_size==0 || *rgidx!=0 || rd->gen==0 ||
+	number->len>DR_CACHE_MAX_NUMBER || (cache==NULL && build_cache()<0))
+		return get_packed_prefix( rd->ppt, rd->pt, number, rgid,
+			matched_len, rgidx);
+
+	now = rd->timed_rules ? time(NULL) : 0;
+
+	hash = core_hash(number, NULL, 0) ^ (rgid * 2654435761u) ^ rd->gen;
+	for (e = cache->buckets[hash & cache->mask]; e; e = e->hnext)
+		if (e->hash==hash && e->gen==rd->gen && e->rgid==rgid &&
+		e->len==number->len && memcmp(e->number, number->s, e->len)==0)
+			break;
+
+	if (e && e->stamp==now) {
+		update_stat( dr_cache_hits, 1);
+		lru_unlink(e);
+		lru_push_front(e);
+		if (matched_len) *matched_len = e->matched_len;
+		*rgidx = e->rgidx;
+		return e->rt_info;
+	}
+
+	update_stat( dr_cache_misses, 1);
+
+	if (e==NULL) {
+		e = evict_entry();
+		e->gen = rd->gen;
+		e->rgid = rgid;
+		e->hash = hash;
+		e->len = number->len;
+		memcpy(e->number, number->s, number->len);
+		e->hnext = cache->buckets[hash & cache->mask];
+		cache->buckets[hash & cache->mask] = e;
+	} else {
+		lru_unlink(e);
+	}
+	lru_push_front(e);
+
+	e->matched_len = e->rgidx = 0;
+	e->rt_info = get_packed_prefix( rd->ppt, rd->pt, number, rgid,
+		&e->matched_len, &e->rgidx);
+	e->stamp = now;
+
+	if (matched_len) *matched_len = e->matched_len;
+	*rgidx = e->rgidx;
+	return e->rt_info;
+}
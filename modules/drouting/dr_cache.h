@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2016 OpenSIPS Solutions
+ *
+ * This file is part of Open SIP Server (OpenSIPS).
+ *
+ * DROUTING OpenSIPS-module is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * DROUTING OpenSIPS-module is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Per process LRU cache of the prefix lookups.
+ *
+ * The results are keyed by (data set, group, number), where the data set is
+ * identified by the generation it got when published - so a reload makes
+ * all the previous results unreachable, without any shared invalidation.
+ * If the data set has rules with time recurrences, a result is used only
+ * within the second it was computed in (the granularity of the time
+ * checks), so the cached lookups give the very same results as the tree.
+ */
+
+#ifndef _DR_DR_CACHE_H
+#define _DR_DR_CACHE_H
+
+#include "../../str.h"
+#include "../../statistics.h"
+#include "routing.h"
+
+/* numbers longer than this are not cached */
+#define DR_CACHE_MAX_NUMBER 32
+
+/* max number of cached lookups per process (0 - cache disabled) */
+extern int dr_cache_size;
+
+extern stat_var *dr_cache_hits;
+extern stat_var *dr_cache_misses;
+
+int init_dr_cache(void);
+
+void destroy_dr_cache(void);
+
+/* gives a new (not used before) generation to a data set about
+ * to be published */
+void dr_cache_tag_data(rt_data_t *rd);
+
+/* same as get_packed_prefix() over the data set, but via the cache */
+rt_info_t* dr_cache_lookup(rt_data_t *rd, str *number, unsigned int rgid,
+		unsigned int *matched_len, unsigned int *rgidx);
+
+#endif
@@ -86,4 +86,11 @@ str gwlist_drc_col = str_init(GWLIST_DRC_COL);
 str attrs_drc_col = str_init(ATTRS_DRC_COL);
 str state_drc_col = str_init(STATE_DRC_COL);
 
+/* DR rules changelog related defs (no table - no delta reloads) */
+#define ID_DRL_COL     "id"
+#define PREFIX_DRL_COL "prefix"
+str drl_table = {NULL, 0};
+str id_drl_col = str_init(ID_DRL_COL);
+str prefix_drl_col = str_init(PREFIX_DRL_COL);
+
 
@@ -63,5 +63,10 @@ extern str gwlist_drc_col;
 extern str attrs_drc_col;
 extern str state_drc_col;
 
+/* DR rules changelog related defs */
+extern str drl_table;
+extern str id_drl_col;
+extern str prefix_drl_col;
+
 #endif
 
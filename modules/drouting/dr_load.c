@@ -39,6 +39,7 @@
 #include "../../route.h"
 #include "../../db/db.h"
 #include "../../mem/shm_mem.h"
+#include "../../mem/mem.h"
 #include "../../time_rec.h"
 #include "../../socket_info.h"
 
@@ -203,6 +204,172 @@ error:
 #define STR_VALS_DSTLIST_DRR_COL  4
 #define STR_VALS_ATTRS_DRR_COL    5
 
+/* loads into @rdata the rules matching the given keys (all if none) */
+static int dr_load_rules(struct head_db *current_partition, rt_data_t *rdata,
+		db_key_t *keys, db_val_t *vals, int n_keys)
+{
+	int    int_vals[5];
+	char * str_vals[6];
+	str tmp;
+	db_func_t *dr_dbf = &current_partition->db_funcs;
+	db_con_t* db_hdl = *current_partition->db_con;
+	str *drr_table = &current_partition->drr_table;
+	db_key_t columns[8];
+	db_res_t* res = 0;
+	db_row_t* row;
+	rt_info_t *ri;
+	tmrec_t   *time_rec;
+	int i,n;
+	int no_rows = 10;
+
+	if (dr_dbf->use_table( db_hdl, drr_table) < 0) {
+		LM_ERR("cannot select table \"%.*s\"\n", drr_table->len, drr_table->s);
+		goto error;
+	}
+
+	columns[0] = &rule_id_drr_col;
+	columns[1] = &group_drr_col;
+	columns[2] = &prefix_drr_col;
+	columns[3] = &time_drr_col;
+	columns[4] = &priority_drr_col;
+	columns[5] = &routeid_drr_col;
+	columns[6] = &dstlist_drr_col;
+	columns[7] = &attrs_drr_col;
+
+	if (DB_CAPABILITY(*dr_dbf, DB_CAP_FETCH)) {
+		if ( dr_dbf->query( db_hdl, keys, 0, vals, columns, n_keys, 8, 0, 0) < 0) {
+			LM_ERR("DB query failed\n");
+			goto error;
+		}
+		no_rows = estimate_available_rows( 4+32+32+128+32+64+128, 8/*cols*/);
+		if (no_rows==0) no_rows = 10;
+		if(dr_dbf->fetch_result(db_hdl, &res, no_rows)<0) {
+			LM_ERR("Error fetching rows\n");
+			goto error;
+		}
+	} else {
+		if ( dr_dbf->query( db_hdl, keys, 0, vals, columns, n_keys, 8, 0, &res) < 0) {
+			LM_ERR("DB query failed\n");
+			goto error;
+		}
+	}
+
+	if (RES_ROW_N(res) == 0 && n_keys==0) {
+		LM_WARN("table \"%.*s\" is empty\n", drr_table->len, drr_table->s);
+	}
+
+	LM_DBG("initial %d records found in %.*s\n", RES_ROW_N(res),
+			drr_table->len, drr_table->s);
+
+	n = 0;
+	do {
+		for(i=0; i < RES_ROW_N(res); i++) {
+			row = RES_ROWS(res) + i;
+			/* RULE_ID column */
+			check_val( rule_id_drr_col, ROW_VALUES(row), DB_INT, 1, 0);
+			int_vals[INT_VALS_RULE_ID_DRR_COL] = VAL_INT (ROW_VALUES(row));
+			/* GROUP column */
+			check_val( group_drr_col, ROW_VALUES(row)+1, DB_STRING, 1, 1);
+			str_vals[STR_VALS_GROUP_DRR_COL] = (char*)VAL_STRING(ROW_VALUES(row)+1);
+			/* PREFIX column - it may be null or empty */
+			check_val( prefix_drr_col, ROW_VALUES(row)+2, DB_STRING, 0, 0);
+			if ((ROW_VALUES(row)+2)->nul || VAL_STRING(ROW_VALUES(row)+2)==0){
+				tmp.s = NULL;
+				tmp.len = 0;
+			} else {
+				str_vals[STR_VALS_PREFIX_DRR_COL] = (char*)VAL_STRING(ROW_VALUES(row)+2);
+				tmp.s = str_vals[STR_VALS_PREFIX_DRR_COL];
+				tmp.len = strlen(str_vals[STR_VALS_PREFIX_DRR_COL]);
+				if (tmp.len > PTREE_MAX_DEPTH) {
+					LM_ERR("prefix of rule id %d longer than %d -> skipping\n",
+						int_vals[INT_VALS_RULE_ID_DRR_COL], PTREE_MAX_DEPTH);
+					continue;
+				}
+			}
+			/* TIME column */
+			check_val( time_drr_col, ROW_VALUES(row)+3, DB_STRING, 0, 0);
+			str_vals[STR_VALS_TIME_DRR_COL] = (char*)VAL_STRING(ROW_VALUES(row)+3);
+			/* PRIORITY column */
+			check_val( priority_drr_col, ROW_VALUES(row)+4, DB_INT, 1, 0);
+			int_vals[INT_VALS_PRIORITY_DRR_COL] = VAL_INT   (ROW_VALUES(row)+4);
+			/* ROUTE_ID column */
+			check_val( routeid_drr_col, ROW_VALUES(row)+5, DB_STRING, 0, 0);
+			str_vals[STR_VALS_ROUTEID_DRR_COL] = (char*)VAL_STRING(ROW_VALUES(row)+5);
+			/* DSTLIST column */
+			check_val( dstlist_drr_col, ROW_VALUES(row)+6, DB_STRING, 1, 1);
+			str_vals[STR_VALS_DSTLIST_DRR_COL] = (char*)VAL_STRING(ROW_VALUES(row)+6);
+			/* ATTRS column */
+			check_val( attrs_drr_col, ROW_VALUES(row)+7, DB_STRING, 0, 0);
+			str_vals[STR_VALS_ATTRS_DRR_COL] = (char*)VAL_STRING(ROW_VALUES(row)+7);
+			/* parse the time definition */
+			if (str_vals[STR_VALS_TIME_DRR_COL] == NULL || *(str_vals[STR_VALS_TIME_DRR_COL]) == 0)
+				time_rec = NULL;
+			else if ((time_rec=parse_time_def(str_vals[STR_VALS_TIME_DRR_COL]))==0) {
+				LM_ERR("bad time definition <%s> for rule id %d -> skipping\n",
+						str_vals[STR_VALS_TIME_DRR_COL], int_vals[INT_VALS_RULE_ID_DRR_COL]);
+				continue;
+			}
+			if (time_rec && time_rec->dtstart)
+				rdata->timed_rules = 1;
+			/* lookup for the script route ID */
+			if (str_vals[STR_VALS_ROUTEID_DRR_COL] && str_vals[STR_VALS_ROUTEID_DRR_COL][0]) {
+				int_vals[INT_VALS_SCRIPT_ROUTE_ID] =
+					get_script_route_ID_by_name( str_vals[STR_VALS_ROUTEID_DRR_COL], rlist, RT_NO);
+				if (int_vals[INT_VALS_SCRIPT_ROUTE_ID]==-1) {
+					LM_WARN("route <%s> does not exist\n",
+							str_vals[STR_VALS_ROUTEID_DRR_COL]);
+					int_vals[INT_VALS_SCRIPT_ROUTE_ID] = 0;
+				}
+			} else {
+				int_vals[INT_VALS_SCRIPT_ROUTE_ID] = 0;
+			}
+			/* build the routing rule */
+			if ((ri = build_rt_info( int_vals[INT_VALS_RULE_ID_DRR_COL],
+							int_vals[INT_VALS_PRIORITY_DRR_COL], time_rec,
+							int_vals[INT_VALS_SCRIPT_ROUTE_ID],
+							str_vals[STR_VALS_DSTLIST_DRR_COL],
+							str_vals[STR_VALS_ATTRS_DRR_COL], rdata))== 0 ) {
+				LM_ERR("failed to add routing info for rule id %d -> "
+						"skipping\n", int_vals[INT_VALS_RULE_ID_DRR_COL]);
+				tmrec_free( time_rec );
+				continue;
+			}
+			/* add the rule */
+			if (add_rule( rdata, str_vals[STR_VALS_GROUP_DRR_COL], &tmp, ri)!=0) {
+				LM_ERR("failed to add rule id %d -> skipping\n",
+						int_vals[INT_VALS_RULE_ID_DRR_COL]);
+				free_rt_info( ri );
+				continue;
+			}
+			n++;
+		}
+		if (DB_CAPABILITY(*dr_dbf, DB_CAP_FETCH)) {
+			if(dr_dbf->fetch_result(db_hdl, &res, no_rows)<0) {
+				LM_ERR( "fetching rows (1)\n");
+				goto error;
+			}
+			LM_DBG("additional %d records found in %.*s\n", RES_ROW_N(res),
+					drr_table->len, drr_table->s);
+		} else {
+			break;
+		}
+	} while(RES_ROW_N(res)>0);
+
+	dr_dbf->free_result(db_hdl, res);
+	res = 0;
+
+	LM_DBG("%d total records loaded from table %.*s\n", n,
+			drr_table->len, drr_table->s);
+
+	return n;
+error:
+	if (res)
+		dr_dbf->free_result(db_hdl, res);
+	return -1;
+}
+
+
+
 /* loads routing info for given partition; if partition_name is NULL
  * loads all partitions
  */
@@ -212,18 +379,14 @@ rt_data_t* dr_load_routing_info(struct head_db *current_partition
 {
 	int    int_vals[5];
 	char * str_vals[6];
-	str tmp;
 	db_func_t *dr_dbf = &current_partition->db_funcs;
 	db_con_t* db_hdl = *current_partition->db_con;
 	str *drd_table = &current_partition->drd_table;
 	str *drc_table = &current_partition->drc_table;
-	str *drr_table = &current_partition->drr_table;
 	db_key_t columns[10];
 	db_res_t* res;
 	db_row_t* row;
-	rt_info_t *ri;
 	rt_data_t *rdata;
-	tmrec_t   *time_rec;
 	int i,n;
 	int no_rows = 10;
 	int db_cols;
@@ -233,7 +396,6 @@ rt_data_t* dr_load_routing_info(struct head_db *current_partition
 	char id_buf[INT2STR_MAX_LEN];
 
 	res = 0;
-	ri = 0;
 	rdata = 0;
 
 	/* init new data structure */
@@ -492,143 +654,264 @@ rt_data_t* dr_load_routing_info(struct head_db *current_partition
 
 
 	/* read the routing rules */
-	if (dr_dbf->use_table( db_hdl, drr_table) < 0) {
-		LM_ERR("cannot select table \"%.*s\"\n", drr_table->len, drr_table->s);
+	if (dr_load_rules( current_partition, rdata, NULL, NULL, 0)<0)
+		goto error;
+
+	/* all prefixes added - switch to the compact tree for lookups */
+	if ( (rdata->ppt=pack_tree(rdata->pt))==NULL ) {
+		LM_ERR("failed to pack the prefix tree\n");
 		goto error;
 	}
+	rdata->pt = NULL;
 
-	columns[0] = &rule_id_drr_col;
-	columns[1] = &group_drr_col;
-	columns[2] = &prefix_drr_col;
-	columns[3] = &time_drr_col;
-	columns[4] = &priority_drr_col;
-	columns[5] = &routeid_drr_col;
-	columns[6] = &dstlist_drr_col;
-	columns[7] = &attrs_drr_col;
+	return rdata;
+error:
+	if (res)
+		dr_dbf->free_result(db_hdl, res);
+	if (rdata)
+		free_rt_data( rdata, 1 );
+	rdata = NULL;
+	return 0;
+}
+
+
+/* max number of changed prefixes kept aside the packed tree; beyond it,
+ * a full reload is cheaper than the per prefix queries */
+#define DR_DELTA_MAX_PREFIXES 4096
+
+struct dr_prefix_set {
+	str *p;
+	int no;
+	int size;
+};
+
+static int add_prefix_to_set(str *prefix, void *param)
+{
+	struct dr_prefix_set *set = (struct dr_prefix_set*)param;
+	str *p;
+	int i;
+
+	for( i=0 ; i<set->no ; i++ )
+		if (set->p[i].len==prefix->len &&
+		memcmp(set->p[i].s, prefix->s, prefix->len)==0)
+			return 0;
+
+	if (set->no==DR_DELTA_MAX_PREFIXES)
+		return 1;
+
+	if (set->no==set->size) {
+		p = pkg_realloc(set->p, (set->size+64)*sizeof(str));
+		if (p==NULL) {
+			LM_ERR("no more pkg mem\n");
+			return -1;
+		}
+		set->p = p;
+		set->size += 64;
+	}
+
+	set->p[set->no].s = pkg_malloc(prefix->len);
+	if (set->p[set->no].s==NULL) {
+		LM_ERR("no more pkg mem\n");
+		return -1;
+	}
+	memcpy(set->p[set->no].s, prefix->s, prefix->len);
+	set->p[set->no++].len = prefix->len;
+
+	return 0;
+}
+
+static void free_prefix_set(struct dr_prefix_set *set)
+{
+	int i;
+
+	for( i=0 ; i<set->no ; i++ )
+		pkg_free(set->p[i].s);
+	if (set->p)
+		pkg_free(set->p);
+	memset(set, 0, sizeof *set);
+}
+
+
+/* reads the changelog entries newer than @last_id and collects the changed
+ * prefixes into @set (if given); @last_id is moved to the newest entry.
+ * Returns 1 if a full reload is required - an entry with an empty prefix
+ * (gateways, carriers or prefixless rules changed) or too many prefixes */
+static int dr_read_changelog(struct head_db *current_partition,
+		unsigned int *last_id, struct dr_prefix_set *set)
+{
+	db_func_t *dr_dbf = &current_partition->db_funcs;
+	db_con_t* db_hdl = *current_partition->db_con;
+	db_key_t columns[2];
+	db_key_t key;
+	db_op_t op = OP_GT;
+	db_val_t val;
+	db_res_t* res = 0;
+	db_row_t* row;
+	unsigned int id;
+	str prefix;
+	int i, rc, full = 0;
+	int no_rows = 10;
+
+	if (dr_dbf->use_table( db_hdl, &drl_table) < 0) {
+		LM_ERR("cannot select table \"%.*s\"\n", drl_table.len, drl_table.s);
+		goto error;
+	}
+
+	columns[0] = &id_drl_col;
+	columns[1] = &prefix_drl_col;
+	key = &id_drl_col;
+	VAL_TYPE(&val) = DB_INT;
+	VAL_NULL(&val) = 0;
+	VAL_INT(&val) = (int)*last_id;
 
 	if (DB_CAPABILITY(*dr_dbf, DB_CAP_FETCH)) {
-		if ( dr_dbf->query( db_hdl, 0, 0, 0, columns, 0, 8, 0, 0) < 0) {
+		if ( dr_dbf->query( db_hdl, &key, &op, &val, columns, 1, 2,
+		&id_drl_col, 0) < 0) {
 			LM_ERR("DB query failed\n");
 			goto error;
 		}
-		no_rows = estimate_available_rows( 4+32+32+128+32+64+128, 8/*cols*/);
+		no_rows = estimate_available_rows( 4+64, 2);
 		if (no_rows==0) no_rows = 10;
 		if(dr_dbf->fetch_result(db_hdl, &res, no_rows)<0) {
 			LM_ERR("Error fetching rows\n");
 			goto error;
 		}
 	} else {
-		if ( dr_dbf->query( db_hdl, 0, 0, 0, columns, 0, 8, 0, &res) < 0) {
+		if ( dr_dbf->query( db_hdl, &key, &op, &val, columns, 1, 2,
+		&id_drl_col, &res) < 0) {
 			LM_ERR("DB query failed\n");
 			goto error;
 		}
 	}
 
-	if (RES_ROW_N(res) == 0) {
-		LM_WARN("table \"%.*s\" is empty\n", drr_table->len, drr_table->s);
-	}
-
-	LM_DBG("initial %d records found in %.*s\n", RES_ROW_N(res),
-			drr_table->len, drr_table->s);
-
-	n = 0;
 	do {
 		for(i=0; i < RES_ROW_N(res); i++) {
 			row = RES_ROWS(res) + i;
-			/* RULE_ID column */
-			check_val( rule_id_drr_col, ROW_VALUES(row), DB_INT, 1, 0);
-			int_vals[INT_VALS_RULE_ID_DRR_COL] = VAL_INT (ROW_VALUES(row));
-			/* GROUP column */
-			check_val( group_drr_col, ROW_VALUES(row)+1, DB_STRING, 1, 1);
-			str_vals[STR_VALS_GROUP_DRR_COL] = (char*)VAL_STRING(ROW_VALUES(row)+1);
-			/* PREFIX column - it may be null or empty */
-			check_val( prefix_drr_col, ROW_VALUES(row)+2, DB_STRING, 0, 0);
-			if ((ROW_VALUES(row)+2)->nul || VAL_STRING(ROW_VALUES(row)+2)==0){
-				tmp.s = NULL;
-				tmp.len = 0;
-			} else {
-				str_vals[STR_VALS_PREFIX_DRR_COL] = (char*)VAL_STRING(ROW_VALUES(row)+2);
-				tmp.s = str_vals[STR_VALS_PREFIX_DRR_COL];
-				tmp.len = strlen(str_vals[STR_VALS_PREFIX_DRR_COL]);
-			}
-			/* TIME column */
-			check_val( time_drr_col, ROW_VALUES(row)+3, DB_STRING, 0, 0);
-			str_vals[STR_VALS_TIME_DRR_COL] = (char*)VAL_STRING(ROW_VALUES(row)+3);
-			/* PRIORITY column */
-			check_val( priority_drr_col, ROW_VALUES(row)+4, DB_INT, 1, 0);
-			int_vals[INT_VALS_PRIORITY_DRR_COL] = VAL_INT   (ROW_VALUES(row)+4);
-			/* ROUTE_ID column */
-			check_val( routeid_drr_col, ROW_VALUES(row)+5, DB_STRING, 0, 0);
-			str_vals[STR_VALS_ROUTEID_DRR_COL] = (char*)VAL_STRING(ROW_VALUES(row)+5);
-			/* DSTLIST column */
-			check_val( dstlist_drr_col, ROW_VALUES(row)+6, DB_STRING, 1, 1);
-			str_vals[STR_VALS_DSTLIST_DRR_COL] = (char*)VAL_STRING(ROW_VALUES(row)+6);
-			/* ATTRS column */
-			check_val( attrs_drr_col, ROW_VALUES(row)+7, DB_STRING, 0, 0);
-			str_vals[STR_VALS_ATTRS_DRR_COL] = (char*)VAL_STRING(ROW_VALUES(row)+7);
-			/* parse the time definition */
-			if (str_vals[STR_VALS_TIME_DRR_COL] == NULL || *(str_vals[STR_VALS_TIME_DRR_COL]) == 0)
-				time_rec = NULL;
-			else if ((time_rec=parse_time_def(str_vals[STR_VALS_TIME_DRR_COL]))==0) {
-				LM_ERR("bad time definition <%s> for rule id %d -> skipping\n",
-						str_vals[STR_VALS_TIME_DRR_COL], int_vals[INT_VALS_RULE_ID_DRR_COL]);
+			check_val( id_drl_col, ROW_VALUES(row), DB_INT, 1, 0);
+			id = (unsigned int)VAL_INT(ROW_VALUES(row));
+			if (id > *last_id)
+				*last_id = id;
+			if (set==NULL || full)
 				continue;
-			}
-			/* lookup for the script route ID */
-			if (str_vals[STR_VALS_ROUTEID_DRR_COL] && str_vals[STR_VALS_ROUTEID_DRR_COL][0]) {
-				int_vals[INT_VALS_SCRIPT_ROUTE_ID] =
-					get_script_route_ID_by_name( str_vals[STR_VALS_ROUTEID_DRR_COL], rlist, RT_NO);
-				if (int_vals[INT_VALS_SCRIPT_ROUTE_ID]==-1) {
-					LM_WARN("route <%s> does not exist\n",
-							str_vals[STR_VALS_ROUTEID_DRR_COL]);
-					int_vals[INT_VALS_SCRIPT_ROUTE_ID] = 0;
-				}
-			} else {
-				int_vals[INT_VALS_SCRIPT_ROUTE_ID] = 0;
-			}
-			/* build the routing rule */
-			if ((ri = build_rt_info( int_vals[INT_VALS_RULE_ID_DRR_COL],
-							int_vals[INT_VALS_PRIORITY_DRR_COL], time_rec,
-							int_vals[INT_VALS_SCRIPT_ROUTE_ID],
-							str_vals[STR_VALS_DSTLIST_DRR_COL],
-							str_vals[STR_VALS_ATTRS_DRR_COL], rdata))== 0 ) {
-				LM_ERR("failed to add routing info for rule id %d -> "
-						"skipping\n", int_vals[INT_VALS_RULE_ID_DRR_COL]);
-				tmrec_free( time_rec );
+			check_val( prefix_drl_col, ROW_VALUES(row)+1, DB_STRING, 0, 0);
+			if ((ROW_VALUES(row)+1)->nul || VAL_STRING(ROW_VALUES(row)+1)==0 ||
+			(prefix.len=strlen(VAL_STRING(ROW_VALUES(row)+1)))==0 ) {
+				full = 1;
 				continue;
 			}
-			/* add the rule */
-			if (add_rule( rdata, str_vals[STR_VALS_GROUP_DRR_COL], &tmp, ri)!=0) {
-				LM_ERR("failed to add rule id %d -> skipping\n",
-						int_vals[INT_VALS_RULE_ID_DRR_COL]);
-				free_rt_info( ri );
+			prefix.s = (char*)VAL_STRING(ROW_VALUES(row)+1);
+			if (prefix.len > PTREE_MAX_DEPTH)
 				continue;
-			}
-			n++;
+			if ( (rc=add_prefix_to_set(&prefix, set))<0 )
+				goto error;
+			if (rc>0)
+				full = 1;
 		}
 		if (DB_CAPABILITY(*dr_dbf, DB_CAP_FETCH)) {
 			if(dr_dbf->fetch_result(db_hdl, &res, no_rows)<0) {
 				LM_ERR( "fetching rows (1)\n");
 				goto error;
 			}
-			LM_DBG("additional %d records found in %.*s\n", RES_ROW_N(res),
-					drr_table->len, drr_table->s);
 		} else {
 			break;
 		}
 	} while(RES_ROW_N(res)>0);
 
 	dr_dbf->free_result(db_hdl, res);
-	res = 0;
 
-	LM_DBG("%d total records loaded from table %.*s\n", n,
-			drr_table->len, drr_table->s);
-	return rdata;
+	return full;
 error:
 	if (res)
 		dr_dbf->free_result(db_hdl, res);
-	if (rdata)
+	return -1;
+}
+
+
+int dr_changelog_position(struct head_db *current_partition,
+		unsigned int *last_id)
+{
+	if (drl_table.s==NULL || drl_table.len==0)
+		return 0;
+
+	return dr_read_changelog( current_partition, last_id, NULL)<0 ? -1 : 0;
+}
+
+
+/* builds a new routing data set out of @old, by re-reading from DB only
+ * the rules of the prefixes changed since the last load. The gws, the
+ * carriers, the prefixless rules and the packed tree are shared with
+ * @old, the changed prefixes are kept in a small tree on top of it.
+ * Returns @old if nothing changed or NULL with @full set if a full reload
+ * is needed instead */
+rt_data_t* dr_load_routing_delta(struct head_db *current_partition,
+		rt_data_t *old, unsigned int *last_id, int *full)
+{
+	struct dr_prefix_set set;
+	rt_data_t *rdata = NULL;
+	db_key_t key;
+	db_val_t val;
+	unsigned int new_id;
+	int i, rc;
+
+	memset(&set, 0, sizeof set);
+	*full = 0;
+
+	new_id = *last_id;
+	if ( (rc=dr_read_changelog( current_partition, &new_id, &set))<0 )
+		goto error;
+	if (rc>0 || old==NULL || old->ppt==NULL) {
+		*full = 1;
+		goto error;
+	}
+	if (new_id==*last_id) {
+		LM_DBG("no changes since changelog entry %u\n", new_id);
+		free_prefix_set(&set);
+		return old;
+	}
+
+	/* the prefixes changed by the previous delta reloads are reloaded too,
+	 * as the new overlay replaces the old one */
+	if ( (rc=walk_tree_prefixes( old->pt, add_prefix_to_set, &set))!=0 ) {
+		if (rc>0)
+			*full = 1;
+		goto error;
+	}
+
+	if ( (rdata=build_rt_data())==0 ) {
+		LM_ERR("failed to build rdata\n");
+		goto error;
+	}
+	rdata->pgw_l = old->pgw_l;
+	rdata->carriers = old->carriers;
+	rdata->noprefix = old->noprefix;
+	rdata->ppt = old->ppt;
+	rdata->timed_rules = old->timed_rules;
+
+	key = &prefix_drr_col;
+	VAL_TYPE(&val) = DB_STR;
+	VAL_NULL(&val) = 0;
+
+	for( i=0 ; i<set.no ; i++ ) {
+		/* even with no rules left, the prefix hides the packed one */
+		if (mark_prefix( rdata->pt, &set.p[i])<0)
+			goto error;
+		VAL_STR(&val) = set.p[i];
+		if (dr_load_rules( current_partition, rdata, &key, &val, 1)<0)
+			goto error;
+	}
+
+	LM_INFO("delta reload of %d prefixes (changelog %u -> %u)\n",
+		set.no, *last_id, new_id);
+	*last_id = new_id;
+
+	free_prefix_set(&set);
+	return rdata;
+error:
+	if (rdata) {
+		/* only the changed prefixes were loaded by us */
+		rdata->handed_over = 1;
 		free_rt_data( rdata, 1 );
-	rdata = NULL;
-	return 0;
+	}
+	free_prefix_set(&set);
+	return NULL;
 }
@@ -38,4 +38,10 @@
 
 rt_data_t* dr_load_routing_info(struct head_db * ,int persistent_state);
 
+rt_data_t* dr_load_routing_delta(struct head_db *current_partition,
+		rt_data_t *old, unsigned int *last_id, int *full);
+
+int dr_changelog_position(struct head_db *current_partition,
+		unsigned int *last_id);
+
 #endif
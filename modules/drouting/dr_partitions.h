@@ -77,7 +77,10 @@ struct head_db {
 	int carrier_attrs_avp;
 	rt_data_t **rdata;
 	rw_lock_t *ref_lock;
+	/* protects the state (flags) of the gws/carriers against reloads */
+	gen_lock_t *state_lock;
 	int ongoing_reload;
+	unsigned int changelog_id; /* last changelog entry loaded */
 	struct head_db *next;
 };
 
@@ -33,10 +33,12 @@
 #include <unistd.h>
 
 #include "../../evi/evi.h"
+#include "../../rcu.h"
 
 #include "dr_load.h"
 #include "prefix_tree.h"
 #include "dr_bl.h"
+#include "dr_cache.h"
 #include "dr_db_def.h"
 #include "dr_partitions.h"
 #include "dr_api.h"
@@ -53,6 +55,7 @@
 #define DRR_TABLE_VER 3
 #define DRG_TABLE_VER 2
 #define DRC_TABLE_VER 2
+#define DRL_TABLE_VER 1
 #define PART_TABLE_VER 1
 
 #define MAX_LEN_NAME_W_PART 510 /* max len of variable containing
@@ -268,6 +271,7 @@ static struct mi_root* mi_dr_gw_status(struct mi_root *cmd, void *param);
 static struct mi_root* mi_dr_cr_status(struct mi_root *cmd, void *param);
 static struct mi_root* mi_dr_number_routing(struct mi_root *cmd_tree, void *param);
 static struct mi_root* mi_dr_reload_status(struct mi_root *cmd_tree, void *param);
+static struct mi_root* dr_reload_delta_cmd(struct mi_root *cmd_tree, void *param);
 
 
 /* event */
@@ -379,6 +383,7 @@ static param_export_t params[] = {
 	{"drr_table",        STR_PARAM, &drr_table.s      },
 	{"drg_table",        STR_PARAM, &drg_table.s      },
 	{"drc_table",        STR_PARAM, &drc_table.s      },
+	{"drl_table",        STR_PARAM, &drl_table.s      },
 	{"use_domain",       INT_PARAM, &use_domain       },
 	{"drg_user_col",     STR_PARAM, &drg_user_col.s   },
 	{"drg_domain_col",   STR_PARAM, &drg_domain_col.s },
@@ -399,6 +404,14 @@ static param_export_t params[] = {
 	{"probing_reply_codes",STR_PARAM, &dr_probe_replies.s     },
 	{"persistent_state", INT_PARAM, &dr_persistent_state      },
 	{"no_concurrent_reload",INT_PARAM, &no_concurrent_reload  },
+	{"cache_size",       INT_PARAM, &dr_cache_size            },
+	{0, 0, 0}
+};
+
+
+static stat_export_t mod_stats[] = {
+	{"cache_hits",       0,             &dr_cache_hits        },
+	{"cache_misses",     0,             &dr_cache_misses      },
 	{0, 0, 0}
 };
 
@@ -421,12 +434,16 @@ static param_export_t params[] = {
 	" (load from database) for all partitions if no parameter is supplied, or"\
 " for a partition given as parameter. If use_partitions is 0, you should"\
 " not specify a partition."
+#define HLP6 "Params: [partition] ; Loads from DB only the rules changed since"\
+	" the last load (as per the changelog table), for all partitions if no"\
+" parameter is supplied, or for a partition given as parameter."
 static mi_export_t mi_cmds[] = {
 	{ "dr_reload",         HLP1, dr_reload_cmd,    0, 0,  0},
 	{ "dr_gw_status",      HLP2, mi_dr_gw_status,  0,                0,  0},
 	{ "dr_carrier_status", HLP3, mi_dr_cr_status,  0,                0,  0},
 	{ "dr_number_routing", HLP4, mi_dr_number_routing, 0,            0,  0},
 	{ "dr_reload_status", HLP5, mi_dr_reload_status,   0,            0,  0},
+	{ "dr_reload_delta",  HLP6, dr_reload_delta_cmd,   0,            0,  0},
 	{ 0, 0, 0, 0, 0, 0}
 };
 
@@ -458,7 +475,7 @@ struct module_exports exports = {
 	cmds,            /* Exported functions */
 	0,               /* Exported async functions */
 	params,          /* Exported parameters */
-	0,               /* exported statistics */
+	mod_stats,       /* exported statistics */
 	mi_cmds,         /* exported MI functions */
 	0,               /* exported pseudo-variables */
 	0,               /* additional processes */
@@ -575,24 +592,29 @@ static int dr_disable_w_part(struct sip_msg *req, struct head_db *current_partit
 	int_str id_val;
 	pgw_t *gw;
 
-	lock_start_read( current_partition->ref_lock );
+	rcu_read_lock();
 
 	avp = search_first_avp( AVP_VAL_STR, current_partition->gw_id_avp, &id_val,0);
 	if (avp==NULL) {
 		LM_DBG(" no AVP ID ->nothing to disable\n");
-		lock_stop_read( current_partition->ref_lock );
+		rcu_read_unlock();
 		return -1;
 	}
 
-	gw = get_gw_by_id( (*current_partition->rdata)->pgw_l, &id_val.s );
+	lock_get( current_partition->state_lock );
+	gw = get_gw_by_id( rcu_dereference(*current_partition->rdata)->pgw_l,
+		&id_val.s );
 	if (gw!=NULL && (gw->flags&DR_DST_STAT_DSBL_FLAG)==0) {
 		LM_INFO(" partition : %.*s\n", current_partition->partition.len,
 				current_partition->partition.s);
 		gw->flags |= DR_DST_STAT_DSBL_FLAG|DR_DST_STAT_DIRT_FLAG;
+		lock_release( current_partition->state_lock );
 		dr_raise_event(gw);
+	} else {
+		lock_release( current_partition->state_lock );
 	}
 
-	lock_stop_read( current_partition->ref_lock );
+	rcu_read_unlock();
 
 	return 1;
 }
@@ -604,6 +626,7 @@ static void dr_probing_callback( struct cell *t, int type,
 	int code = ps->code;
 	pgw_t *gw;
 	int _id ;
+	int raise = 0;
 	struct head_db * current_partition;
 
 	if (!ps->param || !*ps->param) {
@@ -620,11 +643,14 @@ static void dr_probing_callback( struct cell *t, int type,
 
 
 
-	lock_start_read( current_partition->ref_lock );
+	rcu_read_lock();
 
 	_id = ((param_prob_callback_t*)*ps->param)->_id;
 
-	gw = get_gw_by_internal_id( (*(current_partition->rdata))->pgw_l, _id);
+	lock_get( current_partition->state_lock );
+
+	gw = get_gw_by_internal_id(
+		rcu_dereference(*(current_partition->rdata))->pgw_l, _id);
 	if (gw==NULL)
 		goto end;
 
@@ -635,19 +661,22 @@ static void dr_probing_callback( struct cell *t, int type,
 			goto end;
 		gw->flags &= ~DR_DST_STAT_DSBL_FLAG;
 		gw->flags |= DR_DST_STAT_DIRT_FLAG;
-		dr_raise_event(gw);
+		raise = 1;
 		goto end;
 	}
 
 	if (code>=400 && (gw->flags&DR_DST_STAT_DSBL_FLAG)==0) {
 		gw->flags |= DR_DST_STAT_DSBL_FLAG|DR_DST_STAT_DIRT_FLAG;
-		dr_raise_event(gw);
+		raise = 1;
 		goto end;
 	}
 
 
 end:
-	lock_stop_read( current_partition->ref_lock );
+	lock_release( current_partition->state_lock );
+	if (raise)
+		dr_raise_event(gw);
+	rcu_read_unlock();
 
 	return;
 }
@@ -671,7 +700,7 @@ static void dr_prob_handler(unsigned int ticks, void* param)
 		if (it->rdata==NULL || *(it->rdata)==NULL)
 			return;
 
-		lock_start_read( it->ref_lock );
+		rcu_read_lock();
 
 		/* go through all destinations */
 		for( dst = (*(it->rdata))->pgw_l ; dst ; dst=dst->next ) {
@@ -714,7 +743,7 @@ static void dr_prob_handler(unsigned int ticks, void* param)
 
 		}
 
-		lock_stop_read( it->ref_lock );
+		rcu_read_unlock();
 		it = it->next;
 	}
 }
@@ -770,7 +799,9 @@ static void dr_state_flusher(struct head_db* hd)
 		if ( (hd->db_funcs).update(*hd->db_con,&key_cmp,0,&val_cmp,&key_set,&val_set,1,1)<0 ) {
 			LM_ERR("DB update failed\n");
 		} else {
+			lock_get( hd->state_lock );
 			gw->flags &= ~DR_DST_STAT_DIRT_FLAG;
+			lock_release( hd->state_lock );
 		}
 	}
 
@@ -800,7 +831,9 @@ static void dr_state_flusher(struct head_db* hd)
 		if ( (hd->db_funcs).update(*hd->db_con,&key_cmp,0,&val_cmp,&key_set,&val_set,1,1)<0 ) {
 			LM_ERR("DB update failed\n");
 		} else {
+			lock_get( hd->state_lock );
 			cr->flags &= ~DR_CR_FLAG_DIRTY;
+			lock_release( hd->state_lock );
 		}
 	}
 
@@ -814,11 +847,11 @@ static void dr_state_timer(unsigned int ticks, void* param)
 	struct head_db * it;
 	it = head_db_start;
 	while( it!=NULL ) {
-		lock_start_read( it->ref_lock );
+		rcu_read_lock();
 
 		dr_state_flusher(it);
 
-		lock_stop_read( it->ref_lock );
+		rcu_read_unlock();
 		it = it->next;
 	}
 }
@@ -828,12 +861,18 @@ static void dr_state_timer(unsigned int ticks, void* param)
  * -1, else return 0
  */
 
+static void dr_free_rt_data(void *rdata)
+{
+	free_rt_data( (rt_data_t*)rdata, 1 );
+}
+
 static inline int dr_reload_data_head( struct head_db *hd )
 {
 	rt_data_t *new_data;
 	rt_data_t *old_data;
 	pgw_t *gw, *old_gw;
 	pcr_t *cr, *old_cr;
+	unsigned int changelog_id;
 	time_t rawtime;
 
 	if (no_concurrent_reload) {
@@ -847,24 +886,29 @@ static inline int dr_reload_data_head( struct head_db *hd )
 		lock_release( hd->ref_lock->lock );
 	}
 
+	/* changes done while loading are picked up by the next delta reload */
+	changelog_id = hd->changelog_id;
+	if (dr_changelog_position(hd, &changelog_id)<0) {
+		LM_ERR("failed to read the changelog\n");
+		goto error;
+	}
+
 	new_data = dr_load_routing_info(hd, dr_persistent_state);
 	if ( new_data==0 ) {
 		LM_CRIT("failed to load routing info\n");
 		goto error;
 	}
 
-	lock_start_write( hd->ref_lock );
+	/* the readers are never blocked, this only serializes the concurrent
+	 * reloads, so the same old data is not retired twice */
+	lock_get( hd->ref_lock->lock );
 
-	/* no more activ readers -> do the swapping */
-	old_data = *(hd->rdata);
-	*(hd->rdata) = new_data;
-	/* update the time of the last reload for the current partition */
-	time(&rawtime);
-	hd->time_last_update = rawtime;
+	/* the state changes are done under the state lock, on the published
+	 * data - so each of them lands either in the old data before being
+	 * copied from it, or in the new data */
+	lock_get( hd->state_lock );
 
-	lock_stop_write( (hd->ref_lock) );
-
-	/* destroy old data */
+	old_data = *(hd->rdata);
 	if (old_data) {
 		/* copy the state of gw/cr from old data */
 		/* interate new gws and search them into old data */
@@ -883,13 +927,29 @@ static inline int dr_reload_data_head( struct head_db *hd )
 				cr->flags |= old_cr->flags&DR_CR_FLAG_IS_OFF;
 			}
 		}
-
-		/* free old data */
-		free_rt_data( old_data, 1 );
 	}
 
+	/* publish the new data; whoever still works with the old one keeps
+	 * it until leaving its read section */
+	dr_cache_tag_data(new_data);
+	rcu_assign_pointer( *(hd->rdata), new_data);
+
+	lock_release( hd->state_lock );
+
+	hd->changelog_id = changelog_id;
+	/* update the time of the last reload for the current partition */
+	time(&rawtime);
+	hd->time_last_update = rawtime;
+
+	lock_release( hd->ref_lock->lock );
+
+	/* destroy old data */
+	rcu_retire( old_data, dr_free_rt_data);
+
 	/* generate new blacklist from the routing info */
-	populate_dr_bls((*(hd->rdata))->pgw_l);
+	rcu_read_lock();
+	populate_dr_bls(rcu_dereference(*(hd->rdata))->pgw_l);
+	rcu_read_unlock();
 
 	if (no_concurrent_reload)
 		hd->ongoing_reload = 0;
@@ -901,6 +961,71 @@ error:
 	return -1;
 }
 
+/*
+ * applies only the rules changed (as per changelog) since the last load;
+ * falls back to a full reload if the changes are not only rules
+ */
+static inline int dr_reload_delta_head( struct head_db *hd )
+{
+	rt_data_t *new_data;
+	rt_data_t *old_data;
+	unsigned int changelog_id;
+	time_t rawtime;
+	int full;
+
+	if (no_concurrent_reload) {
+		lock_get( hd->ref_lock->lock );
+		if (hd->ongoing_reload) {
+			lock_release( hd->ref_lock->lock );
+			LM_WARN("Reload already in progress, discarding this one\n");
+			return -2;
+		}
+		hd->ongoing_reload = 1;
+		lock_release( hd->ref_lock->lock );
+	}
+
+	/* the new data is built on top of the current one, so keep the other
+	 * reloads from retiring it meanwhile (readers are not affected) */
+	lock_get( hd->ref_lock->lock );
+
+	old_data = *(hd->rdata);
+	changelog_id = hd->changelog_id;
+	new_data = dr_load_routing_delta(hd, old_data, &changelog_id, &full);
+	if (new_data==NULL) {
+		lock_release( hd->ref_lock->lock );
+		if (no_concurrent_reload)
+			hd->ongoing_reload = 0;
+		if (!full) {
+			LM_CRIT("failed to load the routing info changes\n");
+			return -1;
+		}
+		LM_INFO("changes not limited to prefixed rules, doing a full "
+			"reload of partition %.*s\n", hd->partition.len, hd->partition.s);
+		return dr_reload_data_head(hd);
+	}
+
+	if (new_data!=old_data) {
+		/* the gws, carriers and the packed tree belong from now on to the
+		 * new data; the old one still works with them until retired */
+		old_data->handed_over = 1;
+		dr_cache_tag_data(new_data);
+		rcu_assign_pointer( *(hd->rdata), new_data);
+		hd->changelog_id = changelog_id;
+		time(&rawtime);
+		hd->time_last_update = rawtime;
+	} else {
+		old_data = NULL;
+	}
+
+	lock_release( hd->ref_lock->lock );
+
+	rcu_retire( old_data, dr_free_rt_data);
+
+	if (no_concurrent_reload)
+		hd->ongoing_reload = 0;
+	return 0;
+}
+
 static inline int dr_reload_data( void ) {
 	struct head_db * it_head_db;
 	int ret_val = 0;
@@ -1011,6 +1136,10 @@ static int cleanup_head_db( struct head_db *hd) {
 		if( hd->ref_lock ) {
 			lock_destroy_rw( ref_lock );
 		}
+		if( hd->state_lock ) {
+			lock_destroy( hd->state_lock );
+			lock_dealloc( hd->state_lock );
+		}
 		if ( hd->rdata ) {
 			shm_free(hd->rdata);
 			hd->rdata = 0;
@@ -1122,6 +1251,9 @@ static int dr_init(void)
 
 	LM_INFO("Dynamic-Routing - initializing\n");
 
+	if (drl_table.s)
+		drl_table.len = strlen(drl_table.s);
+
 	name_w_part.s = shm_malloc( MAX_LEN_NAME_W_PART /* length of
 													   fixed string */);
 	if( name_w_part.s == 0 ) {
@@ -1401,6 +1533,12 @@ static int dr_init(void)
 			head_db_end->db_url.s = 0;
 			goto skip;
 		}
+		if ((head_db_end->state_lock = lock_alloc()) == NULL ||
+		lock_init(head_db_end->state_lock) == NULL) {
+			LM_CRIT("failed to init state lock\n");
+			head_db_end->db_url.s = 0;
+			goto skip;
+		}
 
 		head_db_end->db_con = pkg_malloc(sizeof(db_con_t **));
 		(*(head_db_end->db_con)) = 0;
@@ -1464,6 +1602,15 @@ static int dr_init(void)
 			return -1;
 		}
 
+		if(drl_table.len && db_check_table_version(&head_db_end->db_funcs,
+		*head_db_end->db_con, &drl_table, DRL_TABLE_VER) < 0) {
+			LM_ERR("error during table version check<changelog table \'%.*s\',"
+					" for partition \'%.*s\'>\n", drl_table.len,
+					drl_table.s, head_db_end->partition.len,
+					head_db_end->partition.s);
+			return -1;
+		}
+
 		(head_db_end->db_funcs).close(*head_db_end->db_con);
 		*head_db_end->db_con = 0;
 
@@ -1512,6 +1659,11 @@ skip:
 		LM_ERR("failed to init DR blacklists\n");
 		return E_CFG;
 	}
+
+	if (init_dr_cache()!=0) {
+		LM_ERR("failed to init the lookup cache\n");
+		return E_OUT_OF_MEM;
+	}
 	it_head_config = head_start;
 	while( it_head_config ) {
 		cleanup_head_config( it_head_config );
@@ -1711,6 +1863,11 @@ static int dr_exit(void)
 			to_clean->ref_lock = 0;
 
 		}
+		if (to_clean->state_lock) {
+			lock_destroy( to_clean->state_lock );
+			lock_dealloc( to_clean->state_lock );
+			to_clean->state_lock = 0;
+		}
 
 		/* free table names stored in head_db */
 		if(to_clean->drd_table.s && to_clean->drd_table.s != drd_table.s) {
@@ -1735,6 +1892,8 @@ static int dr_exit(void)
 	/* destroy blacklists */
 	destroy_dr_bls();
 
+	destroy_dr_cache();
+
 	return 0;
 }
 
@@ -1778,6 +1937,39 @@ error:
 }
 
 
+static struct mi_root* dr_reload_delta_cmd(struct mi_root *cmd_tree,
+															void *param)
+{
+	struct head_db * part;
+	struct mi_node * node = NULL;
+
+	LM_INFO("dr_reload_delta MI command received!\n");
+
+	if (drl_table.s==NULL || drl_table.len==0)
+		return init_mi_tree( 400, MI_SSTR("No changelog table defined"));
+
+	if(cmd_tree!=NULL)
+		node = cmd_tree->node.kids;
+
+	if(node==NULL || use_partitions==0) {
+		for( part=head_db_start ; part ; part=part->next )
+			if( dr_reload_delta_head(part)<0 )
+				goto error;
+	} else {
+		if( (part = get_partition(&node->value))==NULL) {
+			LM_CRIT("Partition not found\n");
+			goto error;
+		}
+		if( dr_reload_delta_head(part)<0 )
+			goto error;
+	}
+
+	return init_mi_tree( 200, MI_OK_S, MI_OK_LEN);
+error:
+	return init_mi_tree( 500, "Failed to reload",16);
+}
+
+
 
 static inline int get_group_id(struct sip_uri *uri, struct head_db *
 		current_partition)
@@ -2206,12 +2398,12 @@ static int use_next_gw_w_part(struct sip_msg* msg,
 		get_avp_val(avp, &val);
 
 		/* we have an ID, so we can check the GW state */
-		lock_start_read( current_partition->ref_lock );
+		rcu_read_lock();
 		dst = get_gw_by_id( (*current_partition->rdata)->pgw_l, &val.s);
 		if (dst && (dst->flags & DR_DST_STAT_DSBL_FLAG) == 0)
 			ok = 1;
 
-		lock_stop_read( current_partition->ref_lock );
+		rcu_read_unlock();
 
 		if ( ok )
 			break;
@@ -2490,6 +2682,7 @@ static int do_routing(struct sip_msg* msg, dr_part_group_t * part_group,
 	unsigned int prefix_len;
 	unsigned int rule_idx;
 	struct head_db *current_partition=NULL;
+	rt_data_t *rdata;
 	unsigned short wl_len;
 	dr_group_t * drg;
 	str username;
@@ -2649,8 +2842,10 @@ static int do_routing(struct sip_msg* msg, dr_part_group_t * part_group,
 	LM_DBG("using dr group %d, rule_idx %d, username %.*s\n",
 			grp_id,rule_idx,username.len,username.s);
 
-	/* ref the data for reading */
-	lock_start_read( current_partition->ref_lock );
+	/* ref the data for reading; a reload may publish a new set meanwhile,
+	 * so stick to the one we found here */
+	rcu_read_lock();
+	rdata = rcu_dereference(*(current_partition->rdata));
 
 search_again:
 
@@ -2669,7 +2864,7 @@ search_again:
 	}
 
 	/* search a prefix */
-	rt_info = get_prefix( (*(current_partition->rdata))->pt, &username,
+	rt_info = dr_cache_lookup( rdata, &username,
 			(unsigned int)grp_id,&prefix_len, &rule_idx);
 
 	if (flags & DR_PARAM_STRICT_LEN) {
@@ -2681,7 +2876,7 @@ search_again:
 		LM_DBG("no matching for prefix \"%.*s\"\n",
 				username.len, username.s);
 		/* try prefixless rules */
-		rt_info = check_rt( &(*(current_partition->rdata))->noprefix,
+		rt_info = check_rt( &rdata->noprefix,
 				(unsigned int)grp_id);
 		if (rt_info==0) {
 			LM_DBG("no prefixless matching for "
@@ -2738,7 +2933,7 @@ search_again:
 		} else {
 			tmp = parsed_whitelist.s[parsed_whitelist.len];
 			parsed_whitelist.s[parsed_whitelist.len] = 0;
-			if (parse_destination_list( *(current_partition->rdata),
+			if (parse_destination_list( rdata,
 						parsed_whitelist.s, &wl_list, &wl_len, 1)!=0) {
 				LM_ERR("invalid format in whitelist-> ignoring...\n");
 				wl_list = NULL;
@@ -2903,7 +3098,7 @@ no_gws:
 	}
 
 	/* we are done reading -> unref the data */
-	lock_stop_read( current_partition->ref_lock );
+	rcu_read_unlock();
 
 	if ( flags & DR_PARAM_RULE_FALLBACK ) {
 		if ( !(flags & DR_PARAM_INTERNAL_TRIGGERED) ) {
@@ -2972,7 +3167,7 @@ no_gws:
 	return 1;
 error2:
 	/* we are done reading -> unref the data */
-	lock_stop_read( current_partition->ref_lock );
+	rcu_read_unlock();
 error1:
 	if (ruri_buf) pkg_free(ruri_buf);
 	return ret;
@@ -3058,7 +3253,7 @@ static int route2_carrier(struct sip_msg* msg, char* part_carrier,
 	}
 
 	/* ref the data for reading */
-	lock_start_read( current_partition->ref_lock );
+	rcu_read_lock();
 
 	cr = get_carrier_by_id( (*current_partition->rdata)->carriers, &id );
 	if (cr==NULL) {
@@ -3146,13 +3341,13 @@ static int route2_carrier(struct sip_msg* msg, char* part_carrier,
 no_gws:
 
 	/* we are done reading -> unref the data */
-	lock_stop_read( current_partition->ref_lock );
+	rcu_read_unlock();
 	if (ruri_buf) pkg_free(ruri_buf);
 
 	return 1;
 error:
 	/* we are done reading -> unref the data */
-	lock_stop_read( current_partition->ref_lock );
+	rcu_read_unlock();
 error_free:
 	if (ruri_buf) pkg_free(ruri_buf);
 	return -1;
@@ -3232,7 +3427,7 @@ static int route2_gw(struct sip_msg* msg, char* ch_part_gw, char* gw_att_pv)
 	}
 
 	/* ref the data for reading */
-	lock_start_read( current_partition->ref_lock );
+	rcu_read_lock();
 
 
 	idx = 0;
@@ -3247,7 +3442,7 @@ static int route2_gw(struct sip_msg* msg, char* ch_part_gw, char* gw_att_pv)
 		str_trim_spaces_lr(id);
 		if (id.len<=0) {
 			LM_ERR("empty slot\n");
-			lock_stop_read( current_partition->ref_lock );
+			rcu_read_unlock();
 			return -1;
 		} else {
 			LM_DBG("found and looking for gw id <%.*s>,len=%d\n",id.len, id.s, id.len);
@@ -3268,7 +3463,7 @@ static int route2_gw(struct sip_msg* msg, char* ch_part_gw, char* gw_att_pv)
 	} while(ids.len>0);
 
 	/* we are done reading -> unref the data */
-	lock_stop_read( current_partition->ref_lock );
+	rcu_read_unlock();
 
 	if ( idx==0 ) {
 		LM_ERR("no GW added at all\n");
@@ -4194,7 +4389,7 @@ static struct mi_root* mi_dr_gw_status(struct mi_root *cmd, void *param)
 	struct head_db * current_partition=0;
 	pgw_t *gw;
 	str *id;
-	int old_flags;
+	int old_flags, changed;
 
 	node = cmd->node.kids;
 
@@ -4202,7 +4397,7 @@ static struct mi_root* mi_dr_gw_status(struct mi_root *cmd, void *param)
 	if( (rpl_tree = mi_w_partition(&node, &current_partition))!=NULL )
 		return rpl_tree; /* something went wrong: bad command format */
 
-	lock_start_read( current_partition->ref_lock );
+	rcu_read_lock();
 
 	if (current_partition->rdata==NULL || *current_partition->rdata==NULL) {
 		rpl_tree = init_mi_tree( 404, MI_SSTR("No Data available yet"));
@@ -4292,23 +4487,32 @@ static struct mi_root* mi_dr_gw_status(struct mi_root *cmd, void *param)
 		rpl_tree = init_mi_tree( 400, MI_SSTR(MI_BAD_PARM_S));
 		goto done;
 	}
-	/* set the disable/enable */
+	/* set the disable/enable, on the gw of the data published by now */
+	lock_get( current_partition->state_lock );
+	gw = get_gw_by_id( rcu_dereference(*current_partition->rdata)->pgw_l, id);
+	if (gw==NULL) {
+		lock_release( current_partition->state_lock );
+		rpl_tree = init_mi_tree( 404, MI_SSTR("GW ID not found"));
+		goto done;
+	}
 	old_flags = gw->flags;
 	if (stat) {
 		gw->flags &= ~ (DR_DST_STAT_DSBL_FLAG|DR_DST_STAT_NOEN_FLAG);
 	} else {
 		gw->flags |= DR_DST_STAT_DSBL_FLAG|DR_DST_STAT_NOEN_FLAG;
 	}
-	if (old_flags!=gw->flags) {
+	changed = (old_flags!=gw->flags);
+	if (changed)
 		gw->flags |= DR_DST_STAT_DIRT_FLAG;
+	lock_release( current_partition->state_lock );
+	if (changed)
 		dr_raise_event(gw);
-	}
 
 done:
-	lock_stop_read( current_partition->ref_lock );
+	rcu_read_unlock();
 	return rpl_tree;
 error:
-	lock_stop_read( current_partition->ref_lock );
+	rcu_read_unlock();
 	if(rpl_tree) free_mi_tree(rpl_tree);
 	return NULL;
 }
@@ -4332,7 +4536,7 @@ static struct mi_root* mi_dr_cr_status(struct mi_root *cmd, void *param)
 		return rpl_tree;
 	}
 
-	lock_start_read( current_partition->ref_lock );
+	rcu_read_lock();
 
 	if (current_partition->rdata==NULL || *current_partition->rdata==NULL) {
 		rpl_tree = init_mi_tree( 404, MI_SSTR("No Data available yet"));
@@ -4395,7 +4599,15 @@ static struct mi_root* mi_dr_cr_status(struct mi_root *cmd, void *param)
 		rpl_tree = init_mi_tree( 400, MI_SSTR(MI_BAD_PARM_S));
 		goto done;
 	}
-	/* set the disable/enable */
+	/* set the disable/enable, on the carrier of the data published by now */
+	lock_get( current_partition->state_lock );
+	cr = get_carrier_by_id( rcu_dereference(*current_partition->rdata)->carriers,
+		id);
+	if (cr==NULL) {
+		lock_release( current_partition->state_lock );
+		rpl_tree = init_mi_tree( 404, MI_SSTR("Carrier ID not found"));
+		goto done;
+	}
 	old_flags = cr->flags;
 	if (stat) {
 		cr->flags &= ~ (DR_CR_FLAG_IS_OFF);
@@ -4404,14 +4616,15 @@ static struct mi_root* mi_dr_cr_status(struct mi_root *cmd, void *param)
 	}
 	if (old_flags!=cr->flags)
 		cr->flags |= DR_CR_FLAG_DIRTY;
+	lock_release( current_partition->state_lock );
 
 	rpl_tree = init_mi_tree( 200, MI_OK_S, MI_OK_LEN);
 
 done:
-	lock_stop_read( current_partition->ref_lock );
+	rcu_read_unlock();
 	return rpl_tree;
 error:
-	lock_stop_read( current_partition->ref_lock );
+	rcu_read_unlock();
 	if(rpl_tree) free_mi_tree(rpl_tree);
 	return NULL;
 }
@@ -4697,17 +4910,18 @@ static struct mi_root* mi_dr_number_routing(struct mi_root *cmd_tree, void *para
 		node = node->next;
 	}
 
-	lock_start_read( partition->ref_lock );
+	rcu_read_lock();
 	route = find_rule_by_prefix_unsafe((*(partition->rdata))->pt,
-			&(*(partition->rdata))->noprefix, node->value, grp_id, &matched_len);
+			(*(partition->rdata))->ppt, &(*(partition->rdata))->noprefix,
+			node->value, grp_id, &matched_len);
 	if (route == NULL){
-		lock_stop_read( partition->ref_lock );
+		rcu_read_unlock();
 		return init_mi_tree(200, MI_OK_S, MI_OK_LEN);
 	}
 
 	struct mi_root* rpl_tree = init_mi_tree(200, MI_OK_S, MI_OK_LEN);
 	if (rpl_tree == NULL){
-		lock_stop_read( partition->ref_lock );
+		rcu_read_unlock();
 		return 0;
 	}
 
@@ -4720,7 +4934,7 @@ static struct mi_root* mi_dr_number_routing(struct mi_root *cmd_tree, void *para
 	if ((prefix_node = add_mi_node_child(&rpl_tree->node, 0, matched_str.s,
 		matched_str.len, node->value.s, matched_len)) == NULL) {
 		LM_ERR("failed to add node\n");
-		lock_stop_read( partition->ref_lock );
+		rcu_read_unlock();
 		free_mi_tree(rpl_tree);
 		return 0;
 	}
@@ -4741,12 +4955,12 @@ static struct mi_root* mi_dr_number_routing(struct mi_root *cmd_tree, void *para
 					chosen_desc.len, chosen_id.s, chosen_id.len) == NULL) {
 
 			LM_ERR("failed to add node\n");
-			lock_stop_read( partition->ref_lock );
+			rcu_read_unlock();
 			free_mi_tree(rpl_tree);
 			return 0;
 		}
 	}
-	lock_stop_read( partition->ref_lock );
+	rcu_read_unlock();
 
 	return rpl_tree;
 }
@@ -4769,7 +4983,7 @@ static struct mi_root* mi_dr_reload_status(struct mi_root *cmd_tree, void *param
 				return init_mi_tree(400, MI_BAD_PARM_S, MI_BAD_PARM_LEN);
 			}
 			/* display just for given partition */
-			lock_start_read(partition->ref_lock);
+			rcu_read_lock();
 			ch_time = ctime(&partition->time_last_update);
 			if((ans = add_mi_node_child(&rpl_tree->node, MI_DUP_VALUE,
 						MI_PART_NAME_S, MI_PART_NAME_LEN, partition->partition.s,
@@ -4782,7 +4996,7 @@ static struct mi_root* mi_dr_reload_status(struct mi_root *cmd_tree, void *param
 				LM_ERR("failed to add mi_attr\n");
 				goto error;
 			}
-			lock_stop_read(partition->ref_lock);
+			rcu_read_unlock();
 		} else {
 			return init_mi_tree(400, MI_NO_PART_S, MI_NO_PART_LEN);
 		}
@@ -4792,7 +5006,7 @@ static struct mi_root* mi_dr_reload_status(struct mi_root *cmd_tree, void *param
 
 		/* display for all partitions */
 		for(partition = head_db_start; partition; partition = partition->next) {
-			lock_start_read(partition->ref_lock);
+			rcu_read_lock();
 			ch_time = ctime(&partition->time_last_update);
 			LM_DBG("partition  %.*s was last updated:%s\n",
 					partition->partition.len, partition->partition.s,
@@ -4808,26 +5022,26 @@ static struct mi_root* mi_dr_reload_status(struct mi_root *cmd_tree, void *param
 				LM_ERR("failed to add attr to mi_node\n");
 				goto error;
 			}
-			lock_stop_read(partition->ref_lock);
+			rcu_read_unlock();
 		}
 	}
 	else {
 		/* just one partition */
 		partition = head_db_start;
 
-		lock_start_read(partition->ref_lock);
+		rcu_read_lock();
 		ch_time = ctime(&partition->time_last_update);
 		if((ans = add_mi_node_child(&rpl_tree->node, 0, MI_LAST_UPDATE_S,
 						MI_LAST_UPDATE_LEN, ch_time, strlen(ch_time))) == NULL) {
 			LM_ERR("failed to add mi_node\n");
 			goto error;
 		}
-		lock_stop_read(partition->ref_lock);
+		rcu_read_unlock();
 
 	}
 	return rpl_tree;
 error:
-	lock_stop_read(partition->ref_lock);
+	rcu_read_unlock();
 	free_mi_tree(rpl_tree);
 	return 0;
 
@@ -33,6 +33,7 @@
 
 #include "../../str.h"
 #include "../../mem/shm_mem.h"
+#include "../../mem/mem.h"
 #include "../../time_rec.h"
 
 #include "prefix_tree.h"
@@ -182,6 +183,217 @@ err_exit:
 	return NULL;
 }
 
+/* number of bits set in a 10 bits digits map */
+static unsigned char map_bits[1<<PTREE_CHILDREN];
+
+static inline unsigned int
+map_count(
+		unsigned short map,
+		unsigned int bit
+		)
+{
+	return map_bits[map & (bit-1)];
+}
+
+
+/* @ovl is the (optional) tree with the prefixes changed by delta reloads;
+ * a prefix present there hides the one in the packed tree, even if it has
+ * no rules anymore */
+rt_info_t*
+get_packed_prefix(
+	ptree_pack_t *pt,
+	ptree_t *ovl,
+	str* prefix,
+	unsigned int rgid,
+	unsigned int *matched_len,
+	unsigned int *rgidx
+	)
+{
+	ptree_node_t *path[PTREE_MAX_DEPTH];
+	ptree_pnode_t *node;
+	rt_info_t *rt = NULL;
+	char *tmp, *end;
+	unsigned int bit;
+	int depth = 0;
+	int idx;
+
+	if(NULL == pt || NULL == prefix)
+		goto err_exit;
+
+	/* go the tree down to the last digit in the prefix string or down
+	 * to a leaf, remembering the routing info found on the way */
+	node = pt->nodes;
+	end = prefix->s + prefix->len;
+	for(tmp = prefix->s; tmp < end && depth < PTREE_MAX_DEPTH; tmp++) {
+		if( !IS_DECIMAL_DIGIT(*tmp) ) {
+			/* unknown character in the prefix string */
+			goto err_exit;
+		}
+		idx = *tmp - '0';
+		bit = 1 << idx;
+		if(NULL != ovl && NULL != ovl->ptnode[idx].rg)
+			path[depth++] = &ovl->ptnode[idx];
+		else
+			path[depth++] = (node && (node->rule_map & bit)) ?
+				&pt->rules[node->first_rule + map_count(node->rule_map, bit)] :
+				NULL;
+		if( tmp == end-1 )
+			break;
+		node = (node && (node->child_map & bit)) ?
+			&pt->nodes[node->first_child + map_count(node->child_map, bit)] :
+			NULL;
+		ovl = ovl ? ovl->ptnode[idx].next : NULL;
+		if( NULL == node && NULL == ovl )
+			break;
+	}
+
+	/* go back up to the root trying to match the prefix */
+	while(depth > 0) {
+		depth--;
+		if(NULL != path[depth] &&
+		NULL != (rt = internal_check_rt(path[depth], rgid, rgidx))) {
+			depth++;
+			break;
+		}
+	}
+	if (matched_len) *matched_len = depth;
+	return rt;
+
+err_exit:
+	return NULL;
+}
+
+
+static void
+count_tree(
+		ptree_t *t,
+		unsigned int *nodes_no,
+		unsigned int *rules_no
+		)
+{
+	int i;
+
+	(*nodes_no)++;
+	for(i=0; i< PTREE_CHILDREN; i++) {
+		if(NULL!=t->ptnode[i].rg)
+			(*rules_no)++;
+		if(NULL!=t->ptnode[i].next)
+			count_tree(t->ptnode[i].next, nodes_no, rules_no);
+	}
+}
+
+
+/* frees the tree nodes only - the routing info is moved in the packed tree */
+static void
+del_tree_nodes(
+		ptree_t *t
+		)
+{
+	int i;
+
+	for(i=0; i< PTREE_CHILDREN; i++)
+		if(NULL!=t->ptnode[i].next)
+			del_tree_nodes(t->ptnode[i].next);
+	shm_free(t);
+}
+
+
+ptree_pack_t*
+pack_tree(
+		ptree_t *ptree
+		)
+{
+	ptree_pack_t *pt;
+	ptree_t **queue = NULL, *t;
+	ptree_pnode_t *node;
+	unsigned int nodes_no = 0, rules_no = 0, head, tail, rule;
+	int i;
+
+	if(NULL == ptree)
+		return NULL;
+
+	if (map_bits[(1<<PTREE_CHILDREN)-1]==0)
+		for(i=1; i<(1<<PTREE_CHILDREN); i++)
+			map_bits[i] = map_bits[i>>1] + (i&1);
+
+	count_tree(ptree, &nodes_no, &rules_no);
+
+	pt = shm_malloc(sizeof(ptree_pack_t) + nodes_no*sizeof(ptree_pnode_t)
+		+ rules_no*sizeof(ptree_node_t));
+	if(NULL == pt) {
+		LM_ERR("no more shm mem for %u nodes\n", nodes_no);
+		goto err_exit;
+	}
+	pt->nodes_no = nodes_no;
+	pt->rules_no = rules_no;
+	pt->rules = (ptree_node_t*)(pt + 1);
+	pt->nodes = (ptree_pnode_t*)(pt->rules + rules_no);
+
+	queue = pkg_malloc(nodes_no * sizeof(ptree_t*));
+	if(NULL == queue) {
+		LM_ERR("no more pkg mem for %u nodes\n", nodes_no);
+		goto err_exit;
+	}
+
+	/* breadth first, so the children of a node are adjacent */
+	queue[0] = ptree;
+	for(head = 0, tail = 1, rule = 0; head < tail; head++) {
+		t = queue[head];
+		node = &pt->nodes[head];
+		node->child_map = node->rule_map = 0;
+		node->first_child = tail;
+		node->first_rule = rule;
+		for(i=0; i< PTREE_CHILDREN; i++) {
+			if(NULL!=t->ptnode[i].rg) {
+				node->rule_map |= 1 << i;
+				pt->rules[rule] = t->ptnode[i];
+				pt->rules[rule++].next = NULL;
+			}
+			if(NULL!=t->ptnode[i].next) {
+				node->child_map |= 1 << i;
+				queue[tail++] = t->ptnode[i].next;
+			}
+		}
+	}
+
+	pkg_free(queue);
+
+	LM_INFO("packed %u prefixes into %u nodes: %lu bytes (%lu unpacked)\n",
+		rules_no, nodes_no, (unsigned long)(sizeof(ptree_pack_t) +
+		nodes_no*sizeof(ptree_pnode_t) + rules_no*sizeof(ptree_node_t)),
+		(unsigned long)nodes_no*sizeof(ptree_t));
+
+	del_tree_nodes(ptree);
+	return pt;
+
+err_exit:
+	if(pt)
+		shm_free(pt);
+	return NULL;
+}
+
+
+void
+del_packed_tree(
+		ptree_pack_t *pt
+		)
+{
+	unsigned int i;
+	int j;
+
+	if(NULL == pt)
+		return;
+
+	for(i=0; i< pt->rules_no; i++) {
+		for(j=0;j<pt->rules[i].rg_pos;j++) {
+			if(pt->rules[i].rg[j].rtlw !=NULL)
+				del_rt_list(pt->rules[i].rg[j].rtlw);
+		}
+		shm_free(pt->rules[i].rg);
+	}
+	shm_free(pt);
+}
+
 pgw_t*
 get_gw_by_internal_id(
 		pgw_t* gw,
@@ -231,16 +443,14 @@ get_carrier_by_id(
 }
 
 
-int
-add_prefix(
+/* returns the node of the prefix, creating the path to it if needed */
+static ptree_node_t*
+add_prefix_node(
 	ptree_t *ptree,
-	str* prefix,
-	rt_info_t *r,
-	unsigned int rg
+	str* prefix
 )
 {
 	char* tmp=NULL;
-	int res = 0;
 	if(NULL==ptree) {
         LM_ERR("ptree is null\n");
 		goto err_exit;
@@ -258,16 +468,7 @@ add_prefix(
 		}
 		if( tmp == (prefix->s+prefix->len-1) ) {
 			/* last digit in the prefix string */
-			LM_DBG("adding info %p, %d at: "
-				"%p (%d)\n", r, rg, &(ptree->ptnode[*tmp-'0']), *tmp-'0');
-			res = add_rt_info(&(ptree->ptnode[*tmp-'0']), r,rg);
-			if(res < 0 ) {
-                LM_ERR("adding rt info doesn't work\n");
-				goto err_exit;
-            }
-			unode++;
-			res = 1;
-			goto ok_exit;
+			return &(ptree->ptnode[*tmp-'0']);
 		}
 		/* process the current digit in the prefix */
 		if(NULL == ptree->ptnode[*tmp - '0'].next) {
@@ -285,11 +486,103 @@ add_prefix(
 		tmp++;
 	}
 
-ok_exit:
+err_exit:
+	return NULL;
+}
+
+
+int
+add_prefix(
+	ptree_t *ptree,
+	str* prefix,
+	rt_info_t *r,
+	unsigned int rg
+)
+{
+	ptree_node_t *node;
+
+	if(NULL == (node = add_prefix_node(ptree, prefix)))
+		return -1;
+
+	LM_DBG("adding info %p, %d at: %p\n", r, rg, node);
+	if(add_rt_info(node, r, rg) < 0) {
+		LM_ERR("adding rt info doesn't work\n");
+		return -1;
+	}
+	unode++;
 	return 0;
+}
 
-err_exit:
-	return -1;
+
+int
+mark_prefix(
+	ptree_t *ptree,
+	str* prefix
+)
+{
+	ptree_node_t *node;
+
+	if(NULL == (node = add_prefix_node(ptree, prefix)))
+		return -1;
+
+	if(NULL == node->rg) {
+		/* an empty groups array - the prefix is there, even without rules */
+		node->rg = (rg_entry_t*)shm_malloc(RG_INIT_LEN*sizeof(rg_entry_t));
+		if(NULL == node->rg) {
+			LM_ERR("no more shm mem\n");
+			return -1;
+		}
+		memset(node->rg, 0, RG_INIT_LEN*sizeof(rg_entry_t));
+		node->rg_len = RG_INIT_LEN;
+		node->rg_pos = 0;
+	}
+	return 0;
+}
+
+
+static int
+walk_tree_node(
+	ptree_t *t,
+	char *buf,
+	int len,
+	ptree_walk_f *f,
+	void *param
+)
+{
+	str prefix;
+	int i;
+
+	if(len == PTREE_MAX_DEPTH)
+		return 0;
+
+	for(i=0; i< PTREE_CHILDREN; i++) {
+		buf[len] = '0' + i;
+		if(NULL != t->ptnode[i].rg) {
+			prefix.s = buf;
+			prefix.len = len + 1;
+			if(f(&prefix, param) < 0)
+				return -1;
+		}
+		if(NULL != t->ptnode[i].next &&
+		walk_tree_node(t->ptnode[i].next, buf, len+1, f, param) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+
+int
+walk_tree_prefixes(
+	ptree_t *ptree,
+	ptree_walk_f *f,
+	void *param
+)
+{
+	char buf[PTREE_MAX_DEPTH];
+
+	if(NULL == ptree)
+		return 0;
+	return walk_tree_node(ptree, buf, 0, f, param);
 }
 
 int
@@ -161,6 +161,28 @@ typedef struct ptree_ {
 	ptree_node_t ptnode[PTREE_CHILDREN];
 } ptree_t;
 
+/* longest prefix accepted in the packed tree (size of the prefix column) */
+#define PTREE_MAX_DEPTH 64
+
+/* node of the packed tree - the children of a node are adjacent in the
+ * nodes array (breadth first order), so the child for a digit is found
+ * by counting the lower bits set in child_map; same for the routing info */
+typedef struct ptree_pnode_ {
+	unsigned short child_map;
+	unsigned short rule_map;
+	unsigned int first_child;
+	unsigned int first_rule;
+} ptree_pnode_t;
+
+/* read-only, compact form of a prefix tree, built in a single shm block
+ * once all the prefixes were added */
+typedef struct ptree_pack_ {
+	unsigned int nodes_no;
+	unsigned int rules_no;
+	ptree_pnode_t *nodes;
+	ptree_node_t *rules;
+} ptree_pack_t;
+
 void
 print_interim(
 		int,
@@ -191,6 +213,43 @@ get_prefix(
 	unsigned int *matched_len
 	);
 
+ptree_pack_t*
+pack_tree(
+	ptree_t *ptree
+	);
+
+/* adds the prefix to the tree even if it gets no routing info */
+int
+mark_prefix(
+	ptree_t *ptree,
+	str* prefix
+	);
+
+typedef int (ptree_walk_f)(str *prefix, void *param);
+
+/* calls @f for each prefix holding routing info (or marked) in the tree */
+int
+walk_tree_prefixes(
+	ptree_t *ptree,
+	ptree_walk_f *f,
+	void *param
+	);
+
+rt_info_t*
+get_packed_prefix(
+	ptree_pack_t *pt,
+	ptree_t *ovl,
+	str* prefix,
+	unsigned int rgid,
+	unsigned int *matched_len,
+	unsigned int *rgidx
+	);
+
+void
+del_packed_tree(
+	ptree_pack_t *pt
+	);
+
 int
 add_rt_info(
 	ptree_node_t*,
@@ -638,13 +638,20 @@ free_rt_data(
 		)
 {
 	int j;
-	if(NULL!=rt_data) {
+	if(NULL!=rt_data && rt_data->handed_over) {
+		/* only the changed prefixes are ours */
+		del_tree(rt_data->pt);
+		rt_data->pt = 0 ;
+		if (all) shm_free(rt_data);
+	} else if(NULL!=rt_data) {
 		/* del GW list */
 		del_pgw_list(rt_data->pgw_l);
 		rt_data->pgw_l = 0 ;
 		/* del prefix tree */
 		del_tree(rt_data->pt);
 		rt_data->pt = 0 ;
+		del_packed_tree(rt_data->ppt);
+		rt_data->ppt = 0 ;
 		/* del prefixless rules */
 		if(NULL!=rt_data->noprefix.rg) {
 			for(j=0;j<rt_data->noprefix.rg_pos;j++) {
@@ -58,8 +58,19 @@ typedef struct rt_data_ {
 	pcr_t *carriers;
 	/* default routing list for prefixless rules */
 	ptree_node_t noprefix;
-	/* tree with routing prefixes */
+	/* tree with routing prefixes (while loading) or, after a delta
+	 * reload, the prefixes changed since the last full load */
 	ptree_t *pt;
+	/* packed tree with routing prefixes (once loaded) */
+	ptree_pack_t *ppt;
+	/* the gws, carriers, prefixless rules and the packed tree were passed
+	 * over to a newer (delta reloaded) data set */
+	int handed_over;
+	/* unique id of the data set, tags the results cached by the processes */
+	unsigned int gen;
+	/* some rules have time recurrences, so the prefix lookups depend on
+	 * the current time too */
+	int timed_rules;
 }rt_data_t;
 
 typedef struct _dr_group {
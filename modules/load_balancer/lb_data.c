@@ -33,6 +33,8 @@
 #include "../../parser/parse_uri.h"
 #include "../../mem/shm_mem.h"
 #include "../../evi/evi.h"
+#include "../../timer.h"
+#include "../tm/tm_load.h"
 #include "lb_parser.h"
 #include "lb_data.h"
 #include "lb_db.h"
@@ -40,6 +42,23 @@
 /* dialog stuff */
 extern struct dlg_binds lb_dlg_binds;
 
+/* TM stuff, used for the latency tracking */
+extern struct tm_binds lb_tmb;
+
+/* weight of a new response time sample is 1/2^LB_RTT_SHIFT */
+#define LB_RTT_SHIFT  3
+/* added to the response times when comparing dsts, so that a not
+ * (yet) measured dst is not infinitely better than the others */
+#define LB_RTT_BASE   1000
+
+struct lb_latency_param {
+	int id;
+	int done;
+	utime_t sent;
+};
+
+void set_dst_latency( int id, int rtt);
+
 
 
 struct lb_data* load_lb_data(void)
@@ -371,6 +390,118 @@ void free_lb_data(struct lb_data *data)
 }
 
 
+void lb_inherit_state(struct lb_data *old_data, struct lb_data *new_data)
+{
+	struct lb_dst *nd, *od;
+
+	if (old_data==NULL)
+		return;
+
+	/* carry over the measured response times and the in-flight requests,
+	 * so the traffic does not rush to one dst right after a reload */
+	for( nd=new_data->dsts ; nd ; nd=nd->next ) {
+		for( od=old_data->dsts ; od ; od=od->next ) {
+			if (od->id==nd->id && od->uri.len==nd->uri.len &&
+			memcmp(od->uri.s, nd->uri.s, nd->uri.len)==0) {
+				nd->rtt = od->rtt;
+				nd->pending = od->pending;
+				break;
+			}
+		}
+	}
+}
+
+
+/* accounts the end of a request sent to @dst; @rtt is the measured
+ * response time (us) or negative if there is no sample */
+void lb_update_dst_latency(struct lb_dst *dst, int rtt)
+{
+	unsigned int old, new;
+
+	do {
+		old = dst->pending;
+		if (old==0)
+			break;
+	} while ( !__sync_bool_compare_and_swap( &dst->pending, old, old-1) );
+
+	if (rtt<0)
+		return;
+
+	do {
+		old = dst->rtt;
+		new = old ? (old - (old>>LB_RTT_SHIFT) + (rtt>>LB_RTT_SHIFT)) : rtt;
+	} while ( !__sync_bool_compare_and_swap( &dst->rtt, old, new) );
+}
+
+
+static void lb_latency_callback(struct cell *t, int type,
+		struct tmcb_params *ps)
+{
+	struct lb_latency_param *lp = (struct lb_latency_param*)*ps->param;
+	int rtt;
+
+	/* only the first reply (or the final failure) counts */
+	if (lp==NULL || !__sync_bool_compare_and_swap( &lp->done, 0, 1))
+		return;
+
+	if (type==TMCB_TRANS_DELETED)
+		/* nothing came back, just drop it from the pending ones */
+		rtt = -1;
+	else
+		rtt = (int)(get_uticks() - lp->sent);
+
+	set_dst_latency( lp->id, rtt);
+}
+
+
+static void lb_latency_release(void *param)
+{
+	shm_free(param);
+}
+
+
+static void lb_track_latency(struct sip_msg *req, struct lb_dst *dst)
+{
+	struct lb_latency_param *lp;
+	struct cell *t;
+
+	if (lb_tmb.register_tmcb==NULL)
+		return;
+
+	/* the callbacks registered ahead of the transaction are dropped
+	 * without being run if none gets created (stateless relay, drop),
+	 * which would leave the request pending for good - so create it */
+	t = lb_tmb.t_gett();
+	if (t==NULL || t==T_UNDEFINED) {
+		if (lb_tmb.t_newtran(req)<=0 ||
+		(t=lb_tmb.t_gett())==NULL || t==T_UNDEFINED) {
+			LM_DBG("no transaction - not tracking the response time\n");
+			return;
+		}
+	}
+
+	lp = (struct lb_latency_param*)shm_malloc(sizeof *lp);
+	if (lp==NULL) {
+		LM_ERR("no more shm mem - not tracking the response time\n");
+		return;
+	}
+	lp->id = dst->id;
+	lp->done = 0;
+	lp->sent = get_uticks();
+
+	if (lb_tmb.register_tmcb( req, t,
+	TMCB_RESPONSE_IN|TMCB_ON_FAILURE|TMCB_TRANS_DELETED,
+	lb_latency_callback, lp, lb_latency_release)<0) {
+		LM_ERR("failed to register TM callback - not tracking the "
+			"response time\n");
+		shm_free(lp);
+		return;
+	}
+
+	__sync_add_and_fetch( &dst->pending, 1);
+}
+
+
 static int get_dst_load(struct lb_resource **res, unsigned int res_no,
 							struct lb_dst *dst, unsigned int flags, int *load)
 {
@@ -407,6 +538,58 @@ static int get_dst_load(struct lb_resource **res, unsigned int res_no,
 }
 
 
+/* picks two different random dsts out of the candidates and keeps the
+ * one with the lower cost - the response time scaled up by the requests
+ * in flight and down by the free load. Comparing only two random dsts
+ * (and not taking the best of all) keeps the traffic spread when the
+ * measurements are stale or alike */
+static struct lb_dst *lb_pick_two(struct lb_resource **res,
+		unsigned int res_no, struct lb_dst **dsts, unsigned int n,
+		unsigned int flags, int *load)
+{
+	struct lb_dst *a, *b;
+	int la, lb;
+	unsigned int i, j;
+	unsigned long long ca, cb;
+
+	i = rand() % n;
+	j = rand() % (n - 1);
+	if (j>=i)
+		j++;
+	a = dsts[i];
+	b = dsts[j];
+
+	la = lb = 0;
+	get_dst_load(res, res_no, a, flags, &la);
+	get_dst_load(res, res_no, b, flags, &lb);
+
+	/* with no free load (only if negative loads are allowed),
+	 * the load is all that matters */
+	if (la<=0 || lb<=0) {
+		if (lb>la) {
+			*load = lb;
+			return b;
+		}
+		*load = la;
+		return a;
+	}
+
+	ca = (unsigned long long)(a->rtt + LB_RTT_BASE) * (a->pending + 1) * lb;
+	cb = (unsigned long long)(b->rtt + LB_RTT_BASE) * (b->pending + 1) * la;
+
+	LM_DBG("comparing dst %d (free=%d, rtt=%u, pending=%u) with dst %d "
+		"(free=%d, rtt=%u, pending=%u)\n", a->id, la, a->rtt, a->pending,
+		b->id, lb, b->rtt, b->pending);
+
+	if (cb<ca) {
+		*load = lb;
+		return b;
+	}
+	*load = la;
+	return a;
+}
+
+
 int lb_route(struct sip_msg *req, int group, struct lb_res_str_list *rl,
 						unsigned int flags, struct lb_data *data, int reuse)
 {
@@ -656,7 +839,8 @@ int lb_route(struct sip_msg *req, int group, struct lb_res_str_list *rl,
 
 	/* init selected destinations buff */
 	dsts_cur = NULL;
-	dsts_size_max = (flags & LB_FLAGS_RANDOM) ? data->dst_no : 1;
+	dsts_size_max = (flags & (LB_FLAGS_RANDOM|LB_FLAGS_LATENCY)) ?
+		data->dst_no : 1;
 	if( dsts_size_max > 1 ) {
 		if( dsts_size_max > dsts_size ) {
 			dsts = (struct lb_dst **)pkg_realloc
@@ -722,7 +906,9 @@ int lb_route(struct sip_msg *req, int group, struct lb_res_str_list *rl,
 					/* only valid load here */
 					if( (it_l > 0) || (flags & LB_FLAGS_NEGATIVE) ) {
 						/* only allowed load here */
-						if( !cond/*first pass*/ || (it_l > load)/*new max*/ ) {
+						if( flags & LB_FLAGS_LATENCY ) {
+							/* keep all of them, two are compared later */
+						} else if( !cond/*first pass*/ || (it_l > load)/*new max*/ ) {
 							cond = 1;
 							/* restart buffer */
 							dsts_size_cur = 0;
@@ -735,7 +921,7 @@ int lb_route(struct sip_msg *req, int group, struct lb_res_str_list *rl,
 						 * if we have a room for it */
 						if( dsts_size_cur < dsts_size_max ) {
 							load = it_l;
-							dsts[dsts_size_cur++] = it_d;
+							dsts_cur[dsts_size_cur++] = it_d;
 
 							LM_DBG("%s call of LB - destination %d <%.*s> "
 								"selected for LB set with free=%d\n",
@@ -766,10 +952,13 @@ int lb_route(struct sip_msg *req, int group, struct lb_res_str_list *rl,
 	}
 	/* choose one destination among selected */
 	if( dsts_size_cur > 0 ) {
-		if( (dsts_size_cur > 1) && (flags & LB_FLAGS_RANDOM) ) {
-			dst = dsts[rand() % dsts_size_cur];
+		if( (dsts_size_cur > 1) && (flags & LB_FLAGS_LATENCY) ) {
+			dst = lb_pick_two(res_cur, res_cur_n, dsts_cur, dsts_size_cur,
+				flags, &load);
+		} else if( (dsts_size_cur > 1) && (flags & LB_FLAGS_RANDOM) ) {
+			dst = dsts_cur[rand() % dsts_size_cur];
 		} else {
-			dst = dsts[0];
+			dst = dsts_cur[0];
 		}
 	}
 
@@ -870,6 +1059,9 @@ int lb_route(struct sip_msg *req, int group, struct lb_res_str_list *rl,
 		return -2;
 	}
 
+	if( (dst != NULL) && (flags & LB_FLAGS_LATENCY) )
+		lb_track_latency(req, dst);
+
 	return dst ? 0 : -2;
 }
 
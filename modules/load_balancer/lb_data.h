@@ -38,6 +38,7 @@
 #define LB_FLAGS_RELATIVE (1<<0) /* do relative versus absolute estimation. default is absolute */
 #define LB_FLAGS_NEGATIVE (1<<1) /* do not skip negative loads. default to skip */
 #define LB_FLAGS_RANDOM   (1<<2) /* pick a random destination among all selected dsts with equal load */
+#define LB_FLAGS_LATENCY  (1<<3) /* pick the best of two random dsts, by free load and response time */
 #define LB_FLAGS_DEFAULT  0
 
 #define LB_DST_PING_DSBL_FLAG   (1<<0)
@@ -73,6 +74,9 @@ struct lb_dst {
 	struct ip_addr ips[LB_MAX_IPS]; /* IP-Address of the entry */
 	unsigned short int ports[LB_MAX_IPS]; /* Port of the request URI */
 	unsigned short ips_cnt;
+	/* latency tracking (LB_FLAGS_LATENCY), updated without locking */
+	unsigned int rtt;      /* EWMA of the INVITE to first reply time (us) */
+	unsigned int pending;  /* requests sent and not answered yet */
 	struct lb_dst *next;
 };
 
@@ -91,6 +95,10 @@ int add_lb_dsturi( struct lb_data *data, int id, int group, char *uri,
 
 void free_lb_data(struct lb_data *data);
 
+void lb_inherit_state(struct lb_data *old_data, struct lb_data *new_data);
+
+void lb_update_dst_latency(struct lb_dst *dst, int rtt);
+
 int do_lb_start(struct sip_msg *req, int group, struct lb_res_str_list *rl,
 		unsigned int flags, struct lb_data *data);
 
@@ -360,6 +360,7 @@ static inline int lb_reload_data( void )
 
 	/* no more activ readers -> do the swapping */
 	old_data = *curr_data;
+	lb_inherit_state( old_data, new_data);
 	*curr_data = new_data;
 
 	lock_stop_write( ref_lock );
@@ -422,13 +423,17 @@ static int mod_init(void)
 	/* close DB connection */
 	lb_close_db();
 
-	/* arm a function for probing */
-	if (lb_prob_interval) {
-		/* load TM API */
+	/* load TM API - mandatory for probing, optional for tracking
+	 * the response times */
+	if (lb_prob_interval || find_export("load_tm", 0, 0)) {
 		if (load_tm_api(&lb_tmb)!=0) {
 			LM_ERR("can't load TM API\n");
 			return -1;
 		}
+	}
+
+	/* arm a function for probing */
+	if (lb_prob_interval) {
 
 		/* probing method */
 		lb_probe_method.len = strlen(lb_probe_method.s);
@@ -605,6 +610,10 @@ static int w_lb_start(struct sip_msg *req, char *grp, char *rl, char *fl)
 					flags |= LB_FLAGS_RANDOM;
 					LM_DBG("pick a random destination among all selected dsts with equal load\n");
 					break;
+				case 'l':
+					flags |= LB_FLAGS_LATENCY;
+					LM_DBG("pick the best of two random dsts, by load and response time\n");
+					break;
 				default:
 					LM_DBG("skipping unknown flag: [%c]\n", *f);
 			}
@@ -883,6 +892,21 @@ void set_dst_state_from_rplcode( int id, int code)
 
 
 
+void set_dst_latency( int id, int rtt)
+{
+	struct lb_dst *dst;
+
+	lock_start_read( ref_lock );
+
+	for( dst=(*curr_data)->dsts ; dst && dst->id!=id ; dst=dst->next);
+	if (dst)
+		lb_update_dst_latency( dst, rtt);
+
+	lock_stop_read( ref_lock );
+}
+
+
+
 static void lb_prob_handler(unsigned int ticks, void* param)
 {
 	lock_start_read( ref_lock );
@@ -76,7 +76,7 @@ int reload_address_table(struct pm_part_struct *part_struct)
 	db_val_t* val;
 
 	struct address_list **new_hash_table;
-	struct subnet *new_subnet_table;
+	struct subnet_table *new_subnet_table;
 	int i, mask, proto, group, port, id;
     struct ip_addr *ip_addr;
 	struct net *subnet;
@@ -144,7 +144,7 @@ int reload_address_table(struct pm_part_struct *part_struct)
 			continue;
 		}
 		if (VAL_TYPE(val + 2) != DB_INT || VAL_NULL(val + 2) ||
-					VAL_INT(val + 2) < 0 || VAL_INT(val + 2) > 32) {
+					VAL_INT(val + 2) < 0 || VAL_INT(val + 2) > 128) {
 			LM_ERR("invalid mask column type on row %d, skipping..\n", i);
 			continue;
 		}
@@ -239,7 +239,16 @@ int reload_address_table(struct pm_part_struct *part_struct)
 		port = (unsigned int) VAL_INT(val + 3);
 		mask = (unsigned int) VAL_INT(val + 2);
 
-		if (mask == 32) {
+		if (mask > ip_addr->len * 8) {
+			LM_DBG("invalid mask %u for ip field in address table, "
+				"ignoring entry with id %d\n", mask, id);
+			continue;
+		}
+
+		/* 32, the default of the column, keeps meaning a host for IPv6
+		 * too, unless /32 subnets were asked for */
+		if (mask == ip_addr->len * 8 ||
+		(ipv6_mask32_host && ip_addr->af == AF_INET6 && mask == 32)) {
 			if (hash_insert(new_hash_table, ip_addr, group, port, proto,
 				&str_pattern, &str_info) == -1) {
 					LM_ERR("hash table insert error\n");
@@ -251,11 +260,17 @@ int reload_address_table(struct pm_part_struct *part_struct)
 					str_info.len,str_info.s);
 		} else {
 			subnet = mk_net_bitlen(ip_addr, mask);
+			if (!subnet) {
+				LM_ERR("failed to build subnet\n");
+				goto error;
+			}
 			if (subnet_table_insert(new_subnet_table, group, subnet,
 				port, proto, &str_pattern, &str_info) == -1) {
 					LM_ERR("subnet table problem\n");
+					pkg_free(subnet);
 					goto error;
 				}
+			pkg_free(subnet);
 			LM_DBG("Tuple <%.*s, %u, %u, %u> inserted into subnet table\n",
 					str_src_ip.len, str_src_ip.s, group, mask, port);
 		}
@@ -343,7 +358,8 @@ int init_address(struct pm_partition *partition)
     part_struct->subnet_table_2 = new_subnet_table();
     if (!part_struct->subnet_table_2) goto error;
 
-	part_struct->subnet_table = (struct subnet **)shm_malloc(sizeof(struct subnet *));
+	part_struct->subnet_table = (struct subnet_table **)shm_malloc(
+		sizeof(struct subnet_table *));
 	if (!part_struct->subnet_table) goto error;
 
 	*part_struct->subnet_table = part_struct->subnet_table_1;
@@ -285,289 +285,507 @@ void empty_hash(struct address_list** table) {
 }
 
 
+/* n-th bit (from the most significant one) of an address */
+#define addr_bit(_a, _n) \
+	(((_a)[(_n) >> 3] >> (7 - ((_n) & 7))) & 1)
+
+/* deepest node a subnet tree may have on a path - the full IPv6 address */
+#define PERM_MAX_BITLEN 128
+
+
 /*
  * Create and initialize a subnet table
  */
-struct subnet* new_subnet_table(void)
+struct subnet_table* new_subnet_table(void)
 {
-    struct subnet* ptr;
+	struct subnet_table* ptr;
 
-    /* subnet record [PERM_MAX_SUBNETS] contains in its grp field
-       the number of subnet records in the subnet table */
-    ptr = (struct subnet *)shm_malloc
-	(sizeof(struct subnet) * (PERM_MAX_SUBNETS + 1));
-
-    if (!ptr) {
+	ptr = (struct subnet_table *)shm_malloc(sizeof(struct subnet_table));
+	if (!ptr) {
 		LM_ERR("no shm memory for subnet table\n");
 		return 0;
-    }
+	}
+
+	memset(ptr, 0, sizeof(struct subnet_table));
+	return ptr;
+}
+
+
+/* number of leading bits (up to max) two addresses have in common */
+static inline unsigned int common_bits(unsigned char *a, unsigned char *b,
+		unsigned int max)
+{
+	unsigned int i, n;
+	unsigned char x;
+
+	for (i = 0; i * 8 < max; i++) {
+		x = a[i] ^ b[i];
+		if (x) {
+			for (n = i * 8; !(x & 0x80); x <<= 1)
+				n++;
+			return n < max ? n : max;
+		}
+	}
+
+	return max;
+}
+
+
+/* number of leading bits set in a mask */
+static inline unsigned int mask_bitlen(struct ip_addr *mask)
+{
+	unsigned int i, n;
+	unsigned char x;
+
+	for (i = 0, n = 0; i < mask->len && mask->u.addr[i] == 0xff; i++)
+		n += 8;
+	if (i < mask->len)
+		for (x = mask->u.addr[i]; x & 0x80; x <<= 1)
+			n++;
 
-    ptr[PERM_MAX_SUBNETS].grp = 0;
-    return ptr;
+	return n;
+}
+
+
+static struct subnet_node* new_subnet_node(struct ip_addr *ip,
+		unsigned int bitlen)
+{
+	struct subnet_node *node;
+	unsigned int r;
+
+	node = (struct subnet_node *)shm_malloc(sizeof(struct subnet_node));
+	if (!node) {
+		LM_ERR("no shm memory for subnet node\n");
+		return NULL;
+	}
+	memset(node, 0, sizeof(struct subnet_node));
+
+	node->bitlen = bitlen;
+
+	for (r = 0; r < bitlen / 8; r++)
+		node->net.mask.u.addr[r] = 0xff;
+	if (bitlen % 8)
+		node->net.mask.u.addr[r] = ~((1 << (8 - (bitlen % 8))) - 1);
+	node->net.mask.af = ip->af;
+	node->net.mask.len = ip->len;
+
+	node->net.ip = *ip;
+	for (r = 0; r < ip->len / 4; r++)
+		node->net.ip.u.addr32[r] &= node->net.mask.u.addr32[r];
+
+	return node;
 }
 
 
 /*
- * Add <grp, subnet, mask, port> into subnet table so that table is
- * kept in increasing ordered according to grp.
+ * Returns the node of the given prefix, adding it (and the branching
+ * node it may need) if not in the tree yet
  */
-int subnet_table_insert(struct subnet* table, unsigned int grp,
-			struct net *subnet,
-			unsigned int port, int proto, str* pattern, str *info)
+static struct subnet_node* get_subnet_node(struct subnet_node **root,
+		struct net *net, unsigned int bitlen)
 {
-    int i;
-    unsigned int count;
+	struct subnet_node *node, *glue, *new_node, **p;
+	unsigned char *key;
+	unsigned int c;
 
-    count = table[PERM_MAX_SUBNETS].grp;
+	key = net->ip.u.addr;
 
-    if (count == PERM_MAX_SUBNETS) {
-		LM_CRIT("subnet table is full\n");
-		return 0;
-    }
+	for (p = root; (node = *p) != NULL; ) {
+		c = common_bits(node->net.ip.u.addr, key,
+			node->bitlen < bitlen ? node->bitlen : bitlen);
 
-    i = count - 1;
+		if (c == node->bitlen) {
+			/* the node's prefix covers the new one */
+			if (node->bitlen == bitlen)
+				return node;
+			p = &node->child[addr_bit(key, node->bitlen)];
+			continue;
+		}
 
-    while (i >= 0 && table[i].grp > grp) {
-		table[i + 1] = table[i];
-		i--;
-    }
+		new_node = new_subnet_node(&net->ip, bitlen);
+		if (!new_node)
+			return NULL;
+
+		if (c == bitlen) {
+			/* the new prefix covers the node */
+			new_node->child[addr_bit(node->net.ip.u.addr, bitlen)] = node;
+			*p = new_node;
+			return new_node;
+		}
+
+		/* the two diverge after c bits - branch there */
+		glue = new_subnet_node(&net->ip, c);
+		if (!glue) {
+			shm_free(new_node);
+			return NULL;
+		}
+		glue->child[addr_bit(key, c)] = new_node;
+		glue->child[addr_bit(node->net.ip.u.addr, c)] = node;
+		*p = glue;
+		return new_node;
+	}
+
+	*p = new_subnet_node(&net->ip, bitlen);
+	return *p;
+}
 
-    table[i + 1].grp = grp;
-    table[i + 1].port = port;
-	table[i + 1].proto = proto;
 
-	if (subnet) {
-		table[i + 1].subnet = (struct net*) shm_malloc(sizeof(struct net));
-		if (!table[i + 1].subnet) {
-			LM_ERR("cannot allocate shm memory for table subnet\n");
+static int add_subnet_group(struct subnet_table *table, unsigned int grp)
+{
+	unsigned int lo, hi, mid, *grps;
+
+	for (lo = 0, hi = table->grp_no; lo < hi; ) {
+		mid = (lo + hi) / 2;
+		if (table->grps[mid] == grp)
+			return 0;
+		if (table->grps[mid] < grp)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (table->grp_no == table->grp_size) {
+		grps = (unsigned int *)shm_realloc(table->grps,
+			(table->grp_size ? 2 * table->grp_size : 8) * sizeof(unsigned int));
+		if (!grps) {
+			LM_ERR("no shm memory for subnet groups\n");
 			return -1;
 		}
-		memcpy(table[i + 1].subnet, subnet, sizeof(struct net));
+		table->grps = grps;
+		table->grp_size = table->grp_size ? 2 * table->grp_size : 8;
 	}
-	else
-		table[i + 1].subnet = NULL;
+
+	memmove(table->grps + lo + 1, table->grps + lo,
+		(table->grp_no - lo) * sizeof(unsigned int));
+	table->grps[lo] = grp;
+	table->grp_no++;
+
+	return 0;
+}
+
+
+static int has_subnet_group(struct subnet_table *table, unsigned int grp)
+{
+	unsigned int lo, hi, mid;
+
+	for (lo = 0, hi = table->grp_no; lo < hi; ) {
+		mid = (lo + hi) / 2;
+		if (table->grps[mid] == grp)
+			return 1;
+		if (table->grps[mid] < grp)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Add <grp, subnet, mask, port> into subnet table, under the node of its
+ * prefix, keeping the entries of the node in increasing order of grp.
+ */
+int subnet_table_insert(struct subnet_table* table, unsigned int grp,
+			struct net *subnet,
+			unsigned int port, int proto, str* pattern, str *info)
+{
+	struct subnet_node *node;
+	struct subnet *entry, **p;
+	unsigned int bitlen;
+
+	if (!subnet) {
+		LM_ERR("no subnet given\n");
+		return -1;
+	}
+
+	bitlen = mask_bitlen(&subnet->mask);
+
+	node = get_subnet_node(&table->root[subnet->ip.af == AF_INET6],
+		subnet, bitlen);
+	if (!node)
+		return -1;
+
+	if (add_subnet_group(table, grp) < 0)
+		return -1;
+
+	entry = (struct subnet *)shm_malloc(sizeof(struct subnet));
+	if (!entry) {
+		LM_ERR("cannot allocate shm memory for table subnet\n");
+		return -1;
+	}
+	memset(entry, 0, sizeof(struct subnet));
+
+	entry->grp = grp;
+	entry->port = port;
+	entry->proto = proto;
 
 	if (info->len) {
-		table[i + 1].info = (char*) shm_malloc(info->len + 1);
-		if (!table[i + 1].info) {
+		entry->info = (char*) shm_malloc(info->len + 1);
+		if (!entry->info) {
 			LM_ERR("cannot allocate shm memory for table info\n");
+			shm_free(entry);
 			return -1;
 		}
-		memcpy(table[i + 1].info, info->s, info->len);
-		table[i + 1].info[info->len] = 0;
+		memcpy(entry->info, info->s, info->len);
+		entry->info[info->len] = 0;
 	}
-	else
-		table[i + 1].info = NULL;
 
 	if (pattern->len) {
-		table[i + 1].pattern = (char*) shm_malloc(pattern->len + 1);
-		if (!table[i + 1].pattern) {
+		entry->pattern = (char*) shm_malloc(pattern->len + 1);
+		if (!entry->pattern) {
 			LM_ERR("cannot allocate shm memory for table pattern\n");
+			if (entry->info) shm_free(entry->info);
+			shm_free(entry);
 			return -1;
 		}
-		memcpy(table[i + 1].pattern, pattern->s, pattern->len);
-		table[i + 1].pattern[ pattern->len ] = 0;
+		memcpy(entry->pattern, pattern->s, pattern->len);
+		entry->pattern[ pattern->len ] = 0;
 	}
-	else
-		table[i + 1].pattern = NULL;
+
+	for (p = &node->entries; *p && (*p)->grp <= grp; p = &(*p)->next);
+	entry->next = *p;
+	*p = entry;
+
+	table->count++;
+
+	return 1;
+}
 
 
-    table[PERM_MAX_SUBNETS].grp = count + 1;
+/*
+ * Collects the nodes with entries on the path of the given address, from
+ * the least to the most specific one; returns their number
+ */
+static inline int subnet_lookup(struct subnet_table *table,
+		struct ip_addr *ip, struct subnet_node **path)
+{
+	struct subnet_node *node;
+	unsigned int maxlen;
+	int n = 0;
+
+	if (ip->af != AF_INET && ip->af != AF_INET6)
+		return 0;
+
+	maxlen = ip->len * 8;
+	node = table->root[ip->af == AF_INET6];
 
-    return 1;
+	/* on the way down only the branching bits are tested, so each prefix
+	 * is checked against the address as a whole */
+	while (node && matchnet(ip, &node->net) == 1) {
+		if (node->entries)
+			path[n++] = node;
+		if (node->bitlen == maxlen)
+			break;
+		node = node->child[addr_bit(ip->u.addr, node->bitlen)];
+	}
+
+	return n;
 }
 
 
 /*
  * Check if an entry exists in subnet table that matches given group, ip_addr,
- * and port.  Port 0 in subnet table matches any port.
+ * and port.  Port 0 in subnet table matches any port.  The entries of the
+ * most specific matching subnets are checked first.
  */
-int match_subnet_table(struct sip_msg *msg, struct subnet* table, unsigned int grp,
-			struct ip_addr *ip, unsigned int port, int proto,
+int match_subnet_table(struct sip_msg *msg, struct subnet_table* table,
+			unsigned int grp, struct ip_addr *ip, unsigned int port, int proto,
 			char *pattern, char *info)
 {
-        unsigned int count, i;
+	struct subnet_node *path[PERM_MAX_BITLEN + 1];
+	struct subnet *entry;
 	pv_value_t pvt;
 	pv_spec_t *pvs;
-	int match_res, found_group = 0;
+	int n, match_res;
 
-	count = table[PERM_MAX_SUBNETS].grp;
-
-	if (count == 0) {
+	if (table->count == 0) {
 		LM_DBG("subnet table is empty\n");
 		return -2;
 	}
 
-	if (grp != GROUP_ANY) {
-		for (i = 0; i < count; i++) {
-			if (table[i].grp == grp) {
-				found_group = 1;
-				break;
-			} else if (table[i].grp > grp) {
+	if (grp != GROUP_ANY && !has_subnet_group(table, grp)) {
+		LM_DBG("specified group %u does not exist in hash table\n", grp);
+		return -2;
+	}
+
+	n = subnet_lookup(table, ip, path);
+	while (n--) {
+		for (entry = path[n]->entries; entry; entry = entry->next) {
+			if (grp != GROUP_ANY && entry->grp > grp)
 				break;
-			}
-		}
 
-		if (!found_group) {
-			LM_DBG("specified group %u does not exist in hash table\n", grp);
-			return -2;
+			if ((entry->grp == grp || entry->grp == GROUP_ANY
+					|| grp == GROUP_ANY) &&
+				(entry->port == port || entry->port == PORT_ANY
+					|| port == PORT_ANY) &&
+				(entry->proto == proto || entry->proto == PROTO_NONE
+					|| proto == PROTO_NONE))
+			{
+				if (entry->pattern && pattern) {
+					match_res = fnmatch(entry->pattern, pattern, FNM_PERIOD);
+
+					if (match_res)
+						continue;
+				}
+
+				goto found;
+			}
 		}
 	}
 
-	i = 0;
-	do {
-		if ((table[i].grp == grp || table[i].grp == GROUP_ANY
-				|| grp == GROUP_ANY) &&
-			(table[i].port == port || table[i].port == PORT_ANY
-				|| port == PORT_ANY) &&
-			(table[i].proto == proto || table[i].proto == PROTO_NONE
-			 	|| proto == PROTO_NONE))
-			{
+	LM_DBG("no match in the subnet table\n");
+	return -1;
 
-				match_res = matchnet(ip, table[i].subnet);
+found:
+	if (info) {
+		pvs = (pv_spec_t *)info;
+		memset(&pvt, 0, sizeof(pv_value_t));
+		pvt.flags = PV_VAL_STR;
+		pvt.rs.s = entry->info;
+		pvt.rs.len = entry->info ? strlen(entry->info) : 0;
 
-				if (match_res != 1) {
-					i++;
-					continue;
-				}
+		if (pv_set_value(msg, pvs, (int)EQ_T, &pvt) < 0) {
+			LM_ERR("setting of avp failed\n");
+			return -1;
+		}
+	}
 
-				if (table[i].pattern && pattern) {
-					match_res = fnmatch(table[i].pattern, pattern, FNM_PERIOD);
+	LM_DBG("match found in the subnet table\n");
+	return 1;
+}
 
-					if (match_res) {
-						i++;
-						continue;
-					}
-				}
 
-				if (info) {
-					pvs = (pv_spec_t *)info;
-					memset(&pvt, 0, sizeof(pv_value_t));
-					pvt.flags = PV_VAL_STR;
-					pvt.rs.s = table[i].info;
-					pvt.rs.len = table[i].info ? strlen(table[i].info) : 0;
-
-					if (pv_set_value(msg, pvs, (int)EQ_T, &pvt) < 0) {
-						LM_ERR("setting of avp failed\n");
-						return -1;
-	    			}
-				}
+static int subnet_node_mi_print(struct subnet_node *node, struct mi_node* rpl,
+		int *i)
+{
+	struct subnet *entry;
+	char *ip, *mask;
+	static char ip_buff[IP_ADDR_MAX_STR_SIZE];
 
-				LM_DBG("match found in the subnet table\n");
-				return 1;
+	for (; node; node = node->child[1]) {
+		if (node->entries) {
+			ip = ip_addr2a(&node->net.ip);
+			if (!ip) {
+				LM_ERR("cannot print ip address\n");
+				goto next;
+			}
+			strcpy(ip_buff, ip);
+			mask = ip_addr2a(&node->net.mask);
+			if (!mask) {
+				LM_ERR("cannot print mask address\n");
+				goto next;
 			}
 
-		if (table[i].grp > grp && grp != GROUP_ANY)
-			break;
-		i++;
-
-	} while (i < count);
+			for (entry = node->entries; entry; entry = entry->next)
+				if (addf_mi_node_child(rpl, 0, 0, 0,
+						"\t%4d <%u, %s, %s, %u>",
+						(*i)++, entry->grp, ip_buff, mask,
+						entry->port) == 0)
+					return -1;
+		}
+next:
+		if (subnet_node_mi_print(node->child[0], rpl, i) < 0)
+			return -1;
+	}
 
-	LM_DBG("no match in the subnet table\n");
-    return -1;
+	return 0;
 }
 
 
 /*
  * Print subnets stored in subnet table
  */
-int subnet_table_mi_print(struct subnet* table, struct mi_node* rpl,
+int subnet_table_mi_print(struct subnet_table* table, struct mi_node* rpl,
 		struct pm_part_struct *pm)
 {
-    unsigned int count, i;
-	char *ip, *mask;
-	static char ip_buff[IP_ADDR_MAX_STR_SIZE];
-    count = table[PERM_MAX_SUBNETS].grp;
+	int i = 0;
 
 	if (addf_mi_node_child(rpl, 0, 0, 0,
 				   "%.*s\n",
 				   pm->name.len, pm->name.s) == 0)
 		return -1;
 
-    for (i = 0; i < count; i++) {
-		ip = ip_addr2a(&table[i].subnet->ip);
-		if (!ip) {
-			LM_ERR("cannot print ip address\n");
-			continue;
-		}
-		strcpy(ip_buff, ip);
-		mask = ip_addr2a(&table[i].subnet->mask);
-		if (!mask) {
-			LM_ERR("cannot print mask address\n");
-			continue;
-		}
-		if (addf_mi_node_child(rpl, 0, 0, 0,
-			       "\t%4d <%u, %s, %s, %u>",
-			       i, table[i].grp, ip_buff, mask,
-				   table[i].port) == 0)
-	    	return -1;
-    }
-    return 0;
+	if (subnet_node_mi_print(table->root[0], rpl, &i) < 0 ||
+	subnet_node_mi_print(table->root[1], rpl, &i) < 0)
+		return -1;
+
+	return 0;
 }
 
 
 /*
  * Check if an entry exists in subnet table that matches given ip_addr,
  * and port.  Port 0 in subnet table matches any port.  Return group of
- * first match or -1 if no match is found.
+ * the most specific match or -1 if no match is found.
  */
-int find_group_in_subnet_table(struct subnet* table,
+int find_group_in_subnet_table(struct subnet_table* table,
 		                   struct ip_addr *ip, unsigned int port)
 {
-	unsigned int count, i, match_res;
-
-	count = table[PERM_MAX_SUBNETS].grp;
+	struct subnet_node *path[PERM_MAX_BITLEN + 1];
+	struct subnet *entry;
+	int n;
+
+	n = subnet_lookup(table, ip, path);
+	while (n--) {
+		for (entry = path[n]->entries; entry; entry = entry->next)
+			if (entry->port == port || entry->port == 0)
+				return entry->grp;
+	}
 
-	i = 0;
-	while (i < count) {
-		if	(table[i].port == port || table[i].port == 0) {
-			match_res = matchnet(ip, table[i].subnet);
+	return -1;
+}
 
-			if (match_res == 1)
-		        return table[i].grp;
 
+static void free_subnet_node(struct subnet_node *node)
+{
+	struct subnet_node *next;
+	struct subnet *entry;
+
+	for (; node; node = next) {
+		free_subnet_node(node->child[0]);
+		next = node->child[1];
+
+		while ((entry = node->entries) != NULL) {
+			node->entries = entry->next;
+			if (entry->info)
+				shm_free(entry->info);
+			if (entry->pattern)
+				shm_free(entry->pattern);
+			shm_free(entry);
 		}
-	    i++;
+		shm_free(node);
 	}
-
-	return -1;
 }
 
 
 /*
  * Empty contents of subnet table
  */
-void empty_subnet_table(struct subnet *table)
+void empty_subnet_table(struct subnet_table *table)
 {
-	int count, i;
-
 	if (!table)
 		return;
 
-	count = table[PERM_MAX_SUBNETS].grp;
-
-	for (i = 0; i < count; i++) {
-		if (table[i].info)
-    		        shm_free(table[i].info);
-		if (table[i].subnet)
-		        shm_free(table[i].subnet);
-	}
+	free_subnet_node(table->root[0]);
+	free_subnet_node(table->root[1]);
+	table->root[0] = table->root[1] = NULL;
 
-	table[PERM_MAX_SUBNETS].grp = 0;
+	table->count = 0;
+	table->grp_no = 0;
 }
 
 
 /*
  * Release memory allocated for a subnet table
  */
-void free_subnet_table(struct subnet* table)
+void free_subnet_table(struct subnet_table* table)
 {
 	empty_subnet_table(table);
 
-	if (table)
-	    shm_free(table);
+	if (table) {
+		if (table->grps)
+			shm_free(table->grps);
+		shm_free(table);
+	}
 }
-
-
-
-
@@ -102,32 +102,55 @@ int find_group_in_hash_table(struct address_list** table,
 
 
 
-#define PERM_MAX_SUBNETS 128
-
 /*
- * Structure used to store a subnet
+ * Structure used to store a subnet entry; all the entries with the same
+ * prefix hang from the same node of the subnet tree, ordered by group
  */
 struct subnet {
-	unsigned int grp;        /* address group, subnet count in last record */
-	struct net *subnet;		 /* IP subnet + mask */
+	unsigned int grp;        /* address group */
 	int proto;                  /* Protocol -- UDP, TCP, TLS, or SCTP */
 	char *pattern;              /* Pattern matching From header field */
 	unsigned int port;       /* port or 0 */
 	char *info;				 /* extra information */
+	struct subnet *next;     /* next entry with the same prefix */
+};
+
+/*
+ * Node of a subnet (path compressed radix) tree. Nodes without entries
+ * are only branching points and always have two children.
+ */
+struct subnet_node {
+	struct net net;                /* IP subnet + mask */
+	unsigned int bitlen;           /* mask length */
+	struct subnet *entries;        /* subnets with this very prefix */
+	struct subnet_node *child[2];  /* subtrees on the next bit 0 / 1 */
+};
+
+/*
+ * Subnet table - one tree per address family, searched for the longest
+ * matching prefix in O(address length), plus the sorted set of groups
+ */
+struct subnet_table {
+	struct subnet_node *root[2];  /* IPv4 and IPv6 trees */
+	unsigned int count;           /* number of subnet entries */
+	unsigned int *grps;           /* distinct groups, in increasing order */
+	unsigned int grp_no;
+	unsigned int grp_size;
 };
 
 
 /*
  * Create a subnet table
  */
-struct subnet* new_subnet_table(void);
+struct subnet_table* new_subnet_table(void);
 
 
 /*
  * Check if an entry exists in subnet table that matches given group, ip_addr,
- * and port.  Port 0 in subnet table matches any port.
+ * and port.  Port 0 in subnet table matches any port.  The most specific
+ * matching subnet wins.
  */
-int match_subnet_table(struct sip_msg *msg, struct subnet* table,
+int match_subnet_table(struct sip_msg *msg, struct subnet_table* table,
 		unsigned int group, struct ip_addr *ip, unsigned int port, int proto,
 		char *pattern, char* info);
 
@@ -135,29 +158,29 @@ int match_subnet_table(struct sip_msg *msg, struct subnet* table,
 /*
  * Checks if an entry exists in subnet table that matches given ip_addr,
  * and port.  Port 0 in subnet table matches any port.  Returns group of
- * the first match or -1 if no match is found.
+ * the most specific match or -1 if no match is found.
  */
-int find_group_in_subnet_table(struct subnet* table,
+int find_group_in_subnet_table(struct subnet_table* table,
 		struct ip_addr *ip, unsigned int port);
 
 /*
  * Empty contents of subnet table
  */
-void empty_subnet_table(struct subnet *table);
+void empty_subnet_table(struct subnet_table *table);
 
 
 /*
  * Release memory allocated for a subnet table
  */
-void free_subnet_table(struct subnet* table);
+void free_subnet_table(struct subnet_table* table);
 
 
 
 /*
- * Add <grp, subnet, mask, port> into subnet table so that table is
- * kept ordered according to subnet, port, grp.
+ * Add <grp, subnet, mask, port> into subnet table, under the node of its
+ * prefix, keeping the entries of the node ordered by grp.
  */
-int subnet_table_insert(struct subnet* table, unsigned int grp,
+int subnet_table_insert(struct subnet_table* table, unsigned int grp,
 		struct net *subnet, unsigned int port, int proto,
 		str* pattern, str *info);
 
@@ -166,7 +189,7 @@ int subnet_table_insert(struct subnet* table, unsigned int grp,
  * Print subnets stored in subnet table
  */
 /*void subnet_table_print(struct subnet* table, FILE* reply_file);*/
-int subnet_table_mi_print(struct subnet* table, struct mi_node* rpl,
+int subnet_table_mi_print(struct subnet_table* table, struct mi_node* rpl,
 		struct pm_part_struct *pm);
 
 
@@ -72,6 +72,10 @@ str mask_col = str_init("mask");			/* Name of mask column */
 str port_col = str_init("port");			/* Name of port column */
 str id_col = str_init("id");				/* Name of id column */
 
+/* IPv6 entries with a mask of 32 stand for a host, as with the old subnet
+ * table (which knew no longer masks) */
+int ipv6_mask32_host = 1;
+
 /*
  * By default we check all branches
  */
@@ -160,6 +164,7 @@ static param_export_t params[] = {
 	{"default_allow_file", STR_PARAM, &default_allow_file},
 	{"default_deny_file",  STR_PARAM, &default_deny_file },
 	{"check_all_branches", INT_PARAM, &check_all_branches},
+	{"ipv6_mask32_host",   INT_PARAM, &ipv6_mask32_host  },
 	{"allow_suffix",       STR_PARAM, &allow_suffix      },
 	{"deny_suffix",        STR_PARAM, &deny_suffix       },
 	{"partition",		   STR_PARAM|USE_FUNC_PARAM,
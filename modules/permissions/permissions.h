@@ -57,6 +57,7 @@ extern str grp_col;       /* Name of address group column */
 extern str mask_col;      /* Name of mask column */
 extern str port_col;      /* Name of port column */
 extern str id_col;        /* Name of id column */
+extern int ipv6_mask32_host; /* IPv6 entries with mask 32 are hosts */
 
 typedef struct int_or_pvar {
     unsigned int i;
@@ -49,6 +49,7 @@
 #include "timer.h"
 #include "pike_mi.h"
 #include "pike_funcs.h"
+#include "pike_sketch.h"
 
 
 
@@ -63,6 +64,7 @@ static int pike_exit(void);
 static int time_unit = 2;
 static int max_reqs  = 30;
 static char *pike_route_s = NULL;
+static char *engine_s = "tree";
 int timeout   = 120;
 int pike_log_level = L_WARN;
 
@@ -86,6 +88,12 @@ static param_export_t params[]={
 	{"remove_latency",        INT_PARAM,  &timeout},
 	{"pike_log_level",        INT_PARAM,  &pike_log_level},
 	{"check_route",           STR_PARAM,  &pike_route_s},
+	{"detection_engine",      STR_PARAM,  &engine_s},
+	{"sketch_width",          INT_PARAM,  &sketch_width},
+	{"sketch_depth",          INT_PARAM,  &sketch_depth},
+	{"sketch_ipv4_prefix",    INT_PARAM,  &sketch_ipv4_prefix},
+	{"sketch_ipv6_prefix",    INT_PARAM,  &sketch_ipv6_prefix},
+	{"sketch_max_hitters",    INT_PARAM,  &sketch_max_hitters},
 	{0,0,0}
 };
 
@@ -127,6 +135,13 @@ static int pike_init(void)
 
 	LM_INFO("initializing...\n");
 
+	if (strcasecmp(engine_s, "sketch")==0) {
+		pike_use_sketch = 1;
+	} else if (strcasecmp(engine_s, "tree")!=0) {
+		LM_ERR("unknown detection engine <%s>\n", engine_s);
+		return -1;
+	}
+
 	/* alloc the timer lock */
 	timer_lock=lock_alloc();
 	if (timer_lock==0) {
@@ -139,6 +154,17 @@ static int pike_init(void)
 		goto error1;
 	}
 
+	if (pike_use_sketch) {
+		/* fixed memory, nothing to clean up */
+		if ( init_pike_sketch(max_reqs)!=0 ) {
+			LM_ERR(" sketch creation failed!\n");
+			goto error2;
+		}
+		register_timer( "pike-swap", pike_sketch_swap, 0, time_unit,
+			TIMER_FLAG_DELAY_ON_DELAY );
+		goto route;
+	}
+
 	/* init the IP tree */
 	if ( init_ip_tree(max_reqs)!=0 ) {
 		LM_ERR(" ip_tree creation failed!\n");
@@ -159,6 +185,7 @@ static int pike_init(void)
 	register_timer( "pike-swap", swap_routine , 0, time_unit,
 		TIMER_FLAG_DELAY_ON_DELAY );
 
+route:
 	if (pike_route_s && *pike_route_s) {
 		rt = get_script_route_ID_by_name( pike_route_s, rlist, RT_NO);
 		if (rt<1) {
@@ -179,6 +206,7 @@ static int pike_init(void)
 	return 0;
 error3:
 	destroy_ip_tree();
+	destroy_pike_sketch();
 error2:
 	lock_destroy(timer_lock);
 error1:
@@ -207,6 +235,7 @@ static int pike_exit(void)
 
 	/* destroy the IP tree */
 	destroy_ip_tree();
+	destroy_pike_sketch();
 
 	return 0;
 }
@@ -47,6 +47,7 @@
 #include "../../script_cb.h"
 #include "ip_tree.h"
 #include "pike_funcs.h"
+#include "pike_sketch.h"
 #include "timer.h"
 
 
@@ -92,7 +93,7 @@ static inline void pike_raise_event(char *ip)
 
 int pike_check_req(struct sip_msg *msg)
 {
-	struct ip_node *node;
+	struct ip_node *node = 0;
 	struct ip_node *father;
 	unsigned char flags;
 	struct ip_addr* ip;
@@ -112,6 +113,10 @@ int pike_check_req(struct sip_msg *msg)
 	ip = &(msg->rcv.src_ip);
 #endif
 
+	if (pike_use_sketch) {
+		flags = pike_sketch_mark(ip);
+		goto check;
+	}
 
 	/* first lock the proper tree branch and mark the IP with one more hit*/
 	lock_tree_branch( ip->u.addr[0] );
@@ -183,10 +188,15 @@ int pike_check_req(struct sip_msg *msg)
 	unlock_tree_branch( ip->u.addr[0] );
 	/*print_tree( 0 );*/ /* debug */
 
+check:
 	if (flags&RED_NODE) {
 		if (flags&NEWRED_NODE) {
-			LM_GEN1( pike_log_level,
-				"PIKE - BLOCKing ip %s, node=%p\n",ip_addr2a(ip),node);
+			if (pike_use_sketch)
+				LM_GEN1( pike_log_level, "PIKE - BLOCKing ip %s (prefix)\n",
+					ip_addr2a(ip));
+			else
+				LM_GEN1( pike_log_level,
+					"PIKE - BLOCKing ip %s, node=%p\n",ip_addr2a(ip),node);
 			pike_raise_event(ip_addr2a(ip));
 			return -2;
 		}
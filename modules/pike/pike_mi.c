@@ -30,6 +30,7 @@
 
 #include "ip_tree.h"
 #include "pike_mi.h"
+#include "pike_sketch.h"
 
 #define IPv6_LEN 16
 #define IPv4_LEN 4
@@ -107,6 +108,14 @@ struct mi_root* mi_pike_rm(struct mi_root *cmd, void *param)
     if (ip==0)
 	return init_mi_tree( 500, "Bad IP", 6);
 
+    if (pike_use_sketch) {
+	if (pike_sketch_rm(ip)<0)
+	    return init_mi_tree( 400, "IP not blocked", 14);
+	LM_GEN1(pike_log_level,
+	    "PIKE - UNBLOCKing ip %s (prefix)\n",ip_addr2a(ip));
+	return init_mi_tree( 200, MI_OK_S, MI_OK_LEN);
+    }
+
     node = 0;
     byte_pos = 0;
 
@@ -164,6 +173,14 @@ struct mi_root* mi_pike_list(struct mi_root* cmd_tree, void* param)
 		return 0;
 	rpl_tree->node.flags |= MI_IS_ARRAY;
 
+	if (pike_use_sketch) {
+		if (pike_sketch_list(&rpl_tree->node)<0) {
+			free_mi_tree(rpl_tree);
+			return 0;
+		}
+		return rpl_tree;
+	}
+
 	for( i=0 ; i<MAX_IP_BRANCHES ; i++ ) {
 
 		if (get_tree_branch(i)==0)
@@ -0,0 +1,366 @@
+/*
+ * Copyright (C) 2016 OpenSIPS Solutions
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#include <string.h>
+#include <limits.h>
+
+#include "../../mem/shm_mem.h"
+#include "../../locking.h"
+#include "../../dprint.h"
+#include "ip_tree.h"
+#include "pike_sketch.h"
+
+/* hitters per bucket; a bucket is searched linearly, under its lock */
+#define PIKE_HH_BUCKET     8
+#define PIKE_MAX_DEPTH     16
+#define PIKE_MAX_LOCKS     256
+
+struct sketch_hitter {
+	/* the prefix, with the host bits cleared; len 0 - free slot */
+	struct ip_addr key;
+	/* hits of the prefix when last seen */
+	unsigned int hits;
+};
+
+struct pike_sketch {
+	unsigned int mask;            /* width - 1 */
+	unsigned int max_hits;
+	/* which of the rows counts the current sampling unit */
+	volatile unsigned int curr;
+	/* depth x width counters for each sampling unit */
+	unsigned int *rows[2];
+	unsigned int buckets;
+	struct sketch_hitter *hitters;
+	gen_lock_set_t *locks;
+	unsigned int locks_no;
+};
+
+int pike_use_sketch = 0;
+int sketch_width = 8192;
+int sketch_depth = 4;
+int sketch_ipv4_prefix = 24;
+int sketch_ipv6_prefix = 64;
+int sketch_max_hitters = 128;
+
+extern int pike_log_level;
+
+static struct pike_sketch *sk = NULL;
+
+
+int init_pike_sketch(int max_hits)
+{
+	unsigned int width, i;
+
+	if (sketch_depth<1 || sketch_depth>PIKE_MAX_DEPTH) {
+		LM_ERR("sketch_depth must be between 1 and %d\n", PIKE_MAX_DEPTH);
+		return -1;
+	}
+	if (sketch_ipv4_prefix<1 || sketch_ipv4_prefix>32 ||
+	sketch_ipv6_prefix<1 || sketch_ipv6_prefix>128) {
+		LM_ERR("bad sketch prefix length (%d for IPv4, %d for IPv6)\n",
+			sketch_ipv4_prefix, sketch_ipv6_prefix);
+		return -1;
+	}
+	if (sketch_width<64)
+		sketch_width = 64;
+	if (sketch_max_hitters<PIKE_HH_BUCKET)
+		sketch_max_hitters = PIKE_HH_BUCKET;
+
+	for (width = 1; width < (unsigned int)sketch_width; width <<= 1);
+
+	sk = (struct pike_sketch*)shm_malloc(sizeof(struct pike_sketch));
+	if (sk==0) {
+		LM_ERR("no more shm mem\n");
+		return -1;
+	}
+	memset(sk, 0, sizeof(struct pike_sketch));
+
+	sk->mask = width - 1;
+	sk->max_hits = max_hits;
+	sk->buckets = (sketch_max_hitters + PIKE_HH_BUCKET - 1) / PIKE_HH_BUCKET;
+
+	sk->rows[0] = (unsigned int*)shm_malloc(
+		2 * sketch_depth * width * sizeof(unsigned int));
+	sk->hitters = (struct sketch_hitter*)shm_malloc(
+		sk->buckets * PIKE_HH_BUCKET * sizeof(struct sketch_hitter));
+	if (sk->rows[0]==0 || sk->hitters==0) {
+		LM_ERR("no more shm mem for a %dx%u sketch\n", sketch_depth, width);
+		goto error;
+	}
+	memset(sk->rows[0], 0, 2 * sketch_depth * width * sizeof(unsigned int));
+	sk->rows[1] = sk->rows[0] + sketch_depth * width;
+	memset(sk->hitters, 0,
+		sk->buckets * PIKE_HH_BUCKET * sizeof(struct sketch_hitter));
+
+	for (i = sk->buckets < PIKE_MAX_LOCKS ? sk->buckets : PIKE_MAX_LOCKS;
+	i; i >>= 1) {
+		sk->locks = lock_set_alloc(i);
+		if (sk->locks==0)
+			continue;
+		if (lock_set_init(sk->locks)==0) {
+			lock_set_dealloc(sk->locks);
+			sk->locks = 0;
+			continue;
+		}
+		break;
+	}
+	if (sk->locks==0) {
+		LM_ERR("cannot get a lock set\n");
+		goto error;
+	}
+	sk->locks_no = i;
+
+	LM_INFO("sketch of %dx%u counters, up to %u blocked prefixes tracked\n",
+		sketch_depth, width, sk->buckets * PIKE_HH_BUCKET);
+	return 0;
+error:
+	destroy_pike_sketch();
+	return -1;
+}
+
+
+void destroy_pike_sketch(void)
+{
+	if (sk==0)
+		return;
+
+	if (sk->locks) {
+		lock_set_destroy(sk->locks);
+		lock_set_dealloc(sk->locks);
+	}
+	if (sk->hitters)
+		shm_free(sk->hitters);
+	if (sk->rows[0])
+		shm_free(sk->rows[0]);
+	shm_free(sk);
+	sk = 0;
+}
+
+
+static inline int prefix_len(struct ip_addr *ip)
+{
+	return ip->af==AF_INET ? sketch_ipv4_prefix : sketch_ipv6_prefix;
+}
+
+
+/* builds the key of the IP - its prefix - and hashes it (FNV-1a) */
+static inline void sketch_key(struct ip_addr *ip, struct ip_addr *key,
+									unsigned int *h1, unsigned int *h2)
+{
+	unsigned long long h = 14695981039346656037ULL;
+	int bits, i;
+
+	memset(key, 0, sizeof *key);
+	key->af = ip->af;
+	key->len = ip->len;
+	for (i = 0, bits = prefix_len(ip); i < ip->len && bits > 0;
+	i++, bits -= 8)
+		key->u.addr[i] = ip->u.addr[i] &
+			(bits >= 8 ? 0xff : (0xff << (8 - bits)) & 0xff);
+
+	h = (h ^ key->len) * 1099511628211ULL;
+	for (i = 0; i < key->len; i++)
+		h = (h ^ key->u.addr[i]) * 1099511628211ULL;
+
+	/* the rows are indexed by h1 + row * h2 (double hashing) */
+	*h1 = (unsigned int)h;
+	*h2 = (unsigned int)(h >> 32) | 1;
+}
+
+
+#define row_idx(_r, _h1, _h2) \
+	((_r) * (sk->mask + 1) + (((_h1) + (_r) * (_h2)) & sk->mask))
+
+static inline unsigned int sketch_estimate(unsigned int *rows,
+									unsigned int h1, unsigned int h2)
+{
+	unsigned int est = UINT_MAX, v;
+	int r;
+
+	for (r = 0; r < sketch_depth; r++) {
+		v = rows[row_idx(r, h1, h2)];
+		if (v < est)
+			est = v;
+	}
+	return est;
+}
+
+
+/* same thresholds as for the IP leaves of the tree */
+#define is_hot(_prev, _curr) \
+	((_prev)>=sk->max_hits || (_curr)>=sk->max_hits)
+
+#define same_key(_a, _b) \
+	((_a)->len==(_b)->len && memcmp((_a)->u.addr, (_b)->u.addr, (_a)->len)==0)
+
+
+int pike_sketch_mark(struct ip_addr *ip)
+{
+	struct ip_addr key;
+	struct sketch_hitter *h, *victim;
+	unsigned int h1, h2, prev, curr, v, b;
+	unsigned int *crows, *prows;
+	int r, c;
+
+	sketch_key(ip, &key, &h1, &h2);
+
+	c = sk->curr;
+	crows = sk->rows[c];
+	prows = sk->rows[c ^ 1];
+
+	prev = curr = UINT_MAX;
+	for (r = 0; r < sketch_depth; r++) {
+		v = __sync_add_and_fetch(&crows[row_idx(r, h1, h2)], 1);
+		if (v < curr)
+			curr = v;
+		v = prows[row_idx(r, h1, h2)];
+		if (v < prev)
+			prev = v;
+	}
+
+	if (!is_hot(prev, curr))
+		return 0;
+
+	/* hot prefix - find it among the heavy hitters */
+	b = h1 % sk->buckets;
+	h = &sk->hitters[b * PIKE_HH_BUCKET];
+	victim = NULL;
+
+	lock_set_get(sk->locks, b % sk->locks_no);
+	for (r = 0; r < PIKE_HH_BUCKET; r++) {
+		if (h[r].key.len==0) {
+			if (victim==NULL || victim->key.len)
+				victim = &h[r];
+			continue;
+		}
+		if (same_key(&h[r].key, &key)) {
+			h[r].hits = curr;
+			lock_set_release(sk->locks, b % sk->locks_no);
+			return RED_NODE;
+		}
+		if (victim==NULL || (victim->key.len && h[r].hits < victim->hits))
+			victim = &h[r];
+	}
+
+	/* a full bucket gives up its least active prefix (still blocked, by
+	 * the sketch, but no longer listed) */
+	if (victim->key.len && victim->hits >= curr) {
+		lock_set_release(sk->locks, b % sk->locks_no);
+		return RED_NODE;
+	}
+	victim->key = key;
+	victim->hits = curr;
+	lock_set_release(sk->locks, b % sk->locks_no);
+
+	return RED_NODE|NEWRED_NODE;
+}
+
+
+void pike_sketch_swap(unsigned int ticks, void *param)
+{
+	struct sketch_hitter *h;
+	unsigned int n, i, b, h1, h2;
+	struct ip_addr key;
+
+	/* the oldest unit is reset and becomes the current one */
+	n = sk->curr ^ 1;
+	memset(sk->rows[n], 0,
+		sketch_depth * (sk->mask + 1) * sizeof(unsigned int));
+	__sync_synchronize();
+	sk->curr = n;
+
+	/* unblock the prefixes which were not hot in the unit just ended */
+	for (b = 0; b < sk->buckets; b++) {
+		h = &sk->hitters[b * PIKE_HH_BUCKET];
+		lock_set_get(sk->locks, b % sk->locks_no);
+		for (i = 0; i < PIKE_HH_BUCKET; i++) {
+			if (h[i].key.len==0)
+				continue;
+			sketch_key(&h[i].key, &key, &h1, &h2);
+			if (is_hot(sketch_estimate(sk->rows[n ^ 1], h1, h2), 0))
+				continue;
+			LM_GEN1(pike_log_level, "PIKE - UNBLOCKing prefix %s/%d\n",
+				ip_addr2a(&h[i].key), prefix_len(&h[i].key));
+			h[i].key.len = 0;
+		}
+		lock_set_release(sk->locks, b % sk->locks_no);
+	}
+}
+
+
+int pike_sketch_list(struct mi_node *rpl)
+{
+	struct sketch_hitter *h;
+	unsigned int i, b;
+
+	for (b = 0; b < sk->buckets; b++) {
+		h = &sk->hitters[b * PIKE_HH_BUCKET];
+		lock_set_get(sk->locks, b % sk->locks_no);
+		for (i = 0; i < PIKE_HH_BUCKET; i++) {
+			if (h[i].key.len==0)
+				continue;
+			if (addf_mi_node_child(rpl, 0, 0, 0, "%s/%d",
+			ip_addr2a(&h[i].key), prefix_len(&h[i].key))==0) {
+				lock_set_release(sk->locks, b % sk->locks_no);
+				return -1;
+			}
+		}
+		lock_set_release(sk->locks, b % sk->locks_no);
+	}
+
+	return 0;
+}
+
+
+int pike_sketch_rm(struct ip_addr *ip)
+{
+	struct sketch_hitter *h;
+	struct ip_addr key;
+	unsigned int h1, h2, b, est, v, *cnt;
+	int i, u, r;
+
+	sketch_key(ip, &key, &h1, &h2);
+
+	b = h1 % sk->buckets;
+	h = &sk->hitters[b * PIKE_HH_BUCKET];
+	lock_set_get(sk->locks, b % sk->locks_no);
+	for (i = 0; i < PIKE_HH_BUCKET; i++)
+		if (h[i].key.len && same_key(&h[i].key, &key))
+			break;
+	if (i==PIKE_HH_BUCKET) {
+		lock_set_release(sk->locks, b % sk->locks_no);
+		return -1;
+	}
+	h[i].key.len = 0;
+
+	/* forget the hits of the prefix, so it is not blocked again right
+	 * away (the other prefixes sharing its counters may lose some too) */
+	for (u = 0; u < 2; u++) {
+		est = sketch_estimate(sk->rows[u], h1, h2);
+		for (r = 0; r < sketch_depth; r++) {
+			cnt = &sk->rows[u][row_idx(r, h1, h2)];
+			v = *cnt;
+			__sync_fetch_and_sub(cnt, v < est ? v : est);
+		}
+	}
+	lock_set_release(sk->locks, b % sk->locks_no);
+
+	return 0;
+}
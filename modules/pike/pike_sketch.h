@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2016 OpenSIPS Solutions
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * Fixed memory detection engine: the hits of the source prefixes are
+ * counted in two count-min sketches (the current and the previous
+ * sampling unit), updated without locks. The prefixes detected as hot are
+ * kept in a small table of heavy hitters, for logging and MI; the memory
+ * does not depend on the number of sources seen.
+ */
+
+#ifndef _PIKE_SKETCH_H
+#define _PIKE_SKETCH_H
+
+#include "../../ip_addr.h"
+#include "../../mi/mi.h"
+
+/* parameters */
+extern int pike_use_sketch;
+extern int sketch_width;
+extern int sketch_depth;
+extern int sketch_ipv4_prefix;
+extern int sketch_ipv6_prefix;
+extern int sketch_max_hitters;
+
+int  init_pike_sketch(int max_hits);
+void destroy_pike_sketch(void);
+
+/* counts a hit of the IP's prefix; returns 0 or RED_NODE[|NEWRED_NODE] */
+int  pike_sketch_mark(struct ip_addr *ip);
+
+/* moves to a new sampling unit and unblocks the prefixes cooled down */
+void pike_sketch_swap(unsigned int ticks, void *param);
+
+/* lists the blocked prefixes */
+int  pike_sketch_list(struct mi_node *rpl);
+
+/* unblocks the prefix of the IP; returns 0, or -1 if not blocked */
+int  pike_sketch_rm(struct ip_addr *ip);
+
+#endif
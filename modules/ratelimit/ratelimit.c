@@ -30,6 +30,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #include <regex.h>
 #include <math.h>
 
@@ -59,6 +60,7 @@ static int *rl_feedback_limit;
 
 int * rl_network_load;	/* network load */
 int * rl_network_count;	/* flag for counting network algo users */
+int * rl_budget_nodes;	/* instances sharing the budgeted pipes */
 
 /* these only change in the mod_init() process -- no locking needed */
 int rl_timer_interval = RL_TIMER_INTERVAL;
@@ -67,6 +69,7 @@ int accept_repl_pipes = 0;
 int rl_repl_cluster = 0;
 int accept_repl_pipes_timeout = 10;
 int repl_pipes_auth_check = 0;
+int rl_repl_budgets = 0;
 
 static str db_url = {0,0};
 str db_prefix = str_init("rl_pipe_");
@@ -140,6 +143,7 @@ static param_export_t params[] = {
 	{ "replicate_pipes_to",		INT_PARAM,	&rl_repl_cluster		},
 	{ "accept_pipes_timeout",	INT_PARAM,	&accept_repl_pipes_timeout	},
 	{ "repl_pipes_auth_check",	INT_PARAM,	&repl_pipes_auth_check		},
+	{ "repl_budgets",		INT_PARAM,	&rl_repl_budgets		},
 	{ 0, 0, 0}
 };
 
@@ -346,6 +350,12 @@ static int mod_init(void)
 
 	if (repl_pipes_auth_check < 0)
 		repl_pipes_auth_check = 0;
+
+	if (rl_repl_budgets && (!rl_repl_cluster || !accept_repl_pipes)) {
+		LM_WARN("repl_budgets requires both replicate_pipes_to and "
+			"accept_pipes_from - disabling it\n");
+		rl_repl_budgets = 0;
+	}
 		
 	if ( (rl_repl_cluster || accept_repl_pipes) && load_clusterer_api(&clusterer_api) != 0 ){
 		LM_DBG("failed to find clusterer API - is clusterer module loaded?\n");
@@ -360,6 +370,7 @@ static int mod_init(void)
 
 	RL_SHM_MALLOC(rl_network_count, sizeof(int));
 	RL_SHM_MALLOC(rl_network_load, sizeof(int));
+	RL_SHM_MALLOC(rl_budget_nodes, sizeof(int));
 	RL_SHM_MALLOC(rl_load_value, sizeof(double));
 	RL_SHM_MALLOC(pid_kp, sizeof(double));
 	RL_SHM_MALLOC(pid_ki, sizeof(double));
@@ -368,6 +379,9 @@ static int mod_init(void)
 	RL_SHM_MALLOC(drop_rate, sizeof(int));
 	RL_SHM_MALLOC(rl_feedback_limit, sizeof(int));
 
+	/* until the first interval, assume this instance is alone */
+	*rl_budget_nodes = 1;
+
 	/* init ki value for feedback algo */
 	*pid_ki = -25.0;
 
@@ -454,6 +468,7 @@ void mod_destroy(void)
 	}
 	RL_SHM_FREE(rl_network_count);
 	RL_SHM_FREE(rl_network_load);
+	RL_SHM_FREE(rl_budget_nodes);
 	RL_SHM_FREE(rl_load_value);
 	RL_SHM_FREE(pid_kp);
 	RL_SHM_FREE(pid_ki);
@@ -478,20 +493,99 @@ int hash[100] = {18, 50, 51, 39, 49, 68, 8, 78, 61, 75, 53, 32, 45, 77, 31,
 	38, 71, 23, 2, 67, 36, 65, 27, 1, 19, 59, 89, 48};
 
 
+#define RL_NSEC	1000000000ULL
+
+static inline unsigned long long rl_now_ns(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long long)tv.tv_sec * RL_NSEC + tv.tv_usec * 1000ULL;
+}
+
+/**
+ * Token bucket holding one second worth of requests (limit tokens),
+ * refilled with limit tokens per second - kept as the time when the bucket
+ * gets full again (GCRA), so each request is a single compare-and-swap
+ */
+static int rl_token_bucket(rl_pipe_t *pipe, unsigned long long now)
+{
+	unsigned long long full, new_full, cost;
+
+	if (pipe->limit <= 0)
+		return -1;
+
+	cost = RL_NSEC / pipe->limit;
+	do {
+		full = pipe->window[0];
+		new_full = (full > now ? full : now) + cost;
+		/* not enough tokens left */
+		if (new_full - now > RL_NSEC)
+			return -1;
+	} while (!__sync_bool_compare_and_swap(&pipe->window[0], full, new_full));
+
+	return 1;
+}
+
+/**
+ * Sliding window of timer_interval seconds: the accepted requests are
+ * counted in fixed windows, and the count of the previous window is weighted
+ * with the part of it still covered by the sliding window
+ */
+static int rl_sliding_window(rl_pipe_t *pipe, unsigned long long now)
+{
+	unsigned long long len, w, old, prev, cnt, left, max;
+
+	len = (rl_timer_interval ? rl_timer_interval : 1) * RL_NSEC;
+	w = (now / len) & 0xffffffff;
+	max = (unsigned long long)pipe->limit * (rl_timer_interval ?
+		rl_timer_interval : 1);
+
+	/* previous window, in 1/1024 parts still covered */
+	old = pipe->window[(w - 1) & 1];
+	prev = ((old >> 32) == ((w - 1) & 0xffffffff)) ? (old & 0xffffffff) : 0;
+	left = ((len - now % len) << 10) / len;
+	prev = (prev * left) >> 10;
+
+	do {
+		old = pipe->window[w & 1];
+		cnt = ((old >> 32) == w) ? (old & 0xffffffff) : 0;
+		if (prev + cnt >= max)
+			return -1;
+	} while (!__sync_bool_compare_and_swap(&pipe->window[w & 1], old,
+		(w << 32) | (cnt + 1)));
+
+	return 1;
+}
+
 /**
  * runs the pipe's algorithm
- * (expects rl_lock to be taken)
+ * (expects rl_lock to be taken, except for the lockless algorithms)
  * \return	-1 if drop needed, 1 if allowed
  */
 int rl_pipe_check(rl_pipe_t *pipe)
 {
-	unsigned counter = rl_get_all_counters(pipe);
+	unsigned counter;
+
+	switch (pipe->algo) {
+		case PIPE_ALGO_TOKENBUCKET:
+			return rl_token_bucket(pipe, rl_now_ns());
+		case PIPE_ALGO_SLIDINGWINDOW:
+			return rl_sliding_window(pipe, rl_now_ns());
+		default:
+			break;
+	}
+
+	counter = rl_get_all_counters(pipe);
 
 	switch (pipe->algo) {
 		case PIPE_ALGO_NOP:
 			LM_ERR("no algorithm defined for this pipe\n");
 			return 1;
 		case PIPE_ALGO_TAILDROP:
+			/* the budget is this instance's share of the cluster limit */
+			if (pipe->budget >= 0)
+				return (pipe->counter <= pipe->budget) ? 1 : -1;
 			return (counter <= pipe->limit * rl_timer_interval) ?
 				1 : -1;
 		case PIPE_ALGO_RED:
@@ -43,9 +43,16 @@ typedef enum {
 	PIPE_ALGO_TAILDROP,
 	PIPE_ALGO_RED,
 	PIPE_ALGO_FEEDBACK,
-	PIPE_ALGO_NETWORK
+	PIPE_ALGO_NETWORK,
+	PIPE_ALGO_TOKENBUCKET,
+	PIPE_ALGO_SLIDINGWINDOW
 } rl_algo_t;
 
+/* algorithms keeping their state in atomically updated words - they are
+ * run without holding the pipe's lock */
+#define RL_ALGO_LOCKLESS(_a) \
+	((_a)==PIPE_ALGO_TOKENBUCKET || (_a)==PIPE_ALGO_SLIDINGWINDOW)
+
 typedef struct rl_repl_counter {
 	int counter;
 	time_t update;
@@ -62,6 +69,14 @@ typedef struct rl_pipe {
 	rl_algo_t algo;				/* the algorithm used */
 	unsigned long last_used;	/* timestamp when the pipe was last accessed */
 	rl_repl_counter_t *dsts;	/* counters per destination */
+	int budget;					/* share of the limit this instance may accept
+								 * in the interval (-1 if not budgeted) */
+	int demand;					/* checks of the last interval */
+	int sent_demand;			/* last demand replicated */
+	unsigned long sent_time;	/* when the demand was last replicated */
+	/* TOKENBUCKET: time (ns) when the bucket is full again
+	 * SLIDINGWINDOW: (window << 32 | counter) of the last two windows */
+	unsigned long long window[2];
 } rl_pipe_t;
 
 typedef struct rl_repl_dst {
@@ -93,6 +108,8 @@ extern int accept_repl_pipes;
 extern int accept_repl_pipes_timeout;
 extern int repl_pipes_auth_check;
 extern int rl_repl_cluster;
+extern int rl_repl_budgets;
+extern int *rl_budget_nodes;
 
 struct clusterer_binds clusterer_api;
 
@@ -131,6 +148,7 @@ int rl_add_repl_dst(modparam_t type, void *val);
 int rl_bin_status(struct mi_root *);
 
 #define RL_PIPE_COUNTER		0
+#define RL_PIPE_BUDGET		1
 #define RL_EXPIRE_TIMER		10
 #define RL_BUF_THRESHOLD	1400
 
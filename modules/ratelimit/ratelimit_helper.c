@@ -51,6 +51,8 @@ static rl_algo_t rl_default_algo = PIPE_ALGO_NOP;
 
 /* other functions */
 static rl_algo_t get_rl_algo(str);
+static int rl_sync_dump(unsigned long long *cursor);
+static int rl_sync_load(int node_id);
 
 /* big hash table */
 rl_big_htable rl_htable;
@@ -83,7 +85,28 @@ int rl_buffer_th = RL_BUF_THRESHOLD;
 
 /* returns true if the pipe should use cachedb interface */
 #define RL_USE_CDB(_p) \
-	(cdbc && (_p)->algo!=PIPE_ALGO_NETWORK && (_p)->algo!=PIPE_ALGO_FEEDBACK)
+	(cdbc && (_p)->algo!=PIPE_ALGO_NETWORK && (_p)->algo!=PIPE_ALGO_FEEDBACK \
+	 && !RL_ALGO_LOCKLESS((_p)->algo))
+
+/* returns true if the pipe's limit is split in per instance budgets */
+#define RL_USE_BUDGET(_p) \
+	(rl_repl_budgets && (_p)->algo==PIPE_ALGO_TAILDROP && !RL_USE_CDB(_p))
+
+/* an instance's demand counts as at least 1/RL_BUDGET_RESERVE of its fair
+ * share, so that it is not blocked for a whole interval when it starts
+ * receiving traffic */
+#define RL_BUDGET_RESERVE	4
+
+/* a demand is replicated again only if it changed by more than
+ * 1/RL_BUDGET_SLACK */
+#define RL_BUDGET_SLACK		8
+
+/* nodes sharing the budgets and their demands for the current pipe,
+ * refreshed each interval by the timer */
+static int *rl_budget_ids = NULL;
+static int *rl_budget_demands = NULL;
+static int rl_budget_size = 0;
+static int rl_budget_ids_no = 0;
 
 
 
@@ -277,6 +300,8 @@ struct {
 	{ str_init("TAILDROP"), PIPE_ALGO_TAILDROP},
 	{ str_init("FEEDBACK"), PIPE_ALGO_FEEDBACK},
 	{ str_init("NETWORK"), PIPE_ALGO_NETWORK},
+	{ str_init("TOKENBUCKET"), PIPE_ALGO_TOKENBUCKET},
+	{ str_init("SLIDINGWINDOW"), PIPE_ALGO_SLIDINGWINDOW},
 	{
 		{ 0, 0}, 0
 	},
@@ -305,6 +330,102 @@ static str * get_rl_algo_name(rl_algo_t algo)
 	return NULL;
 }
 
+/* a new pipe gets an even share of the limit, until the demands of all
+ * the instances are known */
+static inline void rl_budget_init(rl_pipe_t *pipe)
+{
+	pipe->budget = RL_USE_BUDGET(pipe) ?
+		pipe->limit * rl_timer_interval / *rl_budget_nodes : -1;
+	/* announce the first demand, whatever it is */
+	pipe->sent_demand = -1;
+}
+
+/* loads the nodes currently up in the replication cluster */
+static int rl_budget_get_nodes(void)
+{
+	clusterer_node_t *nodes, *d;
+	int n = 0;
+	int *p;
+
+	nodes = clusterer_api.get_nodes(rl_repl_cluster, PROTO_BIN);
+	for (d = nodes; d; d = d->next)
+		n++;
+
+	/* one more slot for this instance */
+	if (n + 1 > rl_budget_size) {
+		p = pkg_realloc(rl_budget_ids, 2 * (n + 1) * sizeof(int));
+		if (!p) {
+			LM_ERR("no more pkg memory\n");
+			clusterer_api.free_nodes(nodes);
+			return -1;
+		}
+		rl_budget_ids = p;
+		rl_budget_demands = p + n + 1;
+		rl_budget_size = n + 1;
+	}
+
+	n = 0;
+	for (d = nodes; d; d = d->next)
+		rl_budget_ids[n++] = d->machine_id;
+	clusterer_api.free_nodes(nodes);
+
+	rl_budget_ids_no = n;
+	*rl_budget_nodes = n + 1;
+	return 0;
+}
+
+/*
+ * Splits the pipe's limit between the instances up, based on the demands
+ * of the last interval: max-min fair shares (an instance never gets more
+ * than it asked for while others are short), then whatever is left is
+ * split evenly, as headroom for growing demands. All the instances run it
+ * on the same demands, so the budgets add up to the limit.
+ */
+static void rl_budget_update(rl_pipe_t *pipe, time_t now)
+{
+	rl_repl_counter_t *d;
+	int n, i, j, v, limit, min, left, level, mine;
+
+	limit = pipe->limit * rl_timer_interval;
+	n = rl_budget_ids_no + 1;
+	min = limit / (n * RL_BUDGET_RESERVE);
+
+	mine = pipe->demand < min ? min : pipe->demand;
+	rl_budget_demands[0] = mine;
+	for (i = 0; i < rl_budget_ids_no; i++) {
+		for (d = pipe->dsts; d; d = d->next)
+			if (d->machine_id == rl_budget_ids[i])
+				break;
+		/* unchanged demands are refreshed every expire_time/2 */
+		v = (d && d->update + rl_expire_time >= now) ? d->counter : 0;
+		rl_budget_demands[i + 1] = v < min ? min : v;
+	}
+
+	/* few nodes - a simple insertion sort does */
+	for (i = 1; i < n; i++) {
+		v = rl_budget_demands[i];
+		for (j = i - 1; j >= 0 && rl_budget_demands[j] > v; j--)
+			rl_budget_demands[j + 1] = rl_budget_demands[j];
+		rl_budget_demands[j + 1] = v;
+	}
+
+	left = limit;
+	level = -1;
+	for (i = 0; i < n; i++) {
+		if ((long long)rl_budget_demands[i] * (n - i) >= left) {
+			/* the rest cannot be satisfied - all get the same share */
+			level = left / (n - i);
+			break;
+		}
+		left -= rl_budget_demands[i];
+	}
+
+	if (level < 0)
+		pipe->budget = mine + left / n;
+	else
+		pipe->budget = mine < level ? mine : level;
+}
+
 int w_rl_check_2(struct sip_msg *_m, char *_n, char *_l)
 {
 	return w_rl_check_3(_m, _n, _l, NULL);
@@ -316,7 +437,7 @@ int w_rl_check_3(struct sip_msg *_m, char *_n, char *_l, char *_a)
 	int limit = 0, ret = 1, should_update = 0;
 	str algorithm;
 	unsigned int hash_idx;
-	rl_pipe_t **pipe;
+	rl_pipe_t **pipe, *p;
 
 	rl_algo_t algo = -1;
 
@@ -385,6 +506,8 @@ int w_rl_check_3(struct sip_msg *_m, char *_n, char *_l, char *_a)
 		if (algo == PIPE_ALGO_NETWORK)
 			should_update = 1;
 		(*pipe)->algo = (algo == PIPE_ALGO_NOP) ? rl_default_algo : algo;
+		(*pipe)->limit = limit;
+		rl_budget_init(*pipe);
 	} else {
 		LM_DBG("Pipe %.*s found: %p - last used %lu\n",
 			name.len, name.s, *pipe, (*pipe)->last_used);
@@ -399,6 +522,17 @@ int w_rl_check_3(struct sip_msg *_m, char *_n, char *_l, char *_a)
 
 	/* set the last used time */
 	(*pipe)->last_used = time(0);
+	if (RL_ALGO_LOCKLESS((*pipe)->algo)) {
+		/* the lock only guards the lookup - the timer does not release a
+		 * pipe used within the last expire_time seconds */
+		p = *pipe;
+		RL_RELEASE_LOCK(hash_idx);
+		__sync_fetch_and_add(&p->counter, 1);
+		ret = rl_pipe_check(p);
+		LM_DBG("Pipe %.*s limit:%d should %sbe blocked (%p)\n",
+			name.len, name.s, p->limit, ret == 1 ? "NOT " : "", p);
+		return ret;
+	}
 	if (RL_USE_CDB(*pipe)) {
 		/* release the counter for a while */
 		if (rl_change_counter(&name, *pipe, 1) < 0) {
@@ -453,6 +587,9 @@ void rl_timer(unsigned int ticks, void *param)
 		*rl_network_load = get_total_bytes_waiting(PROTO_NONE);
 	lock_release(rl_lock);
 
+	if (rl_repl_budgets && rl_budget_get_nodes() < 0)
+		LM_ERR("cannot get the cluster nodes, keeping the old budgets\n");
+
 	/* iterate through each map */
 	for (i = 0; i < rl_htable.size; i++) {
 		RL_GET_LOCK(i);
@@ -514,6 +651,10 @@ void rl_timer(unsigned int ticks, void *param)
 					break;
 				}
 				(*pipe)->last_counter = rl_get_all_counters(*pipe);
+				if (RL_USE_BUDGET(*pipe) && rl_budget_size) {
+					(*pipe)->demand = (*pipe)->counter;
+					rl_budget_update(*pipe, now);
+				}
 				if (RL_USE_CDB(*pipe)) {
 					if (rl_change_counter(key, *pipe, 0) < 0) {
 						LM_ERR("cannot reset counter\n");
@@ -592,6 +733,12 @@ static int rl_map_print(void *param, str key, void *value)
 	if (!(attr = add_mi_attr(node, MI_DUP_VALUE, "counter", 7, p, len)))
 		return -1;
 
+	if (pipe->budget >= 0) {
+		p = int2str((unsigned long)(pipe->budget), &len);
+		if (!(attr = add_mi_attr(node, MI_DUP_VALUE, "budget", 6, p, len)))
+			return -1;
+	}
+
 	if ((++rl_param->counter % 50) == 0) {
 		LM_DBG("flush mi tree - number %d\n", rl_param->counter);
 		flush_mi_tree(rl_param->root);
@@ -846,10 +993,8 @@ void rl_rcv_bin(int packet_type, struct receive_info *ri, int server_id)
 		return;
 	}
 
-	if (packet_type != RL_PIPE_COUNTER)
-		return;
-
-	if (packet_type != RL_PIPE_COUNTER)
+	/* budget packets carry demands instead of counters, same layout */
+	if (packet_type != RL_PIPE_COUNTER && packet_type != RL_PIPE_BUDGET)
 		return;
 
 	now = time(0);
@@ -895,6 +1040,7 @@ void rl_rcv_bin(int packet_type, struct receive_info *ri, int server_id)
 				name.len, name.s, *pipe);
 			(*pipe)->algo = algo;
 			(*pipe)->limit = limit;
+			rl_budget_init(*pipe);
 		} else {
 			LM_DBG("Pipe %.*s found: %p - last used %lu\n",
 				name.len, name.s, *pipe, (*pipe)->last_used);
@@ -909,6 +1055,8 @@ void rl_rcv_bin(int packet_type, struct receive_info *ri, int server_id)
 		(*pipe)->last_used = time(0);
 		/* set the destination's counter */
 		destination = find_destination(*pipe, server_id);
+		if (!destination)
+			goto release;
 		destination->counter = counter;
 		destination->update = now;
 		RL_RELEASE_LOCK(hash_idx);
@@ -935,6 +1083,19 @@ int rl_repl_init(void)
 		return -1;
 	}
 
+	/* learn the demands of the running nodes at startup */
+	if (rl_repl_budgets) {
+		if (clusterer_api.register_sync("ratelimit", rl_repl_cluster,
+		rl_sync_dump, accept_repl_pipes, rl_sync_load) < 0) {
+			LM_ERR("failed to register ratelimit sync\n");
+			return -1;
+		}
+		if (clusterer_api.request_sync("ratelimit") < 0) {
+			LM_ERR("failed to request ratelimit sync\n");
+			return -1;
+		}
+	}
+
 	return 0;
 }
 
@@ -945,7 +1106,22 @@ static inline void rl_replicate(void)
  	}
 }
 
-void rl_timer_repl(utime_t ticks, void *param)
+/* true if the demand of a budgeted pipe should be replicated */
+static inline int rl_demand_changed(rl_pipe_t *pipe, unsigned long now)
+{
+	int diff = pipe->demand - pipe->sent_demand;
+
+	if (diff < 0)
+		diff = -diff;
+	return diff > pipe->sent_demand / RL_BUDGET_SLACK ||
+		pipe->sent_time + rl_expire_time / 2 < now;
+}
+
+/*
+ * Replicates the counters of the shared pipes (RL_PIPE_COUNTER) or the
+ * demands of the budgeted ones that changed since last sent (RL_PIPE_BUDGET)
+ */
+static void rl_repl_pipes(int type)
 {
 	static str module_name = str_init("ratelimit");
 	unsigned int i = 0;
@@ -954,8 +1130,9 @@ void rl_timer_repl(utime_t ticks, void *param)
 	str *key;
 	int nr = 0;
 	int ret;
+	unsigned long now = time(0);
 
-	if (bin_init(&module_name, RL_PIPE_COUNTER, BIN_VERSION) < 0) {
+	if (bin_init(&module_name, type, BIN_VERSION) < 0) {
 		LM_ERR("cannot initiate bin buffer\n");
 		return;
 	}
@@ -975,9 +1152,14 @@ void rl_timer_repl(utime_t ticks, void *param)
 				LM_ERR("[BUG] bogus map[%d] state\n", i);
 				goto next_pipe;
 			}
-			/* ignore cachedb replicated stuff */
-			if (RL_USE_CDB(*pipe))
+			if (type == RL_PIPE_BUDGET) {
+				if (!RL_USE_BUDGET(*pipe) || !rl_demand_changed(*pipe, now))
+					goto next_pipe;
+			/* ignore cachedb replicated stuff and the local only algos */
+			} else if (RL_USE_CDB(*pipe) || RL_ALGO_LOCKLESS((*pipe)->algo) ||
+			RL_USE_BUDGET(*pipe)) {
 				goto next_pipe;
+			}
 
 			key = iterator_key(&it);
 			if (!key) {
@@ -994,15 +1176,21 @@ void rl_timer_repl(utime_t ticks, void *param)
 			if (bin_push_int((*pipe)->limit) < 0)
 				goto error;
 
-			if ((ret = bin_push_int((*pipe)->counter)) < 0)
+			if (type == RL_PIPE_BUDGET) {
+				if ((ret = bin_push_int((*pipe)->demand)) < 0)
+					goto error;
+				(*pipe)->sent_demand = (*pipe)->demand;
+				(*pipe)->sent_time = now;
+			} else if ((ret = bin_push_int((*pipe)->counter)) < 0) {
 				goto error;
+			}
 			nr++;
 
 			if (ret > rl_buffer_th) {
 				/* send the buffer */
 				if (nr)
 					rl_replicate();
-				if (bin_init(&module_name, RL_PIPE_COUNTER, BIN_VERSION) < 0) {
+				if (bin_init(&module_name, type, BIN_VERSION) < 0) {
 					LM_ERR("cannot initiate bin buffer\n");
 					RL_RELEASE_LOCK(i);
 					return;
@@ -1029,6 +1217,128 @@ error:
 		rl_replicate();
 }
 
+void rl_timer_repl(utime_t ticks, void *param)
+{
+	rl_repl_pipes(RL_PIPE_COUNTER);
+	if (rl_repl_budgets)
+		rl_repl_pipes(RL_PIPE_BUDGET);
+}
+
+/*
+ * clusterer sync: pushes the budgeted pipes of a hash entry, with all the
+ * demands known here, so a joining node gets the full picture from a
+ * single peer; the @cursor holds the index of the entry (upper 32 bits)
+ * and of the first pipe to push within the entry (lower 32 bits), so the
+ * pipes of an entry not fitting into a packet are split across the chunks
+ */
+static int rl_sync_dump(unsigned long long *cursor)
+{
+	map_iterator_t it;
+	rl_pipe_t **pipe;
+	rl_repl_counter_t *d;
+	str *key, buf;
+	unsigned int i, skip, pi = 0;
+	int n = 0, nd;
+
+	i = *cursor >> 32;
+	skip = *cursor & 0xFFFFFFFF;
+
+	RL_GET_LOCK(i);
+	if (map_first(rl_htable.maps[i], &it) < 0)
+		goto done;
+	for (; iterator_is_valid(&it); iterator_next(&it), pi++) {
+		pipe = (rl_pipe_t **) iterator_val(&it);
+		key = iterator_key(&it);
+		if (pi < skip || !pipe || !*pipe || !key || !RL_USE_BUDGET(*pipe))
+			continue;
+
+		bin_get_buffer(&buf);
+		for (nd = 1, d = (*pipe)->dsts; d; d = d->next)
+			nd++;
+		if (bin_push_str(key) < 0 || bin_push_int((*pipe)->limit) < 0 ||
+		bin_push_int(nd) < 0 ||
+		bin_push_int(clusterer_api.get_my_id()) < 0 ||
+		bin_push_int((*pipe)->demand) < 0)
+			goto full;
+		for (d = (*pipe)->dsts; d; d = d->next)
+			if (bin_push_int(d->machine_id) < 0 ||
+			bin_push_int(d->counter) < 0)
+				goto full;
+		n++;
+	}
+
+done:
+	RL_RELEASE_LOCK(i);
+	if (++i < rl_htable.size)
+		*cursor = (unsigned long long)i << 32;
+	else
+		*cursor = CL_SYNC_DONE;
+	return n;
+full:
+	RL_RELEASE_LOCK(i);
+	/* the packet is full - drop the partly pushed pipe and continue from
+	 * it with the next chunk */
+	bin_truncate(buf.len);
+	if (!n)
+		return -1;
+	*cursor = ((unsigned long long)i << 32) | pi;
+	return n;
+}
+
+/*
+ * clusterer sync: loads a pipe pushed by rl_sync_dump()
+ */
+static int rl_sync_load(int node_id)
+{
+	str name;
+	int limit, nd, id, demand, my_id;
+	unsigned int hash_idx;
+	rl_pipe_t **pipe;
+	rl_repl_counter_t *d;
+	time_t now = time(0);
+
+	if (bin_pop_str(&name) < 0 || bin_pop_int(&limit) < 0 ||
+	bin_pop_int(&nd) < 0) {
+		LM_ERR("cannot pop pipe\n");
+		return -1;
+	}
+	my_id = clusterer_api.get_my_id();
+
+	hash_idx = RL_GET_INDEX(name);
+	RL_GET_LOCK(hash_idx);
+	pipe = RL_GET_PIPE(hash_idx, name);
+	if (pipe && !*pipe) {
+		*pipe = shm_malloc(sizeof(rl_pipe_t));
+		if (*pipe) {
+			memset(*pipe, 0, sizeof(rl_pipe_t));
+			(*pipe)->algo = PIPE_ALGO_TAILDROP;
+			(*pipe)->limit = limit;
+			(*pipe)->last_used = now;
+			rl_budget_init(*pipe);
+		}
+	}
+
+	/* always consume the whole record */
+	for (; nd > 0; nd--) {
+		if (bin_pop_int(&id) < 0 || bin_pop_int(&demand) < 0) {
+			LM_ERR("cannot pop demand\n");
+			RL_RELEASE_LOCK(hash_idx);
+			return -1;
+		}
+		/* our own demand, as seen before a restart, is of no use */
+		if (!pipe || !*pipe || id == my_id)
+			continue;
+		d = find_destination(*pipe, id);
+		if (!d)
+			continue;
+		d->counter = demand;
+		d->update = now;
+	}
+	RL_RELEASE_LOCK(hash_idx);
+
+	return 0;
+}
+
 int rl_get_all_counters(rl_pipe_t *pipe)
 {
 	unsigned counter = 0;
@@ -1036,6 +1346,10 @@ int rl_get_all_counters(rl_pipe_t *pipe)
 	rl_repl_counter_t *nodes = pipe->dsts;
 	rl_repl_counter_t *d;
 
+	/* the remote demands only size the budgets */
+	if (pipe->budget >= 0)
+		return pipe->counter;
+
 	for (d = nodes; d; d = d->next) {
 		/* if the replication expired, reset its counter */
 		if ((d->update + rl_repl_timer_expire) < now)
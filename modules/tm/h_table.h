@@ -36,6 +36,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/time.h>
 
 #include "../../parser/msg_parser.h"
 #include "../../proxy.h"
@@ -164,6 +165,11 @@ typedef struct ua_client
 	int              br_flags;
 	/* the onreply_route to be processed only for this branch */
 	unsigned int     on_reply;
+	/* when the INVITE was sent out on this branch (for statistics) */
+	struct timeval   sent_tv;
+	/* set (atomically) by the first reply counted against sent_tv; kept
+	 * apart from the flags, which change under the reply lock only */
+	int              timed;
 	/* head list for avps */
 	struct usr_avp *user_avps;
 }ua_client_type;
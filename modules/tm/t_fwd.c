@@ -60,6 +60,7 @@
 #include "fix_lumps.h"
 #include "config.h"
 #include "../../msg_callbacks.h"
+#include "t_stats.h"
 
 /* route to execute for the branches */
 static int goto_on_branch;
@@ -725,6 +726,9 @@ int t_forward_nonack( struct cell *t, struct sip_msg* p_msg ,
 
 			success_branch++;
 
+			if (tm_enable_stats && is_invite(t))
+				start_hist_timer(t->uac[i].sent_tv);
+
 			start_retr( &t->uac[i].request );
 			set_kr(REQ_FWDED);
 
@@ -1410,6 +1410,13 @@ int reply_received( struct sip_msg  *p_msg )
 		goto done;
 	}
 
+	/* the first reply of an INVITE branch; the replies of a branch may be
+	 * processed in parallel up to here, so the branch is claimed with an
+	 * atomic test-and-set - only one of them gets it */
+	if (tm_enable_stats && is_invite(t) && uac->sent_tv.tv_sec &&
+	__sync_lock_test_and_set(&uac->timed, 1) == 0)
+		update_hist_since(tm_inv_rpl_time, uac->sent_tv);
+
 	/* *** stop timers *** */
 	/* stop retransmission */
 	reset_timer(&uac->request.retr_timer);
@@ -45,6 +45,8 @@ extern stat_var *tm_trans_4xx;
 extern stat_var *tm_trans_5xx;
 extern stat_var *tm_trans_6xx;
 extern stat_var *tm_trans_inuse;
+/* from sending an INVITE branch to its first reply (histogram) */
+extern stat_var *tm_inv_rpl_time;
 
 
 #ifdef STATISTICS
@@ -173,6 +173,7 @@ stat_var *tm_trans_4xx;
 stat_var *tm_trans_5xx;
 stat_var *tm_trans_6xx;
 stat_var *tm_trans_inuse;
+stat_var *tm_inv_rpl_time;
 
 
 static cmd_export_t cmds[]={
@@ -289,6 +290,7 @@ static stat_export_t mod_stats[] = {
 	{"5xx_transactions" ,    0,              &tm_trans_5xx   },
 	{"6xx_transactions" ,    0,              &tm_trans_6xx   },
 	{"inuse_transactions" ,  STAT_NO_RESET,  &tm_trans_inuse },
+	{"invite_1st_reply_time", STAT_IS_HIST,  &tm_inv_rpl_time },
 	{0,0,0}
 };
 
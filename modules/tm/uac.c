@@ -64,6 +64,7 @@
 #include "t_msgbuilder.h"
 #include "callid.h"
 #include "uac.h"
+#include "t_stats.h"
 
 
 #define FROM_TAG_LEN (MD5_LEN + 1 /* - */ + CRC16_LEN) /* length of FROM tags */
@@ -472,6 +473,8 @@ abort_update:
 		LM_ERR("attempt to send to '%.*s' failed\n",
 			dialog->hooks.next_hop->len,
 			dialog->hooks.next_hop->s);
+	} else if (tm_enable_stats && is_invite(new_cell)) {
+		start_hist_timer(new_cell->uac[0].sent_tv);
 	}
 
 	if (method->len==ACK_LEN && memcmp(method->s, ACK, ACK_LEN)==0 ) {
@@ -136,6 +136,7 @@ unsigned int init_flag = 0;
 /* usrloc data replication using the bin interface */
 int accept_replicated_udata = 0;
 int ul_replicate_cluster = 0;
+int ul_sync = 0;
 
 db_con_t* ul_dbh = 0; /* Database connection handle */
 db_func_t ul_dbf;
@@ -184,6 +185,7 @@ static param_export_t params[] = {
     /* data replication through UDP binary packets */
 	{ "accept_replicated_contacts",INT_PARAM, &accept_replicated_udata },
 	{ "replicate_contacts_to",	INT_PARAM, &ul_replicate_cluster   },
+	{ "sync_replicated_contacts",	INT_PARAM, &ul_sync   },
 	{ "skip_replicated_db_ops", INT_PARAM, &skip_replicated_db_ops     },
 	{ "max_contact_delete", INT_PARAM, &max_contact_delete },
 	{0, 0, 0}
@@ -404,6 +406,20 @@ static int mod_init(void)
 	if(ul_replicate_cluster < 0){
 		ul_replicate_cluster = 0;
 	}
+
+	/* serve our contacts to the joining nodes and/or fetch theirs */
+	if (ul_sync && accept_replicated_udata <= 0)
+		ul_sync = 0;
+	if ((ul_replicate_cluster || ul_sync) &&
+	clusterer_api.register_sync(repl_module_name.s, ul_replicate_cluster,
+	ul_sync_dump, accept_replicated_udata, ul_sync ? ul_sync_load : NULL) < 0) {
+		LM_ERR("failed to register contacts sync\n");
+		return -1;
+	}
+	if (ul_sync && clusterer_api.request_sync(repl_module_name.s) < 0) {
+		LM_ERR("failed to request contacts sync\n");
+		return -1;
+	}
 	
 	init_flag = 1;
 
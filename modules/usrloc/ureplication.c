@@ -528,6 +528,127 @@ error:
 	return -1;
 }
 
+/* clusterer sync */
+
+/* pushes a contact in the format expected by receive_ucontact_update() */
+static int push_ucontact(urecord_t *r, ucontact_t *c)
+{
+	str st;
+	int rc = 0;
+
+	/* any failed push (buffer full) leaves a negative rc */
+	rc |= bin_push_str(r->domain);
+	rc |= bin_push_str(&r->aor);
+	rc |= bin_push_str(&c->c);
+	rc |= bin_push_str(&c->callid);
+	rc |= bin_push_str(&c->user_agent);
+	rc |= bin_push_str(&c->path);
+	rc |= bin_push_str(&c->attr);
+	rc |= bin_push_str(&c->received);
+	rc |= bin_push_str(&c->instance);
+
+	st.s = (char *) &c->expires;
+	st.len = sizeof c->expires;
+	rc |= bin_push_str(&st);
+
+	st.s = (char *) &c->q;
+	st.len = sizeof c->q;
+	rc |= bin_push_str(&st);
+
+	rc |= bin_push_str(&c->sock->sock_str);
+	rc |= bin_push_int(c->cseq);
+	rc |= bin_push_int(c->flags);
+	rc |= bin_push_int(c->cflags);
+	rc |= bin_push_int(c->methods);
+
+	st.s   = (char *)&c->last_modified;
+	st.len = sizeof c->last_modified;
+	rc |= bin_push_str(&st);
+
+	return rc < 0 ? -1 : 0;
+}
+
+/**
+ * pushes the contacts of a hash slot; the @cursor holds the index of the
+ * domain (upper 16 bits), of the slot (next 16 bits) and of the first
+ * contact to push within the slot (lower 32 bits), so the contacts of a
+ * slot not fitting into a packet are split across the sync chunks
+ */
+int ul_sync_dump(unsigned long long *cursor)
+{
+	dlist_t *dl;
+	udomain_t *d;
+	urecord_t *r;
+	ucontact_t *c;
+	map_iterator_t it;
+	void **dest;
+	unsigned int di, sl, skip, ci = 0;
+	time_t now = time(0);
+	str buf;
+	int n = 0;
+
+	di = *cursor >> 48;
+	sl = (*cursor >> 32) & 0xFFFF;
+	skip = *cursor & 0xFFFFFFFF;
+
+	for (dl = root; dl && di; dl = dl->next, di--);
+	if (!dl) {
+		*cursor = CL_SYNC_DONE;
+		return 0;
+	}
+	d = dl->d;
+
+	lock_ulslot(d, sl);
+
+	for (map_first(d->table[sl].records, &it);
+			iterator_is_valid(&it);
+			iterator_next(&it)) {
+		dest = iterator_val(&it);
+		if (!dest)
+			break;
+
+		r = (urecord_t *)*dest;
+		for (c = r->contacts; c; c = c->next, ci++) {
+			if (ci < skip || (c->expires != 0 && c->expires <= now))
+				continue;
+
+			bin_get_buffer(&buf);
+			if (push_ucontact(r, c) < 0) {
+				unlock_ulslot(d, sl);
+				if (!n)
+					return -1;
+
+				/* the packet is full - continue from this contact */
+				bin_truncate(buf.len);
+				*cursor = (*cursor & ~0xFFFFFFFFULL) | ci;
+				return n;
+			}
+			n++;
+		}
+	}
+
+	unlock_ulslot(d, sl);
+
+	if (++sl < d->size)
+		*cursor = (*cursor & 0xFFFF000000000000ULL) |
+			((unsigned long long)sl << 32);
+	else if (dl->next)
+		*cursor = ((*cursor >> 48) + 1) << 48;
+	else
+		*cursor = CL_SYNC_DONE;
+
+	return n;
+}
+
+/**
+ * loads a contact pushed by ul_sync_dump() of @node_id
+ */
+int ul_sync_load(int node_id)
+{
+	/* creates the record and contact if missing */
+	return receive_ucontact_update();
+}
+
 void receive_binary_packet(int packet_type, struct receive_info *ri, void *att)
 {
 	int rc;
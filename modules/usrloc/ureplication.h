@@ -58,5 +58,11 @@ void replicate_ucontact_delete(urecord_t *r, ucontact_t *c);
 
 void receive_binary_packet(int packet_type, struct receive_info *ri, void *att);
 
+/* full contacts transfer towards the joining nodes */
+extern int ul_sync;
+
+int ul_sync_dump(unsigned long long *cursor);
+int ul_sync_load(int node_id);
+
 #endif /* _USRLOC_REPLICATION_H_ */
 
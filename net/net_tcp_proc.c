@@ -27,6 +27,7 @@
 #include "../timer.h"
 #include "../reactor.h"
 #include "../async.h"
+#include "../resolve_cache.h"
 #include "tcp_conn.h"
 #include "tcp_passfd.h"
 #include "trans.h"
@@ -116,6 +117,9 @@ inline static int handle_io(struct fd_map* fm, int idx,int event_type)
 		case F_TIMER_JOB:
 			handle_timer_job();
 			break;
+		case F_DNS_ASYNC:
+			dns_cache_async_reply( fm->fd, fm->data);
+			return 0;
 		case F_SCRIPT_ASYNC:
 			async_resume_f( fm->fd, fm->data);
 			return 0;
@@ -302,6 +306,9 @@ void tcp_worker_proc( int unix_sock, int max_fd )
 		goto error;
 	}
 
+	/* the DNS cache refreshes may be watched from now on */
+	dns_cache_enable_async();
+
 	/* add the unix socket */
 	if (reactor_add_reader( tcpmain_sock, F_TCPMAIN, RCT_PRIO_PROC, NULL)<0) {
 		LM_CRIT("failed to add socket to the fd list\n");
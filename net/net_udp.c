@@ -31,6 +31,7 @@
 #include "../daemonize.h"
 #include "../reactor.h"
 #include "../timer.h"
+#include "../resolve_cache.h"
 #include "net_udp.h"
 
 
@@ -264,6 +265,9 @@ inline static int handle_io(struct fd_map* fm, int idx,int event_type)
 		case F_TIMER_JOB:
 			handle_timer_job();
 			return 0;
+		case F_DNS_ASYNC:
+			dns_cache_async_reply( fm->fd, fm->data);
+			return 0;
 		case F_SCRIPT_ASYNC:
 			async_resume_f( fm->fd, fm->data);
 			return 0;
@@ -298,6 +302,9 @@ int udp_rcv_loop( struct socket_info *si )
 		goto error;
 	}
 
+	/* init: the DNS cache refreshes may be watched from now on */
+	dns_cache_enable_async();
+
 	/* init: start watching the SIP UDP fd */
 	if (reactor_add_reader( si->socket, F_UDP_READ, RCT_PRIO_NET, si)<0) {
 		LM_CRIT("failed to add UDP listen socket to reactor\n");
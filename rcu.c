@@ -0,0 +1,213 @@
+/*
+ * Copyright (C) 2016 OpenSIPS Solutions
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * Each process owns a slot holding the global epoch it observed when it
+ * entered its outermost read section (0 if it is not reading). Retiring a
+ * data set stamps it with the current epoch and advances the global one;
+ * a retired set may be freed as soon as no slot holds an epoch lower or
+ * equal to its stamp.
+ */
+
+#include "mem/shm_mem.h"
+#include "locking.h"
+#include "timer.h"
+#include "dprint.h"
+#include "pt.h"
+#include "rcu.h"
+
+/* how often (in seconds) the retired data sets are checked */
+#define RCU_RECLAIM_INTERVAL  1
+
+struct rcu_retired {
+	unsigned long epoch;
+	void *data;
+	rcu_free_f *free_f;
+	struct rcu_retired *next;
+};
+
+struct rcu_table {
+	/* global epoch, starts at 1 so that 0 means "not reading" */
+	volatile unsigned long epoch;
+	gen_lock_t lock;
+	struct rcu_retired *retired;
+	unsigned int slots_no;
+	volatile unsigned long slots[0];
+};
+
+static struct rcu_table *rcu_tbl = NULL;
+
+int rcu_nesting = 0;
+
+
+static void rcu_timer(unsigned int ticks, void *param)
+{
+	rcu_reclaim();
+}
+
+
+int init_rcu(void)
+{
+	rcu_tbl = shm_malloc(sizeof(struct rcu_table) +
+		counted_processes * sizeof(unsigned long));
+	if (rcu_tbl==NULL) {
+		LM_ERR("no more shm memory\n");
+		return -1;
+	}
+	memset(rcu_tbl, 0, sizeof(struct rcu_table) +
+		counted_processes * sizeof(unsigned long));
+
+	rcu_tbl->epoch = 1;
+	rcu_tbl->slots_no = counted_processes;
+	if (lock_init(&rcu_tbl->lock)==NULL) {
+		LM_ERR("failed to init lock\n");
+		goto error;
+	}
+
+	if (register_timer("rcu-reclaim", rcu_timer, NULL,
+	RCU_RECLAIM_INTERVAL, TIMER_FLAG_SKIP_ON_DELAY)<0) {
+		LM_ERR("failed to register reclaim timer\n");
+		goto error;
+	}
+
+	return 0;
+error:
+	shm_free(rcu_tbl);
+	rcu_tbl = NULL;
+	return -1;
+}
+
+
+void destroy_rcu(void)
+{
+	struct rcu_retired *r;
+
+	if (rcu_tbl==NULL)
+		return;
+
+	/* nobody is reading anymore */
+	while ( (r=rcu_tbl->retired)!=NULL ) {
+		rcu_tbl->retired = r->next;
+		r->free_f(r->data);
+		shm_free(r);
+	}
+
+	lock_destroy(&rcu_tbl->lock);
+	shm_free(rcu_tbl);
+	rcu_tbl = NULL;
+}
+
+
+void rcu_enter(void)
+{
+	if (rcu_tbl==NULL || process_no>=rcu_tbl->slots_no)
+		return;
+
+	rcu_tbl->slots[process_no] = rcu_tbl->epoch;
+	/* the slot must be visible before any load of the protected data */
+	__sync_synchronize();
+}
+
+
+void rcu_exit(void)
+{
+	if (rcu_tbl==NULL || process_no>=rcu_tbl->slots_no)
+		return;
+
+	__sync_synchronize();
+	rcu_tbl->slots[process_no] = 0;
+}
+
+
+int rcu_retire(void *data, rcu_free_f *free_f)
+{
+	struct rcu_retired *r;
+
+	if (data==NULL)
+		return 0;
+
+	/* still in the single process startup phase - no readers around */
+	if (rcu_tbl==NULL) {
+		free_f(data);
+		return 0;
+	}
+
+	r = shm_malloc(sizeof *r);
+	if (r==NULL) {
+		LM_ERR("no more shm memory, leaking retired data %p\n", data);
+		return -1;
+	}
+	r->data = data;
+	r->free_f = free_f;
+
+	lock_get(&rcu_tbl->lock);
+	/* the data was unpublished before, so any reader entering from now on
+	 * (with the new epoch) cannot reach it */
+	r->epoch = __sync_fetch_and_add(&rcu_tbl->epoch, 1);
+	r->next = rcu_tbl->retired;
+	rcu_tbl->retired = r;
+	lock_release(&rcu_tbl->lock);
+
+	return 0;
+}
+
+
+void rcu_reclaim(void)
+{
+	struct rcu_retired *r, **prev, *done;
+	unsigned long min, e;
+	unsigned int i;
+
+	if (rcu_tbl==NULL || rcu_tbl->retired==NULL)
+		return;
+
+	lock_get(&rcu_tbl->lock);
+
+	/* oldest epoch still observed by a reader */
+	__sync_synchronize();
+	min = 0;
+	for (i = 0; i < rcu_tbl->slots_no; i++) {
+		e = rcu_tbl->slots[i];
+		if (e && (min==0 || e<min))
+			min = e;
+	}
+
+	done = NULL;
+	prev = &rcu_tbl->retired;
+	while ( (r=*prev)!=NULL ) {
+		if (min==0 || r->epoch<min) {
+			*prev = r->next;
+			r->next = done;
+			done = r;
+		} else {
+			prev = &r->next;
+		}
+	}
+
+	lock_release(&rcu_tbl->lock);
+
+	/* free outside the lock, the free functions may be slow */
+	while ( (r=done)!=NULL ) {
+		done = r->next;
+		LM_DBG("freeing data %p retired in epoch %lu\n", r->data, r->epoch);
+		r->free_f(r->data);
+		shm_free(r);
+	}
+}
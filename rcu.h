@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2016 OpenSIPS Solutions
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * Epoch based reclamation for read-mostly shm data sets.
+ *
+ * Readers wrap their lookups in rcu_read_lock()/rcu_read_unlock() and
+ * never block. A writer builds a complete new data set, publishes it with
+ * rcu_assign_pointer() and hands the old one to rcu_retire(); the old set
+ * is freed by the core only after every process that may still see it has
+ * left its read section.
+ *
+ * Rules for the readers:
+ *  - load the published pointer only once per read section (or use
+ *    rcu_dereference()) and work only with that copy;
+ *  - never sleep or do blocking I/O inside a read section - it delays the
+ *    reclamation for all the data sets.
+ */
+
+#ifndef _RCU_H
+#define _RCU_H
+
+typedef void (rcu_free_f)(void *data);
+
+/* read-side nesting level of the current process */
+extern int rcu_nesting;
+
+int init_rcu(void);
+
+void destroy_rcu(void);
+
+void rcu_enter(void);
+
+void rcu_exit(void);
+
+/* hands over a data set that was already unpublished; @free_f is called
+ * on it once no reader may reference it anymore */
+int rcu_retire(void *data, rcu_free_f *free_f);
+
+/* frees all the retired data sets that are no longer reachable */
+void rcu_reclaim(void);
+
+#define rcu_read_lock() \
+	do { \
+		if (rcu_nesting++==0) \
+			rcu_enter(); \
+	} while (0)
+
+#define rcu_read_unlock() \
+	do { \
+		if (--rcu_nesting==0) \
+			rcu_exit(); \
+	} while (0)
+
+#define rcu_dereference(_p) \
+	(*(__typeof__(_p) volatile *)&(_p))
+
+/* publish @_v into @_p; all the stores into the new data set are made
+ * visible before the pointer itself */
+#define rcu_assign_pointer(_p, _v) \
+	do { \
+		__sync_synchronize(); \
+		*(__typeof__(_p) volatile *)&(_p) = (_v); \
+		__sync_synchronize(); \
+	} while (0)
+
+#endif
@@ -101,7 +101,8 @@ int receive_msg(char* buf, unsigned int len, struct receive_info* rcv_info)
 	static context_p ctx = NULL;
 	struct sip_msg* msg;
 	struct timeval start;
-	int rc;
+	struct timeval rt_start;
+	int rc, rc2;
 	char *tmp;
 	str in_buff;
 
@@ -190,11 +191,15 @@ int receive_msg(char* buf, unsigned int len, struct receive_info* rcv_info)
 		}
 
 		/* exec the routing script */
-		if (rc & SCB_RUN_TOP_ROUTE)
+		if (rc & SCB_RUN_TOP_ROUTE) {
 			/* run the main request route and skip post_script callbacks
 			 * if the TOBE_CONTINUE flag is returned */
-			if ( run_top_route(rlist[DEFAULT_RT].a, msg) & ACT_FL_TBCONT )
+			start_hist_timer(rt_start);
+			rc2 = run_top_route(rlist[DEFAULT_RT].a, msg);
+			update_hist_since(req_route_time, rt_start);
+			if ( rc2 & ACT_FL_TBCONT )
 				goto end;
+		}
 
 		/* execute post request-script callbacks */
 		if (rc & SCB_RUN_POST_CBS)
@@ -231,9 +236,13 @@ int receive_msg(char* buf, unsigned int len, struct receive_info* rcv_info)
 		}
 
 		/* exec the onreply routing script */
-		if (rc & SCB_RUN_TOP_ROUTE &&  onreply_rlist[DEFAULT_RT].a &&
-		    (run_top_route(onreply_rlist[DEFAULT_RT].a,msg) & ACT_FL_DROP)
-		    && msg->REPLY_STATUS < 200) {
+		rc2 = 0;
+		if (rc & SCB_RUN_TOP_ROUTE &&  onreply_rlist[DEFAULT_RT].a) {
+			start_hist_timer(rt_start);
+			rc2 = run_top_route(onreply_rlist[DEFAULT_RT].a,msg);
+			update_hist_since(rpl_route_time, rt_start);
+		}
+		if ( (rc2 & ACT_FL_DROP) && msg->REPLY_STATUS < 200) {
 
 			LM_DBG("dropping provisional reply %d\n", msg->REPLY_STATUS);
 			update_stat( drp_rpls, 1);
@@ -49,6 +49,7 @@
 #include "ip_addr.h"
 #include "globals.h"
 #include "blacklists.h"
+#include "resolve_cache.h"
 
 fetch_dns_cache_f *dnscache_fetch_func=NULL;
 put_dns_cache_f *dnscache_put_func=NULL;
@@ -445,6 +446,62 @@ query:
 	return &global_he;
 }
 
+/*! \brief gethostbyname2() on top of get_record(), so the lookups are
+ * served by the shm DNS cache; the names not resolved by DNS are still
+ * looked up by the resolver of the libc, which also knows /etc/hosts */
+static struct hostent* cached_gethostbyname2(char *name, int af)
+{
+	struct rdata *head, *rd;
+	int type, size, n;
+	char *bp;
+
+	if (af==AF_INET6) {
+		type = T_AAAA;
+		size = 16;
+	} else {
+		type = T_A;
+		size = 4;
+	}
+
+	head = get_record(name, type);
+	if (head==NULL)
+		goto local;
+
+	n = strlen(name);
+	if (n >= DNS_MAX_NAME)
+		n = DNS_MAX_NAME - 1;
+	memcpy(hostbuf, name, n);
+	hostbuf[n] = 0;
+	global_he.h_name = hostbuf;
+	host_aliases[0] = NULL;
+	global_he.h_aliases = host_aliases;
+	global_he.h_addrtype = af;
+	global_he.h_length = size;
+
+	/* the addresses go after the name, skipping the CNAME records */
+	bp = hostbuf + DNS_MAX_NAME;
+	for (rd=head, n=0; rd && n<MAXADDRS-1; rd=rd->next) {
+		if (rd->type!=type || rd->rdata==NULL)
+			continue;
+		memcpy(bp, rd->rdata, size);
+		h_addr_ptrs[n++] = bp;
+		bp += size;
+	}
+	h_addr_ptrs[n] = NULL;
+	global_he.h_addr_list = h_addr_ptrs;
+
+	free_rdata_list(head);
+	if (n)
+		return &global_he;
+
+local:
+#ifdef HAVE_GETHOSTBYNAME2
+	return gethostbyname2(name, af);
+#else
+	return af==AF_INET ? gethostbyname(name) : NULL;
+#endif
+}
+
 inline struct hostent* resolvehost(char* name, int no_ip_test)
 {
         static struct hostent* he=0;
@@ -471,7 +528,10 @@ inline struct hostent* resolvehost(char* name, int no_ip_test)
         if(dns_try_ipv6){
                 /*try ipv6*/
         #ifdef HAVE_GETHOSTBYNAME2
-                if (dnscache_fetch_func != NULL) {
+                if (dns_cache_size) {
+                        he = cached_gethostbyname2(name,AF_INET6);
+                }
+                else if (dnscache_fetch_func != NULL) {
                         he = own_gethostbyname2(name,AF_INET6);
                 }
                 else {
@@ -492,7 +552,10 @@ inline struct hostent* resolvehost(char* name, int no_ip_test)
                         return he;
         }
 
-        if (dnscache_fetch_func != NULL) {
+        if (dns_cache_size) {
+                he = cached_gethostbyname2(name,AF_INET);
+        }
+        else if (dnscache_fetch_func != NULL) {
                 he = own_gethostbyname2(name,AF_INET);
         }
         else {
@@ -1044,26 +1107,22 @@ void free_rdata_list(struct rdata* head)
 
 
 
-/*! \brief gets the DNS records for name:type
- * \return A dyn. alloc'ed struct rdata linked list with the parsed responses
- * or 0 on error
- * \note see rfc1035 for the query/response format */
-struct rdata* get_record(char* name, int type)
+/*! \brief parses the answer of a DNS query
+ * \return 0 and the dyn. alloc'ed struct rdata linked list with the parsed
+ * records in head_p (0 if no records), or -1 on error
+ * \note the cachedb serialized len of the records is added to buf_len,
+ * if not NULL */
+int dns_parse_answer(union dns_query *ans, int size, struct rdata **head_p,
+											unsigned int *min_ttl, int *buf_len)
 {
-	int size;
 	int qno, answers_no;
 	int r;
-	static union dns_query buff;
 	unsigned char* p;
-/*	unsigned char* t;
-	int ans_len;
-	static unsigned char answer[ANS_SIZE]; */
 	static int rdata_struct_len=sizeof(struct rdata)-sizeof(void *) -
 		sizeof(struct rdata *);
 	unsigned char* end;
 	unsigned short rtype, class, rdlength;
 	unsigned int ttl;
-	unsigned int min_ttl = UINT_MAX;
 	struct rdata* head;
 	struct rdata** crt;
 	struct rdata** last;
@@ -1073,43 +1132,16 @@ struct rdata* get_record(char* name, int type)
 	struct naptr_rdata* naptr_rd;
 	struct txt_rdata* txt_rd;
 	struct ebl_rdata* ebl_rd;
-	struct timeval start;
 	int rdata_buf_len=0;
 
-	if (dnscache_fetch_func != NULL) {
-		head = (struct rdata *)dnscache_fetch_func(name,type,0);
-		if (head == NULL) {
-			LM_DBG("not found in cache or other internal error\n");
-			goto query;
-		} else if (head == (void *)-1) {
-			LM_DBG("previously failed query\n");
-			goto not_found;
-		} else {
-			LM_DBG("cache hit for %s - %d\n",name,type);
-			return head;
-		}
-	}
-
-query:
-	start_expire_timer(start,execdnsthreshold);
-	size=res_search(name, C_IN, type, buff.buff, sizeof(buff));
-	stop_expire_timer(start,execdnsthreshold,"dns",name,strlen(name),0);
-	if (size<0) {
-		LM_DBG("lookup(%s, %d) failed\n", name, type);
-		if (dnscache_put_func != NULL) {
-			if (dnscache_put_func(name,type,NULL,0,1,0) < 0)
-				LM_ERR("Failed to store %s - %d in cache\n",name,type);
-		}
-		goto not_found;
-	}
-	else if ((unsigned int)size > sizeof(buff)) size=sizeof(buff);
+	if ((unsigned int)size > sizeof(*ans)) size=sizeof(*ans);
 	head=rd=0;
 	last=crt=&head;
 
-	p=buff.buff+DNS_HDR_SIZE;
-	end=buff.buff+size;
+	p=ans->buff+DNS_HDR_SIZE;
+	end=ans->buff+size;
 	if (p>=end) goto error_boundary;
-	qno=ntohs((unsigned short)buff.hdr.qdcount);
+	qno=ntohs((unsigned short)ans->hdr.qdcount);
 
 	for (r=0; r<qno; r++){
 		/* skip the name of the question */
@@ -1127,7 +1159,7 @@ query:
 			goto error;
 		}
 	};
-	answers_no=ntohs((unsigned short)buff.hdr.ancount);
+	answers_no=ntohs((unsigned short)ans->hdr.ancount);
 	/*ans_len=ANS_SIZE;
 	t=answer;*/
 	for (r=0; (r<answers_no) && (p<end); r++){
@@ -1137,7 +1169,7 @@ query:
 			goto error;
 		}
 		/*
-		skip=dn_expand(buff.buff, end, p, t, ans_len);
+		skip=dn_expand(ans->buff, end, p, t, ans_len);
 		p+=skip;
 		*/
 		/* check if enough space is left for type, class, ttl & size */
@@ -1153,8 +1185,8 @@ query:
 		/* get ttl*/
 		memcpy((void*) &ttl, (void*)p, 4);
 		ttl=ntohl(ttl);
-		if (ttl < min_ttl)
-			min_ttl = ttl;
+		if (ttl < *min_ttl)
+			*min_ttl = ttl;
 		p+=4;
 		/* get size */
 		memcpy((void*)&rdlength, (void*)p, 2);
@@ -1175,7 +1207,7 @@ query:
 			LM_ERR("out of pkg memory\n");
 			goto error;
 		}
-		if (dnscache_put_func)
+		if (buf_len)
 			rdata_buf_len+=rdata_struct_len;
 		rd->type=rtype;
 		rd->class=class;
@@ -1183,9 +1215,9 @@ query:
 		rd->next=0;
 		switch(rtype){
 			case T_SRV:
-				srv_rd= dns_srv_parser(buff.buff, end, p);
+				srv_rd= dns_srv_parser(ans->buff, end, p);
 				if (srv_rd==0) goto error_parse;
-				if (dnscache_put_func)
+				if (buf_len)
 					rdata_buf_len+=4*sizeof(unsigned short) +
 					sizeof(unsigned int ) + srv_rd->name_len+1;
 				rd->rdata=(void*)srv_rd;
@@ -1210,7 +1242,7 @@ query:
 			case T_A:
 				rd->rdata=(void*) dns_a_parser(p,end);
 				if (rd->rdata==0) goto error_parse;
-				if (dnscache_put_func)
+				if (buf_len)
 					rdata_buf_len+=sizeof(struct a_rdata);
 				*last=rd; /* last points to the last "next" or the list head*/
 				last=&(rd->next);
@@ -1218,15 +1250,15 @@ query:
 			case T_AAAA:
 				rd->rdata=(void*) dns_aaaa_parser(p,end);
 				if (rd->rdata==0) goto error_parse;
-				if (dnscache_put_func)
+				if (buf_len)
 					rdata_buf_len+=sizeof(struct aaaa_rdata);
 				*last=rd;
 				last=&(rd->next);
 				break;
 			case T_CNAME:
-				rd->rdata=(void*) dns_cname_parser(buff.buff, end, p);
+				rd->rdata=(void*) dns_cname_parser(ans->buff, end, p);
 				if(rd->rdata==0) goto error_parse;
-				if (dnscache_put_func)
+				if (buf_len)
 					rdata_buf_len+=
 					strlen(((struct cname_rdata *)rd->rdata)->name) +
 					1 + sizeof(int);
@@ -1234,10 +1266,10 @@ query:
 				last=&(rd->next);
 				break;
 			case T_NAPTR:
-				naptr_rd = dns_naptr_parser(buff.buff,end,p);
+				naptr_rd = dns_naptr_parser(ans->buff,end,p);
 				rd->rdata=(void*) naptr_rd;
 				if(rd->rdata==0) goto error_parse;
-				if (dnscache_put_func)
+				if (buf_len)
 					rdata_buf_len+=2*sizeof(unsigned short) +
 					4*sizeof(unsigned int) + naptr_rd->flags_len+1 +
 					+ naptr_rd->services_len+1+naptr_rd->regexp_len +
@@ -1246,19 +1278,19 @@ query:
 				last=&(rd->next);
 				break;
 			case T_TXT:
-				txt_rd = dns_txt_parser(buff.buff, end, p);
+				txt_rd = dns_txt_parser(ans->buff, end, p);
 				rd->rdata=(void*) txt_rd;
 				if(rd->rdata==0) goto error_parse;
-				if (dnscache_put_func)
+				if (buf_len)
 					rdata_buf_len+=sizeof(int)+strlen(txt_rd->txt)+1;
 				*last=rd;
 				last=&(rd->next);
 				break;
 			case T_EBL:
-				ebl_rd = dns_ebl_parser(buff.buff, end, p);
+				ebl_rd = dns_ebl_parser(ans->buff, end, p);
 				rd->rdata=(void*) ebl_rd;
 				if(rd->rdata==0) goto error_parse;
-				if (dnscache_put_func)
+				if (buf_len)
 					rdata_buf_len+=sizeof(unsigned char)+
 					2*sizeof(unsigned int)+ebl_rd->apex_len + 1 +
 					ebl_rd->separator_len + 1;
@@ -1276,23 +1308,91 @@ query:
 
 	}
 
-	if (dnscache_put_func != NULL) {
-		if (dnscache_put_func(name,type,head,rdata_buf_len,0,min_ttl) < 0)
-			LM_ERR("Failed to store %s - %d in cache\n",name,type);
-	}
-	return head;
+	if (buf_len)
+		*buf_len += rdata_buf_len;
+	*head_p = head;
+	return 0;
 error_boundary:
 		LM_ERR("end of query buff reached\n");
 		if(head)
 			free_rdata_list(head);
-		return 0;
+		return -1;
 error_parse:
 		LM_ERR("rdata parse error \n");
 		if (rd) local_free(rd); /* rd->rdata=0 & rd is not linked yet into
 								   the list */
 error:
-		LM_ERR("get_record \n");
 		if (head) free_rdata_list(head);
+		return -1;
+}
+
+
+/*! \brief gets the DNS records for name:type
+ * \return A dyn. alloc'ed struct rdata linked list with the parsed responses
+ * or 0 on error
+ * \note see rfc1035 for the query/response format */
+struct rdata* get_record(char* name, int type)
+{
+	int size;
+	static union dns_query buff;
+	unsigned int min_ttl = UINT_MAX;
+	struct rdata* head;
+	struct timeval start;
+	int rdata_buf_len=0;
+
+	if (dns_cache_size) {
+		head = dns_cache_fetch(name, type);
+		if (head == (void *)-1) {
+			LM_DBG("previously failed query\n");
+			goto not_found;
+		} else if (head) {
+			LM_DBG("shm cache hit for %s - %d\n",name,type);
+			return head;
+		}
+	}
+
+	if (dnscache_fetch_func != NULL) {
+		head = (struct rdata *)dnscache_fetch_func(name,type,0);
+		if (head == NULL) {
+			LM_DBG("not found in cache or other internal error\n");
+			goto query;
+		} else if (head == (void *)-1) {
+			LM_DBG("previously failed query\n");
+			goto not_found;
+		} else {
+			LM_DBG("cache hit for %s - %d\n",name,type);
+			return head;
+		}
+	}
+
+query:
+	start_expire_timer(start,execdnsthreshold);
+	size=res_search(name, C_IN, type, buff.buff, sizeof(buff));
+	stop_expire_timer(start,execdnsthreshold,"dns",name,strlen(name),0);
+	if (size<0) {
+		LM_DBG("lookup(%s, %d) failed\n", name, type);
+		if (dns_cache_size)
+			dns_cache_put(name, type, NULL, 0);
+		if (dnscache_put_func != NULL) {
+			if (dnscache_put_func(name,type,NULL,0,1,0) < 0)
+				LM_ERR("Failed to store %s - %d in cache\n",name,type);
+		}
+		goto not_found;
+	}
+
+	if (dns_parse_answer(&buff, size, &head, &min_ttl,
+	dnscache_put_func ? &rdata_buf_len : NULL) < 0) {
+		LM_ERR("get_record \n");
+		goto not_found;
+	}
+
+	if (dns_cache_size)
+		dns_cache_put(name, type, head, min_ttl);
+	if (dnscache_put_func != NULL) {
+		if (dnscache_put_func(name,type,head,rdata_buf_len,0,min_ttl) < 0)
+			LM_ERR("Failed to store %s - %d in cache\n",name,type);
+	}
+	return head;
 not_found:
 	return 0;
 }
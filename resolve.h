@@ -147,6 +147,8 @@ struct dns_node {
 
 
 struct rdata* get_record(char* name, int type);
+int dns_parse_answer(union dns_query *ans, int size, struct rdata **head_p,
+		unsigned int *min_ttl, int *buf_len);
 void free_rdata_list(struct rdata* head);
 
 
@@ -0,0 +1,694 @@
+/*
+ * Copyright (C) 2016 OpenSIPS Solutions
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/* first, so that io_wait.h gets _GNU_SOURCE (F_SETSIG) in before
+ * any system header */
+#include "reactor_defs.h"
+
+#include <string.h>
+#include <strings.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <resolv.h>
+#include <limits.h>
+
+#include "mem/mem.h"
+#include "mem/shm_mem.h"
+#include "locking.h"
+#include "dprint.h"
+#include "timer.h"
+#include "hash_func.h"
+#include "resolve_cache.h"
+
+#define DNS_CE_FAILED      (1<<0)
+#define DNS_CE_REFRESHING  (1<<1)
+
+#define DNS_CACHE_MAX_LOCKS 256
+
+#define dns_align(_n) (((_n) + 7) & ~7)
+
+/* a cached record, followed by its (fixed size) parsed rdata */
+struct dns_cache_rr {
+	unsigned short type;
+	unsigned short class;
+	unsigned int ttl;
+	unsigned int len;
+	unsigned int pad;
+};
+
+struct dns_cache_entry {
+	unsigned int hash;
+	unsigned short type;
+	unsigned short flags;
+	/* in ticks */
+	unsigned int expires;
+	unsigned int ttl;
+	unsigned int refresh_start;
+	unsigned int rr_no;
+	int name_len;
+	char *name;
+	char *rrs;
+	struct dns_cache_entry *next;
+};
+
+struct dns_cache {
+	unsigned int mask;
+	unsigned int locks_mask;
+	unsigned int count;
+	gen_lock_set_t *locks;
+	struct dns_cache_entry **buckets;
+};
+
+/* a refresh query sent by this process */
+struct dns_async_query {
+	int fd;
+	unsigned short id;
+	unsigned short type;
+	unsigned int hash;
+	unsigned int start;
+	int name_len;
+	char name[MAX_DNS_NAME];
+	struct dns_async_query *next;
+};
+
+int dns_cache_size = 0;
+int dns_cache_max_ttl = 86400;
+int dns_cache_neg_ttl = 60;
+int dns_cache_prefetch = 10;
+
+static struct dns_cache *dc = NULL;
+
+/* per process - the refresh queries in flight */
+static int dns_async_on = 0;
+static int dns_queries_no = 0;
+static struct dns_async_query *dns_queries = NULL;
+
+static void dns_cache_gc(unsigned int ticks, void *param);
+
+
+int init_dns_cache(void)
+{
+	unsigned int size, locks;
+
+	if (dns_cache_size <= 0) {
+		dns_cache_size = 0;
+		return 0;
+	}
+
+	if (dns_cache_max_ttl <= 0) {
+		LM_ERR("bad dns_cache_max_ttl %d - need a positive value\n",
+			dns_cache_max_ttl);
+		return -1;
+	}
+	if (dns_cache_prefetch < 0 || dns_cache_prefetch > 100) {
+		LM_ERR("bad dns_cache_prefetch %d - need a percentage\n",
+			dns_cache_prefetch);
+		return -1;
+	}
+
+	for (size = 1; size < (unsigned int)dns_cache_size; size <<= 1);
+	locks = size < DNS_CACHE_MAX_LOCKS ? size : DNS_CACHE_MAX_LOCKS;
+
+	dc = shm_malloc(sizeof(struct dns_cache) +
+		size*sizeof(struct dns_cache_entry*));
+	if (dc == NULL) {
+		LM_ERR("no more shm mem\n");
+		return -1;
+	}
+	memset(dc, 0, sizeof(struct dns_cache) +
+		size*sizeof(struct dns_cache_entry*));
+	dc->mask = size - 1;
+	dc->locks_mask = locks - 1;
+	dc->buckets = (struct dns_cache_entry **)(dc + 1);
+
+	dc->locks = lock_set_alloc(locks);
+	if (dc->locks == NULL || lock_set_init(dc->locks) == NULL) {
+		LM_ERR("failed to init the DNS cache locks\n");
+		goto error;
+	}
+
+	if (register_timer("dns-cache-gc", dns_cache_gc, NULL,
+	DNS_CACHE_GC_INTERVAL, TIMER_FLAG_SKIP_ON_DELAY) < 0) {
+		LM_ERR("failed to register the DNS cache timer\n");
+		goto error;
+	}
+
+	LM_DBG("DNS cache of %d entries, %u buckets\n", dns_cache_size, size);
+	return 0;
+error:
+	if (dc->locks) {
+		lock_set_dealloc(dc->locks);
+	}
+	shm_free(dc);
+	dc = NULL;
+	return -1;
+}
+
+
+void destroy_dns_cache(void)
+{
+	struct dns_cache_entry *e, *next;
+	unsigned int i;
+
+	if (dc == NULL)
+		return;
+
+	for (i = 0; i <= dc->mask; i++)
+		for (e = dc->buckets[i]; e; e = next) {
+			next = e->next;
+			shm_free(e);
+		}
+
+	lock_set_destroy(dc->locks);
+	lock_set_dealloc(dc->locks);
+	shm_free(dc);
+	dc = NULL;
+}
+
+
+/* pkg size of the parsed rdata of a record */
+static inline int dns_rdata_size(unsigned short type)
+{
+	switch (type) {
+		case T_SRV:   return sizeof(struct srv_rdata);
+		case T_NAPTR: return sizeof(struct naptr_rdata);
+		case T_A:     return sizeof(struct a_rdata);
+		case T_AAAA:  return sizeof(struct aaaa_rdata);
+		case T_CNAME: return sizeof(struct cname_rdata);
+		case T_TXT:   return sizeof(struct txt_rdata);
+		case T_EBL:   return sizeof(struct ebl_rdata);
+	}
+	return 0;
+}
+
+
+/* bytes of the parsed rdata worth caching - the unused tail of the name
+ * buffers is skipped */
+static inline int dns_rdata_len(unsigned short type, void *rdata)
+{
+	switch (type) {
+		case T_SRV:
+			return offsetof(struct srv_rdata, name) +
+				((struct srv_rdata *)rdata)->name_len + 1;
+		case T_CNAME:
+			return strlen(((struct cname_rdata *)rdata)->name) + 1;
+		case T_TXT:
+			return strlen(((struct txt_rdata *)rdata)->txt) + 1;
+	}
+	return dns_rdata_size(type);
+}
+
+
+static inline int dns_name_len(char *name)
+{
+	int len = strlen(name);
+
+	/* "example.com." is "example.com" */
+	if (len > 1 && name[len-1] == '.')
+		len--;
+	return len;
+}
+
+
+static inline unsigned int dns_hash(char *name, int len, int type)
+{
+	str s;
+
+	s.s = name;
+	s.len = len;
+	return core_case_hash(&s, NULL, 0) + type;
+}
+
+
+static inline struct dns_cache_entry **dns_cache_find(
+			struct dns_cache_entry **b, char *name, int len, int type)
+{
+	for (; *b; b = &(*b)->next)
+		if ((*b)->type == type && (*b)->name_len == len &&
+		strncasecmp((*b)->name, name, len) == 0)
+			return b;
+	return NULL;
+}
+
+
+static struct rdata* dns_cache_copy(struct dns_cache_entry *e)
+{
+	struct dns_cache_rr *rr;
+	struct rdata *head, *rd, **last;
+	char *p;
+	unsigned int i;
+
+	head = NULL;
+	last = &head;
+	p = e->rrs;
+	for (i = 0; i < e->rr_no; i++) {
+		rr = (struct dns_cache_rr *)p;
+
+		rd = pkg_malloc(sizeof(struct rdata));
+		if (rd == NULL)
+			goto error;
+		rd->type = rr->type;
+		rd->class = rr->class;
+		rd->ttl = rr->ttl;
+		rd->rdata = NULL;
+		rd->next = NULL;
+		*last = rd;
+		last = &rd->next;
+
+		if (rr->len) {
+			rd->rdata = pkg_malloc(dns_rdata_size(rr->type));
+			if (rd->rdata == NULL)
+				goto error;
+			memcpy(rd->rdata, rr + 1, rr->len);
+		}
+
+		p += dns_align(sizeof(struct dns_cache_rr) + rr->len);
+	}
+
+	return head;
+error:
+	LM_ERR("no more pkg mem\n");
+	free_rdata_list(head);
+	return NULL;
+}
+
+
+static void dns_cache_release(char *name, int len, int type,
+															unsigned int hash)
+{
+	struct dns_cache_entry **e;
+
+	lock_set_get(dc->locks, hash & dc->locks_mask);
+	e = dns_cache_find(&dc->buckets[hash & dc->mask], name, len, type);
+	if (e)
+		(*e)->flags &= ~DNS_CE_REFRESHING;
+	lock_set_release(dc->locks, hash & dc->locks_mask);
+}
+
+
+static void dns_async_drop(struct dns_async_query *q, int close_fd)
+{
+	struct dns_async_query **p;
+
+	for (p = &dns_queries; *p; p = &(*p)->next)
+		if (*p == q) {
+			*p = q->next;
+			dns_queries_no--;
+			break;
+		}
+
+	if (close_fd) {
+		reactor_del_reader(q->fd, -1, IO_FD_CLOSING);
+		close(q->fd);
+	}
+}
+
+
+static void dns_async_expire(unsigned int now)
+{
+	struct dns_async_query *q, *next;
+
+	for (q = dns_queries; q; q = next) {
+		next = q->next;
+		if (now - q->start < DNS_CACHE_QUERY_TIMEOUT)
+			continue;
+
+		LM_DBG("refresh of %.*s - %d timed out\n", q->name_len, q->name,
+			q->type);
+		dns_async_drop(q, 1);
+		dns_cache_release(q->name, q->name_len, q->type, q->hash);
+		pkg_free(q);
+	}
+}
+
+
+/* sends a refresh query over a non blocking UDP socket, to be read by
+ * dns_cache_async_reply() once the reactor finds it readable */
+static int dns_async_query(char *name, int len, int type, unsigned int hash,
+															unsigned int now)
+{
+	static unsigned int ns_idx = 0;
+	union dns_query query;
+	struct sockaddr_in *ns;
+	struct dns_async_query *q;
+	int qlen, fd, i, flags;
+
+	dns_async_expire(now);
+	if (dns_queries_no >= DNS_CACHE_MAX_QUERIES)
+		return -1;
+
+	/* round robin over the IPv4 servers of resolv.conf */
+	ns = NULL;
+	for (i = 0; i < _res.nscount; i++) {
+		ns = &_res.nsaddr_list[ns_idx++ % _res.nscount];
+		if (ns->sin_family == AF_INET)
+			break;
+		ns = NULL;
+	}
+	if (ns == NULL) {
+		LM_DBG("no IPv4 name server to refresh %s with\n", name);
+		return -1;
+	}
+
+	q = pkg_malloc(sizeof *q);
+	if (q == NULL) {
+		LM_ERR("no more pkg mem\n");
+		return -1;
+	}
+	memcpy(q->name, name, len);
+	q->name[len] = 0;
+	q->name_len = len;
+	q->type = type;
+	q->hash = hash;
+	q->start = now;
+
+	qlen = res_mkquery(QUERY, q->name, C_IN, type, NULL, 0, NULL,
+		query.buff, sizeof query.buff);
+	if (qlen < 0) {
+		LM_ERR("failed to build the query for %s - %d\n", name, type);
+		goto error;
+	}
+	q->id = query.hdr.id;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		LM_ERR("socket() failed: %s\n", strerror(errno));
+		goto error;
+	}
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0 ||
+	connect(fd, (struct sockaddr *)ns, sizeof *ns) < 0 ||
+	send(fd, query.buff, qlen, 0) != qlen) {
+		LM_ERR("failed to send the query for %s - %d: %s\n", name, type,
+			strerror(errno));
+		goto error_close;
+	}
+
+	q->fd = fd;
+	if (reactor_add_reader(fd, F_DNS_ASYNC, RCT_PRIO_ASYNC, q) < 0) {
+		LM_ERR("failed to add the DNS query fd to the reactor\n");
+		goto error_close;
+	}
+
+	q->next = dns_queries;
+	dns_queries = q;
+	dns_queries_no++;
+	return 0;
+
+error_close:
+	close(fd);
+error:
+	pkg_free(q);
+	return -1;
+}
+
+
+int dns_cache_async_reply(int fd, void *param)
+{
+	static union dns_query ans;
+	struct dns_async_query *q = (struct dns_async_query *)param;
+	char qname[MAX_DNS_NAME];
+	unsigned char *p, *end;
+	unsigned short qtype;
+	unsigned int min_ttl = UINT_MAX;
+	struct rdata *head;
+	int n;
+
+	n = recv(fd, ans.buff, sizeof ans.buff, 0);
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		LM_DBG("refresh of %s - %d failed: %s\n", q->name, q->type,
+			strerror(errno));
+		dns_async_drop(q, 1);
+		goto release;
+	}
+
+	/* not an answer to this very question - keep waiting for it */
+	if (n <= DNS_HDR_SIZE || ans.hdr.id != q->id || !ans.hdr.qr ||
+	ntohs(ans.hdr.qdcount) != 1)
+		goto ignore;
+	p = ans.buff + DNS_HDR_SIZE;
+	end = ans.buff + n;
+	n = dn_expand(ans.buff, end, p, qname, sizeof qname);
+	if (n < 0 || p + n + 4 > end || strcasecmp(qname, q->name) != 0)
+		goto ignore;
+	memcpy(&qtype, p + n, 2);
+	if (ntohs(qtype) != q->type)
+		goto ignore;
+
+	dns_async_drop(q, 1);
+
+	/* only a full, positive answer is taken */
+	if (ans.hdr.tc || ans.hdr.rcode != NOERROR || ntohs(ans.hdr.ancount) == 0)
+		goto release;
+
+	if (dns_parse_answer(&ans, end - ans.buff, &head, &min_ttl, NULL) < 0)
+		goto release;
+	if (head == NULL || min_ttl == 0) {
+		free_rdata_list(head);
+		goto release;
+	}
+
+	LM_DBG("refreshed %s - %d, ttl %u\n", q->name, q->type, min_ttl);
+	dns_cache_put(q->name, q->type, head, min_ttl);
+	free_rdata_list(head);
+	pkg_free(q);
+	return 0;
+
+release:
+	dns_cache_release(q->name, q->name_len, q->type, q->hash);
+	pkg_free(q);
+	return 0;
+ignore:
+	LM_DBG("unexpected DNS packet while refreshing %s - %d\n", q->name,
+		q->type);
+	return 0;
+}
+
+
+void dns_cache_enable_async(void)
+{
+	if (dc && dns_cache_prefetch && reactor_has_async())
+		dns_async_on = 1;
+}
+
+
+struct rdata* dns_cache_fetch(char *name, int type)
+{
+	struct dns_cache_entry *e, **pe;
+	struct rdata *head;
+	unsigned int hash, now;
+	int len, refresh;
+
+	if (dc == NULL)
+		return NULL;
+
+	len = dns_name_len(name);
+	hash = dns_hash(name, len, type);
+	now = get_ticks();
+	refresh = 0;
+
+	lock_set_get(dc->locks, hash & dc->locks_mask);
+
+	pe = dns_cache_find(&dc->buckets[hash & dc->mask], name, len, type);
+	if (pe == NULL) {
+		head = NULL;
+		goto done;
+	}
+	e = *pe;
+
+	if (e->flags & DNS_CE_FAILED) {
+		head = (now < e->expires) ? (struct rdata *)-1 : NULL;
+		goto done;
+	}
+
+	if (now >= e->expires) {
+		/* stale - still good if refreshed in the background */
+		if (!dns_async_on || now - e->expires >= DNS_CACHE_STALE_TIME) {
+			head = NULL;
+			goto done;
+		}
+		refresh = 1;
+	} else if (dns_async_on &&
+	(e->expires - now) * 100 <= e->ttl * dns_cache_prefetch) {
+		refresh = 1;
+	}
+
+	/* a single refresh at a time, across all the processes */
+	if (refresh) {
+		if (!(e->flags & DNS_CE_REFRESHING) ||
+		now - e->refresh_start >= DNS_CACHE_QUERY_TIMEOUT) {
+			e->flags |= DNS_CE_REFRESHING;
+			e->refresh_start = now;
+		} else {
+			refresh = 0;
+		}
+	}
+
+	head = dns_cache_copy(e);
+
+done:
+	lock_set_release(dc->locks, hash & dc->locks_mask);
+
+	if (refresh && (head == NULL ||
+	dns_async_query(name, len, type, hash, now) < 0))
+		dns_cache_release(name, len, type, hash);
+
+	return head;
+}
+
+
+void dns_cache_put(char *name, int type, struct rdata *head,
+															unsigned int ttl)
+{
+	struct dns_cache_entry *e, *old, **pe, **victim;
+	struct dns_cache_rr *rr;
+	struct rdata *rd;
+	unsigned int hash, size, now;
+	int len, rr_len;
+	char *p;
+
+	if (dc == NULL)
+		return;
+
+	if (head) {
+		if (ttl == 0)
+			return;
+		if (ttl > (unsigned int)dns_cache_max_ttl)
+			ttl = dns_cache_max_ttl;
+	} else {
+		if (dns_cache_neg_ttl <= 0)
+			return;
+		ttl = dns_cache_neg_ttl;
+	}
+
+	len = dns_name_len(name);
+	hash = dns_hash(name, len, type);
+
+	size = dns_align(sizeof(struct dns_cache_entry) + len + 1);
+	for (rd = head; rd; rd = rd->next)
+		size += dns_align(sizeof(struct dns_cache_rr) +
+			(rd->rdata ? dns_rdata_len(rd->type, rd->rdata) : 0));
+
+	e = shm_malloc(size);
+	if (e == NULL) {
+		LM_ERR("no more shm mem for the DNS cache (%u)\n", size);
+		return;
+	}
+
+	now = get_ticks();
+	e->hash = hash;
+	e->type = type;
+	e->flags = head ? 0 : DNS_CE_FAILED;
+	e->expires = now + ttl;
+	e->ttl = ttl;
+	e->refresh_start = 0;
+	e->rr_no = 0;
+	e->name = (char *)(e + 1);
+	e->name_len = len;
+	memcpy(e->name, name, len);
+	e->name[len] = 0;
+	e->rrs = (char *)e + dns_align(sizeof(struct dns_cache_entry) + len + 1);
+
+	p = e->rrs;
+	for (rd = head; rd; rd = rd->next) {
+		rr_len = rd->rdata ? dns_rdata_len(rd->type, rd->rdata) : 0;
+		rr = (struct dns_cache_rr *)p;
+		rr->type = rd->type;
+		rr->class = rd->class;
+		rr->ttl = rd->ttl;
+		rr->len = rr_len;
+		if (rr_len)
+			memcpy(rr + 1, rd->rdata, rr_len);
+		p += dns_align(sizeof(struct dns_cache_rr) + rr_len);
+		e->rr_no++;
+	}
+
+	old = NULL;
+	lock_set_get(dc->locks, hash & dc->locks_mask);
+
+	pe = dns_cache_find(&dc->buckets[hash & dc->mask], name, len, type);
+	if (pe) {
+		old = *pe;
+		*pe = old->next;
+	} else if (__sync_fetch_and_add(&dc->count, 1) >=
+	(unsigned int)dns_cache_size) {
+		/* full - make room by evicting the entry of the bucket which
+		 * expires first, if any */
+		victim = NULL;
+		for (pe = &dc->buckets[hash & dc->mask]; *pe; pe = &(*pe)->next)
+			if (victim == NULL || (int)((*pe)->expires - (*victim)->expires) < 0)
+				victim = pe;
+		if (victim == NULL) {
+			__sync_fetch_and_sub(&dc->count, 1);
+			lock_set_release(dc->locks, hash & dc->locks_mask);
+			LM_DBG("DNS cache full, %s - %d not cached\n", name, type);
+			shm_free(e);
+			return;
+		}
+		old = *victim;
+		*victim = old->next;
+		__sync_fetch_and_sub(&dc->count, 1);
+	}
+
+	e->next = dc->buckets[hash & dc->mask];
+	dc->buckets[hash & dc->mask] = e;
+
+	lock_set_release(dc->locks, hash & dc->locks_mask);
+
+	if (old)
+		shm_free(old);
+}
+
+
+static void dns_cache_gc(unsigned int ticks, void *param)
+{
+	struct dns_cache_entry *e, **pe, *dead;
+	unsigned int i, grace;
+
+	for (i = 0; i <= dc->mask; i++) {
+		if (dc->buckets[i] == NULL)
+			continue;
+
+		dead = NULL;
+		lock_set_get(dc->locks, i & dc->locks_mask);
+		for (pe = &dc->buckets[i]; *pe; ) {
+			e = *pe;
+			grace = (e->flags & DNS_CE_FAILED) ? 0 : DNS_CACHE_STALE_TIME;
+			if ((int)(ticks - e->expires) >= (int)grace) {
+				*pe = e->next;
+				e->next = dead;
+				dead = e;
+				__sync_fetch_and_sub(&dc->count, 1);
+			} else {
+				pe = &e->next;
+			}
+		}
+		lock_set_release(dc->locks, i & dc->locks_mask);
+
+		for (; dead; dead = e) {
+			e = dead->next;
+			shm_free(dead);
+		}
+	}
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2016 OpenSIPS Solutions
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+/*
+ * Shared memory cache of the parsed DNS records, used by get_record().
+ *
+ * The records of a name:type are kept, flattened, for the min TTL of the
+ * answer (capped by dns_cache_max_ttl); the failed lookups are kept for
+ * dns_cache_neg_ttl. When a hit finds the entry in its last
+ * dns_cache_prefetch percents of TTL - or expired for less than
+ * DNS_CACHE_STALE_TIME - the SIP worker sends a refresh query over a non
+ * blocking UDP socket watched by its reactor and goes on with the cached
+ * records; the answer is stored when it arrives. So only the first lookup
+ * of a name (or one after a long idle time) waits for the DNS server.
+ *
+ * The cache only holds DNS answers: resolvehost() falls back to the libc
+ * resolver for the A/AAAA lookups failing here, so the names of /etc/hosts
+ * still resolve - but with no caching, as without dns_cache_size.
+ */
+
+#ifndef _RESOLVE_CACHE_H
+#define _RESOLVE_CACHE_H
+
+#include "resolve.h"
+
+/* how long an expired entry may still be served while being refreshed */
+#define DNS_CACHE_STALE_TIME    30
+/* how long to wait for the answer of a refresh query */
+#define DNS_CACHE_QUERY_TIMEOUT 5
+/* max refresh queries in flight, per process */
+#define DNS_CACHE_MAX_QUERIES   16
+/* interval of the timer dropping the expired entries */
+#define DNS_CACHE_GC_INTERVAL   60
+
+/* max number of cached name:type entries (0 - cache disabled) */
+extern int dns_cache_size;
+/* max lifetime of an entry, in seconds */
+extern int dns_cache_max_ttl;
+/* lifetime of a failed lookup (0 - not cached) */
+extern int dns_cache_neg_ttl;
+/* refresh the entries in their last percents of TTL (0 - no prefetch) */
+extern int dns_cache_prefetch;
+
+int init_dns_cache(void);
+void destroy_dns_cache(void);
+
+/* returns a pkg copy of the cached records (to be freed with
+ * free_rdata_list()), (void*)-1 for a cached failure or NULL if not cached */
+struct rdata* dns_cache_fetch(char *name, int type);
+
+/* caches the records of name:type (@head NULL - failed lookup) */
+void dns_cache_put(char *name, int type, struct rdata *head,
+		unsigned int ttl);
+
+/* to be called by the processes running a reactor able to watch the fds
+ * of the refresh queries (F_DNS_ASYNC) */
+void dns_cache_enable_async(void);
+
+/* F_DNS_ASYNC handler - reads the answer of a refresh query */
+int dns_cache_async_reply(int fd, void *param);
+
+#endif
@@ -106,3 +106,17 @@ END dr_partitions_tr;
 /
 BEGIN map2users('dr_partitions'); END;
 /
+INSERT INTO version (table_name, table_version) values ('dr_rules_log','1');
+CREATE TABLE dr_rules_log (
+    id NUMBER(10) PRIMARY KEY,
+    prefix VARCHAR2(64) DEFAULT NULL
+);
+
+CREATE OR REPLACE TRIGGER dr_rules_log_tr
+before insert on dr_rules_log FOR EACH ROW
+BEGIN
+  auto_id(:NEW.id);
+END dr_rules_log_tr;
+/
+BEGIN map2users('dr_rules_log'); END;
+/
@@ -71,3 +71,10 @@ CREATE TABLE dr_partitions (
 );
 
 ALTER SEQUENCE dr_partitions_id_seq MAXVALUE 2147483647 CYCLE;
+INSERT INTO version (table_name, table_version) values ('dr_rules_log','1');
+CREATE TABLE dr_rules_log (
+    id SERIAL PRIMARY KEY NOT NULL,
+    prefix VARCHAR(64) DEFAULT NULL
+);
+
+ALTER SEQUENCE dr_rules_log_id_seq MAXVALUE 2147483647 CYCLE;
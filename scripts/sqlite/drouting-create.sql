@@ -66,3 +66,9 @@ CREATE TABLE dr_partitions (
     carrier_id_avp CHAR(255)
 );
 
+INSERT INTO version (table_name, table_version) values ('dr_rules_log','1');
+CREATE TABLE dr_rules_log (
+    id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL,
+    prefix CHAR(64) DEFAULT NULL
+);
+
@@ -80,6 +80,127 @@ gen_lock_t *stat_lock = 0;
 
 #define stat_hash(_s) core_hash( _s, 0, STATS_HASH_SIZE)
 
+#define STAT_CACHE_LINE 64
+
+#ifdef NO_ATOMIC_OPS
+	#define stat_counter(_v) (*(_v))
+	typedef unsigned int stat_counter_t;
+#else
+	#define stat_counter(_v) ((_v)->counter)
+	typedef __typeof__(((stat_val*)0)->counter) stat_counter_t;
+#endif
+
+/* a chunk of per process slots - the stripe of process N starts at
+ * base + N*STAT_CHUNK_STRIDE */
+struct stat_chunk_ {
+	char *base;
+	unsigned int used;
+	struct stat_chunk_ *next;
+};
+
+/* number of processes with slots (0 - not known yet, single counters) */
+static unsigned int stat_procs_no = 0;
+
+/* the histogram stripes are cache line aligned */
+#define STAT_HIST_STRIDE \
+	((sizeof(stat_hist) + STAT_CACHE_LINE - 1) & ~(STAT_CACHE_LINE - 1))
+
+
+/*! \brief
+ * Allocates the histogram of a statistic: a stripe for each process if their
+ * number is known, a single one otherwise; the start of the allocated block
+ * is kept right before the first stripe
+ */
+static stat_hist* stat_alloc_hist(stat_var *stat)
+{
+	unsigned int n;
+	unsigned long mem;
+	char *p, *base;
+
+	n = stat_procs_no ? stat_procs_no : 1;
+	mem = n * STAT_HIST_STRIDE + STAT_CACHE_LINE + sizeof(void*);
+
+	p = (char*)shm_malloc(mem);
+	if (p==0)
+		return 0;
+	memset(p, 0, mem);
+
+	base = (char*)(((unsigned long)(p + sizeof(void*)) + STAT_CACHE_LINE - 1)
+		& ~(unsigned long)(STAT_CACHE_LINE - 1));
+	((void**)base)[-1] = p;
+
+	stat->stride = stat_procs_no ? STAT_HIST_STRIDE : 0;
+	return (stat_hist*)base;
+}
+
+
+/*! \brief
+ * Allocates the counter of a statistic: a slot in a chunk if the number of
+ * processes is known, a single counter otherwise
+ */
+static stat_val* stat_alloc_val(stat_var *stat, int unsafe)
+{
+	struct stat_chunk_ *chunk;
+	stat_val *val;
+	unsigned long mem;
+
+	if (stat_procs_no==0 || (stat->flags&STAT_SHARED)) {
+		val = unsafe ?
+			(stat_val*)shm_malloc_unsafe(sizeof(stat_val)) :
+			(stat_val*)shm_malloc(sizeof(stat_val));
+		if (val==0)
+			return 0;
+		memset(val, 0, sizeof(stat_val));
+		stat->stride = 0;
+		return val;
+	}
+
+	/* may be called at runtime, by any process */
+	lock_start_write((rw_lock_t *)collector->rwl);
+
+	chunk = collector->chunks;
+	if (chunk==0 || chunk->used==STAT_CHUNK_SLOTS) {
+		/* the stripes are cache line aligned */
+		mem = stat_procs_no * STAT_CHUNK_STRIDE + STAT_CACHE_LINE;
+		chunk = (struct stat_chunk_*)shm_malloc(sizeof(*chunk) + mem);
+		if (chunk==0) {
+			lock_stop_write((rw_lock_t *)collector->rwl);
+			return 0;
+		}
+		memset(chunk, 0, sizeof(*chunk) + mem);
+		chunk->base = (char*)(((unsigned long)(chunk+1) + STAT_CACHE_LINE - 1)
+			& ~(unsigned long)(STAT_CACHE_LINE - 1));
+		chunk->next = collector->chunks;
+		collector->chunks = chunk;
+	}
+
+	/* the slots are never reused, so they are all 0 */
+	val = (stat_val*)chunk->base + chunk->used++;
+
+	lock_stop_write((rw_lock_t *)collector->rwl);
+
+	stat->stride = STAT_CHUNK_STRIDE;
+	return val;
+}
+
+
+static void stat_free_val(stat_var *stat, int unsafe)
+{
+	if (stat->flags&STAT_IS_HIST) {
+		shm_free( ((void**)stat->u.hist)[-1] );
+		return;
+	}
+
+	/* the slots are freed with their chunk */
+	if (stat->stride)
+		return;
+
+	if (unsafe)
+		shm_free_unsafe(stat->u.val);
+	else
+		shm_free(stat->u.val);
+}
+
 
 /*! \brief
  * Returns the statistic associated with 'numerical_code' and 'out_codes'.
@@ -157,12 +278,11 @@ int register_udp_load_stat(str *name, stat_var **s, int children)
 	memset(*s,0,sizeof(stat_var));
 	*((int*)((*s)+1)) = children;
 
-	(*s)->u.val = shm_malloc(sizeof(stat_val));
+	(*s)->u.val = stat_alloc_val(*s, 0);
 	if (!(*s)->u.val) {
 		LM_ERR("no more shm\n");
 		return -1;
 	}
-	memset((*s)->u.val,0,sizeof(stat_val));
 
 	if ( (stat_name = build_stat_name(name,"load")) == 0 ||
 	register_stat2("load",stat_name,(stat_var**)calc_udp_load,
@@ -183,12 +303,11 @@ int register_tcp_load_stat(stat_var **s)
 	}
 	memset(*s,0,sizeof(stat_var));
 
-	(*s)->u.val = shm_malloc(sizeof(stat_val));
+	(*s)->u.val = stat_alloc_val(*s, 0);
 	if (!(*s)->u.val) {
 		LM_ERR("no more shm\n");
 		return -1;
 	}
-	memset((*s)->u.val,0,sizeof(stat_val));
 
 	if (register_stat2("load","tcp-load",(stat_var**)calc_tcp_load,
 	STAT_IS_FUNC, *s, 0) != 0) {
@@ -368,6 +487,16 @@ int init_stats_collector(void)
 		goto error;
 	}
 
+	/* register the DB and cachedb latency histograms */
+	if (register_module_stats( "db", db_stats)!=0 ) {
+		LM_ERR("failed to register DB statistics\n");
+		goto error;
+	}
+	if (register_module_stats( "cachedb", cdb_stats)!=0 ) {
+		LM_ERR("failed to register cachedb statistics\n");
+		goto error;
+	}
+
 	/* create the module for "dynamic" statistics */
 	dy_mod = add_stat_module( DYNAMIC_MODULE_NAME );
 	if (dy_mod==NULL) {
@@ -388,6 +517,7 @@ error:
 
 void destroy_stats_collector(void)
 {
+	struct stat_chunk_ *chunk;
 	stat_var *stat;
 	stat_var *tmp_stat;
 	int i;
@@ -406,7 +536,7 @@ void destroy_stats_collector(void)
 				tmp_stat = stat;
 				stat = stat->hnext;
 				if ((tmp_stat->flags&STAT_IS_FUNC)==0 && tmp_stat->u.val)
-					shm_free(tmp_stat->u.val);
+					stat_free_val(tmp_stat, 0);
 				if ( (tmp_stat->flags&STAT_SHM_NAME) && tmp_stat->name.s)
 					shm_free(tmp_stat->name.s);
 				shm_free(tmp_stat);
@@ -416,7 +546,7 @@ void destroy_stats_collector(void)
 				tmp_stat = stat;
 				stat = stat->hnext;
 				if ((tmp_stat->flags&STAT_IS_FUNC)==0 && tmp_stat->u.val)
-					shm_free(tmp_stat->u.val);
+					stat_free_val(tmp_stat, 0);
 				if ( (tmp_stat->flags&STAT_SHM_NAME) && tmp_stat->name.s)
 					shm_free(tmp_stat->name.s);
 				shm_free(tmp_stat);
@@ -427,6 +557,13 @@ void destroy_stats_collector(void)
 		if (collector->amodules)
 			shm_free(collector->amodules);
 
+		/* destroy the per process slots */
+		while (collector->chunks) {
+			chunk = collector->chunks;
+			collector->chunks = chunk->next;
+			shm_free(chunk);
+		}
+
 		/* destroy the RW lock */
 		if (collector->rwl)
 			lock_destroy_rw( (rw_lock_t *)collector->rwl);
@@ -443,6 +580,202 @@ int stats_are_ready(void)
 	return stats_ready;
 }
 
+
+static int stat_move_to_slots(stat_var *stat)
+{
+	stat_hist *old_hist;
+	stat_val *old;
+
+	if ( (stat->flags&(STAT_IS_FUNC|STAT_SHARED)) || stat->stride )
+		return 0;
+
+	if (stat->flags&STAT_IS_HIST) {
+		old_hist = stat->u.hist;
+		stat->u.hist = stat_alloc_hist(stat);
+		if (stat->u.hist==0) {
+			LM_ERR("no more shm mem\n");
+			stat->u.hist = old_hist;
+			return -1;
+		}
+		memcpy(stat->u.hist, old_hist, sizeof(stat_hist));
+		shm_free( ((void**)old_hist)[-1] );
+		return 0;
+	}
+
+	old = stat->u.val;
+	stat->u.val = stat_alloc_val(stat, 0);
+	if (stat->u.val==0) {
+		LM_ERR("no more shm mem\n");
+		stat->u.val = old;
+		return -1;
+	}
+
+	/* whatever was counted so far goes to the first process */
+	stat_counter(stat->u.val) = stat_counter(old);
+	shm_free(old);
+
+	return 0;
+}
+
+
+int init_stats_proc_slots(void)
+{
+	stat_var *stat;
+	int i;
+
+	if (collector==NULL || stat_procs_no)
+		return 0;
+
+	stat_procs_no = counted_processes;
+
+	for( i=0 ; i<STATS_HASH_SIZE ; i++ ) {
+		for( stat=collector->hstats[i] ; stat ; stat=stat->hnext )
+			if (stat_move_to_slots(stat)<0)
+				return -1;
+		for( stat=collector->dy_hstats[i] ; stat ; stat=stat->hnext )
+			if (stat_move_to_slots(stat)<0)
+				return -1;
+	}
+
+	LM_DBG("statistics moved to %u per process slots\n", stat_procs_no);
+	return 0;
+}
+
+
+/*! \brief
+ * Merges the stripes of a histogram; returns the number of values
+ */
+static unsigned long stat_merge_hist(stat_var *var, stat_hist *h)
+{
+	stat_hist *ph;
+	unsigned long count;
+	unsigned int i, j, n;
+
+	n = var->stride ? stat_procs_no : 1;
+
+	memset(h, 0, sizeof(*h));
+	for( i=0 ; i<n ; i++ ) {
+		ph = (stat_hist*)((char*)var->u.hist + i*var->stride);
+		h->sum += ph->sum;
+		for( j=0 ; j<STAT_HIST_BUCKETS ; j++ )
+			h->buckets[j] += ph->buckets[j];
+	}
+
+	/* counted from the buckets, so the percentiles always add up, even if
+	 * the owners update their stripes while merging */
+	for( j=0,count=0 ; j<STAT_HIST_BUCKETS ; j++ )
+		count += h->buckets[j];
+
+	return count;
+}
+
+
+/* the highest value counted in a histogram bucket */
+static inline unsigned long stat_hist_bucket_max(unsigned int idx)
+{
+	unsigned int e;
+
+	if (idx < STAT_HIST_SUB)
+		return idx;
+
+	e = (idx >> STAT_HIST_SUB_BITS) + STAT_HIST_SUB_BITS - 1;
+	return ((unsigned long)(STAT_HIST_SUB + (idx & (STAT_HIST_SUB - 1)) + 1)
+		<< (e - STAT_HIST_SUB_BITS)) - 1;
+}
+
+
+static unsigned long stat_hist_percentile(stat_hist *h, unsigned long count,
+															unsigned int q)
+{
+	unsigned long rank, n;
+	unsigned int j;
+
+	if (count==0)
+		return 0;
+
+	/* the value of the ceil(q*count)-th smallest value's bucket; reported
+	 * as the top of the bucket, so a percentile is never under estimated */
+	rank = (count * q + 999) / 1000;
+	if (rank==0)
+		rank = 1;
+
+	for( j=0,n=0 ; j<STAT_HIST_BUCKETS ; j++ ) {
+		n += h->buckets[j];
+		if (n>=rank)
+			return stat_hist_bucket_max(j);
+	}
+
+	return stat_hist_bucket_max(STAT_HIST_BUCKETS - 1);
+}
+
+
+unsigned long get_hist_percentile(stat_var *var, unsigned int q)
+{
+	stat_hist h;
+
+	if ((var->flags&STAT_IS_HIST)==0)
+		return 0;
+
+	return stat_hist_percentile(&h, stat_merge_hist(var, &h), q);
+}
+
+
+unsigned long get_stat_val(stat_var *var)
+{
+	stat_counter_t sum;
+	unsigned int i;
+	stat_hist h;
+
+	if (var->flags&STAT_IS_FUNC)
+		return (unsigned long)var->u.f(var->context);
+
+	if (var->flags&STAT_IS_HIST)
+		return stat_merge_hist(var, &h);
+
+	if (var->stride==0)
+		return (unsigned long)stat_counter(var->u.val);
+
+	/* summed in the counter type, so the decrements done by other
+	 * processes than the incrementing ones still wrap around */
+	sum = 0;
+	for( i=0 ; i<stat_procs_no ; i++ )
+		sum += stat_counter((stat_val*)((char*)var->u.val + i*var->stride));
+
+	return (unsigned long)sum;
+}
+
+
+void reset_stat_val(stat_var *var)
+{
+	unsigned int i, n;
+
+	n = var->stride ? stat_procs_no : 1;
+
+	if (var->flags&STAT_IS_HIST) {
+		/* racing with the updates of the owners may only lose a few values */
+		for( i=0 ; i<n ; i++ )
+			memset((char*)var->u.hist + i*var->stride, 0, sizeof(stat_hist));
+		return;
+	}
+
+#ifdef NO_ATOMIC_OPS
+	if ((var->flags&STAT_NO_SYNC)==0)
+		lock_get(stat_lock);
+#endif
+
+	for( i=0 ; i<n ; i++ )
+#ifdef NO_ATOMIC_OPS
+		*(stat_val*)((char*)var->u.val + i*var->stride) = 0;
+#else
+		atomic_set( (stat_val*)((char*)var->u.val + i*var->stride), 0);
+#endif
+
+#ifdef NO_ATOMIC_OPS
+	if ((var->flags&STAT_NO_SYNC)==0)
+		lock_release(stat_lock);
+#endif
+}
+
 /********************* Create/Register STATS functions ***********************/
 
 /**
@@ -480,19 +813,30 @@ int register_stat2( char *module, char *name, stat_var **pvar,
 	}
 	memset( stat, 0, sizeof(stat_var) );
 
-	if ( (flags&STAT_IS_FUNC)==0 ) {
-		stat->u.val = unsafe ?
-			(stat_val*)shm_malloc_unsafe(sizeof(stat_val)) :
-			(stat_val*)shm_malloc(sizeof(stat_val));
+	/* the stats of the allocator are updated and read by the allocations
+	 * themselves - summing the slots there would cost too much */
+	if (unsafe)
+		flags |= STAT_SHARED;
+	stat->flags = flags;
+
+	if (flags&STAT_IS_HIST) {
+		if (flags&(STAT_IS_FUNC|STAT_SHARED)) {
+			LM_ERR("histogram %s:%s cannot be a function or shared\n",
+				module, name);
+			goto error1;
+		}
+		stat->u.hist = stat_alloc_hist(stat);
+		if (stat->u.hist==0) {
+			LM_ERR("no more shm memory\n");
+			goto error1;
+		}
+		*pvar = stat;
+	} else if ( (flags&STAT_IS_FUNC)==0 ) {
+		stat->u.val = stat_alloc_val(stat, unsafe);
 		if (stat->u.val==0) {
 			LM_ERR("no more shm memory\n");
 			goto error1;
 		}
-#ifdef NO_ATOMIC_OPS
-		*(stat->u.val) = 0;
-#else
-		atomic_set(stat->u.val,0);
-#endif
 		*pvar = stat;
 	} else {
 		stat->u.f = (stat_function)(pvar);
@@ -543,7 +887,7 @@ int register_stat2( char *module, char *name, stat_var **pvar,
 						shm_free_unsafe(stat->name.s);
 
 					if ((flags&STAT_IS_FUNC)==0)
-						shm_free_unsafe(stat->u.val);
+						stat_free_val(stat, unsafe);
 
 					shm_free_unsafe(stat);
 				
@@ -552,7 +896,7 @@ int register_stat2( char *module, char *name, stat_var **pvar,
 						shm_free(stat->name.s);
 
 					if ((flags&STAT_IS_FUNC)==0)
-						shm_free(stat->u.val);
+						stat_free_val(stat, unsafe);
 
 					shm_free(stat);
 				}
@@ -592,10 +936,7 @@ int register_stat2( char *module, char *name, stat_var **pvar,
 
 error2:
 	if ( (flags&STAT_IS_FUNC)==0 ) {
-		if (unsafe)
-			shm_free_unsafe(*pvar);
-		else
-			shm_free(*pvar);
+		stat_free_val(stat, unsafe);
 		*pvar = 0;
 	}
 error1:
@@ -735,10 +1076,78 @@ int mi_print_stat(struct mi_node *rpl, str *mod, str *stat, unsigned long val)
 
 /***************************** MI STUFF ********************************/
 
+static struct {
+	char *suffix;
+	unsigned int q;   /* permille, 0 - the average */
+} mi_hist_vals[] = {
+	{"_avg",  0},
+	{"_p50",  500},
+	{"_p90",  900},
+	{"_p99",  990},
+	{"_p999", 999},
+	{0, 0}
+};
+
+/*! \brief
+ * Prints a histogram as its number of values, followed by the average and
+ * the percentiles, each as a <name>_<what> statistic
+ */
+static int mi_print_hist(struct mi_node *rpl, str *mod, stat_var *stat)
+{
+	static char *buf = NULL;
+	static int buf_len = 0;
+	unsigned long count, val;
+	stat_hist h;
+	str name;
+	char *tmp;
+	int i, l;
+
+	count = stat_merge_hist(stat, &h);
+	if (mi_print_stat(rpl, mod, &stat->name, count) < 0)
+		return -1;
+
+	if (buf_len < stat->name.len + 6) {
+		tmp = pkg_realloc(buf, stat->name.len + 6);
+		if (!tmp) {
+			LM_ERR("no more pkg memory\n");
+			return -1;
+		}
+		buf = tmp;
+		buf_len = stat->name.len + 6;
+	}
+	memcpy(buf, stat->name.s, stat->name.len);
+	name.s = buf;
+
+	for( i=0 ; mi_hist_vals[i].suffix ; i++ ) {
+		l = strlen(mi_hist_vals[i].suffix);
+		memcpy(buf + stat->name.len, mi_hist_vals[i].suffix, l);
+		name.len = stat->name.len + l;
+
+		if (mi_hist_vals[i].q)
+			val = stat_hist_percentile(&h, count, mi_hist_vals[i].q);
+		else
+			val = count ? h.sum / count : 0;
+
+		if (mi_print_stat(rpl, mod, &name, val) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+inline static int mi_print_stat_var(struct mi_node *rpl, str *mod,
+															stat_var *stat)
+{
+	if (stat->flags&STAT_IS_HIST)
+		return mi_print_hist(rpl, mod, stat);
+
+	return mi_print_stat(rpl, mod, &stat->name, get_stat_val(stat));
+}
+
 inline static int mi_add_stat(struct mi_node *rpl, stat_var *stat)
 {
-	return mi_print_stat(rpl, &collector->amodules[stat->mod_idx].name,
-					&stat->name, get_stat_val(stat));
+	return mi_print_stat_var(rpl, &collector->amodules[stat->mod_idx].name,
+					stat);
 }
 
 inline static int mi_list_stat(struct mi_node *rpl, str *mod, stat_var *stat)
@@ -751,9 +1160,11 @@ inline static int mi_list_stat(struct mi_node *rpl, str *mod, stat_var *stat)
 		return -1;
 	}
 
-	if (stat->flags & STAT_IS_FUNC)
+	if (stat->flags & STAT_IS_HIST)
+		buf = "histogram";
+	else if (stat->flags & STAT_IS_FUNC)
 		buf = "function";
-	if (stat->flags & STAT_NO_RESET)
+	else if (stat->flags & STAT_NO_RESET)
 		buf = "non-incremental";
 	else
 		buf = "incremental";
@@ -775,8 +1186,7 @@ inline static int mi_add_module_stats(struct mi_node *rpl,
 		lock_start_read((rw_lock_t *)collector->rwl);
 
 	for( stat=mods->head ; stat ; stat=stat->lnext) {
-		ret = mi_print_stat(rpl, &mods->name, &stat->name,
-				get_stat_val(stat));
+		ret = mi_print_stat_var(rpl, &mods->name, stat);
 		if (ret < 0)
 			break;
 	}
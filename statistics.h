@@ -34,6 +34,8 @@
 #ifndef _STATISTICS_H_
 #define _STATISTICS_H_
 
+#include <sys/time.h>
+
 #include "hash_func.h"
 #include "atomic.h"
 
@@ -46,6 +48,25 @@
 #define STAT_NO_SYNC   (1<<1)
 #define STAT_SHM_NAME  (1<<2)
 #define STAT_IS_FUNC   (1<<3)
+#define STAT_SHARED    (1<<4)  /* one counter for all processes */
+#define STAT_IS_HIST   (1<<5)  /* histogram of values (latencies) */
+
+/* the counters are kept per process, in chunks of STAT_CHUNK_SLOTS slots:
+ * the slots of a process are in a cache line aligned stripe of the chunk,
+ * so the processes never write the same cache lines; the value of a
+ * statistic is the sum of its slots */
+#define STAT_CHUNK_SLOTS  256
+#define STAT_CHUNK_STRIDE (STAT_CHUNK_SLOTS*sizeof(stat_val))
+
+/* the histograms count the values (durations in microseconds) in log-linear
+ * buckets: the values below STAT_HIST_SUB have a bucket each, every power of
+ * 2 above is split in STAT_HIST_SUB buckets - so a percentile is known within
+ * 1/STAT_HIST_SUB of its value, up to 2^(STAT_HIST_MAX_EXP+1) */
+#define STAT_HIST_SUB_BITS 3
+#define STAT_HIST_SUB      (1<<STAT_HIST_SUB_BITS)
+#define STAT_HIST_MAX_EXP  31
+#define STAT_HIST_BUCKETS \
+	((STAT_HIST_MAX_EXP-STAT_HIST_SUB_BITS+2)*STAT_HIST_SUB)
 
 #ifdef NO_ATOMIC_OPS
 typedef unsigned int stat_val;
@@ -53,17 +74,28 @@ typedef unsigned int stat_val;
 typedef atomic_t stat_val;
 #endif
 
+/* the histogram of a process - only written by its process, in a stripe of
+ * its own, so there is no need for atomic operations */
+typedef struct stat_hist_ {
+	unsigned long sum;
+	unsigned int buckets[STAT_HIST_BUCKETS];
+} stat_hist;
+
 typedef unsigned long (*stat_function)(void *);
 
 struct module_stats_;
+struct stat_chunk_;
 
 typedef struct stat_var_{
 	unsigned int mod_idx;
 	str name;
 	unsigned short flags;
+	/* distance between the slots of two processes (0 - single counter) */
+	unsigned int stride;
 	void * context;
 	union{
-		stat_val *val;
+		stat_val *val;   /* the slot of the first process */
+		stat_hist *hist; /* the stripe of the first process */
 		stat_function f;
 	}u;
 	struct stat_var_ *hnext;
@@ -86,6 +118,7 @@ typedef struct stats_collector_ {
 	stat_var* dy_hstats[STATS_HASH_SIZE];   /* hash with dynamic statistics */
 	void *rwl;      /* lock for protecting dynamic stats/modules */
 	module_stats *amodules;
+	struct stat_chunk_ *chunks;  /* per process slots, the first has room */
 }stats_collector;
 
 typedef struct stat_export_ {
@@ -103,6 +136,10 @@ char *build_stat_name( str* prefix, char *var_name);
 int init_stats_collector();
 int stats_are_ready(); /* for code which is statistics-dependent */
 
+/* moves the counters registered so far to per process slots - to be
+ * called once the number of processes is known, before forking */
+int init_stats_proc_slots(void);
+
 int register_udp_load_stat(str *name, stat_var **ctx, int children);
 int register_tcp_load_stat(stat_var **ctx);
 
@@ -116,6 +153,9 @@ int register_stat2( char *module, char *name, stat_var **pvar,
 
 int register_dynamic_stat( str *name, stat_var **pvar);
 
+#define register_hist(_mod,_name,_pvar,_flags) \
+		register_stat2(_mod,_name,_pvar,(_flags)|STAT_IS_HIST, NULL, 0)
+
 #define register_module_stats(mod, stats) \
 	__register_module_stats(mod, stats, 0)
 
@@ -125,7 +165,13 @@ int clone_pv_stat_name(str *name, str *clone);
 
 stat_var* get_stat( str *name );
 
-unsigned int get_stat_val( stat_var *var );
+/* for a histogram, the number of values */
+unsigned long get_stat_val( stat_var *var );
+
+/* the q-th permille (e.g. 990 for p99) of a histogram */
+unsigned long get_hist_percentile( stat_var *var, unsigned int q );
+
+void reset_stat_val( stat_var *var );
 
 /*! \brief
  * Returns the statistic associated with 'numerical_code' and 'is_a_reply'.
@@ -146,13 +192,16 @@ extern gen_lock_t *stat_lock;
 
 #else
 	#define init_stats_collector()  0
+	#define init_stats_proc_slots()  0
 	#define destroy_stats_collector()
 	#define register_module_stats(_mod,_stats) 0
 	#define __register_module_stats(_mod,_stats, unsafe) 0
 	#define register_stat( _mod, _name, _pvar, _flags) 0
+	#define register_hist( _mod, _name, _pvar, _flags) 0
 	#define register_dynamic_stat( _name, _pvar) 0
 	#define get_stat( _name )  0
 	#define get_stat_val( _var ) 0
+	#define get_hist_percentile( _var, _q) 0
 	#define get_stat_var_from_num_code( _n_code, _in_code) NULL
 	#define register_udp_load_stat( _a, _b, _c) 0
 	#define register_tcp_load_stat( _a)     0
@@ -162,52 +211,42 @@ extern gen_lock_t *stat_lock;
 
 
 #ifdef STATISTICS
+	extern int process_no;
+
+	/* the counter of the current process */
+	#define stat_slot( _var) \
+		((stat_val*)((char*)(_var)->u.val + process_no*(_var)->stride))
+
 	#ifdef NO_ATOMIC_OPS
 		#define update_stat( _var, _n) \
 			do { \
-				if ( !((_var)->flags&STAT_IS_FUNC) ) {\
-					if ((_var)->flags&STAT_NO_SYNC) {\
-						*((_var)->u.val) += _n;\
-					} else {\
-						lock_get(stat_lock);\
-						*((_var)->u.val) += _n;\
-						lock_release(stat_lock);\
-					}\
-				}\
-			}while(0)
-		#define reset_stat( _var) \
-			do { \
-				if ( ((_var)->flags&(STAT_NO_RESET|STAT_IS_FUNC))==0 ) {\
+				if ( !((_var)->flags&(STAT_IS_FUNC|STAT_IS_HIST)) ) {\
 					if ((_var)->flags&STAT_NO_SYNC) {\
-						*((_var)->u.val) = 0;\
+						*stat_slot(_var) += _n;\
 					} else {\
 						lock_get(stat_lock);\
-						*((_var)->u.val) = 0;\
+						*stat_slot(_var) += _n;\
 						lock_release(stat_lock);\
 					}\
 				}\
 			}while(0)
-		#define get_stat_val( _var ) ((unsigned long)\
-			((_var)->flags&STAT_IS_FUNC)?(_var)->u.f((_var)->context):*((_var)->u.val))
 	#else
 		#define update_stat( _var, _n) \
 			do { \
-				if ( !((_var)->flags&STAT_IS_FUNC) ) {\
+				if ( !((_var)->flags&(STAT_IS_FUNC|STAT_IS_HIST)) ) {\
 					if (_n>=0) \
-						atomic_add( _n, (_var)->u.val);\
+						atomic_add( _n, stat_slot(_var));\
 					else \
-						atomic_sub( -(_n), (_var)->u.val);\
+						atomic_sub( -(_n), stat_slot(_var));\
 				}\
 			}while(0)
-		#define reset_stat( _var) \
-			do { \
-				if ( ((_var)->flags&(STAT_NO_RESET|STAT_IS_FUNC))==0 ) {\
-					atomic_set( (_var)->u.val, 0);\
-				}\
-			}while(0)
-		#define get_stat_val( _var ) ((unsigned long)\
-			((_var)->flags&STAT_IS_FUNC)?(_var)->u.f((_var)->context):(_var)->u.val->counter)
 	#endif /* NO_ATOMIC_OPS */
+	#define reset_stat( _var) \
+		do { \
+			if ( ((_var)->flags&(STAT_NO_RESET|STAT_IS_FUNC))==0 ) {\
+				reset_stat_val(_var);\
+			}\
+		}while(0)
 
 	#define if_update_stat(_c, _var, _n) \
 		do { \
@@ -217,11 +256,65 @@ extern gen_lock_t *stat_lock;
 		do { \
 			if (_c) reset_stat( _var); \
 		}while(0)
+
+	/* the histogram of the current process */
+	#define stat_hist_slot( _var) \
+		((stat_hist*)((char*)(_var)->u.hist + process_no*(_var)->stride))
+
+	static inline unsigned int stat_hist_idx(unsigned long v)
+	{
+		unsigned int e;
+
+		if (v < STAT_HIST_SUB)
+			return v;
+
+		e = sizeof(long)*8 - 1 - __builtin_clzl(v);
+		if (e > STAT_HIST_MAX_EXP)
+			return STAT_HIST_BUCKETS - 1;
+
+		return ((e - STAT_HIST_SUB_BITS + 1) << STAT_HIST_SUB_BITS) +
+			((v >> (e - STAT_HIST_SUB_BITS)) & (STAT_HIST_SUB - 1));
+	}
+
+	/* microseconds since tv (0 if the clock went back) */
+	static inline unsigned long stat_usec_since(struct timeval *tv)
+	{
+		struct timeval now;
+		long usec;
+
+		gettimeofday(&now, 0);
+		usec = (now.tv_sec - tv->tv_sec) * 1000000 +
+			(now.tv_usec - tv->tv_usec);
+
+		return usec > 0 ? usec : 0;
+	}
+
+	#define update_hist( _var, _v) \
+		do { \
+			stat_hist *__h = stat_hist_slot(_var); \
+			unsigned long __v = (_v); \
+			__h->buckets[stat_hist_idx(__v)]++; \
+			__h->sum += __v; \
+		}while(0)
+	#define if_update_hist(_c, _var, _v) \
+		do { \
+			if (_c) update_hist( _var, _v); \
+		}while(0)
+
+	/* measuring a duration: start_hist_timer() and, when done,
+	 * update_hist_since() with the same timeval */
+	#define start_hist_timer( _tv) gettimeofday(&(_tv), 0)
+	#define update_hist_since( _var, _tv) \
+		update_hist( _var, stat_usec_since(&(_tv)))
 #else
 	#define update_stat( _var, _n)
 	#define reset_stat( _var)
 	#define if_update_stat( _c, _var, _n)
 	#define if_reset_stat( _c, _var)
+	#define update_hist( _var, _v)
+	#define if_update_hist( _c, _var, _v)
+	#define start_hist_timer( _tv)
+	#define update_hist_since( _var, _tv)
 #endif /*STATISTICS*/
 
 
@@ -0,0 +1,70 @@
+#!/bin/bash
+# cr_route() lookup rate and memory over a random prefix table
+
+# Copyright (C) 2016 OpenSIPS Solutions
+#
+# This file is part of opensips, a free SIP server.
+#
+# opensips is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version
+#
+# opensips is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+source include/bench
+
+RULES=${1:-500000}
+SEED=${2:-1}
+
+if ! (check_opensips && check_module "carrierroute" && check_module "db_text" \
+&& check_module "benchmark"); then
+	exit 0
+fi ;
+
+bench_init
+
+for t in carrierroute carrierfailureroute route_tree; do
+	dbtext_table $t
+done
+
+echo "1:default" >> $WORK/route_tree
+
+# prefixes of 3 to 10 digits, each one with 1 to 4 targets sharing the
+# probability; the targets of a prefix are consecutive rows
+awk -v n=$RULES -v seed=$SEED 'BEGIN {
+	srand(seed);
+	id = 1;
+	for (i = 1; i <= n; i++) {
+		len = 3 + int(rand() * 8);
+		p = "";
+		for (j = 0; j < len; j++)
+			p = p int(rand() * 10);
+		t = 1 + int(rand() * 4);
+		for (j = 0; j < t; j++)
+			printf "%d:1:proxy:%s:0:0:%f:0:127.0.0.1\\:%d:::\n",
+				id++, p, 1 / t, 7000 + j;
+	}
+}' >> $WORK/carrierroute
+
+start_opensips carrierroute.cfg 4096
+ret=$?
+
+if [ "$ret" -eq 0 ] ; then
+	echo "carrierroute, $RULES prefixes:"
+	grep "flattened tree" $LOG | sed 's/.*flattened/flattened/'
+	run_batches 200
+	ret=$?
+	report_batches
+fi ;
+
+bench_cleanup
+
+exit $ret
@@ -0,0 +1,68 @@
+#!/bin/bash
+# do_routing() lookup rate and memory over a random prefix table
+
+# Copyright (C) 2016 OpenSIPS Solutions
+#
+# This file is part of opensips, a free SIP server.
+#
+# opensips is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version
+#
+# opensips is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+source include/bench
+
+RULES=${1:-1000000}
+SEED=${2:-1}
+
+if ! (check_opensips && check_module "drouting" && check_module "db_text" \
+&& check_module "benchmark"); then
+	exit 0
+fi ;
+
+bench_init
+
+for t in dr_gateways dr_rules dr_carriers dr_groups; do
+	dbtext_table $t
+done
+
+for i in `seq 10`; do
+	echo "$i:gw$i:0:127.0.0.1\:$((7000 + $i)):0:::0:0::" >> $WORK/dr_gateways
+done
+
+# prefixes of 3 to 10 digits, over the 10 gateways
+awk -v n=$RULES -v seed=$SEED 'BEGIN {
+	srand(seed);
+	for (i = 1; i <= n; i++) {
+		len = 3 + int(rand() * 8);
+		p = "";
+		for (j = 0; j < len; j++)
+			p = p int(rand() * 10);
+		printf "%d:0:%s::0::gw%d::\n", i, p, 1 + int(rand() * 10);
+	}
+}' >> $WORK/dr_rules
+
+# the rules are loaded by the first worker
+start_opensips drouting.cfg 4096 "packed .* prefixes"
+ret=$?
+
+if [ "$ret" -eq 0 ] ; then
+	echo "drouting, $RULES rules:"
+	grep "packed .* prefixes" $LOG | sed 's/.*packed/packed/'
+	run_batches 200
+	ret=$?
+	report_batches
+fi ;
+
+bench_cleanup
+
+exit $ret
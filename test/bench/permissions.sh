@@ -0,0 +1,63 @@
+#!/bin/bash
+# check_address() lookup rate over random IPv4 and IPv6 subnets
+
+# Copyright (C) 2016 OpenSIPS Solutions
+#
+# This file is part of opensips, a free SIP server.
+#
+# opensips is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version
+#
+# opensips is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+source include/bench
+
+SUBNETS=${1:-200000}
+SEED=${2:-1}
+
+if ! (check_opensips && check_module "permissions" && check_module "db_text" \
+&& check_module "benchmark"); then
+	exit 0
+fi ;
+
+bench_init
+
+dbtext_table address
+
+# as many IPv4 subnets of 10/8 (/16 to /32) as IPv6 ones of 2001:db8::/32
+# (/32 to /128); the IPv6 groups are decimal, like the ones looked up
+awk -v n=$SUBNETS -v seed=$SEED 'BEGIN {
+	srand(seed);
+	for (i = 1; i <= n; i++) {
+		if (i % 2)
+			printf "%d:1:10.%d.%d.%d:%d:0:any::\n", i, int(rand() * 256),
+				int(rand() * 256), int(rand() * 256), 16 + int(rand() * 17);
+		else
+			printf "%d:1:2001\\:db8\\:%d\\:%d\\:\\:%d:%d:0:any::\n", i,
+				int(rand() * 10000), int(rand() * 10000),
+				int(rand() * 10000), 32 + int(rand() * 97);
+	}
+}' >> $WORK/address
+
+start_opensips permissions.cfg 1024
+ret=$?
+
+if [ "$ret" -eq 0 ] ; then
+	echo "permissions, $SUBNETS subnets:"
+	run_batches 200
+	ret=$?
+	report_batches
+fi ;
+
+bench_cleanup
+
+exit $ret
@@ -0,0 +1,87 @@
+#!/bin/bash
+# requests accepted by a 100 cps pipe, at a steady rate and in bursts
+
+# Copyright (C) 2016 OpenSIPS Solutions
+#
+# This file is part of opensips, a free SIP server.
+#
+# opensips is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version
+#
+# opensips is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+source include/bench
+
+ALGO=${1:-TAILDROP}
+
+if ! (check_opensips && check_sipp && check_module "ratelimit" \
+&& check_module "statistics"); then
+	exit 0
+fi ;
+
+# report <from line> - the accepted requests since the given stats line:
+# in total, and at most in any 1, 2 and 10 consecutive seconds
+function report() {
+	grep "bench: accepted" $LOG | tail -n +$1 | awk '
+		{ d[n++] = $NF - prev; prev = $NF }
+		END {
+			for (i = 1; i < n; i++) {
+				total += d[i];
+				for (w = 1; w <= 10; w++) {
+					s = 0;
+					for (j = i; j < i + w && j < n; j++)
+						s += d[j];
+					if (s > max[w])
+						max[w] = s;
+				}
+			}
+			printf "accepted %d, at most %d/1s, %d/2s, %d/10s\n",
+				total, max[1], max[2], max[10];
+		}'
+}
+
+function stats_lines() {
+	grep -c "bench: accepted" $LOG
+}
+
+bench_init
+sed -e "s#@ALGO@#$ALGO#g" ratelimit.cfg > $WORK/ratelimit.cfg
+
+start_opensips $WORK/ratelimit.cfg
+ret=$?
+
+if [ "$ret" -eq 0 ] ; then
+	echo "ratelimit, $ALGO, limit 100 cps, timer_interval 10s:"
+
+	echo -n "steady 200 cps for 60s: "
+	from=`stats_lines`
+	sipp -sn uac -i 127.0.0.1 -p 5061 -r 200 -m 12000 -timeout 90 \
+		127.0.0.1:5059 &> /dev/null
+	sleep 2
+	report $from
+
+	# the bursts are 7s apart, so at least one of them crosses the edge
+	# between two windows, whatever their phase
+	echo -n "5 bursts of 3000 cps for 2s: "
+	from=`stats_lines`
+	for i in `seq 5`; do
+		sipp -sn uac -i 127.0.0.1 -p 5061 -r 3000 -m 6000 -timeout 10 \
+			127.0.0.1:5059 &> /dev/null
+		sleep 5
+	done
+	report $from
+fi ;
+
+killall -9 sipp &> /dev/null
+bench_cleanup
+
+exit $ret